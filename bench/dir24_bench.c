@@ -0,0 +1,409 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <ixmap.h>
+
+#include "main.h"
+#include "fib.h"
+
+#define BENCH_FRAME_SIZE	64
+#define BENCH_DADDR_OFFSET	(14 + 16)
+
+struct bench_kernel {
+	char			*name;
+	void			(*lookup_bulk)(
+				struct dir24_table *,
+				void **,
+				void **,
+				unsigned int
+				);
+};
+
+/*
+ * Rough share of each prefix length in a DFZ IPv4 table, in 1/1000.
+ * Lengths not listed are not generated.
+ */
+static const unsigned int bench_len_dist[33] = {
+	[8] = 1, [12] = 1, [13] = 2, [14] = 4, [15] = 6, [16] = 30,
+	[17] = 10, [18] = 17, [19] = 30, [20] = 40, [21] = 45,
+	[22] = 95, [23] = 75, [24] = 620, [28] = 8, [29] = 6,
+	[30] = 5, [32] = 5
+};
+
+static void usage();
+static uint64_t bench_rand(uint64_t *state);
+static unsigned int bench_len_pick(uint64_t *state);
+static double bench_now();
+static int bench_aggregate(struct fib *fib, struct fib_route *routes,
+	unsigned int num_routes, struct ixmap_desc *desc, uint64_t *state);
+static int bench_verify(struct fib *fib, void **dst,
+	struct fib_entry **ref, struct fib_entry **res,
+	unsigned int num_packets);
+
+static struct bench_kernel kernels[] = {
+	{ "scalar",	dir24_lookup_bulk_scalar },
+#ifdef __x86_64__
+	{ "avx2",	dir24_lookup_bulk_avx2 },
+#endif
+};
+
+int main(int argc, char **argv)
+{
+	struct ixmap_desc *desc;
+	struct fib *fib, *fib_new;
+	struct fib_route *routes;
+	struct fib_entry **ref, **res;
+	uint8_t *frames;
+	uint32_t *prefixes, prefix, nexthop, addr;
+	unsigned int *prefix_lens;
+	void **dst;
+	unsigned int num_routes, num_packets, num_iter, burst, bulk;
+	unsigned int aggregate, num_nexthops;
+	unsigned int installed, i, j, k, iter;
+	uint64_t state = 0x9e3779b97f4a7c15ULL;
+	double start, elapsed, mpps_base = 0;
+	int opt, ret;
+
+	num_routes	= 10000;
+	num_packets	= 1 << 20;
+	num_iter	= 16;
+	burst		= 32;
+	bulk		= 0;
+	aggregate	= 0;
+	num_nexthops	= 65536;
+
+	while((opt = getopt(argc, argv, "r:p:i:b:n:Bah")) != -1){
+		switch(opt){
+		case 'r':
+			num_routes = atoi(optarg);
+			break;
+		case 'p':
+			num_packets = atoi(optarg);
+			break;
+		case 'i':
+			num_iter = atoi(optarg);
+			break;
+		case 'b':
+			burst = atoi(optarg);
+			break;
+		case 'n':
+			num_nexthops = atoi(optarg);
+			break;
+		case 'B':
+			bulk = 1;
+			break;
+		case 'a':
+			aggregate = 1;
+			break;
+		case 'h':
+			usage();
+			return 0;
+		default:
+			usage();
+			return -1;
+		}
+	}
+
+	if(!num_routes || !num_packets || !burst || !num_nexthops
+	|| (bulk && aggregate)){
+		usage();
+		return -1;
+	}
+
+	desc = ixmap_desc_alloc_nodev(0);
+	if(!desc)
+		goto err_desc_alloc;
+
+	fib = fib_alloc(desc, FIB_ENGINE_DIR24, NULL);
+	if(!fib)
+		goto err_fib_alloc;
+
+	if(aggregate){
+		ret = fib_aggregate(fib, AF_INET, desc);
+		if(ret < 0)
+			goto err_fib_aggregate;
+	}
+
+	prefixes = malloc(sizeof(uint32_t) * num_routes);
+	prefix_lens = malloc(sizeof(unsigned int) * num_routes);
+	frames = calloc(num_packets, BENCH_FRAME_SIZE);
+	dst = malloc(sizeof(void *) * num_packets);
+	ref = malloc(sizeof(struct fib_entry *) * num_packets);
+	res = malloc(sizeof(struct fib_entry *) * num_packets);
+	routes = calloc(num_routes, sizeof(struct fib_route));
+	if(!prefixes || !prefix_lens || !frames || !dst || !ref || !res
+	|| !routes)
+		goto err_buf_alloc;
+
+	for(i = 0; i < num_routes; i++){
+		prefix_lens[i] = bench_len_pick(&state);
+		prefixes[i] = (uint32_t)bench_rand(&state)
+			& (prefix_lens[i] ?
+			~((1ULL << (32 - prefix_lens[i])) - 1) : 0);
+
+		prefix = htonl(prefixes[i]);
+		nexthop = htonl(0x0a000000 | (i % num_nexthops));
+
+		routes[i].family	= AF_INET;
+		routes[i].type		= FIB_TYPE_FORWARD;
+		routes[i].prefix_len	= prefix_lens[i];
+		routes[i].port_index	= (i % num_nexthops) % 4;
+		routes[i].id		= 0;
+		memcpy(routes[i].prefix, &prefix, sizeof(uint32_t));
+		memcpy(routes[i].nexthop, &nexthop, sizeof(uint32_t));
+	}
+
+	start = bench_now();
+	if(bulk){
+		fib_new = fib_build(fib, AF_INET, routes, num_routes, NULL,
+			desc);
+		if(!fib_new)
+			goto err_fib_build;
+
+		fib_release(fib);
+		fib = fib_new;
+	}else{
+		for(i = 0; i < num_routes; i++){
+			fib_route_update(fib, AF_INET, routes[i].type,
+				routes[i].prefix, routes[i].prefix_len,
+				routes[i].nexthop, NULL, NULL,
+				routes[i].port_index, routes[i].id, desc);
+		}
+	}
+	elapsed = bench_now() - start;
+	installed = aggregate ? fib->agg->num_routes : fib->num_routes;
+
+	printf("routes: %u installed %s (%u duplicate or rejected), "
+		"%.0f routes/s\n", installed,
+		bulk ? "by fib_build()" : "one by one",
+		num_routes - installed, installed / elapsed);
+	printf("tbl8 groups: %u of %u\n",
+		DIR24_TBL8_GROUPS - fib->table.dir24->tbl8_free_num,
+		DIR24_TBL8_GROUPS);
+
+	if(!installed)
+		goto err_no_route;
+
+	if(aggregate){
+		ret = bench_aggregate(fib, routes, num_routes, desc, &state);
+		if(ret < 0)
+			goto err_aggregate;
+	}
+
+	/* 64-byte IPv4 frames destined to hosts under generated routes */
+	for(i = 0; i < num_packets; i++){
+		k = bench_rand(&state) % num_routes;
+		addr = prefixes[k] | ((uint32_t)bench_rand(&state)
+			& ((1ULL << (32 - prefix_lens[k])) - 1));
+		addr = htonl(addr);
+
+		dst[i] = frames + (i * BENCH_FRAME_SIZE) + BENCH_DADDR_OFFSET;
+		memcpy(dst[i], &addr, sizeof(uint32_t));
+		ref[i] = fib_lookup(fib, dst[i]);
+	}
+
+	printf("packets: %u x %d bytes, burst %u, %u iterations\n",
+		num_packets, BENCH_FRAME_SIZE, burst, num_iter);
+
+	for(k = 0; k < sizeof(kernels) / sizeof(struct bench_kernel); k++){
+#ifdef __x86_64__
+		if(kernels[k].lookup_bulk == dir24_lookup_bulk_avx2
+		&& !__builtin_cpu_supports("avx2")){
+			printf("%-8s: not supported by this CPU\n",
+				kernels[k].name);
+			continue;
+		}
+#endif
+		fib->table.dir24->lookup_bulk = kernels[k].lookup_bulk;
+
+		memset(res, 0, sizeof(struct fib_entry *) * num_packets);
+		for(i = 0; i < num_packets; i += burst){
+			fib_lookup_bulk(fib, &dst[i], &res[i],
+				min(burst, num_packets - i));
+		}
+
+		ret = bench_verify(fib, dst, ref, res, num_packets);
+		if(ret < 0)
+			goto err_verify;
+
+		start = bench_now();
+		for(iter = 0; iter < num_iter; iter++){
+			for(i = 0; i < num_packets; i += burst){
+				j = min(burst, num_packets - i);
+				fib_lookup_bulk(fib, &dst[i], &res[i], j);
+			}
+		}
+		elapsed = bench_now() - start;
+
+		printf("%-8s: %8.2f Mpps, %6.2f ns/lookup",
+			kernels[k].name,
+			(double)num_packets * num_iter / elapsed / 1e6,
+			elapsed * 1e9 / ((double)num_packets * num_iter));
+		if(mpps_base)
+			printf(", x%.2f",
+				(double)num_packets * num_iter / elapsed / 1e6
+				/ mpps_base);
+		else
+			mpps_base = (double)num_packets * num_iter
+				/ elapsed / 1e6;
+		printf("\n");
+	}
+
+	fib_release(fib);
+	ixmap_desc_release(NULL, 0, 0, desc);
+	free(routes);
+	free(res);
+	free(ref);
+	free(dst);
+	free(frames);
+	free(prefix_lens);
+	free(prefixes);
+	return 0;
+
+err_verify:
+err_aggregate:
+err_no_route:
+err_fib_build:
+err_buf_alloc:
+	free(routes);
+	free(res);
+	free(ref);
+	free(dst);
+	free(frames);
+	free(prefix_lens);
+	free(prefixes);
+err_fib_aggregate:
+	fib_release(fib);
+err_fib_alloc:
+	ixmap_desc_release(NULL, 0, 0, desc);
+err_desc_alloc:
+	return -1;
+}
+
+static void usage()
+{
+	printf("\n");
+	printf("Usage:\n");
+	printf("  -r [n] : Number of random routes (default=10000)\n");
+	printf("  -p [n] : Number of 64-byte frames looked up (default=1048576)\n");
+	printf("  -i [n] : Number of passes over the frames (default=16)\n");
+	printf("  -b [n] : Burst size per fib_lookup_bulk() (default=32)\n");
+	printf("  -n [n] : Number of distinct nexthops (default=65536)\n");
+	printf("  -B : Install the routes as one generation with fib_build()\n");
+	printf("  -a : Aggregate the routes with fibagg, check and churn them\n");
+	printf("  -h : Show this help\n");
+	printf("\n");
+	return;
+}
+
+static uint64_t bench_rand(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+
+	return x;
+}
+
+static unsigned int bench_len_pick(uint64_t *state)
+{
+	unsigned int r, len;
+
+	r = bench_rand(state) % 1000;
+	for(len = 0; len < 32; len++){
+		if(r < bench_len_dist[len])
+			break;
+		r -= bench_len_dist[len];
+	}
+
+	return len;
+}
+
+static double bench_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench_verify(struct fib *fib, void **dst,
+	struct fib_entry **ref, struct fib_entry **res,
+	unsigned int num_packets)
+{
+	char addr_a[INET_ADDRSTRLEN];
+	unsigned int i;
+
+	for(i = 0; i < num_packets; i++){
+		if(res[i] != ref[i])
+			goto err_mismatch;
+	}
+
+	return 0;
+
+err_mismatch:
+	inet_ntop(AF_INET, dst[i], addr_a, sizeof(addr_a));
+	printf("lookup mismatch for %s\n", addr_a);
+	return -1;
+}
+
+/*
+ * Reports the compression of an aggregated fib, then withdraws and
+ * re-announces a tenth of the routes over another nexthop. The fib
+ * must forward as the routes do at each step.
+ */
+static int bench_aggregate(struct fib *fib, struct fib_route *routes,
+	unsigned int num_routes, struct ixmap_desc *desc, uint64_t *state)
+{
+	struct fib_route *route;
+	unsigned int num_churn, i;
+	double start, elapsed;
+	int ret;
+
+	printf("aggregated: %u rib prefixes in %u fib prefixes (%.1f%%)\n",
+		fib->agg->num_prefixes, fib->num_routes,
+		100.0 * fib->num_routes / fib->agg->num_prefixes);
+
+	ret = fibagg_verify(fib->agg);
+	if(ret)
+		goto err_verify;
+
+	num_churn = num_routes / 10;
+	start = bench_now();
+	for(i = 0; i < num_churn; i++){
+		route = &routes[bench_rand(state) % num_routes];
+
+		fib_route_delete(fib, AF_INET, route->prefix,
+			route->prefix_len, route->id);
+
+		route->nexthop[3]++;
+		route->port_index = (route->port_index + 1) % 4;
+		fib_route_update(fib, AF_INET, route->type,
+			route->prefix, route->prefix_len, route->nexthop,
+			NULL, NULL, route->port_index, route->id, desc);
+	}
+	elapsed = bench_now() - start;
+
+	printf("churned: %u withdraw + announce, %.0f updates/s, "
+		"%u fib prefixes (%.1f%%)\n",
+		num_churn, 2 * num_churn / elapsed, fib->num_routes,
+		100.0 * fib->num_routes / fib->agg->num_prefixes);
+
+	ret = fibagg_verify(fib->agg);
+	if(ret)
+		goto err_verify;
+
+	printf("aggregation verified\n");
+	return 0;
+
+err_verify:
+	printf("aggregation verify failed (%d)\n", ret);
+	return -1;
+}
@@ -0,0 +1,987 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <ixmap.h>
+
+#include "main.h"
+#include "fib.h"
+#include "vrf.h"
+#include "flow.h"
+
+#define BENCH_LINE_MAX		512
+#define BENCH_FLOWS		4096
+#define BENCH_FRAME_NS		67.2 /* 64-byte frames at 14.88 Mpps */
+
+struct bench_shape {
+	char			*name;
+	int			family;
+	/* share of each prefix length in 1/1000 */
+	unsigned int		dist[FIB_PREFIX_LEN_MAX + 1];
+};
+
+struct bench_engine {
+	char			*name;
+	enum fib_engine		engine;
+	int			family; /* 0 means any */
+};
+
+struct bench_stream {
+	char			*name;
+	void			(*generate)(
+				struct fib_route *,
+				unsigned int,
+				uint8_t (*)[16],
+				unsigned int,
+				uint64_t *
+				);
+};
+
+static void usage();
+static uint64_t bench_rand(uint64_t *state);
+static double bench_now();
+static unsigned long bench_resident();
+static void bench_mask(uint8_t *prefix, unsigned int prefix_len);
+static void bench_host(struct fib_route *route, uint8_t *addr,
+	uint64_t *state);
+static unsigned int bench_synthetic(struct bench_shape *shape,
+	struct fib_route *routes, unsigned int num_routes, uint64_t *state);
+static int bench_file(char *path, int family,
+	struct fib_route **routes_ret, unsigned int *num_ret);
+static void bench_stream_random(struct fib_route *routes,
+	unsigned int num_routes, uint8_t (*addrs)[16],
+	unsigned int num_addrs, uint64_t *state);
+static void bench_stream_locality(struct fib_route *routes,
+	unsigned int num_routes, uint8_t (*addrs)[16],
+	unsigned int num_addrs, uint64_t *state);
+static int bench_lookup(struct fib *fib, int family,
+	struct bench_stream *stream, uint8_t (*addrs)[16], void **dst,
+	struct fib_entry **ref, struct fib_entry **res, unsigned int num_addrs,
+	unsigned int num_iter, unsigned int burst);
+static int bench_flow(struct fib *fib, int family,
+	struct bench_stream *stream, void **dst, struct fib_entry **ref,
+	unsigned int num_addrs, unsigned int num_iter,
+	unsigned int flow_entries, struct ixmap_desc *desc);
+static int bench_stats(struct fib *fib, struct bench_stream *stream,
+	void **dst, struct fib_entry **res, unsigned int num_addrs,
+	unsigned int num_iter, unsigned int burst,
+	struct stats_table *stats);
+static int bench_vrf(int family, struct fib_route *routes,
+	unsigned int num_routes, unsigned int num_vrfs, uint8_t (*addrs)[16],
+	void **dst, struct fib_entry **ref, struct fib_entry **res,
+	unsigned int num_addrs, unsigned int num_iter, unsigned int burst,
+	struct ixmap_desc *desc, uint64_t *state);
+
+/* Rough prefix length shares of the public tables */
+static struct bench_shape shapes[] = {
+	{ "dfz", AF_INET, {
+		[8] = 1, [12] = 1, [13] = 2, [14] = 4, [15] = 6,
+		[16] = 30, [17] = 10, [18] = 17, [19] = 30, [20] = 40,
+		[21] = 45, [22] = 95, [23] = 75, [24] = 620, [28] = 8,
+		[29] = 6, [30] = 5, [32] = 5 } },
+	{ "v6-48", AF_INET6, {
+		[19] = 1, [28] = 4, [29] = 60, [32] = 100, [33] = 10,
+		[36] = 20, [40] = 60, [44] = 80, [46] = 10, [47] = 10,
+		[48] = 600, [56] = 20, [64] = 25 } },
+	{ "v6-64", AF_INET6, {
+		[29] = 10, [32] = 30, [40] = 10, [44] = 10, [48] = 120,
+		[52] = 10, [56] = 100, [60] = 10, [64] = 680, [128] = 20 } },
+};
+
+static struct bench_engine engines[] = {
+	{ "dir24",	FIB_ENGINE_DIR24,	AF_INET },
+	{ "lpm6",	FIB_ENGINE_LPM6,	AF_INET6 },
+	{ "lpm6-inet",	FIB_ENGINE_LPM6_INET,	AF_INET },
+	{ "lpm",	FIB_ENGINE_LPM,		0 },
+};
+
+static struct bench_stream streams[] = {
+	{ "random",	bench_stream_random },
+	{ "locality",	bench_stream_locality },
+};
+
+int main(int argc, char **argv)
+{
+	struct ixmap_desc *desc;
+	struct fib *fib;
+	struct stats_table *stats;
+	struct bench_shape *shape;
+	struct bench_engine *engine;
+	struct fib_route *routes, *route;
+	struct fib_entry **ref, **res;
+	uint8_t (*addrs)[16];
+	void **dst;
+	char *shape_name, *engine_name, *path;
+	unsigned int num_routes, num_addrs, num_iter, burst, num_vrfs;
+	unsigned int flow_entries, count;
+	unsigned int installed, deleted, i;
+	unsigned long mem_base, mem_empty, mem_full;
+	uint64_t state = 0x9e3779b97f4a7c15ULL;
+	double start, elapsed;
+	int opt, ret, *added;
+
+	shape_name	= "dfz";
+	engine_name	= NULL;
+	path		= NULL;
+	num_routes	= 100000;
+	num_addrs	= 1 << 20;
+	num_iter	= 4;
+	burst		= 32;
+	num_vrfs	= 0;
+	flow_entries	= 0;
+	count		= 0;
+	stats		= NULL;
+
+	while((opt = getopt(argc, argv, "s:e:f:r:p:i:b:v:c:kh")) != -1){
+		switch(opt){
+		case 's':
+			shape_name = optarg;
+			break;
+		case 'e':
+			engine_name = optarg;
+			break;
+		case 'f':
+			path = optarg;
+			break;
+		case 'r':
+			num_routes = atoi(optarg);
+			break;
+		case 'p':
+			num_addrs = atoi(optarg);
+			break;
+		case 'i':
+			num_iter = atoi(optarg);
+			break;
+		case 'b':
+			burst = atoi(optarg);
+			break;
+		case 'v':
+			num_vrfs = atoi(optarg);
+			break;
+		case 'c':
+			flow_entries = atoi(optarg);
+			break;
+		case 'k':
+			count = 1;
+			break;
+		case 'h':
+			usage();
+			return 0;
+		default:
+			usage();
+			return -1;
+		}
+	}
+
+	shape = NULL;
+	for(i = 0; i < sizeof(shapes) / sizeof(struct bench_shape); i++){
+		if(!strcmp(shapes[i].name, shape_name))
+			shape = &shapes[i];
+	}
+
+	if(!shape || !num_routes || !num_addrs || !num_iter || !burst){
+		usage();
+		return -1;
+	}
+
+	/* the shape also gives the family of a routes file */
+	engine = NULL;
+	for(i = 0; i < sizeof(engines) / sizeof(struct bench_engine); i++){
+		if(engine_name && strcmp(engines[i].name, engine_name))
+			continue;
+		if(engines[i].family && engines[i].family != shape->family)
+			continue;
+
+		engine = &engines[i];
+		break;
+	}
+
+	if(!engine){
+		printf("engine %s does not take %s routes\n",
+			engine_name, shape->name);
+		return -1;
+	}
+
+	desc = ixmap_desc_alloc_nodev(0);
+	if(!desc)
+		goto err_desc_alloc;
+
+	if(path){
+		ret = bench_file(path, shape->family, &routes, &num_routes);
+		if(ret < 0)
+			goto err_routes;
+	}else{
+		routes = calloc(num_routes, sizeof(struct fib_route));
+		if(!routes)
+			goto err_routes;
+
+		bench_synthetic(shape, routes, num_routes, &state);
+	}
+
+	added = calloc(num_routes, sizeof(int));
+	addrs = malloc(sizeof(*addrs) * num_addrs);
+	dst = malloc(sizeof(void *) * num_addrs);
+	ref = malloc(sizeof(struct fib_entry *) * num_addrs);
+	res = malloc(sizeof(struct fib_entry *) * num_addrs);
+	if(!added || !addrs || !dst || !ref || !res)
+		goto err_buf_alloc;
+
+	if(num_vrfs){
+		ret = bench_vrf(shape->family, routes, num_routes, num_vrfs,
+			addrs, dst, ref, res, num_addrs, num_iter, burst,
+			desc, &state);
+		goto out;
+	}
+
+	mem_base = ixmap_mem_used(desc);
+
+	fib = fib_alloc(desc, engine->engine, NULL);
+	if(!fib)
+		goto err_fib_alloc;
+
+	/* an id for every route, as ixmap -r would give */
+	if(count){
+		stats = stats_table_alloc(desc, num_routes, 1);
+		if(!stats)
+			goto err_stats_alloc;
+
+		fib_stats_set(fib, stats);
+	}
+
+	mem_empty = ixmap_mem_used(desc);
+
+	printf("engine: %s, routes: %u %s from %s\n", engine->name,
+		num_routes, shape->family == AF_INET ? "IPv4" : "IPv6",
+		path ? path : shape->name);
+
+	start = bench_now();
+	for(i = 0; i < num_routes; i++){
+		route = &routes[i];
+
+		ret = fib_route_update(fib, route->family, route->type,
+			route->prefix, route->prefix_len, route->nexthop,
+			NULL, NULL, route->port_index, route->id, desc);
+		added[i] = (ret == 0);
+	}
+	elapsed = bench_now() - start;
+	installed = fib->num_routes;
+
+	mem_full = ixmap_mem_used(desc);
+
+	printf("insert: %u routes (%u duplicate or rejected), "
+		"%.0f routes/s\n", installed, num_routes - installed,
+		num_routes / elapsed);
+	printf("memory: %lu KB empty, %lu KB loaded, %.1f bytes/route\n",
+		(mem_empty - mem_base) >> 10, (mem_full - mem_base) >> 10,
+		installed ? (double)(mem_full - mem_empty) / installed : 0);
+
+	if(!installed)
+		goto err_no_route;
+
+	printf("lookup: %u addresses, burst %u, %u iterations\n",
+		num_addrs, burst, num_iter);
+
+	for(i = 0; i < sizeof(streams) / sizeof(struct bench_stream); i++){
+		streams[i].generate(routes, num_routes,
+			addrs, num_addrs, &state);
+
+		ret = bench_lookup(fib, shape->family, &streams[i],
+			addrs, dst, ref, res, num_addrs, num_iter, burst);
+		if(ret < 0)
+			goto err_lookup;
+
+		if(!flow_entries)
+			continue;
+
+		ret = bench_flow(fib, shape->family, &streams[i], dst, ref,
+			num_addrs, num_iter, flow_entries, desc);
+		if(ret < 0)
+			goto err_lookup;
+	}
+
+	if(stats){
+		ret = bench_stats(fib, &streams[i - 1], dst, res,
+			num_addrs, num_iter, burst, stats);
+		if(ret < 0)
+			goto err_lookup;
+	}
+
+	start = bench_now();
+	for(i = 0, deleted = 0; i < num_routes; i++){
+		route = &routes[i];
+		if(!added[i])
+			continue;
+
+		ret = fib_route_delete(fib, route->family,
+			route->prefix, route->prefix_len, route->id);
+		if(!ret)
+			deleted++;
+	}
+	elapsed = bench_now() - start;
+
+	printf("delete: %u routes, %.0f routes/s, %lu KB left\n",
+		deleted, deleted / elapsed,
+		(ixmap_mem_used(desc) - mem_base) >> 10);
+
+	fib_release(fib);
+	if(stats)
+		stats_table_release(stats);
+	ret = 0;
+out:
+	free(res);
+	free(ref);
+	free(dst);
+	free(addrs);
+	free(added);
+	free(routes);
+	ixmap_desc_release(NULL, 0, 0, desc);
+	return ret;
+
+err_lookup:
+err_no_route:
+	if(stats)
+		stats_table_release(stats);
+err_stats_alloc:
+	fib_release(fib);
+err_fib_alloc:
+err_buf_alloc:
+	free(res);
+	free(ref);
+	free(dst);
+	free(addrs);
+	free(added);
+	free(routes);
+err_routes:
+	ixmap_desc_release(NULL, 0, 0, desc);
+err_desc_alloc:
+	return -1;
+}
+
+static void usage()
+{
+	printf("\n");
+	printf("Usage:\n");
+	printf("  -s [name] : Table shape, dfz, v6-48 or v6-64 (default=dfz)\n");
+	printf("  -e [name] : FIB engine, dir24, lpm6, lpm6-inet or lpm "
+		"(default=dir24 or lpm6)\n");
+	printf("  -f [path] : Routes dump instead of a synthetic table,\n");
+	printf("              one \"prefix/len [via nexthop]\" per line "
+		"of the shape's family\n");
+	printf("  -r [n] : Number of synthetic routes (default=100000)\n");
+	printf("  -p [n] : Number of destinations looked up (default=1048576)\n");
+	printf("  -i [n] : Number of passes over the destinations (default=4)\n");
+	printf("  -b [n] : Burst size per fib_lookup_bulk() (default=32)\n");
+	printf("  -v [n] : Spread the routes over n VRF tables, bursts taking\n");
+	printf("           turns among them (default=0, one plain FIB)\n");
+	printf("  -c [n] : Also look up through a flow cache of n entries\n");
+	printf("           keyed by destination (default=0, none)\n");
+	printf("  -k : Also count packets and bytes per route and report\n");
+	printf("       the cost against 14.88 Mpps\n");
+	printf("  -h : Show this help\n");
+	printf("\n");
+	return;
+}
+
+static uint64_t bench_rand(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+
+	return x;
+}
+
+static double bench_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Bytes of the process in memory, sparse mappings included */
+static unsigned long bench_resident()
+{
+	FILE *fp;
+	unsigned long size, resident;
+
+	fp = fopen("/proc/self/statm", "r");
+	if(!fp)
+		return 0;
+
+	if(fscanf(fp, "%lu %lu", &size, &resident) != 2)
+		resident = 0;
+
+	fclose(fp);
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void bench_mask(uint8_t *prefix, unsigned int prefix_len)
+{
+	unsigned int i;
+
+	for(i = 0; i < 16; i++){
+		if(prefix_len <= i * 8)
+			prefix[i] = 0;
+		else if(prefix_len < (i + 1) * 8)
+			prefix[i] &= 0xff << (8 - (prefix_len - i * 8));
+	}
+
+	return;
+}
+
+/* A random address under route */
+static void bench_host(struct fib_route *route, uint8_t *addr,
+	uint64_t *state)
+{
+	uint8_t host[16];
+	unsigned int i;
+
+	for(i = 0; i < 16; i += sizeof(uint64_t)){
+		*(uint64_t *)&host[i] = bench_rand(state);
+	}
+
+	memcpy(addr, host, 16);
+	bench_mask(addr, route->prefix_len);
+
+	for(i = 0; i < 16; i++){
+		addr[i] = route->prefix[i] | (host[i] & ~addr[i]);
+	}
+
+	return;
+}
+
+static unsigned int bench_synthetic(struct bench_shape *shape,
+	struct fib_route *routes, unsigned int num_routes, uint64_t *state)
+{
+	struct fib_route *route;
+	unsigned int i, r, len, len_max;
+	uint32_t nexthop;
+
+	len_max = shape->family == AF_INET ? 32 : 128;
+
+	for(i = 0; i < num_routes; i++){
+		route = &routes[i];
+
+		r = bench_rand(state) % 1000;
+		for(len = 0; len < len_max; len++){
+			if(r < shape->dist[len])
+				break;
+			r -= shape->dist[len];
+		}
+
+		*(uint64_t *)&route->prefix[0] = bench_rand(state);
+		*(uint64_t *)&route->prefix[8] = bench_rand(state);
+
+		/* global unicast only, like the IPv6 tables */
+		if(shape->family == AF_INET6)
+			route->prefix[0] = 0x20 | (route->prefix[0] & 0x1f);
+
+		bench_mask(route->prefix, len);
+
+		nexthop = htonl(0x0a000000 | (i & 0xffff));
+		memset(route->nexthop, 0, 16);
+		memcpy(route->nexthop, &nexthop, sizeof(uint32_t));
+
+		route->family		= shape->family;
+		route->type		= FIB_TYPE_FORWARD;
+		route->prefix_len	= len;
+		route->port_index	= i % 4;
+		route->id		= 0;
+	}
+
+	return num_routes;
+}
+
+/*
+ * Reads "prefix/len [via nexthop]" lines, so that `ip route` and
+ * `ip -6 route` dumps can be given as they are. "default" stands for
+ * the zero prefix, lines of the other family or not parsed are skipped.
+ */
+static int bench_file(char *path, int family,
+	struct fib_route **routes_ret, unsigned int *num_ret)
+{
+	FILE *fp;
+	struct fib_route *routes, *route, *routes_new;
+	char line[BENCH_LINE_MAX], *token, *save, *slash;
+	unsigned int num, size, prefix_len;
+	uint32_t nexthop;
+
+	fp = fopen(path, "r");
+	if(!fp)
+		goto err_open;
+
+	num = 0;
+	size = 1024;
+	routes = malloc(sizeof(struct fib_route) * size);
+	if(!routes)
+		goto err_routes_alloc;
+
+	while(fgets(line, sizeof(line), fp)){
+		token = strtok_r(line, " \t\n", &save);
+		if(!token || token[0] == '#')
+			continue;
+
+		if(num == size){
+			routes_new = realloc(routes,
+				sizeof(struct fib_route) * size * 2);
+			if(!routes_new)
+				goto err_routes_realloc;
+
+			routes = routes_new;
+			size *= 2;
+		}
+
+		route = &routes[num];
+		memset(route, 0, sizeof(struct fib_route));
+
+		prefix_len = family == AF_INET ? 32 : 128;
+		if(!strcmp(token, "default")){
+			prefix_len = 0;
+		}else{
+			slash = strchr(token, '/');
+			if(slash){
+				*slash = '\0';
+				prefix_len = atoi(slash + 1);
+			}
+
+			if(inet_pton(family, token, route->prefix) != 1)
+				continue;
+		}
+
+		if(prefix_len > (family == AF_INET ? 32 : 128))
+			continue;
+
+		nexthop = htonl(0x0a000000 | (num & 0xffff));
+		memcpy(route->nexthop, &nexthop, sizeof(uint32_t));
+
+		while((token = strtok_r(NULL, " \t\n", &save))){
+			if(strcmp(token, "via"))
+				continue;
+
+			token = strtok_r(NULL, " \t\n", &save);
+			if(token)
+				inet_pton(family, token, route->nexthop);
+			break;
+		}
+
+		bench_mask(route->prefix, prefix_len);
+		route->family		= family;
+		route->type		= FIB_TYPE_FORWARD;
+		route->prefix_len	= prefix_len;
+		route->port_index	= num % 4;
+		route->id		= 0;
+		num++;
+	}
+
+	if(!num)
+		goto err_no_route;
+
+	fclose(fp);
+	*routes_ret = routes;
+	*num_ret = num;
+	return 0;
+
+err_no_route:
+	printf("no route of the family found in %s\n", path);
+err_routes_realloc:
+	free(routes);
+err_routes_alloc:
+	fclose(fp);
+err_open:
+	return -1;
+}
+
+/* Every destination under a route picked at random, little reuse */
+static void bench_stream_random(struct fib_route *routes,
+	unsigned int num_routes, uint8_t (*addrs)[16],
+	unsigned int num_addrs, uint64_t *state)
+{
+	unsigned int i;
+
+	for(i = 0; i < num_addrs; i++){
+		bench_host(&routes[bench_rand(state) % num_routes],
+			addrs[i], state);
+	}
+
+	return;
+}
+
+/*
+ * BENCH_FLOWS destinations taking turns with a heavy tail: the flow
+ * of rank k is picked about as often as 1/k^2, and arrives in trains
+ * of a few packets like segments of one transfer do.
+ */
+static void bench_stream_locality(struct fib_route *routes,
+	unsigned int num_routes, uint8_t (*addrs)[16],
+	unsigned int num_addrs, uint64_t *state)
+{
+	uint8_t (*flows)[16];
+	unsigned int i, j, train;
+	double u;
+
+	flows = malloc(sizeof(*flows) * BENCH_FLOWS);
+	if(!flows){
+		bench_stream_random(routes, num_routes,
+			addrs, num_addrs, state);
+		return;
+	}
+
+	for(i = 0; i < BENCH_FLOWS; i++){
+		bench_host(&routes[bench_rand(state) % num_routes],
+			flows[i], state);
+	}
+
+	for(i = 0; i < num_addrs; i += train){
+		u = (bench_rand(state) >> 11) / (double)(1ULL << 53);
+		j = (unsigned int)(BENCH_FLOWS * u * u) % BENCH_FLOWS;
+		train = 1 + bench_rand(state) % 8;
+
+		for(; train && i < num_addrs; train--, i++){
+			memcpy(addrs[i], flows[j], 16);
+		}
+	}
+
+	free(flows);
+	return;
+}
+
+static int bench_lookup(struct fib *fib, int family,
+	struct bench_stream *stream, uint8_t (*addrs)[16], void **dst,
+	struct fib_entry **ref, struct fib_entry **res, unsigned int num_addrs,
+	unsigned int num_iter, unsigned int burst)
+{
+	char addr_a[INET6_ADDRSTRLEN];
+	unsigned int i, iter, missed;
+	double start, single, bulk;
+
+	for(i = 0; i < num_addrs; i++){
+		dst[i] = addrs[i];
+	}
+
+	start = bench_now();
+	for(iter = 0; iter < num_iter; iter++){
+		for(i = 0; i < num_addrs; i++){
+			ref[i] = fib_lookup(fib, dst[i]);
+		}
+	}
+	single = bench_now() - start;
+
+	start = bench_now();
+	for(iter = 0; iter < num_iter; iter++){
+		for(i = 0; i < num_addrs; i += burst){
+			fib_lookup_bulk(fib, &dst[i], &res[i],
+				min(burst, num_addrs - i));
+		}
+	}
+	bulk = bench_now() - start;
+
+	for(i = 0, missed = 0; i < num_addrs; i++){
+		if(res[i] != ref[i])
+			goto err_mismatch;
+		if(!ref[i])
+			missed++;
+	}
+
+	printf("%-8s: single %7.2f Mlookups/s, bulk %7.2f Mlookups/s, "
+		"x%.2f (%u without route)\n", stream->name,
+		(double)num_addrs * num_iter / single / 1e6,
+		(double)num_addrs * num_iter / bulk / 1e6,
+		single / bulk, missed);
+	return 0;
+
+err_mismatch:
+	inet_ntop(family, dst[i], addr_a, sizeof(addr_a));
+	printf("%s: bulk lookup differs for %s\n", stream->name, addr_a);
+	return -1;
+}
+
+/*
+ * Destinations through a flow cache first, as forwarding does with
+ * -f: a miss costs the FIB lookup and an insert. Entries keep only
+ * the port, the FIB entry they came from is checked against ref.
+ */
+static int bench_flow(struct fib *fib, int family,
+	struct bench_stream *stream, void **dst, struct fib_entry **ref,
+	unsigned int num_addrs, unsigned int num_iter,
+	unsigned int flow_entries, struct ixmap_desc *desc)
+{
+	struct flow_cache *cache;
+	struct flow_entry *flow;
+	struct fib_entry *entry;
+	uint8_t rewrite[ADJ_REWRITE_LEN] = {};
+	uint32_t key[FLOW_KEY_WORDS], hash;
+	char addr_a[INET6_ADDRSTRLEN];
+	unsigned int gen = 0, i, iter;
+	int port_index;
+	double start, elapsed;
+
+	cache = flow_cache_alloc(desc, flow_entries, 0, &gen);
+	if(!cache)
+		goto err_cache_alloc;
+
+	start = bench_now();
+	for(iter = 0; iter < num_iter; iter++){
+		for(i = 0; i < num_addrs; i++){
+			memset(key, 0, sizeof(key));
+			memcpy(key, dst[i], family == AF_INET ? 4 : 16);
+			key[FLOW_KEY_WORDS - 1] = family << 16;
+			hash = flow_hash(key);
+
+			flow = flow_cache_lookup(cache, key, hash);
+			if(flow){
+				port_index = flow->port_index;
+			}else{
+				entry = fib_lookup(fib, dst[i]);
+				port_index = entry ? entry->port_index : -1;
+				flow_cache_insert(cache, key, hash,
+					port_index, rewrite, STATS_ID_NONE);
+			}
+
+			if(port_index != (ref[i] ? ref[i]->port_index : -1))
+				goto err_mismatch;
+		}
+	}
+	elapsed = bench_now() - start;
+
+	printf("%-8s: flow   %7.2f Mlookups/s, %.1f%% hit in %u entries\n",
+		stream->name, (double)num_addrs * num_iter / elapsed / 1e6,
+		100.0 * cache->hits / (cache->hits + cache->misses),
+		(cache->mask + 1) * FLOW_WAYS);
+
+	flow_cache_release(cache);
+	return 0;
+
+err_mismatch:
+	inet_ntop(family, dst[i], addr_a, sizeof(addr_a));
+	printf("%s: flow cache differs for %s\n", stream->name, addr_a);
+	flow_cache_release(cache);
+err_cache_alloc:
+	return -1;
+}
+
+/*
+ * Bulk lookups of the last stream alone, then each result counted
+ * as forwarding does with -r. The entry is read in both loops, so
+ * the difference is the counting itself.
+ */
+static int bench_stats(struct fib *fib, struct bench_stream *stream,
+	void **dst, struct fib_entry **res, unsigned int num_addrs,
+	unsigned int num_iter, unsigned int burst,
+	struct stats_table *stats)
+{
+	struct stats_counter *counters, sum;
+	unsigned int i, j, iter, num;
+	unsigned long ports = 0;
+	double start, plain, counted;
+
+	counters = stats->counters[0];
+
+	start = bench_now();
+	for(iter = 0; iter < num_iter; iter++){
+		for(i = 0; i < num_addrs; i += burst){
+			num = min(burst, num_addrs - i);
+			fib_lookup_bulk(fib, &dst[i], &res[i], num);
+
+			for(j = i; j < i + num; j++){
+				if(res[j])
+					ports += res[j]->port_index;
+			}
+		}
+	}
+	plain = bench_now() - start;
+
+	start = bench_now();
+	for(iter = 0; iter < num_iter; iter++){
+		for(i = 0; i < num_addrs; i += burst){
+			num = min(burst, num_addrs - i);
+			fib_lookup_bulk(fib, &dst[i], &res[i], num);
+
+			for(j = i; j < i + num; j++){
+				if(!res[j])
+					continue;
+
+				ports += res[j]->port_index;
+				stats_count(counters, res[j]->stats_id, 64);
+			}
+		}
+	}
+	counted = bench_now() - start;
+
+	/* every hit must have landed on some id */
+	for(i = 0, sum.packets = 0; i < stats->num_ids; i++){
+		sum.packets += counters[i].packets;
+	}
+	for(i = 0, num = 0; i < num_addrs; i++){
+		if(res[i])
+			num++;
+	}
+	if(sum.packets != (uint64_t)num * num_iter)
+		goto err_count;
+
+	plain	= plain * 1e9 / num_addrs / num_iter;
+	counted	= counted * 1e9 / num_addrs / num_iter;
+
+	printf("%-8s: counted %.1f ns/packet, %.1f plain, "
+		"%+.1f ns or %.1f%% of a 14.88 Mpps frame (%lu)\n",
+		stream->name, counted, plain, counted - plain,
+		100.0 * (counted - plain) / BENCH_FRAME_NS, ports & 1);
+	return 0;
+
+err_count:
+	printf("%s: %lu packets counted for %u hits\n", stream->name,
+		(unsigned long)sum.packets, num * num_iter);
+	return -1;
+}
+
+/*
+ * The routes split in num_vrfs tables of a vrf_table, destinations
+ * drawn from each table's own routes. Bursts go to the tables in turn
+ * as they would from ports bound to different VRFs.
+ */
+static int bench_vrf(int family, struct fib_route *routes,
+	unsigned int num_routes, unsigned int num_vrfs, uint8_t (*addrs)[16],
+	void **dst, struct fib_entry **ref, struct fib_entry **res,
+	unsigned int num_addrs, unsigned int num_iter, unsigned int burst,
+	struct ixmap_desc *desc, uint64_t *state)
+{
+	struct vrf_table *vrfs;
+	struct vrf *vrf;
+	struct fib **fibs;
+	struct fib_route *route;
+	char addr_a[INET6_ADDRSTRLEN];
+	unsigned int per_vrf, per_addrs, installed, missed, i, j, k, iter;
+	unsigned long mem_base, mem_pool, mem_full, res_pool, res_full;
+	double start, elapsed;
+
+	per_vrf = num_routes / num_vrfs;
+	per_addrs = num_addrs / num_vrfs / burst * burst;
+	if(num_vrfs > VRF_MAX || !per_vrf || !per_addrs){
+		printf("%u VRFs take at most %u routes and %u addresses\n",
+			num_vrfs, num_routes, num_addrs / burst);
+		goto err_invalid;
+	}
+
+	fibs = malloc(sizeof(struct fib *) * num_vrfs);
+	if(!fibs)
+		goto err_fibs_alloc;
+
+	mem_base = ixmap_mem_used(desc);
+
+	vrfs = vrf_table_alloc(1, NULL, NULL, 0, desc);
+	if(!vrfs)
+		goto err_vrfs_alloc;
+
+	/* taken by the first table otherwise, counted apart */
+	vrfs->pool = lpm6_pool_alloc(desc);
+	if(!vrfs->pool)
+		goto err_vrf_fib;
+
+	mem_pool = ixmap_mem_used(desc);
+	res_pool = bench_resident();
+
+	for(k = 0; k < num_vrfs; k++){
+		vrf = vrf_get(vrfs, 100 + k);
+		if(!vrf)
+			goto err_vrf_fib;
+
+		fibs[k] = vrf_fib(vrfs, vrf, family, desc);
+		if(!fibs[k])
+			goto err_vrf_fib;
+	}
+
+	printf("vrf: %u tables, routes: %u %s each\n", num_vrfs, per_vrf,
+		family == AF_INET ? "IPv4" : "IPv6");
+
+	start = bench_now();
+	for(k = 0, installed = 0; k < num_vrfs; k++){
+		for(i = 0; i < per_vrf; i++){
+			route = &routes[k * per_vrf + i];
+
+			fib_route_update(fibs[k], route->family, route->type,
+				route->prefix, route->prefix_len,
+				route->nexthop, NULL, NULL, route->port_index,
+				route->id, desc);
+		}
+
+		installed += fibs[k]->num_routes;
+	}
+	elapsed = bench_now() - start;
+
+	mem_full = ixmap_mem_used(desc);
+	res_full = bench_resident();
+
+	printf("insert: %u routes, %.0f routes/s\n", installed,
+		per_vrf * num_vrfs / elapsed);
+	printf("memory: %lu KB shared, %lu KB per table, "
+		"%.1f bytes/route\n", (mem_pool - mem_base) >> 10,
+		(mem_full - mem_pool) / num_vrfs >> 10,
+		installed ? (double)(mem_full - mem_pool) / installed : 0);
+	printf("resident: %lu KB per table, sparse mappings included\n",
+		(res_full - res_pool) / num_vrfs >> 10);
+	printf("lookup: %u addresses per table, burst %u, "
+		"%u iterations\n", per_addrs, burst, num_iter);
+
+	for(i = 0; i < sizeof(streams) / sizeof(struct bench_stream); i++){
+		for(k = 0; k < num_vrfs; k++){
+			streams[i].generate(&routes[k * per_vrf], per_vrf,
+				&addrs[k * per_addrs], per_addrs, state);
+		}
+
+		for(j = 0; j < per_addrs * num_vrfs; j++){
+			dst[j] = addrs[j];
+		}
+
+		for(k = 0; k < num_vrfs; k++){
+			for(j = 0; j < per_addrs; j++){
+				ref[k * per_addrs + j] =
+					fib_lookup(fibs[k], dst[k * per_addrs + j]);
+			}
+		}
+
+		start = bench_now();
+		for(iter = 0; iter < num_iter; iter++){
+			for(j = 0; j < per_addrs; j += burst){
+				for(k = 0; k < num_vrfs; k++){
+					fib_lookup_bulk(fibs[k],
+						&dst[k * per_addrs + j],
+						&res[k * per_addrs + j], burst);
+				}
+			}
+		}
+		elapsed = bench_now() - start;
+
+		for(j = 0, missed = 0; j < per_addrs * num_vrfs; j++){
+			if(res[j] != ref[j])
+				goto err_mismatch;
+			if(!ref[j])
+				missed++;
+		}
+
+		printf("%-8s: bulk %7.2f Mlookups/s over %u VRFs "
+			"(%u without route)\n", streams[i].name,
+			(double)per_addrs * num_vrfs * num_iter / elapsed / 1e6,
+			num_vrfs, missed);
+	}
+
+	vrf_table_release(vrfs);
+	free(fibs);
+	return 0;
+
+err_mismatch:
+	inet_ntop(family, dst[j], addr_a, sizeof(addr_a));
+	printf("%s: bulk lookup differs for %s\n", streams[i].name, addr_a);
+err_vrf_fib:
+	vrf_table_release(vrfs);
+err_vrfs_alloc:
+	free(fibs);
+err_fibs_alloc:
+err_invalid:
+	return -1;
+}
@@ -0,0 +1,277 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
+#include <ixmap.h>
+
+#include "main.h"
+#include "neigh.h"
+
+#define BENCH_SIZES_MAX		8
+
+static void usage();
+static uint64_t bench_rand(uint64_t *state);
+static double bench_now();
+static uint64_t bench_cycles();
+static int bench_run(unsigned int num_neighs, int family,
+	unsigned int num_lookups, unsigned int num_iter, unsigned int burst,
+	struct ixmap_desc *desc, uint64_t *state);
+
+/*
+ * Hosts of one large L2 segment, looked up one by one and by bursts,
+ * at each table size given. Lookups pick hosts at random, so tables
+ * past the caches pay a miss per bucket and per entry.
+ */
+int main(int argc, char **argv)
+{
+	struct ixmap_desc *desc;
+	unsigned int sizes[BENCH_SIZES_MAX];
+	unsigned int num_sizes, num_lookups, num_iter, burst, i;
+	uint64_t state = 0x9e3779b97f4a7c15ULL;
+	char *token;
+	int family, opt, ret;
+
+	sizes[0]	= 1000;
+	sizes[1]	= 10000;
+	sizes[2]	= 100000;
+	num_sizes	= 3;
+	num_lookups	= 1 << 20;
+	num_iter	= 16;
+	burst		= 32;
+	family		= AF_INET;
+
+	while((opt = getopt(argc, argv, "n:p:i:b:6h")) != -1){
+		switch(opt){
+		case 'n':
+			num_sizes = 0;
+			for(token = strtok(optarg, ","); token
+			&& num_sizes < BENCH_SIZES_MAX;
+			token = strtok(NULL, ",")){
+				sizes[num_sizes++] = atoi(token);
+			}
+			break;
+		case 'p':
+			num_lookups = atoi(optarg);
+			break;
+		case 'i':
+			num_iter = atoi(optarg);
+			break;
+		case 'b':
+			burst = atoi(optarg);
+			break;
+		case '6':
+			family = AF_INET6;
+			break;
+		case 'h':
+			usage();
+			return 0;
+		default:
+			usage();
+			return -1;
+		}
+	}
+
+	if(!num_sizes || !num_lookups || !burst){
+		usage();
+		return -1;
+	}
+
+	for(i = 0; i < num_sizes; i++){
+		if(!sizes[i]){
+			usage();
+			return -1;
+		}
+	}
+
+	desc = ixmap_desc_alloc_nodev(0);
+	if(!desc)
+		goto err_desc_alloc;
+
+	printf("lookups: %u %s hosts, burst %u, %u iterations\n",
+		num_lookups, family == AF_INET ? "IPv4" : "IPv6",
+		burst, num_iter);
+
+	for(i = 0; i < num_sizes; i++){
+		ret = bench_run(sizes[i], family, num_lookups, num_iter,
+			burst, desc, &state);
+		if(ret < 0)
+			goto err_run;
+	}
+
+	ixmap_desc_release(NULL, 0, 0, desc);
+	return 0;
+
+err_run:
+	ixmap_desc_release(NULL, 0, 0, desc);
+err_desc_alloc:
+	return -1;
+}
+
+static void usage()
+{
+	printf("\n");
+	printf("Usage:\n");
+	printf("  -n [n,...] : Numbers of neighbors (default=1000,10000,100000)\n");
+	printf("  -p [n] : Number of lookups per pass (default=1048576)\n");
+	printf("  -i [n] : Number of passes over the lookups (default=16)\n");
+	printf("  -b [n] : Burst size per neigh_lookup_bulk() (default=32)\n");
+	printf("  -6 : IPv6 neighbors in one /64\n");
+	printf("  -h : Show this help\n");
+	printf("\n");
+	return;
+}
+
+static uint64_t bench_rand(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+
+	return x;
+}
+
+static double bench_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* TSC ticks, 0 where there is none */
+static uint64_t bench_cycles()
+{
+#ifdef __x86_64__
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static int bench_run(unsigned int num_neighs, int family,
+	unsigned int num_lookups, unsigned int num_iter, unsigned int burst,
+	struct ixmap_desc *desc, uint64_t *state)
+{
+	struct neigh_table *neigh;
+	struct neigh_stats stats;
+	struct neigh_entry **ref, **res;
+	uint8_t *addrs, mac[ETH_ALEN];
+	uint32_t host;
+	void **dst;
+	unsigned int addr_len, i, j, iter;
+	double start, elapsed_one, elapsed_bulk, num_total;
+	uint64_t cycles_start, cycles_one, cycles_bulk;
+	int ret;
+
+	addr_len = family == AF_INET ? 4 : 16;
+
+	neigh = neigh_alloc(desc, family, NULL);
+	if(!neigh)
+		goto err_neigh_alloc;
+
+	addrs = calloc(num_neighs, 16);
+	dst = malloc(sizeof(void *) * num_lookups);
+	ref = malloc(sizeof(struct neigh_entry *) * num_lookups);
+	res = malloc(sizeof(struct neigh_entry *) * num_lookups);
+	if(!addrs || !dst || !ref || !res)
+		goto err_buf_alloc;
+
+	/* 10.0.0.0/8 or 2001:db8::/64, hosts numbered from 1 */
+	for(i = 0; i < num_neighs; i++){
+		host = htonl(i + 1);
+		if(family == AF_INET){
+			addrs[i * 16] = 10;
+			memcpy(&addrs[i * 16 + 1], (uint8_t *)&host + 1, 3);
+		}else{
+			addrs[i * 16] = 0x20;
+			addrs[i * 16 + 1] = 0x01;
+			addrs[i * 16 + 2] = 0x0d;
+			addrs[i * 16 + 3] = 0xb8;
+			memcpy(&addrs[i * 16 + 12], &host, 4);
+		}
+
+		memset(mac, 0, ETH_ALEN);
+		memcpy(mac + 2, &host, 4);
+		ret = neigh_add(neigh, family, &addrs[i * 16], mac, desc);
+		if(ret < 0)
+			goto err_neigh_add;
+	}
+
+	memset(&stats, 0, sizeof(struct neigh_stats));
+	for(i = 0; i < num_lookups; i++){
+		dst[i] = &addrs[(bench_rand(state) % num_neighs) * 16];
+		ref[i] = neigh_lookup(neigh, &stats, dst[i]);
+		if(!ref[i] || memcmp(ref[i]->dst_addr, dst[i], addr_len))
+			goto err_verify;
+	}
+
+	for(i = 0; i < num_lookups; i += burst){
+		neigh_lookup_bulk(neigh, &stats, &dst[i], &res[i],
+			min(burst, num_lookups - i));
+	}
+
+	for(i = 0; i < num_lookups; i++){
+		if(res[i] != ref[i])
+			goto err_verify;
+	}
+
+	start = bench_now();
+	cycles_start = bench_cycles();
+	for(iter = 0; iter < num_iter; iter++){
+		for(i = 0; i < num_lookups; i++){
+			res[i] = neigh_lookup(neigh, &stats, dst[i]);
+		}
+	}
+	cycles_one = bench_cycles() - cycles_start;
+	elapsed_one = bench_now() - start;
+
+	start = bench_now();
+	cycles_start = bench_cycles();
+	for(iter = 0; iter < num_iter; iter++){
+		for(i = 0; i < num_lookups; i += burst){
+			j = min(burst, num_lookups - i);
+			neigh_lookup_bulk(neigh, &stats, &dst[i], &res[i], j);
+		}
+	}
+	cycles_bulk = bench_cycles() - cycles_start;
+	elapsed_bulk = bench_now() - start;
+	num_total = (double)num_lookups * num_iter;
+
+	printf("%7u neighbors: %u buckets, %.2f probes/lookup, "
+		"%lu kicks, %lu collisions\n", num_neighs,
+		neigh->layout->mask + 1, (double)stats.probes / stats.lookups,
+		neigh->kicks, stats.collisions);
+	printf("  one by one: %6.2f ns/lookup, %6.1f cycles/lookup\n",
+		elapsed_one * 1e9 / num_total, cycles_one / num_total);
+	printf("  bulk      : %6.2f ns/lookup, %6.1f cycles/lookup, x%.2f\n",
+		elapsed_bulk * 1e9 / num_total, cycles_bulk / num_total,
+		elapsed_one / elapsed_bulk);
+
+	free(res);
+	free(ref);
+	free(dst);
+	free(addrs);
+	neigh_release(neigh);
+	return 0;
+
+err_verify:
+	printf("lookup mismatch with %u neighbors\n", num_neighs);
+err_neigh_add:
+err_buf_alloc:
+	free(res);
+	free(ref);
+	free(dst);
+	free(addrs);
+	neigh_release(neigh);
+err_neigh_alloc:
+	return -1;
+}
@@ -0,0 +1,715 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <ixmap.h>
+
+#include "main.h"
+#include "thread.h"
+#include "netlink.h"
+#include "forward.h"
+#include "epoll.h"
+
+#define BENCH_IFNAME		"lo"
+#define BENCH_ADDR		0xc6120001 /* 198.18.0.1/24 */
+#define BENCH_GATEWAYS		16
+#define BENCH_IDLE		1000 /* ms without a message once injected */
+#define BENCH_SEND_SIZE		65536
+
+static void usage();
+static uint64_t bench_rand(uint64_t *state);
+static double bench_now();
+static int bench_netns(unsigned int *ifindex);
+static int bench_node_alloc(struct ixmapfwd_fib *fib,
+	struct ixmapfwd_thread *thread, struct tun_plane *tun_plane,
+	struct ixmap_desc *desc);
+static void bench_node_release(struct ixmapfwd_fib *fib);
+static int bench_inject(unsigned int num_routes, unsigned int batch,
+	unsigned int ifindex, uint64_t *state);
+static int bench_run(struct ixmapfwd_thread *thread, pid_t child,
+	double *first, double *last, double *done, unsigned long *overruns);
+static int bench_warm(struct ixmapfwd_thread *thread,
+	struct ixmapfwd_fib *fib, struct tun_plane *tun_plane, char *path,
+	struct ixmap_desc *desc);
+
+static int bench_verbose;
+
+char *optarg;
+
+/*
+ * A BGP session coming up, as seen by the writer: a child process adds
+ * DFZ shaped routes to the kernel of a network namespace of its own,
+ * and the notifications are read and handled one read at a time as in
+ * thread.c, through netlink_process() and netlink_bulk_poll(). Needs
+ * CAP_NET_ADMIN, for unshare(CLONE_NEWNET). Given a snapshot path, the
+ * node then restarts warm from what it saved, as ixmapfwd -s does.
+ */
+int main(int argc, char **argv)
+{
+	struct ixmap_desc *desc;
+	struct epoll_desc *ep_desc;
+	struct sockaddr_nl addr;
+	struct ixmapfwd_fib fib;
+	struct ixmapfwd_thread thread;
+	struct tun_port port;
+	struct tun_plane tun_plane;
+	struct rusage usage_self, usage_child;
+	unsigned int num_routes, batch, ifindex;
+	unsigned long overruns;
+	char *snapshot_path;
+	uint64_t state = 0x9e3779b97f4a7c15ULL;
+	double first, last, done;
+	pid_t child;
+	int opt, ret;
+
+	num_routes	= 100000;
+	batch		= 64;
+	snapshot_path	= NULL;
+
+	while((opt = getopt(argc, argv, "r:b:s:vh")) != -1){
+		switch(opt){
+		case 'r':
+			if(sscanf(optarg, "%u", &num_routes) < 1
+			|| !num_routes || num_routes > LPM6_NEXTHOP_MAX)
+				goto err_arg;
+			break;
+		case 'b':
+			if(sscanf(optarg, "%u", &batch) < 1 || !batch)
+				goto err_arg;
+			break;
+		case 's':
+			snapshot_path = optarg;
+			break;
+		case 'v':
+			bench_verbose = 1;
+			break;
+		case 'h':
+			usage();
+			return 0;
+		default:
+			usage();
+			return -1;
+		}
+	}
+
+	ret = bench_netns(&ifindex);
+	if(ret < 0)
+		goto err_netns;
+
+	desc = ixmap_desc_alloc_nodev(0);
+	if(!desc)
+		goto err_desc_alloc;
+
+	port.fd		= -1;
+	port.ifindex	= ifindex;
+	port.mtu_frame	= 0;
+	tun_plane.ports	= &port;
+
+	ret = bench_node_alloc(&fib, &thread, &tun_plane, desc);
+	if(ret < 0)
+		goto err_node_alloc;
+
+	/* the groups thread.c listens to */
+	memset(&addr, 0, sizeof(struct sockaddr_nl));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = RTMGRP_NEIGH | RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE
+		| RTMGRP_LINK;
+
+	ep_desc = epoll_desc_alloc_netlink(&addr, 0);
+	if(!ep_desc)
+		goto err_listen;
+
+	thread.netlink_fd = ep_desc->fd;
+
+	child = fork();
+	if(child < 0)
+		goto err_fork;
+
+	if(!child)
+		_exit(bench_inject(num_routes, batch, ifindex, &state) < 0);
+
+	ret = bench_run(&thread, child, &first, &last, &done, &overruns);
+	if(ret < 0)
+		goto err_run;
+
+	printf("routes: %u added, %u in the FIB\n",
+		num_routes, fib.fib_inet->num_routes);
+	printf("notifications: %.0f ms from the first to the last, "
+		"%lu overruns\n", (last - first) * 1000, overruns);
+	printf("converged: %.0f ms after the first, %.0f ms after the last, "
+		"%.0f routes/s\n", (done - first) * 1000, (done - last) * 1000,
+		num_routes / (done - first));
+
+	/* the kernel adds the routes in the injector's system time */
+	getrusage(RUSAGE_SELF, &usage_self);
+	getrusage(RUSAGE_CHILDREN, &usage_child);
+	printf("cpu: writer %.1f s, injector %.1f s\n",
+		usage_self.ru_utime.tv_sec + usage_self.ru_utime.tv_usec / 1e6
+		+ usage_self.ru_stime.tv_sec + usage_self.ru_stime.tv_usec / 1e6,
+		usage_child.ru_utime.tv_sec + usage_child.ru_utime.tv_usec / 1e6
+		+ usage_child.ru_stime.tv_sec
+		+ usage_child.ru_stime.tv_usec / 1e6);
+
+	if(snapshot_path){
+		ret = bench_warm(&thread, &fib, &tun_plane, snapshot_path,
+			desc);
+		if(ret < 0)
+			goto err_warm;
+	}
+
+	epoll_desc_release_netlink(ep_desc);
+	bench_node_release(&fib);
+	ixmap_desc_release(NULL, 0, 0, desc);
+	return 0;
+
+err_run:
+	kill(child, SIGKILL);
+	waitpid(child, NULL, 0);
+err_warm:
+err_fork:
+	epoll_desc_release_netlink(ep_desc);
+err_listen:
+	bench_node_release(&fib);
+err_node_alloc:
+	ixmap_desc_release(NULL, 0, 0, desc);
+err_desc_alloc:
+err_netns:
+	return -1;
+
+err_arg:
+	usage();
+	return -1;
+}
+
+static void usage()
+{
+	printf("\n");
+	printf("Usage:\n");
+	printf("  -r [n] : Number of routes added (default=100000)\n");
+	printf("  -b [n] : Routes per sendto() of the injector (default=64)\n");
+	printf("  -s [path] : Then save a snapshot there and restart from it\n");
+	printf("  -v : Print what the writer logs\n");
+	printf("  -h : Show this help\n");
+	printf("\n");
+	return;
+}
+
+/* the forwarding path is not linked in, nothing is ever held */
+void forward_pending_flush(struct ixmapfwd_thread *thread, int family,
+	int port_out, void *addr, uint8_t *mac)
+{
+	return;
+}
+
+void ixmapfwd_log(int level, char *fmt, ...)
+{
+	va_list args;
+
+	if(!bench_verbose)
+		return;
+
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	printf("\n");
+	va_end(args);
+	return;
+}
+
+static uint64_t bench_rand(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+
+	return x;
+}
+
+static double bench_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* gateways of the routes are on the loopback of a fresh namespace */
+static int bench_netns(unsigned int *ifindex)
+{
+	struct ifreq ifr;
+	struct sockaddr_in *sin;
+	int fd, ret;
+
+	ret = unshare(CLONE_NEWNET);
+	if(ret < 0)
+		goto err_unshare;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if(fd < 0)
+		goto err_socket;
+
+	memset(&ifr, 0, sizeof(struct ifreq));
+	strncpy(ifr.ifr_name, BENCH_IFNAME, IFNAMSIZ - 1);
+
+	sin = (struct sockaddr_in *)&ifr.ifr_addr;
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(BENCH_ADDR);
+	ret = ioctl(fd, SIOCSIFADDR, &ifr);
+	if(ret < 0)
+		goto err_ioctl;
+
+	sin->sin_addr.s_addr = htonl(0xffffff00);
+	ret = ioctl(fd, SIOCSIFNETMASK, &ifr);
+	if(ret < 0)
+		goto err_ioctl;
+
+	ret = ioctl(fd, SIOCGIFFLAGS, &ifr);
+	if(ret < 0)
+		goto err_ioctl;
+
+	ifr.ifr_flags |= IFF_UP;
+	ret = ioctl(fd, SIOCSIFFLAGS, &ifr);
+	if(ret < 0)
+		goto err_ioctl;
+
+	*ifindex = if_nametoindex(BENCH_IFNAME);
+	if(!*ifindex)
+		goto err_ioctl;
+
+	close(fd);
+	return 0;
+
+err_ioctl:
+	close(fd);
+err_socket:
+err_unshare:
+	perror("netns");
+	return -1;
+}
+
+/* one node of one port, as ixmapfwd_fib_alloc() sets it up */
+static int bench_node_alloc(struct ixmapfwd_fib *fib,
+	struct ixmapfwd_thread *thread, struct tun_plane *tun_plane,
+	struct ixmap_desc *desc)
+{
+	uint8_t mac[ETH_ALEN] = { 0x02, 0, 0, 0, 0, 1 };
+
+	memset(fib, 0, sizeof(struct ixmapfwd_fib));
+	memset(thread, 0, sizeof(struct ixmapfwd_thread));
+	fib->num_threads	= 1;
+	fib->threads_assigned	= 1;
+
+	fib->qsbr = qsbr_alloc(desc, 1);
+	if(!fib->qsbr)
+		goto err_fib_alloc;
+
+	fib->nexthops = nexthop_table_alloc(desc);
+	if(!fib->nexthops)
+		goto err_fib_alloc;
+
+	fib->adjs = adj_table_alloc(1, desc);
+	if(!fib->adjs)
+		goto err_fib_alloc;
+
+	fib->neigh_inet = ixmap_mem_alloc(desc, sizeof(struct neigh_table *));
+	if(!fib->neigh_inet)
+		goto err_fib_alloc;
+	fib->neigh_inet[0] = NULL;
+
+	fib->neigh_inet6 = ixmap_mem_alloc(desc, sizeof(struct neigh_table *));
+	if(!fib->neigh_inet6)
+		goto err_fib_alloc;
+	fib->neigh_inet6[0] = NULL;
+
+	fib->neigh_inet[0] = neigh_alloc(desc, AF_INET, fib->qsbr);
+	fib->neigh_inet6[0] = neigh_alloc(desc, AF_INET6, fib->qsbr);
+	if(!fib->neigh_inet[0] || !fib->neigh_inet6[0])
+		goto err_fib_alloc;
+
+	adj_table_port_mac(fib->adjs, 0, mac);
+	adj_table_neigh(fib->adjs, fib->neigh_inet, fib->neigh_inet6);
+
+	fib->locals = local_table_alloc(desc, fib->qsbr);
+	if(!fib->locals)
+		goto err_fib_alloc;
+
+	fib->fib_inet = fib_alloc(desc, FIB_ENGINE_DIR24, fib->qsbr);
+	if(!fib->fib_inet)
+		goto err_fib_alloc;
+
+	fib->fib_inet6 = fib_alloc(desc, FIB_ENGINE_LPM6, fib->qsbr);
+	if(!fib->fib_inet6)
+		goto err_fib_alloc;
+
+	fib->vrfs = vrf_table_alloc(1, fib->qsbr, NULL, 0, desc);
+	if(!fib->vrfs)
+		goto err_fib_alloc;
+
+	thread->desc		= desc;
+	thread->fib		= fib;
+	thread->qsbr		= fib->qsbr;
+	thread->qsbr_reader	= &fib->qsbr->readers[0];
+	thread->fib_writer	= 1;
+	thread->tun_plane	= tun_plane;
+	thread->num_ports	= 1;
+	thread->netlink_fd	= -1;
+	return 0;
+
+err_fib_alloc:
+	bench_node_release(fib);
+	return -1;
+}
+
+static void bench_node_release(struct ixmapfwd_fib *fib)
+{
+	if(fib->locals)
+		local_table_release(fib->locals);
+	if(fib->vrfs)
+		vrf_table_release(fib->vrfs);
+	if(fib->fib_inet6)
+		fib_release(fib->fib_inet6);
+	if(fib->fib_inet)
+		fib_release(fib->fib_inet);
+	if(fib->nexthops)
+		nexthop_table_release(fib->nexthops);
+	if(fib->adjs)
+		adj_table_release(fib->adjs);
+	if(fib->neigh_inet){
+		if(fib->neigh_inet[0])
+			neigh_release(fib->neigh_inet[0]);
+		ixmap_mem_free(fib->neigh_inet);
+	}
+	if(fib->neigh_inet6){
+		if(fib->neigh_inet6[0])
+			neigh_release(fib->neigh_inet6[0]);
+		ixmap_mem_free(fib->neigh_inet6);
+	}
+	if(fib->qsbr)
+		qsbr_release(fib->qsbr);
+
+	free(fib->bulk.routes);
+	free(fib->resync_bulk.routes);
+
+	/* released once only, from a failed restart as well */
+	memset(fib, 0, sizeof(struct ixmapfwd_fib));
+	return;
+}
+
+/*
+ * Prefixes are drawn as in fib_bench, but none longer than /24, which
+ * peers filter out of the DFZ. A prefix already added is drawn again,
+ * so that every request adds a route of its own.
+ */
+static int bench_inject(unsigned int num_routes, unsigned int batch,
+	unsigned int ifindex, uint64_t *state)
+{
+	static const unsigned int dfz_len[33] = {
+		[8] = 1, [12] = 1, [13] = 2, [14] = 4, [15] = 6, [16] = 30,
+		[17] = 10, [18] = 17, [19] = 30, [20] = 40, [21] = 45,
+		[22] = 95, [23] = 75, [24] = 620
+	};
+	struct {
+		struct nlmsghdr	nlh;
+		struct rtmsg	rt;
+		struct rtattr	dst_attr;
+		uint32_t	dst;
+		struct rtattr	gw_attr;
+		uint32_t	gw;
+		struct rtattr	oif_attr;
+		uint32_t	oif;
+	} *req;
+	struct sockaddr_nl addr;
+	uint64_t *added, key;
+	unsigned int total, prefix_len, num, i, j, added_size;
+	uint32_t prefix, seq;
+	uint8_t *send_buf;
+	double start;
+	int fd, ret;
+
+	total = 0;
+	for(i = 0; i <= 32; i++)
+		total += dfz_len[i];
+
+	added_size = 1;
+	while(added_size < num_routes * 2)
+		added_size <<= 1;
+
+	added = calloc(added_size, sizeof(uint64_t));
+	if(!added)
+		goto err_added;
+
+	send_buf = malloc(BENCH_SEND_SIZE);
+	if(!send_buf)
+		goto err_send_buf;
+
+	fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if(fd < 0)
+		goto err_socket;
+
+	memset(&addr, 0, sizeof(struct sockaddr_nl));
+	addr.nl_family = AF_NETLINK;
+
+	start = bench_now();
+	seq = 0;
+
+	for(i = 0; i < num_routes; i += num){
+		num = min(batch, num_routes - i);
+		if(num * sizeof(*req) > BENCH_SEND_SIZE)
+			num = BENCH_SEND_SIZE / sizeof(*req);
+
+		for(j = 0; j < num; j++){
+			do{
+				key = bench_rand(state) % total;
+				for(prefix_len = 0; key >= dfz_len[prefix_len];
+				prefix_len++)
+					key -= dfz_len[prefix_len];
+
+				prefix = bench_rand(state) >> 32;
+				prefix &= ~0U << (32 - prefix_len);
+				/* off 198.18.0.0/24 and the reserved blocks */
+				if(prefix >> 24 < 1 || prefix >> 24 >= 224
+				|| prefix >> 24 == 127 || prefix >> 24 == 198)
+					continue;
+
+				key = (uint64_t)prefix << 8 | prefix_len | 1;
+				key = key * 0x9e3779b97f4a7c15ULL;
+				while(added[key & (added_size - 1)]
+				&& added[key & (added_size - 1)]
+				!= ((uint64_t)prefix << 8 | prefix_len))
+					key++;
+				if(!added[key & (added_size - 1)])
+					break;
+			}while(1);
+			added[key & (added_size - 1)] =
+				(uint64_t)prefix << 8 | prefix_len;
+
+			req = (void *)&send_buf[j * sizeof(*req)];
+			memset(req, 0, sizeof(*req));
+			req->nlh.nlmsg_len	= sizeof(*req);
+			req->nlh.nlmsg_type	= RTM_NEWROUTE;
+			req->nlh.nlmsg_flags	= NLM_F_REQUEST | NLM_F_CREATE
+				| NLM_F_EXCL;
+			req->nlh.nlmsg_seq	= ++seq;
+			req->rt.rtm_family	= AF_INET;
+			req->rt.rtm_dst_len	= prefix_len;
+			req->rt.rtm_table	= RT_TABLE_MAIN;
+			req->rt.rtm_protocol	= RTPROT_BGP;
+			req->rt.rtm_scope	= RT_SCOPE_UNIVERSE;
+			req->rt.rtm_type	= RTN_UNICAST;
+			req->dst_attr.rta_len	= RTA_LENGTH(sizeof(uint32_t));
+			req->dst_attr.rta_type	= RTA_DST;
+			req->dst		= htonl(prefix);
+			req->gw_attr.rta_len	= RTA_LENGTH(sizeof(uint32_t));
+			req->gw_attr.rta_type	= RTA_GATEWAY;
+			req->gw			= htonl((BENCH_ADDR & ~0xff)
+				+ 2 + (i + j) % BENCH_GATEWAYS);
+			req->oif_attr.rta_len	= RTA_LENGTH(sizeof(uint32_t));
+			req->oif_attr.rta_type	= RTA_OIF;
+			req->oif		= ifindex;
+		}
+
+		ret = sendto(fd, send_buf, num * sizeof(*req), 0,
+			(struct sockaddr *)&addr, sizeof(struct sockaddr_nl));
+		if(ret < 0)
+			goto err_sendto;
+	}
+
+	printf("injector: %u routes in %.0f ms\n", num_routes,
+		(bench_now() - start) * 1000);
+	fflush(stdout);
+
+	close(fd);
+	free(send_buf);
+	free(added);
+	return 0;
+
+err_sendto:
+	perror("sendto");
+	close(fd);
+err_socket:
+	free(send_buf);
+err_send_buf:
+	free(added);
+err_added:
+	return -1;
+}
+
+/*
+ * A restart of the node: the snapshot is loaded as by
+ * ixmapfwd_snapshot_load(), then checked against the kernel by
+ * netlink_resync(), which dumps the routes and builds them afresh.
+ */
+static int bench_warm(struct ixmapfwd_thread *thread,
+	struct ixmapfwd_fib *fib, struct tun_plane *tun_plane, char *path,
+	struct ixmap_desc *desc)
+{
+	struct snapshot *snapshot;
+	unsigned long overruns;
+	unsigned int num_routes;
+	double start, first, last, done;
+	int netlink_fd, num_inet, num_neighs, ret;
+
+	num_routes = fib->fib_inet->num_routes;
+	netlink_fd = thread->netlink_fd;
+
+	start = bench_now();
+	ret = snapshot_save(path, fib->fib_inet, fib->fib_inet6,
+		fib->neigh_inet, fib->neigh_inet6, 1);
+	if(ret < 0)
+		goto err_save;
+
+	printf("snapshot: %u routes saved in %.0f ms\n", num_routes,
+		(bench_now() - start) * 1000);
+
+	bench_node_release(fib);
+	ret = bench_node_alloc(fib, thread, tun_plane, desc);
+	if(ret < 0)
+		goto err_node_alloc;
+
+	thread->netlink_fd = netlink_fd;
+
+	start = bench_now();
+	snapshot = snapshot_open(path);
+	if(!snapshot)
+		goto err_open;
+
+	num_neighs = snapshot_load_neigh(snapshot, fib->neigh_inet,
+		fib->neigh_inet6, 1, desc);
+	num_inet = snapshot_load_fib(snapshot, &fib->fib_inet, fib->adjs,
+		AF_INET, &tun_plane->ports[0].ifindex, 1, desc);
+	if(num_neighs < 0 || num_inet < 0)
+		goto err_load;
+
+	printf("warm start: %d routes and %d neighbors loaded in %.0f ms, "
+		"%u in the FIB\n", num_inet, num_neighs,
+		(bench_now() - start) * 1000, fib->fib_inet->num_routes);
+
+	thread->snapshot = snapshot;
+	start = bench_now();
+	ret = netlink_resync(thread);
+	if(ret < 0)
+		goto err_load;
+
+	ret = bench_run(thread, 0, &first, &last, &done, &overruns);
+	if(ret < 0)
+		goto err_load;
+
+	printf("resync: %.0f ms, %u in the FIB, %lu overruns\n",
+		(done - start) * 1000, fib->fib_inet->num_routes, overruns);
+
+	thread->snapshot = NULL;
+	snapshot_close(snapshot);
+	unlink(path);
+	return 0;
+
+err_load:
+	thread->snapshot = NULL;
+	snapshot_close(snapshot);
+err_open:
+	unlink(path);
+err_node_alloc:
+	return -1;
+
+err_save:
+	unlink(path);
+	return -1;
+}
+
+/*
+ * The writer's side of thread_wait(), until the injector, if any, is
+ * gone and nothing came for BENCH_IDLE ms. The FIB has converged once no route
+ * is held back and no resynchronization runs, after a read or after
+ * netlink_bulk_poll().
+ */
+static int bench_run(struct ixmapfwd_thread *thread, pid_t child,
+	double *first, double *last, double *done, unsigned long *overruns)
+{
+	struct pollfd pfd;
+	uint8_t *read_buf;
+	int ret, status, exited, timeout, busy;
+
+	read_buf = malloc(NETLINK_READ_SIZE);
+	if(!read_buf)
+		goto err_read_buf;
+
+	pfd.fd		= thread->netlink_fd;
+	pfd.events	= POLLIN;
+	*first		= 0;
+	*last		= 0;
+	*done		= 0;
+	*overruns	= 0;
+	exited		= !child;
+
+	while(1){
+		timeout = BENCH_IDLE;
+		if(thread->fib->bulk.num)
+			timeout = NETLINK_BULK_QUIET;
+		if(thread->qsbr->defer_num)
+			timeout = QSBR_POLL_INTERVAL;
+
+		qsbr_offline(thread->qsbr_reader);
+		ret = poll(&pfd, 1, timeout);
+		qsbr_online(thread->qsbr, thread->qsbr_reader);
+		if(ret < 0)
+			goto err_poll;
+
+		if(ret > 0){
+			ret = read(thread->netlink_fd, read_buf,
+				NETLINK_READ_SIZE);
+			if(ret < 0 && errno == ENOBUFS){
+				(*overruns)++;
+				netlink_overrun(thread);
+			}else if(ret < 0){
+				goto err_poll;
+			}else{
+				if(!*first)
+					*first = bench_now();
+				*last = bench_now();
+				netlink_process(thread, read_buf, ret);
+			}
+		}
+
+		netlink_bulk_poll(thread);
+		qsbr_poll(thread->qsbr);
+
+		busy = thread->fib->bulk.num || thread->resync_seq
+			|| thread->netlink_lost;
+		if(*first && !busy)
+			*done = bench_now();
+
+		if(!exited && waitpid(child, &status, WNOHANG) == child){
+			if(!WIFEXITED(status) || WEXITSTATUS(status))
+				goto err_poll;
+			exited = 1;
+		}
+
+		if(exited && !ret && !busy && !thread->qsbr->defer_num)
+			break;
+	}
+
+	free(read_buf);
+	return 0;
+
+err_poll:
+	free(read_buf);
+err_read_buf:
+	return -1;
+}
@@ -265,6 +265,10 @@ unsigned int ixmap_rx_clean(struct ixmap_plane *plane, unsigned int port_index,
 		packet[total_rx_packets].slot_index = slot_index;
 		packet[total_rx_packets].slot_size = slot_size;
 		packet[total_rx_packets].slot_buf = slot_buf;
+		packet[total_rx_packets].rss_hash =
+			(le16toh(rx_desc->wb.lower.lo_dword.hs_rss.pkt_info)
+			& IXGBE_RXDADV_RSSTYPE_MASK) ?
+			le32toh(rx_desc->wb.lower.hi_dword.rss) : 0;
 
 		next_to_clean = rx_ring->next_to_clean + 1;
 		rx_ring->next_to_clean = 
@@ -3,6 +3,7 @@
 
 /* Receive Descriptor bit definitions */
 #define IXGBE_RXD_STAT_DD	0x01 /* Descriptor Done */
+#define IXGBE_RXDADV_RSSTYPE_MASK	0x0000000F /* RSS type, 0 if none */
 #define IXGBE_RXDADV_ERR_CE     0x01000000 /* CRC Error */
 #define IXGBE_RXDADV_ERR_LE     0x02000000 /* Length Error */
 #define IXGBE_RXDADV_ERR_PE     0x08000000 /* Packet Error */
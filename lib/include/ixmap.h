@@ -32,6 +32,7 @@ struct ixmap_packet {
 	void			*slot_buf;
 	unsigned int		slot_size;
 	int			slot_index;
+	uint32_t		rss_hash; /* 0 when the NIC computed none */
 };
 
 enum ixmap_irq_type {
@@ -45,6 +46,7 @@ struct ixmap_plane *ixmap_plane_alloc(struct ixmap_handle **ih_list,
 void ixmap_plane_release(struct ixmap_plane *plane, int ih_num);
 struct ixmap_desc *ixmap_desc_alloc(struct ixmap_handle **ih_list, int ih_num,
 	int core_id);
+struct ixmap_desc *ixmap_desc_alloc_nodev(int core_id);
 void ixmap_desc_release(struct ixmap_handle **ih_list, int ih_num,
         int core_id, struct ixmap_desc *desc);
 struct ixmap_buf *ixmap_buf_alloc(struct ixmap_handle **ih_list,
@@ -101,6 +103,15 @@ inline unsigned long ixmap_count_tx_clean_total(struct ixmap_plane *plane,
 void *ixmap_mem_alloc(struct ixmap_desc *desc,
 	unsigned int size);
 void ixmap_mem_free(void *addr_free);
+void *ixmap_mem_alloc_huge(struct ixmap_desc *desc,
+	unsigned long size);
+void ixmap_mem_free_huge(struct ixmap_desc *desc, void *addr_free,
+	unsigned long size);
+void *ixmap_mem_alloc_sparse(struct ixmap_desc *desc,
+	unsigned long size);
+void ixmap_mem_reset_sparse(void *addr, unsigned long size);
+void ixmap_mem_free_sparse(void *addr_free, unsigned long size);
+unsigned long ixmap_mem_used(struct ixmap_desc *desc);
 
 void ixmap_configure_rx(struct ixmap_handle *ih);
 void ixmap_configure_tx(struct ixmap_handle *ih);
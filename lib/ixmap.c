@@ -296,6 +296,48 @@ err_alloc_desc:
 	return NULL;
 }
 
+/*
+ * Descriptor memory without any port attached, for offline tools.
+ * Falls back to normal pages when no 1GB hugepage is reserved.
+ * Release it with ixmap_desc_release(NULL, 0, core_id, desc).
+ */
+struct ixmap_desc *ixmap_desc_alloc_nodev(int core_id)
+{
+	struct ixmap_desc *desc;
+	void *addr_mem;
+
+	desc = numa_alloc_onnode(sizeof(struct ixmap_desc),
+		numa_node_of_cpu(core_id));
+	if(!desc)
+		goto err_alloc_desc;
+
+	desc->addr_virt = mmap(NULL, SIZE_1GB, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, 0, 0);
+	if(desc->addr_virt == MAP_FAILED){
+		desc->addr_virt = mmap(NULL, SIZE_1GB, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, 0, 0);
+		if(desc->addr_virt == MAP_FAILED)
+			goto err_mmap;
+	}
+
+	addr_mem	= (void *)ALIGN((unsigned long)desc->addr_virt,
+				L1_CACHE_BYTES);
+	desc->core_id	= core_id;
+	desc->node	= ixmap_mem_init(addr_mem,
+				SIZE_1GB - (addr_mem - desc->addr_virt), core_id);
+	if(!desc->node)
+		goto err_mem_init;
+
+	return desc;
+
+err_mem_init:
+	munmap(desc->addr_virt, SIZE_1GB);
+err_mmap:
+	numa_free(desc, sizeof(struct ixmap_desc));
+err_alloc_desc:
+	return NULL;
+}
+
 void ixmap_desc_release(struct ixmap_handle **ih_list, int ih_num,
 	int core_id, struct ixmap_desc *desc)
 {
@@ -10,6 +10,7 @@
 #define FILENAME_SIZE 256
 #define IXMAP_IFNAME "ixgbe"
 #define SIZE_1GB (1ul << 30)
+#define SIZE_2MB (1ul << 21)
 
 #define min(x, y) ({				\
 	typeof(x) _min1 = (x);			\
@@ -146,6 +147,7 @@ struct ixmap_packet {
 	void			*slot_buf;
 	unsigned int		slot_size;
 	int			slot_index;
+	uint32_t		rss_hash; /* 0 when the NIC computed none */
 };
 
 enum {
@@ -5,34 +5,48 @@
 #include <stdint.h>
 #include <net/ethernet.h>
 #include <numa.h>
+#include <sys/mman.h>
 
 #include "ixmap.h"
 #include "memory.h"
 
 static struct ixmap_mnode *ixmap_mnode_alloc(struct ixmap_mnode *parent,
-	void *ptr, unsigned int size, unsigned int index, int core_id);
+	void *ptr, unsigned int size, unsigned int index);
 static void ixmap_mnode_release(struct ixmap_mnode *node);
+static int ixmap_mpool_grow(struct ixmap_mpool *pool);
 static void _ixmap_mem_destroy(struct ixmap_mnode *node);
 static struct ixmap_mnode *_ixmap_mem_alloc(struct ixmap_mnode *node,
-	unsigned int size, int core_id);
+	unsigned int size);
 static void _ixmap_mem_free(struct ixmap_mnode *node);
+static void ixmap_mnode_update(struct ixmap_mnode *node);
+static unsigned long _ixmap_mem_used(struct ixmap_mnode *node);
 
 static struct ixmap_mnode *ixmap_mnode_alloc(struct ixmap_mnode *parent,
-	void *ptr, unsigned int size, unsigned int index, int core_id)
+	void *ptr, unsigned int size, unsigned int index)
 {
+	struct ixmap_mpool *pool;
 	struct ixmap_mnode *node;
+	int ret;
 
-	node = numa_alloc_onnode(sizeof(struct ixmap_mnode),
-		numa_node_of_cpu(core_id));
-	if(!node)
-		goto err_alloc_node;
+	pool = parent->pool;
+
+	if(!pool->free){
+		ret = ixmap_mpool_grow(pool);
+		if(ret < 0)
+			goto err_alloc_node;
+	}
+
+	node = pool->free;
+	pool->free = node->parent;
 
 	node->parent	= parent;
+	node->pool	= pool;
 	node->child[0]	= NULL;
 	node->child[1]	= NULL;
 	node->allocated	= 0;
 	node->index	= index;
 	node->size	= size;
+	node->free_max	= size;
 	node->ptr	= ptr;
 
 	return node;
@@ -44,32 +58,94 @@ err_alloc_node:
 static void ixmap_mnode_release(struct ixmap_mnode *node)
 {
 	struct ixmap_mnode *parent;
+	struct ixmap_mpool *pool;
 
 	parent = node->parent;
 	if(parent)
 		parent->child[node->index] = NULL;
 
-	numa_free(node, sizeof(struct ixmap_mnode));
+	/* released mnodes are linked through their parent pointer */
+	pool = node->pool;
+	node->parent = pool->free;
+	pool->free = node;
 	return;
 }
 
+/*
+ * The first word of each chunk links it to the previous one,
+ * so that ixmap_mem_destroy() can unmap all of them.
+ */
+static int ixmap_mpool_grow(struct ixmap_mpool *pool)
+{
+	struct ixmap_mnode *node;
+	void *chunk;
+	unsigned int offset;
+
+	chunk = numa_alloc_onnode(IXMAP_MPOOL_CHUNK,
+		numa_node_of_cpu(pool->core_id));
+	if(!chunk)
+		goto err_alloc_chunk;
+
+	*(void **)chunk = pool->chunk;
+	pool->chunk = chunk;
+
+	for(offset = ALIGN(sizeof(void *), L1_CACHE_BYTES);
+	offset + sizeof(struct ixmap_mnode) <= IXMAP_MPOOL_CHUNK;
+	offset += sizeof(struct ixmap_mnode)){
+		node = chunk + offset;
+		node->parent = pool->free;
+		pool->free = node;
+	}
+
+	return 0;
+
+err_alloc_chunk:
+	return -1;
+}
+
 struct ixmap_mnode *ixmap_mem_init(void *ptr, unsigned int size, int core_id)
 {
-	struct ixmap_mnode *root;
+	struct ixmap_mpool *pool;
+	struct ixmap_mnode root_parent, *root;
+
+	pool = numa_alloc_onnode(sizeof(struct ixmap_mpool),
+		numa_node_of_cpu(core_id));
+	if(!pool)
+		goto err_alloc_pool;
+
+	pool->free	= NULL;
+	pool->chunk	= NULL;
+	pool->core_id	= core_id;
+	pool->huge	= 0;
 
-	root = ixmap_mnode_alloc(NULL, ptr, size, 0, core_id);
+	root_parent.pool = pool;
+	root = ixmap_mnode_alloc(&root_parent, ptr, size, 0);
 	if(!root)
 		goto err_alloc_root;
 
+	root->parent = NULL;
 	return root;
 
 err_alloc_root:
+	numa_free(pool, sizeof(struct ixmap_mpool));
+err_alloc_pool:
 	return NULL;
 }
 
 void ixmap_mem_destroy(struct ixmap_mnode *node)
 {
+	struct ixmap_mpool *pool;
+	void *chunk, *chunk_next;
+
+	pool = node->pool;
 	_ixmap_mem_destroy(node);
+
+	for(chunk = pool->chunk; chunk; chunk = chunk_next){
+		chunk_next = *(void **)chunk;
+		numa_free(chunk, IXMAP_MPOOL_CHUNK);
+	}
+
+	numa_free(pool, sizeof(struct ixmap_mpool));
 }
 
 static void _ixmap_mem_destroy(struct ixmap_mnode *node)
@@ -95,8 +171,7 @@ void *ixmap_mem_alloc(struct ixmap_desc *desc,
 
 	node = _ixmap_mem_alloc(desc->node,
 		ALIGN(size, L1_CACHE_BYTES) +
-		ALIGN(sizeof(unsigned long), L1_CACHE_BYTES),
-		desc->core_id);
+		ALIGN(sizeof(unsigned long), L1_CACHE_BYTES));
 
 	if(!node)
 		goto err_alloc;
@@ -109,8 +184,12 @@ err_alloc:
 	return NULL;
 }
 
+/*
+ * free_max lets the search skip subtrees without a large enough
+ * block, so an allocation only walks down the depth of the tree.
+ */
 static struct ixmap_mnode *_ixmap_mem_alloc(struct ixmap_mnode *node,
-	unsigned int size, int core_id)
+	unsigned int size)
 {
 	void *ptr_new;
 	struct ixmap_mnode *ret;
@@ -119,37 +198,39 @@ static struct ixmap_mnode *_ixmap_mem_alloc(struct ixmap_mnode *node,
 
 	ret = NULL;
 
-	if(!node)
+	if(!node || node->free_max < size)
 		goto ign_node;
 
 	if((node->size >> 1) < size){
-		if(!node->allocated
-		&& node->size >= size){
-			ret = node;
-		}
-	}else{
-		if(!node->allocated){
-			size_new = node->size >> 1;
-			for(i = 0, buddy_allocated = 0; i < 2; i++, buddy_allocated++){
-				ptr_new = node->ptr + (size_new * i);
-
-				node->child[i] = ixmap_mnode_alloc(node, ptr_new, size_new,
-					i, core_id);
-				if(!node->child[i])
-					goto err_alloc_child;
-			}
-		}
+		/* only a free leaf can satisfy free_max here */
+		ret = node;
+		node->allocated = 1;
+		node->free_max = 0;
+		goto ign_node;
+	}
 
-		for(i = 0; i < 2; i++){
-			ret = _ixmap_mem_alloc(node->child[i], size, core_id);
-			if(ret)
-				break;
+	if(!node->allocated){
+		size_new = node->size >> 1;
+		for(i = 0, buddy_allocated = 0; i < 2; i++, buddy_allocated++){
+			ptr_new = node->ptr + (size_new * i);
+
+			node->child[i] = ixmap_mnode_alloc(node, ptr_new, size_new, i);
+			if(!node->child[i])
+				goto err_alloc_child;
 		}
 	}
 
+	for(i = 0; i < 2; i++){
+		ret = _ixmap_mem_alloc(node->child[i], size);
+		if(ret)
+			break;
+	}
+
 	if(ret)
 		node->allocated = 1;
 
+	ixmap_mnode_update(node);
+
 ign_node:
 	return ret;
 
@@ -159,6 +240,21 @@ err_alloc_child:
 	return NULL;
 }
 
+static void ixmap_mnode_update(struct ixmap_mnode *node)
+{
+	struct ixmap_mnode *child0, *child1;
+
+	child0 = node->child[0];
+	child1 = node->child[1];
+
+	if(!child0 || !child1)
+		return;
+
+	node->free_max = child0->free_max > child1->free_max ?
+		child0->free_max : child1->free_max;
+	return;
+}
+
 void ixmap_mem_free(void *addr_free)
 {
 	struct ixmap_mnode *node;
@@ -172,8 +268,10 @@ void ixmap_mem_free(void *addr_free)
 static void _ixmap_mem_free(struct ixmap_mnode *node)
 {
 	struct ixmap_mnode *parent, *buddy;
+	unsigned int free_max;
 
 	node->allocated = 0;
+	node->free_max = node->size;
 	
 	parent = node->parent;
 	if(!parent)
@@ -181,7 +279,7 @@ static void _ixmap_mem_free(struct ixmap_mnode *node)
 
 	buddy = parent->child[!node->index];
 	if(buddy->allocated)
-		goto out;
+		goto update;
 
 	ixmap_mnode_release(buddy);
 	ixmap_mnode_release(node);
@@ -189,6 +287,108 @@ static void _ixmap_mem_free(struct ixmap_mnode *node)
 
 	return;
 
+update:
+	/*
+	 * The buddy is still in use, propagate the larger free block.
+	 * Above a node whose free_max did not change, none does either.
+	 */
+	for(; parent; parent = parent->parent){
+		free_max = parent->free_max;
+		ixmap_mnode_update(parent);
+		if(parent->free_max == free_max)
+			break;
+	}
 out:
 	return;
 }
+
+/*
+ * Maps size bytes of hugepages apart from the arena, for a table
+ * as large as a buddy block would double. Falls back to small pages.
+ */
+void *ixmap_mem_alloc_huge(struct ixmap_desc *desc,
+	unsigned long size)
+{
+	void *addr;
+
+	size = ALIGN(size, SIZE_2MB);
+	numa_set_preferred(numa_node_of_cpu(desc->core_id));
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, 0, 0);
+	if(addr == MAP_FAILED){
+		addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, 0, 0);
+		if(addr == MAP_FAILED)
+			goto err_mmap;
+	}
+
+	desc->node->pool->huge += size;
+	return addr;
+
+err_mmap:
+	return NULL;
+}
+
+void ixmap_mem_free_huge(struct ixmap_desc *desc, void *addr_free,
+	unsigned long size)
+{
+	size = ALIGN(size, SIZE_2MB);
+	munmap(addr_free, size);
+	desc->node->pool->huge -= size;
+	return;
+}
+
+/*
+ * Maps size bytes that are backed only as they are written. Small
+ * pages keep scattered writes from backing 2MB each, reads of the
+ * rest see zeroes. Not counted by ixmap_mem_used(), nothing is
+ * reserved.
+ */
+void *ixmap_mem_alloc_sparse(struct ixmap_desc *desc,
+	unsigned long size)
+{
+	void *addr;
+
+	size = ALIGN(size, SIZE_2MB);
+	numa_set_preferred(numa_node_of_cpu(desc->core_id));
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, 0, 0);
+	if(addr == MAP_FAILED)
+		goto err_mmap;
+
+	madvise(addr, size, MADV_NOHUGEPAGE);
+	return addr;
+
+err_mmap:
+	return NULL;
+}
+
+/* Zeroes the mapping again and gives its pages back */
+void ixmap_mem_reset_sparse(void *addr, unsigned long size)
+{
+	madvise(addr, ALIGN(size, SIZE_2MB), MADV_DONTNEED);
+	return;
+}
+
+void ixmap_mem_free_sparse(void *addr_free, unsigned long size)
+{
+	munmap(addr_free, ALIGN(size, SIZE_2MB));
+	return;
+}
+
+/* Bytes held by allocated blocks, headers and buddy rounding included */
+unsigned long ixmap_mem_used(struct ixmap_desc *desc)
+{
+	return _ixmap_mem_used(desc->node) + desc->node->pool->huge;
+}
+
+static unsigned long _ixmap_mem_used(struct ixmap_mnode *node)
+{
+	if(!node->child[0] || !node->child[1])
+		return node->allocated ? node->size : 0;
+
+	return _ixmap_mem_used(node->child[0])
+		+ _ixmap_mem_used(node->child[1]);
+}
@@ -1,12 +1,24 @@
 #ifndef _IXMAP_MEMORY_H
 #define _IXMAP_MEMORY_H
 
+/* mnodes are carved from chunks of this size, not mapped one by one */
+#define IXMAP_MPOOL_CHUNK	(1 << 21)
+
+struct ixmap_mpool {
+	struct ixmap_mnode	*free;
+	void			*chunk;
+	int			core_id;
+	unsigned long		huge; /* bytes mapped outside the tree */
+};
+
 struct ixmap_mnode {
 	struct ixmap_mnode	*child[2];
 	struct ixmap_mnode	*parent;
+	struct ixmap_mpool	*pool;
 	unsigned int		allocated;
 	unsigned int		index;
 	unsigned int		size;
+	unsigned int		free_max; /* largest free block below */
 	void			*ptr;
 };
 
@@ -0,0 +1,269 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <ixmap.h>
+
+#include "main.h"
+#include "adj.h"
+
+static void adj_key_set(uint32_t *key, int family, int port_index,
+	void *addr);
+static unsigned int adj_key_generate(void *key, unsigned int bit_len);
+static int adj_key_compare(void *key_tgt, void *key_ent);
+static void adj_entry_delete(struct hash_entry *entry);
+static void adj_set(struct adj *adj, void *mac);
+static uint8_t *adj_neigh_mac(struct adj *adj);
+
+struct adj_table *adj_table_alloc(unsigned int num_ports,
+	struct ixmap_desc *desc)
+{
+	struct adj_table *table;
+
+	table = ixmap_mem_alloc(desc, sizeof(struct adj_table));
+	if(!table)
+		goto err_table_alloc;
+
+	table->port_mac = ixmap_mem_alloc(desc, ETH_ALEN * num_ports);
+	if(!table->port_mac)
+		goto err_port_mac_alloc;
+
+	memset(table->port_mac, 0, ETH_ALEN * num_ports);
+	table->num_ports = num_ports;
+	table->neigh_inet = NULL;
+	table->neigh_inet6 = NULL;
+
+	hash_init(&table->table);
+	table->table.hash_entry_delete	= adj_entry_delete;
+	table->table.hash_key_generate	= adj_key_generate;
+	table->table.hash_key_compare	= adj_key_compare;
+
+	return table;
+
+err_port_mac_alloc:
+	ixmap_mem_free(table);
+err_table_alloc:
+	return NULL;
+}
+
+/* The routes and groups holding adjacencies must be released first */
+void adj_table_release(struct adj_table *table)
+{
+	hash_delete_all(&table->table);
+	ixmap_mem_free(table->port_mac);
+	ixmap_mem_free(table);
+	return;
+}
+
+/* Source of the rewrites out of port, set before any adjacency */
+void adj_table_port_mac(struct adj_table *table, unsigned int port_index,
+	uint8_t *mac)
+{
+	memcpy(table->port_mac[port_index], mac, ETH_ALEN);
+	return;
+}
+
+/*
+ * Neighbor tables of the node, per port and indexed like it. A new
+ * adjacency takes its MAC from them, see adj_get().
+ */
+void adj_table_neigh(struct adj_table *table, struct neigh_table **neigh_inet,
+	struct neigh_table **neigh_inet6)
+{
+	table->neigh_inet = neigh_inet;
+	table->neigh_inet6 = neigh_inet6;
+	return;
+}
+
+static void adj_key_set(uint32_t *key, int family, int port_index,
+	void *addr)
+{
+	memset(key, 0, sizeof(uint32_t) * ADJ_KEY_WORDS);
+	memcpy(key, addr, family == AF_INET ? 4 : 16);
+	key[ADJ_KEY_WORDS - 1] = (family << 16) | port_index;
+	return;
+}
+
+static unsigned int adj_key_generate(void *key, unsigned int bit_len)
+{
+	uint64_t hash = 0;
+	int i;
+
+	for(i = 0; i < ADJ_KEY_WORDS; i++){
+		hash = (hash ^ ((uint32_t *)key)[i]) * GOLDEN_RATIO_64;
+	}
+
+	return hash >> (64 - bit_len);
+}
+
+static int adj_key_compare(void *key_tgt, void *key_ent)
+{
+	return memcmp(key_tgt, key_ent,
+		sizeof(uint32_t) * ADJ_KEY_WORDS) ? 1 : 0;
+}
+
+static void adj_entry_delete(struct hash_entry *entry)
+{
+	ixmap_mem_free(hash_entry(entry, struct adj, hash));
+	return;
+}
+
+/*
+ * Returns the adjacency of a gateway with one reference, for the
+ * caller. A new one is resolved from the neighbor tables before any
+ * route holds it, or else waits for its neighbor, see adj_update().
+ */
+struct adj *adj_get(struct adj_table *table, int family, int port_index,
+	void *addr, struct ixmap_desc *desc)
+{
+	struct adj *adj;
+	struct hash_entry *hash_entry;
+	uint32_t key[ADJ_KEY_WORDS];
+	int ret;
+
+	if(port_index < 0 || port_index >= table->num_ports)
+		goto err_invalid_port;
+
+	adj_key_set(key, family, port_index, addr);
+
+	hash_entry = hash_lookup(&table->table, key);
+	if(hash_entry){
+		adj = hash_entry(hash_entry, struct adj, hash);
+		adj->refcount++;
+		return adj;
+	}
+
+	adj = ixmap_mem_alloc(desc, sizeof(struct adj));
+	if(!adj)
+		goto err_adj_alloc;
+
+	memset(adj->rewrite, 0, ADJ_REWRITE_LEN);
+	memcpy(adj->key, key, sizeof(key));
+	adj->state	= ADJ_STATE_INCOMPLETE;
+	adj->seq	= 0;
+	adj->used	= 0;
+	adj->port_index	= port_index;
+	adj->family	= family;
+	adj->refcount	= 1;
+	adj->table	= table;
+	adj_set(adj, adj_neigh_mac(adj));
+
+	ret = hash_add(&table->table, adj->key, &adj->hash);
+	if(ret < 0)
+		goto err_hash_add;
+
+	return adj;
+
+err_hash_add:
+	ixmap_mem_free(adj);
+err_adj_alloc:
+err_invalid_port:
+	return NULL;
+}
+
+void adj_hold(struct adj *adj)
+{
+	adj->refcount++;
+	return;
+}
+
+/* The last holder is a route released after its grace period */
+void adj_put(struct adj *adj)
+{
+	adj->refcount--;
+
+	if(!adj->refcount)
+		hash_delete(&adj->table->table, adj->key);
+
+	return;
+}
+
+/* mac NULL means the neighbor is gone */
+static void adj_set(struct adj *adj, void *mac)
+{
+	adj->seq++;
+	smp_wmb();
+
+	if(mac){
+		memcpy(adj->rewrite, mac, ETH_ALEN);
+		memcpy(adj->rewrite + ETH_ALEN,
+			adj->table->port_mac[adj->port_index], ETH_ALEN);
+		adj->state = ADJ_STATE_VALID;
+	}else{
+		adj->state = ADJ_STATE_INCOMPLETE;
+	}
+
+	smp_wmb();
+	adj->seq++;
+	return;
+}
+
+/* A neighbor changed, whatever the number of routes through it */
+void adj_update(struct adj_table *table, int family, int port_index,
+	void *addr, void *mac)
+{
+	struct hash_entry *hash_entry;
+	uint32_t key[ADJ_KEY_WORDS];
+
+	if(port_index < 0 || port_index >= table->num_ports)
+		return;
+
+	adj_key_set(key, family, port_index, addr);
+
+	hash_entry = hash_lookup(&table->table, key);
+	if(!hash_entry)
+		return;
+
+	adj_set(hash_entry(hash_entry, struct adj, hash), mac);
+	return;
+}
+
+/* MAC of the gateway in the neighbor tables of the node, or NULL */
+static uint8_t *adj_neigh_mac(struct adj *adj)
+{
+	struct adj_table *table = adj->table;
+	struct neigh_entry *neigh_entry;
+	struct neigh_table *neigh;
+
+	if(!table->neigh_inet)
+		return NULL;
+
+	neigh = adj->family == AF_INET ?
+		table->neigh_inet[adj->port_index] :
+		table->neigh_inet6[adj->port_index];
+
+	neigh_entry = neigh_get(neigh, adj->key);
+	return neigh_entry ? neigh_entry->dst_mac : NULL;
+}
+
+/* Every adjacency taken again from the neighbor tables of the node */
+void adj_resolve(struct adj_table *table)
+{
+	struct adj *adj;
+	unsigned int i;
+
+	for(i = 0; i < HASH_SIZE; i++){
+		hlist_for_each_entry(adj, &table->table.head[i], hash.list){
+			adj_set(adj, adj_neigh_mac(adj));
+		}
+	}
+
+	return;
+}
+
+void adj_walk(struct adj_table *table,
+	void (*func)(struct adj *, void *), void *arg)
+{
+	struct adj *adj;
+	unsigned int i;
+
+	for(i = 0; i < HASH_SIZE; i++){
+		hlist_for_each_entry(adj, &table->table.head[i], hash.list){
+			func(adj, arg);
+		}
+	}
+
+	return;
+}
@@ -0,0 +1,93 @@
+#ifndef _IXMAPFWD_ADJ_H
+#define _IXMAPFWD_ADJ_H
+
+#include <stdint.h>
+#include <string.h>
+#include <linux/if_ether.h>
+#include "hash.h"
+#include "neigh.h"
+
+/*
+ * Adjacency: a gateway out of an ixmap port, shared by every route
+ * and path through it. It holds the Ethernet rewrite resolved from
+ * the neighbor, so forwarding needs no neigh_lookup(), and the loss
+ * or change of that neighbor reaches all of those routes at once.
+ * Only the FIB writer changes an adjacency, readers copy rewrite and
+ * state under seq, odd while the writer is inside.
+ */
+#define ADJ_REWRITE_LEN		(ETH_ALEN * 2)
+#define ADJ_KEY_WORDS		5
+
+enum adj_state {
+	ADJ_STATE_INCOMPLETE = 0,	/* no neighbor, the kernel resolves it */
+	ADJ_STATE_VALID
+};
+
+struct adj_table;
+
+/* rewrite and state first, one 16 byte load */
+struct adj {
+	uint8_t			rewrite[ADJ_REWRITE_LEN]; /* h_dest, h_source */
+	uint32_t		state;
+	volatile unsigned int	seq;
+	unsigned int		used; /* set by readers, see adj_use() */
+	int			port_index;
+	int			family;
+	unsigned int		refcount;
+	struct adj_table	*table;
+	struct hash_entry	hash;
+	uint32_t		key[ADJ_KEY_WORDS]; /* addr, family, port */
+};
+
+struct adj_table {
+	struct hash_table	table;
+	unsigned int		num_ports;
+	uint8_t			(*port_mac)[ETH_ALEN];
+	struct neigh_table	**neigh_inet; /* of the node, NULL if none */
+	struct neigh_table	**neigh_inet6;
+};
+
+struct adj_table *adj_table_alloc(unsigned int num_ports,
+	struct ixmap_desc *desc);
+void adj_table_release(struct adj_table *table);
+void adj_table_port_mac(struct adj_table *table, unsigned int port_index,
+	uint8_t *mac);
+void adj_table_neigh(struct adj_table *table, struct neigh_table **neigh_inet,
+	struct neigh_table **neigh_inet6);
+struct adj *adj_get(struct adj_table *table, int family, int port_index,
+	void *addr, struct ixmap_desc *desc);
+void adj_hold(struct adj *adj);
+void adj_put(struct adj *adj);
+void adj_update(struct adj_table *table, int family, int port_index,
+	void *addr, void *mac);
+void adj_resolve(struct adj_table *table);
+void adj_walk(struct adj_table *table,
+	void (*func)(struct adj *, void *), void *arg);
+
+/* Marks the gateway as forwarded to for netlink_confirm(), as neigh_use() */
+static inline void adj_use(struct adj *adj)
+{
+	if(unlikely(!ACCESS_ONCE(adj->used)))
+		ACCESS_ONCE(adj->used) = 1;
+
+	return;
+}
+
+/* Copies the rewrite to apply, returns -1 unless the neighbor is known */
+static inline int adj_load(struct adj *adj, uint8_t *rewrite)
+{
+	unsigned int seq;
+	uint32_t state;
+
+	do{
+		seq = adj->seq;
+		smp_rmb();
+		memcpy(rewrite, adj->rewrite, ADJ_REWRITE_LEN);
+		state = adj->state;
+		smp_rmb();
+	}while(unlikely((seq & 1) || seq != adj->seq));
+
+	return state == ADJ_STATE_VALID ? 0 : -1;
+}
+
+#endif /* _IXMAPFWD_ADJ_H */
@@ -0,0 +1,768 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <stddef.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+#include "main.h"
+#include "dir24.h"
+
+static void dir24_tbl24_free(struct dir24_table *table);
+static void dir24_tbl8_free(struct dir24_table *table);
+static uint32_t dir24_mask(unsigned int prefix_len);
+static struct dir24_rule *dir24_rule_lookup(struct dir24_table *table,
+	uint32_t prefix, unsigned int prefix_len);
+static struct dir24_rule *dir24_rule_cover(struct dir24_table *table,
+	uint32_t prefix, unsigned int prefix_len);
+static void dir24_rule_delete(struct hash_entry *entry);
+static unsigned int dir24_key_generate(void *key,
+	unsigned int bit_len);
+static int dir24_key_compare(void *key_tgt, void *key_ent);
+static int dir24_install(struct dir24_table *table, uint32_t prefix,
+	unsigned int prefix_len, uint32_t value);
+static void dir24_uninstall(struct dir24_table *table, uint32_t prefix,
+	unsigned int prefix_len, uint32_t value);
+static void dir24_tbl8_recycle(struct dir24_table *table,
+	unsigned int index24);
+static void dir24_tbl8_release(void *ptr, unsigned long group);
+static void dir24_nexthop_release(void *ptr, unsigned long index);
+static void dir24_entry_release(void *ptr, unsigned long data);
+
+/* Without a pool the table gets one of its own, see dir24.h */
+int dir24_init(struct dir24_table *table, struct lpm6_pool *pool,
+	struct ixmap_desc *desc)
+{
+	int i;
+
+	table->desc = desc;
+	table->pool_private = !pool;
+
+	if(table->pool_private){
+		table->tbl24 = ixmap_mem_alloc_huge(desc,
+			sizeof(uint32_t) * DIR24_TBL24_SIZE);
+		if(!table->tbl24)
+			goto err_tbl24_alloc;
+
+		table->tbl8 = ixmap_mem_alloc(desc,
+			sizeof(uint32_t) * DIR24_TBL8_SIZE * DIR24_TBL8_GROUPS);
+		if(!table->tbl8)
+			goto err_tbl8_alloc;
+
+		pool = lpm6_pool_alloc(desc);
+		if(!pool)
+			goto err_pool_alloc;
+
+		memset(table->tbl24, 0, sizeof(uint32_t) * DIR24_TBL24_SIZE);
+	}else{
+		table->tbl24 = ixmap_mem_alloc_sparse(desc,
+			sizeof(uint32_t) * DIR24_TBL24_SIZE);
+		if(!table->tbl24)
+			goto err_tbl24_alloc;
+
+		table->tbl8 = ixmap_mem_alloc_sparse(desc,
+			sizeof(uint32_t) * DIR24_TBL8_SIZE * DIR24_TBL8_GROUPS);
+		if(!table->tbl8)
+			goto err_tbl8_alloc;
+	}
+
+	table->tbl8_free = ixmap_mem_alloc(desc,
+		sizeof(uint32_t) * DIR24_TBL8_GROUPS);
+	if(!table->tbl8_free)
+		goto err_tbl8_free_alloc;
+
+	table->pool = pool;
+	table->nexthop = pool->nexthop;
+
+	/* lower indices are popped first */
+	for(i = 0; i < DIR24_TBL8_GROUPS; i++){
+		table->tbl8_free[i] = DIR24_TBL8_GROUPS - 1 - i;
+	}
+	table->tbl8_free_num = DIR24_TBL8_GROUPS;
+
+#ifdef __x86_64__
+	if(__builtin_cpu_supports("avx2"))
+		table->lookup_bulk = dir24_lookup_bulk_avx2;
+	else
+#endif
+		table->lookup_bulk = dir24_lookup_bulk_scalar;
+
+	hash_init(&table->rules);
+	table->qsbr = NULL;
+	table->rules.hash_entry_delete	= dir24_rule_delete;
+	table->rules.hash_key_generate	= dir24_key_generate;
+	table->rules.hash_key_compare	= dir24_key_compare;
+
+	return 0;
+
+err_tbl8_free_alloc:
+	if(table->pool_private)
+		lpm6_pool_release(pool);
+err_pool_alloc:
+	dir24_tbl8_free(table);
+err_tbl8_alloc:
+	dir24_tbl24_free(table);
+err_tbl24_alloc:
+	return -1;
+}
+
+void dir24_destroy(struct dir24_table *table)
+{
+	dir24_delete_all(table);
+
+	ixmap_mem_free(table->tbl8_free);
+	if(table->pool_private)
+		lpm6_pool_release(table->pool);
+	dir24_tbl8_free(table);
+	dir24_tbl24_free(table);
+	return;
+}
+
+static void dir24_tbl24_free(struct dir24_table *table)
+{
+	if(table->pool_private)
+		ixmap_mem_free_huge(table->desc, table->tbl24,
+			sizeof(uint32_t) * DIR24_TBL24_SIZE);
+	else
+		ixmap_mem_free_sparse(table->tbl24,
+			sizeof(uint32_t) * DIR24_TBL24_SIZE);
+	return;
+}
+
+static void dir24_tbl8_free(struct dir24_table *table)
+{
+	if(table->pool_private)
+		ixmap_mem_free(table->tbl8);
+	else
+		ixmap_mem_free_sparse(table->tbl8,
+			sizeof(uint32_t) * DIR24_TBL8_SIZE * DIR24_TBL8_GROUPS);
+	return;
+}
+
+static uint32_t dir24_mask(unsigned int prefix_len)
+{
+	return prefix_len ? ~((1ULL << (32 - prefix_len)) - 1) : 0;
+}
+
+static unsigned int dir24_key_generate(void *key, unsigned int bit_len)
+{
+	uint64_t hash = ((uint64_t)((uint32_t *)key)[1] << 32)
+		| ((uint32_t *)key)[0];
+	hash *= GOLDEN_RATIO_64;
+
+	return hash >> (64 - bit_len);
+}
+
+static int dir24_key_compare(void *key_tgt, void *key_ent)
+{
+	return ((uint32_t *)key_tgt)[0] ^ ((uint32_t *)key_ent)[0] ?
+		1 : (((uint32_t *)key_tgt)[1] ^ ((uint32_t *)key_ent)[1] ?
+		1 : 0);
+}
+
+static void dir24_rule_delete(struct hash_entry *entry)
+{
+	struct dir24_rule *rule;
+
+	rule = hash_entry(entry, struct dir24_rule, hash);
+	ixmap_mem_free(rule);
+	return;
+}
+
+static struct dir24_rule *dir24_rule_lookup(struct dir24_table *table,
+	uint32_t prefix, unsigned int prefix_len)
+{
+	struct hash_entry *hash_entry;
+	uint32_t key[2];
+
+	key[0] = prefix;
+	key[1] = prefix_len;
+
+	hash_entry = hash_lookup(&table->rules, key);
+	if(!hash_entry)
+		goto err_hash_lookup;
+
+	return hash_entry(hash_entry, struct dir24_rule, hash);
+
+err_hash_lookup:
+	return NULL;
+}
+
+/* Find the longest rule strictly shorter than prefix_len covering prefix */
+static struct dir24_rule *dir24_rule_cover(struct dir24_table *table,
+	uint32_t prefix, unsigned int prefix_len)
+{
+	struct dir24_rule *rule;
+	int len;
+
+	for(len = prefix_len - 1; len >= 0; len--){
+		rule = dir24_rule_lookup(table, prefix & dir24_mask(len), len);
+		if(rule)
+			return rule;
+	}
+
+	return NULL;
+}
+
+void *dir24_lookup(struct dir24_table *table, void *dst)
+{
+	uint32_t addr, ent;
+
+	addr = ntohl(*(uint32_t *)dst);
+	ent = table->tbl24[addr >> 8];
+
+	if(unlikely(ent & DIR24_EXT)){
+		ent = table->tbl8[(dir24_index(ent) << 8) | (addr & 0xff)];
+	}
+
+	if(!(ent & DIR24_VALID))
+		goto err_not_found;
+
+	return table->nexthop[dir24_index(ent)];
+
+err_not_found:
+	return NULL;
+}
+
+void dir24_lookup_bulk(struct dir24_table *table, void **dst,
+	void **ptr, unsigned int num)
+{
+	table->lookup_bulk(table, dst, ptr, num);
+	return;
+}
+
+/*
+ * Resolve each stage for the whole burst before the next one,
+ * so that cache misses of different destinations overlap.
+ */
+void dir24_lookup_bulk_scalar(struct dir24_table *table, void **dst,
+	void **ptr, unsigned int num)
+{
+	uint32_t addr[DIR24_LOOKUP_BULK], ent[DIR24_LOOKUP_BULK];
+	unsigned int base, num_bulk;
+	int i;
+
+	for(base = 0; base < num; base += num_bulk){
+		num_bulk = min(num - base, (unsigned int)DIR24_LOOKUP_BULK);
+
+		for(i = 0; i < num_bulk; i++){
+			addr[i] = ntohl(*(uint32_t *)dst[base + i]);
+			prefetch(&table->tbl24[addr[i] >> 8]);
+		}
+
+		for(i = 0; i < num_bulk; i++){
+			ent[i] = table->tbl24[addr[i] >> 8];
+			if(unlikely(ent[i] & DIR24_EXT)){
+				prefetch(&table->tbl8[(dir24_index(ent[i]) << 8)
+					| (addr[i] & 0xff)]);
+			}
+		}
+
+		for(i = 0; i < num_bulk; i++){
+			if(unlikely(ent[i] & DIR24_EXT)){
+				ent[i] = table->tbl8[(dir24_index(ent[i]) << 8)
+					| (addr[i] & 0xff)];
+			}
+
+			if(ent[i] & DIR24_VALID)
+				prefetch(&table->nexthop[dir24_index(ent[i])]);
+		}
+
+		for(i = 0; i < num_bulk; i++){
+			ptr[base + i] = ent[i] & DIR24_VALID ?
+				table->nexthop[dir24_index(ent[i])] : NULL;
+		}
+	}
+
+	return;
+}
+
+#ifdef __x86_64__
+/*
+ * 8 destinations per round: byte swap and shift in vector registers,
+ * then one gather for tbl24 and two for the nexthop pointers.
+ * tbl8 entries are rare and resolved by scalar code.
+ */
+__attribute__((target("avx2")))
+void dir24_lookup_bulk_avx2(struct dir24_table *table, void **dst,
+	void **ptr, unsigned int num)
+{
+	const __m256i bswap = _mm256_set_epi8(
+		12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+		12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	const __m256i index_mask = _mm256_set1_epi32(DIR24_INDEX_MASK);
+	__m256i addr, ent, index, valid, lo, hi;
+	uint32_t addr_buf[DIR24_SIMD_WIDTH], ent_buf[DIR24_SIMD_WIDTH];
+	unsigned int base;
+	int i, ext;
+
+	for(base = 0; base + DIR24_SIMD_WIDTH <= num;
+	base += DIR24_SIMD_WIDTH){
+		addr = _mm256_set_epi32(
+			*(uint32_t *)dst[base + 7], *(uint32_t *)dst[base + 6],
+			*(uint32_t *)dst[base + 5], *(uint32_t *)dst[base + 4],
+			*(uint32_t *)dst[base + 3], *(uint32_t *)dst[base + 2],
+			*(uint32_t *)dst[base + 1], *(uint32_t *)dst[base + 0]);
+		addr = _mm256_shuffle_epi8(addr, bswap);
+
+		ent = _mm256_i32gather_epi32((const int *)table->tbl24,
+			_mm256_srli_epi32(addr, 8), 4);
+
+		/* move DIR24_EXT to the sign bit of each lane */
+		ext = _mm256_movemask_ps(_mm256_castsi256_ps(
+			_mm256_slli_epi32(ent, 1)));
+		if(unlikely(ext)){
+			_mm256_storeu_si256((__m256i *)addr_buf, addr);
+			_mm256_storeu_si256((__m256i *)ent_buf, ent);
+
+			for(i = 0; i < DIR24_SIMD_WIDTH; i++){
+				if(!(ext & (1 << i)))
+					continue;
+
+				ent_buf[i] = table->tbl8[
+					(dir24_index(ent_buf[i]) << 8)
+					| (addr_buf[i] & 0xff)];
+			}
+
+			ent = _mm256_loadu_si256((__m256i *)ent_buf);
+		}
+
+		/* lanes without DIR24_VALID are left NULL */
+		index = _mm256_and_si256(ent, index_mask);
+		valid = _mm256_srai_epi32(ent, 31);
+
+		lo = _mm256_mask_i32gather_epi64(_mm256_setzero_si256(),
+			(const long long *)table->nexthop,
+			_mm256_castsi256_si128(index),
+			_mm256_cvtepi32_epi64(_mm256_castsi256_si128(valid)), 8);
+		hi = _mm256_mask_i32gather_epi64(_mm256_setzero_si256(),
+			(const long long *)table->nexthop,
+			_mm256_extracti128_si256(index, 1),
+			_mm256_cvtepi32_epi64(_mm256_extracti128_si256(valid, 1)),
+			8);
+
+		_mm256_storeu_si256((__m256i *)&ptr[base], lo);
+		_mm256_storeu_si256((__m256i *)&ptr[base + 4], hi);
+	}
+
+	if(base < num)
+		dir24_lookup_bulk_scalar(table, &dst[base],
+			&ptr[base], num - base);
+
+	return;
+}
+#endif
+
+static int dir24_install(struct dir24_table *table, uint32_t prefix,
+	unsigned int prefix_len, uint32_t value)
+{
+	uint32_t *tbl8, ent;
+	unsigned int index, range, group;
+	int i, j;
+
+	if(prefix_len <= 24){
+		index = prefix >> 8;
+		range = 1 << (24 - prefix_len);
+
+		for(i = 0; i < range; i++){
+			ent = table->tbl24[index + i];
+
+			if(!(ent & DIR24_EXT)){
+				if(!(ent & DIR24_VALID)
+				|| dir24_depth(ent) <= prefix_len)
+					table->tbl24[index + i] = value;
+				continue;
+			}
+
+			tbl8 = &table->tbl8[dir24_index(ent) << 8];
+			for(j = 0; j < DIR24_TBL8_SIZE; j++){
+				if(!(tbl8[j] & DIR24_VALID)
+				|| dir24_depth(tbl8[j]) <= prefix_len)
+					tbl8[j] = value;
+			}
+		}
+	}else{
+		index = prefix >> 8;
+		ent = table->tbl24[index];
+
+		if(!(ent & DIR24_EXT)){
+			if(!table->tbl8_free_num)
+				goto err_tbl8_exhausted;
+
+			group = table->tbl8_free[--table->tbl8_free_num];
+			tbl8 = &table->tbl8[group << 8];
+
+			/* inherit the covering /24 or shorter entry */
+			for(j = 0; j < DIR24_TBL8_SIZE; j++){
+				tbl8[j] = ent;
+			}
+
+			/* group must be filled before it is linked */
+			__sync_synchronize();
+			table->tbl24[index] = DIR24_VALID | DIR24_EXT | group;
+		}else{
+			tbl8 = &table->tbl8[dir24_index(ent) << 8];
+		}
+
+		index = prefix & 0xff;
+		range = 1 << (32 - prefix_len);
+
+		for(j = 0; j < range; j++){
+			if(!(tbl8[index + j] & DIR24_VALID)
+			|| dir24_depth(tbl8[index + j]) <= prefix_len)
+				tbl8[index + j] = value;
+		}
+	}
+
+	return 0;
+
+err_tbl8_exhausted:
+	return -1;
+}
+
+static void dir24_uninstall(struct dir24_table *table, uint32_t prefix,
+	unsigned int prefix_len, uint32_t value)
+{
+	uint32_t *tbl8, ent;
+	unsigned int index, range;
+	int i, j;
+
+	if(prefix_len <= 24){
+		index = prefix >> 8;
+		range = 1 << (24 - prefix_len);
+
+		for(i = 0; i < range; i++){
+			ent = table->tbl24[index + i];
+
+			if(!(ent & DIR24_EXT)){
+				if((ent & DIR24_VALID)
+				&& dir24_depth(ent) == prefix_len)
+					table->tbl24[index + i] = value;
+				continue;
+			}
+
+			tbl8 = &table->tbl8[dir24_index(ent) << 8];
+			for(j = 0; j < DIR24_TBL8_SIZE; j++){
+				if((tbl8[j] & DIR24_VALID)
+				&& dir24_depth(tbl8[j]) == prefix_len)
+					tbl8[j] = value;
+			}
+
+			dir24_tbl8_recycle(table, index + i);
+		}
+	}else{
+		index = prefix >> 8;
+		ent = table->tbl24[index];
+		if(!(ent & DIR24_EXT))
+			return;
+
+		tbl8 = &table->tbl8[dir24_index(ent) << 8];
+		range = 1 << (32 - prefix_len);
+
+		for(j = prefix & 0xff; range; j++, range--){
+			if((tbl8[j] & DIR24_VALID)
+			&& dir24_depth(tbl8[j]) == prefix_len)
+				tbl8[j] = value;
+		}
+
+		dir24_tbl8_recycle(table, index);
+	}
+
+	return;
+}
+
+/* Collapse a tbl8 group back into tbl24 when no prefix longer than /24 remains */
+static void dir24_tbl8_recycle(struct dir24_table *table,
+	unsigned int index24)
+{
+	uint32_t *tbl8;
+	unsigned int group;
+	int j;
+
+	group = dir24_index(table->tbl24[index24]);
+	tbl8 = &table->tbl8[group << 8];
+
+	for(j = 0; j < DIR24_TBL8_SIZE; j++){
+		if((tbl8[j] & DIR24_VALID)
+		&& dir24_depth(tbl8[j]) > 24)
+			return;
+	}
+
+	table->tbl24[index24] = tbl8[0];
+
+	/* lookups may still be walking the group */
+	qsbr_call(table->qsbr, dir24_tbl8_release, table, group);
+	return;
+}
+
+static void dir24_tbl8_release(void *ptr, unsigned long group)
+{
+	struct dir24_table *table = ptr;
+
+	table->tbl8_free[table->tbl8_free_num++] = group;
+	return;
+}
+
+static void dir24_nexthop_release(void *ptr, unsigned long index)
+{
+	struct dir24_table *table = ptr;
+
+	table->pool->free[table->pool->free_num++] = index;
+	return;
+}
+
+static void dir24_entry_release(void *ptr, unsigned long data)
+{
+	struct dir24_table *table = (struct dir24_table *)data;
+
+	table->entry_put(ptr);
+	return;
+}
+
+int dir24_add(struct dir24_table *table, void *prefix,
+	unsigned int prefix_len, unsigned int id,
+	void *ptr, struct ixmap_desc *desc)
+{
+	struct dir24_rule *rule;
+	struct dir24_entry *entry, *entry_dir24;
+	uint32_t addr, value;
+	int ret, rule_allocated = 0;
+
+	if(prefix_len > 32)
+		goto err_invalid_len;
+
+	addr = ntohl(*(uint32_t *)prefix) & dir24_mask(prefix_len);
+
+	rule = dir24_rule_lookup(table, addr, prefix_len);
+	if(rule){
+		hlist_for_each_entry(entry_dir24, &rule->head, list){
+			if(!table->entry_identify(entry_dir24->ptr,
+			id, prefix_len))
+				goto err_entry_exist;
+		}
+	}else{
+		if(!table->pool->free_num)
+			goto err_nexthop_exhausted;
+
+		rule = ixmap_mem_alloc(desc, sizeof(struct dir24_rule));
+		if(!rule)
+			goto err_rule_alloc;
+
+		rule->key[0] = addr;
+		rule->key[1] = prefix_len;
+		INIT_HLIST_HEAD(&rule->head);
+		rule_allocated = 1;
+	}
+
+	entry = ixmap_mem_alloc(desc, sizeof(struct dir24_entry));
+	if(!entry)
+		goto err_entry_alloc;
+
+	entry->ptr = ptr;
+
+	if(rule_allocated){
+		rule->index = table->pool->free[table->pool->free_num - 1];
+		table->nexthop[rule->index] = ptr;
+
+		value = DIR24_VALID | (prefix_len << DIR24_DEPTH_SHIFT)
+			| rule->index;
+		ret = dir24_install(table, addr, prefix_len, value);
+		if(ret < 0)
+			goto err_install;
+
+		table->pool->free_num--;
+		hash_add(&table->rules, rule->key, &rule->hash);
+	}
+
+	/* the newest entry takes precedence as lpm_entry_insert() does */
+	table->entry_pull(ptr);
+	hlist_add_head(&entry->list, &rule->head);
+	table->nexthop[rule->index] = ptr;
+
+	return 0;
+
+err_install:
+	ixmap_mem_free(entry);
+err_entry_alloc:
+	if(rule_allocated)
+		ixmap_mem_free(rule);
+err_rule_alloc:
+err_nexthop_exhausted:
+err_entry_exist:
+err_invalid_len:
+	return -1;
+}
+
+/*
+ * The route of prefix with id, or else the one in use, gives way to
+ * ptr. Neither tbl24 nor tbl8 change, readers take the old or the new
+ * entry from the nexthop slot and never fall to a shorter prefix.
+ */
+int dir24_replace(struct dir24_table *table, void *prefix,
+	unsigned int prefix_len, unsigned int id, void *ptr)
+{
+	struct dir24_rule *rule;
+	struct dir24_entry *entry, *target;
+	uint32_t addr;
+	void *ptr_old;
+
+	if(prefix_len > 32)
+		goto err_not_found;
+
+	addr = ntohl(*(uint32_t *)prefix) & dir24_mask(prefix_len);
+
+	rule = dir24_rule_lookup(table, addr, prefix_len);
+	if(!rule)
+		goto err_not_found;
+
+	target = hlist_first_entry(&rule->head, struct dir24_entry, list);
+	hlist_for_each_entry(entry, &rule->head, list){
+		if(!table->entry_identify(entry->ptr, id, prefix_len)){
+			target = entry;
+			break;
+		}
+	}
+
+	ptr_old = target->ptr;
+	table->entry_pull(ptr);
+	target->ptr = ptr;
+
+	if(target == hlist_first_entry(&rule->head,
+	struct dir24_entry, list)){
+		smp_wmb();
+		ACCESS_ONCE(table->nexthop[rule->index]) = ptr;
+	}
+
+	qsbr_call(table->qsbr, dir24_entry_release,
+		ptr_old, (unsigned long)table);
+	return 0;
+
+err_not_found:
+	return -1;
+}
+
+int dir24_delete(struct dir24_table *table, void *prefix,
+	unsigned int prefix_len, unsigned int id)
+{
+	struct dir24_rule *rule, *cover;
+	struct dir24_entry *entry, *target;
+	uint32_t addr, value;
+
+	if(prefix_len > 32)
+		goto err_not_found;
+
+	addr = ntohl(*(uint32_t *)prefix) & dir24_mask(prefix_len);
+
+	rule = dir24_rule_lookup(table, addr, prefix_len);
+	if(!rule)
+		goto err_not_found;
+
+	target = NULL;
+	hlist_for_each_entry(entry, &rule->head, list){
+		if(!table->entry_identify(entry->ptr, id, prefix_len)){
+			target = entry;
+			break;
+		}
+	}
+
+	if(!target)
+		goto err_not_found;
+
+	hlist_del(&target->list);
+
+	if(!hlist_empty(&rule->head)){
+		entry = hlist_first_entry(&rule->head,
+			struct dir24_entry, list);
+		table->nexthop[rule->index] = entry->ptr;
+	}else{
+		cover = dir24_rule_cover(table, addr, prefix_len);
+		value = cover ? DIR24_VALID | (cover->key[1] << DIR24_DEPTH_SHIFT)
+			| cover->index : 0;
+
+		dir24_uninstall(table, addr, prefix_len, value);
+		qsbr_call(table->qsbr, dir24_nexthop_release,
+			table, rule->index);
+		hash_delete(&table->rules, rule->key);
+	}
+
+	qsbr_call(table->qsbr, dir24_entry_release,
+		target->ptr, (unsigned long)table);
+	ixmap_mem_free(target);
+
+	return 0;
+
+err_not_found:
+	return -1;
+}
+
+void dir24_delete_all(struct dir24_table *table)
+{
+	struct dir24_rule *rule;
+	struct dir24_entry *entry;
+	struct hlist_node *next;
+	int i;
+
+	/*
+	 * No lookup may run any longer, and pending releases
+	 * would refill the free lists reset below.
+	 */
+	if(table->qsbr)
+		qsbr_synchronize(table->qsbr);
+
+	for(i = 0; i < HASH_SIZE; i++){
+		hlist_for_each_entry(rule, &table->rules.head[i], hash.list){
+			hlist_for_each_entry_safe(entry, next,
+			&rule->head, list){
+				hlist_del(&entry->list);
+				table->entry_put(entry->ptr);
+				ixmap_mem_free(entry);
+			}
+			/* the pool may be shared, so slots go back one by one */
+			table->pool->free[table->pool->free_num++] =
+				rule->index;
+		}
+	}
+
+	hash_delete_all(&table->rules);
+
+	if(table->pool_private){
+		memset(table->tbl24, 0, sizeof(uint32_t) * DIR24_TBL24_SIZE);
+	}else{
+		ixmap_mem_reset_sparse(table->tbl24,
+			sizeof(uint32_t) * DIR24_TBL24_SIZE);
+		ixmap_mem_reset_sparse(table->tbl8,
+			sizeof(uint32_t) * DIR24_TBL8_SIZE * DIR24_TBL8_GROUPS);
+	}
+
+	for(i = 0; i < DIR24_TBL8_GROUPS; i++){
+		table->tbl8_free[i] = DIR24_TBL8_GROUPS - 1 - i;
+	}
+	table->tbl8_free_num = DIR24_TBL8_GROUPS;
+
+	return;
+}
+
+/*
+ * Calls func on the ptr of every route. Routes sharing a prefix
+ * come one after another, newest first.
+ */
+void dir24_walk(struct dir24_table *table,
+	void (*func)(void *, void *), void *arg)
+{
+	struct dir24_rule *rule;
+	struct dir24_entry *entry;
+	int i;
+
+	for(i = 0; i < HASH_SIZE; i++){
+		hlist_for_each_entry(rule, &table->rules.head[i], hash.list){
+			hlist_for_each_entry(entry, &rule->head, list){
+				func(entry->ptr, arg);
+			}
+		}
+	}
+
+	return;
+}
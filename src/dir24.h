@@ -0,0 +1,107 @@
+#ifndef _IXMAPFWD_DIR24_H
+#define _IXMAPFWD_DIR24_H
+
+#include <stdint.h>
+#include "linux/list.h"
+#include "hash.h"
+#include "lpm6.h"
+#include "qsbr.h"
+
+#define DIR24_TBL24_SIZE	(1 << 24)
+#define DIR24_TBL8_SIZE		(1 << 8)
+#define DIR24_LOOKUP_BULK	32
+#define DIR24_SIMD_WIDTH	8
+
+/*
+ * tbl24 takes 64MB and is mapped apart from the arena, where the
+ * header of ixmap_mem_alloc() would double it to a 128MB block.
+ * tbl8 takes 16MB of the arena, its size kept just below a power
+ * of two so that the header still fits, and the nexthop slots come
+ * from an lpm6_pool of 12MB.
+ * Tables drawing from a shared pool are expected many and mostly
+ * small: both their tbl24 and tbl8 are mapped sparse, backed only
+ * where routes are written, and take no arena at all.
+ */
+#define DIR24_TBL8_GROUPS	((1 << 14) - 1)
+
+/*
+ * Table entry format:
+ * [31] valid, [30] tbl8 extended, [29:24] depth, [23:0] index
+ * The index points to a tbl8 group when extended,
+ * otherwise to the nexthop array.
+ */
+#define DIR24_VALID		0x80000000
+#define DIR24_EXT		0x40000000
+#define DIR24_DEPTH_SHIFT	24
+#define DIR24_DEPTH_MASK	0x3f000000
+#define DIR24_INDEX_MASK	0x00ffffff
+
+#define dir24_depth(ent)	(((ent) & DIR24_DEPTH_MASK) >> DIR24_DEPTH_SHIFT)
+#define dir24_index(ent)	((ent) & DIR24_INDEX_MASK)
+
+struct dir24_entry {
+	struct hlist_node	list;
+	void			*ptr;
+};
+
+struct dir24_rule {
+	struct hash_entry	hash;
+	uint32_t		key[2]; /* prefix(host order), prefix_len */
+	struct hlist_head	head;
+	uint32_t		index;
+};
+
+struct dir24_table {
+	uint32_t		*tbl24;
+	struct ixmap_desc	*desc; /* owning the mapping of tbl24 */
+	uint32_t		*tbl8;
+	void			**nexthop; /* of pool */
+	uint32_t		*tbl8_free;
+	unsigned int		tbl8_free_num;
+	struct lpm6_pool	*pool;
+	int			pool_private;
+	struct hash_table	rules;
+	struct qsbr		*qsbr; /* NULL when private to one thread */
+	void			(*lookup_bulk)(
+				struct dir24_table *,
+				void **,
+				void **,
+				unsigned int
+				);
+	int			(*entry_identify)(
+				void *,
+				unsigned int,
+				unsigned int
+				);
+	void	 		(*entry_pull)(
+				void *
+				);
+	void			(*entry_put)(
+				void *
+				);
+};
+
+int dir24_init(struct dir24_table *table, struct lpm6_pool *pool,
+	struct ixmap_desc *desc);
+void dir24_destroy(struct dir24_table *table);
+void *dir24_lookup(struct dir24_table *table, void *dst);
+void dir24_lookup_bulk(struct dir24_table *table, void **dst,
+	void **ptr, unsigned int num);
+void dir24_lookup_bulk_scalar(struct dir24_table *table, void **dst,
+	void **ptr, unsigned int num);
+#ifdef __x86_64__
+void dir24_lookup_bulk_avx2(struct dir24_table *table, void **dst,
+	void **ptr, unsigned int num);
+#endif
+int dir24_add(struct dir24_table *table, void *prefix,
+	unsigned int prefix_len, unsigned int id,
+	void *ptr, struct ixmap_desc *desc);
+int dir24_replace(struct dir24_table *table, void *prefix,
+	unsigned int prefix_len, unsigned int id, void *ptr);
+int dir24_delete(struct dir24_table *table, void *prefix,
+	unsigned int prefix_len, unsigned int id);
+void dir24_delete_all(struct dir24_table *table);
+void dir24_walk(struct dir24_table *table,
+	void (*func)(void *, void *), void *arg);
+
+#endif /* _IXMAPFWD_DIR24_H */
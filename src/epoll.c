@@ -10,6 +10,8 @@
 
 #include "main.h"
 #include "epoll.h"
+#include "thread.h"
+#include "netlink.h"
 
 int epoll_add(int fd_ep, void *ptr, int fd)
 {
@@ -145,7 +147,7 @@ struct epoll_desc *epoll_desc_alloc_netlink(struct sockaddr_nl *addr,
 	unsigned int core_id)
 {
 	struct epoll_desc *ep_desc;
-	int fd, ret;
+	int fd, size, ret;
 	
 	ep_desc = numa_alloc_onnode(sizeof(struct epoll_desc),
 		numa_node_of_cpu(core_id));
@@ -161,6 +163,11 @@ struct epoll_desc *epoll_desc_alloc_netlink(struct sockaddr_nl *addr,
 	if(ret < 0)
 		goto err_bind_netlink;
 
+	size = NETLINK_RCVBUF_SIZE;
+	ret = setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(int));
+	if(ret < 0)
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(int));
+
 	ep_desc->fd = fd;
 	ep_desc->type = EPOLL_NETLINK;
 
@@ -13,9 +13,12 @@
 
 static int fib_entry_identify(void *ptr, unsigned int id,
 	unsigned int prefix_len);
-static int fib_entry_compare(void *ptr, unsigned int prefix_len);
 static void fib_entry_pull(void *ptr);
 static void fib_entry_put(void *ptr);
+static void fib_walk(struct fib *fib,
+	void (*func)(void *, void *), void *arg);
+static void fib_build_collect(void *ptr, void *arg);
+static void fib_retire_release(void *ptr, unsigned long data);
 
 #ifdef DEBUG
 static void fib_update_print(int family, enum fib_type type,
@@ -60,6 +63,15 @@ static void fib_update_print(int family, enum fib_type type,
 	case FIB_TYPE_LOCAL:
 		strcpy(type_a, "FIB_TYPE_LOCAL");
 		break;
+	case FIB_TYPE_BLACKHOLE:
+		strcpy(type_a, "FIB_TYPE_BLACKHOLE");
+		break;
+	case FIB_TYPE_UNREACHABLE:
+		strcpy(type_a, "FIB_TYPE_UNREACHABLE");
+		break;
+	case FIB_TYPE_PROHIBIT:
+		strcpy(type_a, "FIB_TYPE_PROHIBIT");
+		break;
 	default:
 		break;
 	}
@@ -107,41 +119,245 @@ static void fib_delete_print(int family, void *prefix,
 }
 #endif
 
-struct fib *fib_alloc(struct ixmap_desc *desc)
+struct fib *fib_alloc(struct ixmap_desc *desc, enum fib_engine engine,
+	struct qsbr *qsbr)
+{
+	return fib_alloc_pool(desc, engine, qsbr, NULL);
+}
+
+/*
+ * The LPM6 and DIR24 engines may draw their nexthop slots from a pool
+ * shared with other tables of the same writer, see lpm6_pool_alloc().
+ */
+struct fib *fib_alloc_pool(struct ixmap_desc *desc, enum fib_engine engine,
+	struct qsbr *qsbr, struct lpm6_pool *pool)
 {
-        struct fib *fib;
+	struct fib *fib;
+	int ret;
 
 	fib = ixmap_mem_alloc(desc, sizeof(struct fib));
 	if(!fib)
 		goto err_fib_alloc;
 
-	lpm_init(&fib->table);
+	fib->engine = engine;
+	fib->num_routes = 0;
+	fib->agg = NULL;
+	fib->pool = pool;
+	fib->stats = NULL;
+
+	switch(engine){
+	case FIB_ENGINE_LPM:
+		if(qsbr)
+			goto err_invalid_engine;
 
-	fib->table.entry_identify	= fib_entry_identify;
-	fib->table.entry_compare	= fib_entry_compare;
-	fib->table.entry_pull		= fib_entry_pull;
-	fib->table.entry_put		= fib_entry_put;
+		fib->table.lpm = ixmap_mem_alloc(desc, sizeof(struct lpm_table));
+		if(!fib->table.lpm)
+			goto err_table_alloc;
+
+		lpm_init(fib->table.lpm);
+
+		fib->table.lpm->entry_identify	= fib_entry_identify;
+		fib->table.lpm->entry_pull	= fib_entry_pull;
+		fib->table.lpm->entry_put	= fib_entry_put;
+		break;
+	case FIB_ENGINE_DIR24:
+		fib->table.dir24 = ixmap_mem_alloc(desc, sizeof(struct dir24_table));
+		if(!fib->table.dir24)
+			goto err_table_alloc;
+
+		ret = dir24_init(fib->table.dir24, pool, desc);
+		if(ret < 0)
+			goto err_dir24_init;
+
+		fib->table.dir24->entry_identify	= fib_entry_identify;
+		fib->table.dir24->entry_pull		= fib_entry_pull;
+		fib->table.dir24->entry_put		= fib_entry_put;
+		break;
+	case FIB_ENGINE_LPM6:
+	case FIB_ENGINE_LPM6_INET:
+		fib->table.lpm6 = ixmap_mem_alloc(desc, sizeof(struct lpm6_table));
+		if(!fib->table.lpm6)
+			goto err_table_alloc;
+
+		ret = lpm6_init(fib->table.lpm6,
+			engine == FIB_ENGINE_LPM6_INET ? 32 : 128, pool, desc);
+		if(ret < 0)
+			goto err_lpm6_init;
+
+		fib->table.lpm6->entry_identify	= fib_entry_identify;
+		fib->table.lpm6->entry_pull	= fib_entry_pull;
+		fib->table.lpm6->entry_put	= fib_entry_put;
+		break;
+	default:
+		goto err_invalid_engine;
+		break;
+	}
 
+	fib_qsbr_set(fib, qsbr);
 	return fib;
 
+err_lpm6_init:
+	ixmap_mem_free(fib->table.lpm6);
+	goto err_table_alloc;
+err_dir24_init:
+	ixmap_mem_free(fib->table.dir24);
+err_table_alloc:
+err_invalid_engine:
+	ixmap_mem_free(fib);
 err_fib_alloc:
 	return NULL;
 }
 
 void fib_release(struct fib *fib)
 {
-	lpm_delete_all(&fib->table);
+	if(fib->agg)
+		fibagg_release(fib->agg);
+
+	switch(fib->engine){
+	case FIB_ENGINE_LPM:
+		lpm_delete_all(fib->table.lpm);
+		ixmap_mem_free(fib->table.lpm);
+		break;
+	case FIB_ENGINE_DIR24:
+		dir24_destroy(fib->table.dir24);
+		ixmap_mem_free(fib->table.dir24);
+		break;
+	case FIB_ENGINE_LPM6:
+	case FIB_ENGINE_LPM6_INET:
+		lpm6_destroy(fib->table.lpm6);
+		ixmap_mem_free(fib->table.lpm6);
+		break;
+	default:
+		break;
+	}
+
 	ixmap_mem_free(fib);
 	return;
 }
 
+/* Readers may only be given fib once it is set */
+void fib_qsbr_set(struct fib *fib, struct qsbr *qsbr)
+{
+	fib->qsbr = qsbr;
+
+	switch(fib->engine){
+	case FIB_ENGINE_DIR24:
+		fib->table.dir24->qsbr = qsbr;
+		break;
+	case FIB_ENGINE_LPM6:
+	case FIB_ENGINE_LPM6_INET:
+		fib->table.lpm6->qsbr = qsbr;
+		break;
+	default:
+		break;
+	}
+
+	return;
+}
+
+/* Before the first route, entries allocated earlier stay uncounted */
+void fib_stats_set(struct fib *fib, struct stats_table *stats)
+{
+	fib->stats = stats;
+	return;
+}
+
+/* Entries the engine returns, aggregates rather than the routes below */
+void fib_entry_count(struct fib *fib, struct fib_entry *entry)
+{
+	if(!fib->stats)
+		return;
+
+	entry->stats	= fib->stats;
+	entry->stats_id	= stats_id_get(fib->stats);
+	return;
+}
+
 int fib_route_update(struct fib *fib, int family, enum fib_type type,
 	void *prefix, unsigned int prefix_len, void *nexthop,
-	int port_index, int id, struct ixmap_desc *desc)
+	struct nexthop_group *group, struct adj *adj, int port_index, int id,
+	struct ixmap_desc *desc)
+{
+	struct fib_entry *entry;
+	int ret;
+
+	entry = fib_entry_alloc(family, type, prefix, prefix_len,
+		nexthop, group, adj, port_index, id, desc);
+	if(!entry)
+		goto err_alloc_entry;
+
+	if(!fib->agg)
+		fib_entry_count(fib, entry);
+
+#ifdef DEBUG
+	fib_update_print(family, type, prefix, prefix_len,
+		nexthop, port_index, id);
+#endif
+
+	if(fib->agg)
+		ret = fibagg_add(fib->agg, entry);
+	else
+		ret = fib_table_add(fib, entry, desc);
+	if(ret < 0)
+		goto err_lpm_add;
+
+	return 0;
+
+err_lpm_add:
+	fib_entry_free(entry);
+err_alloc_entry:
+	return -1;
+}
+
+/*
+ * NLM_F_REPLACE: the route of the prefix with id, or else the one in
+ * use, gives way to a new entry in one store of the engine's pointer.
+ * Fails without a route of the prefix, the caller adds one then.
+ */
+int fib_route_replace(struct fib *fib, int family, enum fib_type type,
+	void *prefix, unsigned int prefix_len, void *nexthop,
+	struct nexthop_group *group, struct adj *adj, int port_index, int id,
+	struct ixmap_desc *desc)
 {
 	struct fib_entry *entry;
 	int ret;
 
+	entry = fib_entry_alloc(family, type, prefix, prefix_len,
+		nexthop, group, adj, port_index, id, desc);
+	if(!entry)
+		goto err_alloc_entry;
+
+	if(!fib->agg)
+		fib_entry_count(fib, entry);
+
+#ifdef DEBUG
+	fib_update_print(family, type, prefix, prefix_len,
+		nexthop, port_index, id);
+#endif
+
+	if(fib->agg)
+		ret = fibagg_replace(fib->agg, entry);
+	else
+		ret = fib_table_replace(fib, entry);
+	if(ret < 0)
+		goto err_replace;
+
+	return 0;
+
+err_replace:
+	fib_entry_free(entry);
+err_alloc_entry:
+	return -1;
+}
+
+/* The entry holds a reference to group and adj, if any */
+struct fib_entry *fib_entry_alloc(int family, enum fib_type type,
+	void *prefix, unsigned int prefix_len, void *nexthop,
+	struct nexthop_group *group, struct adj *adj, int port_index, int id,
+	struct ixmap_desc *desc)
+{
+	struct fib_entry *entry;
+
 	entry = ixmap_mem_alloc(desc, sizeof(struct fib_entry));
 	if(!entry)
 		goto err_alloc_entry;
@@ -165,23 +381,68 @@ int fib_route_update(struct fib *fib, int family, enum fib_type type,
 	entry->type		= type;
 	entry->id		= id;
 	entry->refcount		= 0;
+	entry->group		= group;
+	entry->adj		= adj;
+	entry->stats		= NULL;
+	entry->stats_id		= STATS_ID_NONE;
 
-#ifdef DEBUG
-	fib_update_print(family, type, prefix, prefix_len,
-		nexthop, port_index, id);
-#endif
-
-	ret = lpm_add(&fib->table, prefix, prefix_len,
-		id, entry, desc);
-	if(ret < 0)
-		goto err_lpm_add;
+	if(group)
+		nexthop_group_get(group);
+	if(adj)
+		adj_hold(adj);
 
-	return 0;
+	return entry;
 
-err_lpm_add:
 err_invalid_family:
 	ixmap_mem_free(entry);
 err_alloc_entry:
+	return NULL;
+}
+
+void fib_entry_free(struct fib_entry *entry)
+{
+	if(entry->group)
+		nexthop_group_put(entry->group);
+	if(entry->adj)
+		adj_put(entry->adj);
+	if(entry->stats)
+		stats_id_put(entry->stats, entry->stats_id);
+
+	ixmap_mem_free(entry);
+	return;
+}
+
+int fib_table_add(struct fib *fib, struct fib_entry *entry,
+	struct ixmap_desc *desc)
+{
+	int ret;
+
+	switch(fib->engine){
+	case FIB_ENGINE_LPM:
+		ret = lpm_add(fib->table.lpm, entry->prefix, entry->prefix_len,
+			entry->id, entry, desc);
+		break;
+	case FIB_ENGINE_DIR24:
+		ret = dir24_add(fib->table.dir24, entry->prefix, entry->prefix_len,
+			entry->id, entry, desc);
+		break;
+	case FIB_ENGINE_LPM6:
+	case FIB_ENGINE_LPM6_INET:
+		ret = lpm6_add(fib->table.lpm6, entry->prefix, entry->prefix_len,
+			entry->id, entry, desc);
+		break;
+	default:
+		ret = -1;
+		break;
+	}
+
+	if(ret < 0)
+		goto err_table_add;
+
+	fib->num_routes++;
+	return 0;
+
+err_table_add:
 	return -1;
 }
 
@@ -189,27 +450,308 @@ int fib_route_delete(struct fib *fib, int family,
 	void *prefix, unsigned int prefix_len,
 	int id)
 {
-	int ret;
-
 #ifdef DEBUG
 	fib_delete_print(family, prefix, prefix_len, id);
 #endif
 
-	ret = lpm_delete(&fib->table, prefix, prefix_len, id);
+	if(fib->agg)
+		return fibagg_delete(fib->agg, prefix, prefix_len, id);
+
+	return fib_table_delete(fib, prefix, prefix_len, id);
+}
+
+/* The number of routes stays, one took the place of another */
+int fib_table_replace(struct fib *fib, struct fib_entry *entry)
+{
+	int ret;
+
+	switch(fib->engine){
+	case FIB_ENGINE_LPM:
+		ret = lpm_replace(fib->table.lpm, entry->prefix,
+			entry->prefix_len, entry->id, entry);
+		break;
+	case FIB_ENGINE_DIR24:
+		ret = dir24_replace(fib->table.dir24, entry->prefix,
+			entry->prefix_len, entry->id, entry);
+		break;
+	case FIB_ENGINE_LPM6:
+	case FIB_ENGINE_LPM6_INET:
+		ret = lpm6_replace(fib->table.lpm6, entry->prefix,
+			entry->prefix_len, entry->id, entry);
+		break;
+	default:
+		ret = -1;
+		break;
+	}
+
+	return ret;
+}
+
+int fib_table_delete(struct fib *fib, void *prefix,
+	unsigned int prefix_len, int id)
+{
+	int ret;
+
+	switch(fib->engine){
+	case FIB_ENGINE_LPM:
+		ret = lpm_delete(fib->table.lpm, prefix, prefix_len, id);
+		break;
+	case FIB_ENGINE_DIR24:
+		ret = dir24_delete(fib->table.dir24, prefix, prefix_len, id);
+		break;
+	case FIB_ENGINE_LPM6:
+	case FIB_ENGINE_LPM6_INET:
+		ret = lpm6_delete(fib->table.lpm6, prefix, prefix_len, id);
+		break;
+	default:
+		ret = -1;
+		break;
+	}
+
 	if(ret < 0)
 		goto err_lpm_delete;
 
+	fib->num_routes--;
 	return 0;
 
 err_lpm_delete:
 	return -1;
 }
 
+/*
+ * Routes fib through fibagg from now on. The fib must be empty,
+ * as it then only holds the entries fibagg installs.
+ */
+int fib_aggregate(struct fib *fib, int family, struct ixmap_desc *desc)
+{
+	if(fib->agg || fib->num_routes)
+		goto err_not_empty;
+
+	fib->agg = fibagg_alloc(fib, family, desc);
+	if(!fib->agg)
+		goto err_agg_alloc;
+
+	return 0;
+
+err_agg_alloc:
+err_not_empty:
+	return -1;
+}
+
+static void fib_walk(struct fib *fib,
+	void (*func)(void *, void *), void *arg)
+{
+	switch(fib->engine){
+	case FIB_ENGINE_LPM:
+		lpm_walk(fib->table.lpm, func, arg);
+		break;
+	case FIB_ENGINE_DIR24:
+		dir24_walk(fib->table.dir24, func, arg);
+		break;
+	case FIB_ENGINE_LPM6:
+	case FIB_ENGINE_LPM6_INET:
+		lpm6_walk(fib->table.lpm6, func, arg);
+		break;
+	default:
+		break;
+	}
+
+	return;
+}
+
+/*
+ * Visits the routes given to fib, as they were given when aggregated.
+ * Routes of one prefix come newest first.
+ */
+void fib_route_walk(struct fib *fib,
+	void (*func)(void *, void *), void *arg)
+{
+	if(fib->agg)
+		fibagg_walk(fib->agg, func, arg);
+	else
+		fib_walk(fib, func, arg);
+
+	return;
+}
+
+void fib_entry_walk(struct fib *fib,
+	void (*func)(void *, void *), void *arg)
+{
+	fib_walk(fib, func, arg);
+	return;
+}
+
+static void fib_build_collect(void *ptr, void *arg)
+{
+	struct fib_entry ***tail = arg;
+
+	*(*tail)++ = ptr;
+	return;
+}
+
+/*
+ * Builds the next generation of fib from its routes and a batch of
+ * new ones, without touching the table readers see. Routes are added
+ * shortest prefix first so that a longer one never has to push into
+ * a range already split below it. Existing fib_entry objects are
+ * shared with the new generation. Routes of the batch rejected the way
+ * fib_route_update() would reject them, short of memory included, are
+ * dropped and counted in num_dropped if given.
+ * Returns NULL, with fib unchanged, if the generation can't be built.
+ * An aggregated fib is never rebuilt, it takes routes one by one.
+ */
+struct fib *fib_build(struct fib *fib, int family,
+	struct fib_route *routes, unsigned int num_routes,
+	unsigned int *num_dropped, struct ixmap_desc *desc)
+{
+	struct fib *fib_new;
+	struct fib_entry **entries, **sorted, **tail, *entry;
+	unsigned int count[FIB_PREFIX_LEN_MAX + 2];
+	unsigned int num, len, dropped, i;
+	int ret;
+
+	if(fib->agg)
+		goto err_fib_aggregated;
+
+	/* not published yet, nothing has to be deferred */
+	fib_new = fib_alloc_pool(desc, fib->engine, NULL, fib->pool);
+	if(!fib_new)
+		goto err_fib_alloc;
+
+	fib_stats_set(fib_new, fib->stats);
+
+	num = fib->num_routes;
+	for(i = 0; i < num_routes; i++){
+		if(routes[i].family == family)
+			num++;
+	}
+
+	entries = malloc(sizeof(struct fib_entry *) * num);
+	sorted = malloc(sizeof(struct fib_entry *) * num);
+	if(!entries || !sorted)
+		goto err_buf_alloc;
+
+	tail = entries;
+	fib_walk(fib, fib_build_collect, &tail);
+
+	/* oldest first, so that the newest route of a prefix still wins */
+	for(i = 0; i < fib->num_routes / 2; i++){
+		entry = entries[i];
+		entries[i] = entries[fib->num_routes - 1 - i];
+		entries[fib->num_routes - 1 - i] = entry;
+	}
+
+	for(i = 0; i < num_routes; i++){
+		if(routes[i].family != family
+		|| routes[i].prefix_len > FIB_PREFIX_LEN_MAX)
+			continue;
+
+		entry = fib_entry_alloc(family, routes[i].type,
+			routes[i].prefix, routes[i].prefix_len,
+			routes[i].nexthop, routes[i].group, routes[i].adj,
+			routes[i].port_index, routes[i].id, desc);
+		if(!entry)
+			goto err_entry_alloc;
+
+		fib_entry_count(fib_new, entry);
+		*tail++ = entry;
+	}
+	num = tail - entries;
+
+	/* stable counting sort, later routes of the batch stay later */
+	memset(count, 0, sizeof(count));
+	for(i = 0; i < num; i++){
+		count[entries[i]->prefix_len + 1]++;
+	}
+	for(len = 0; len <= FIB_PREFIX_LEN_MAX; len++){
+		count[len + 1] += count[len];
+	}
+	for(i = 0; i < num; i++){
+		sorted[count[entries[i]->prefix_len]++] = entries[i];
+	}
+
+	for(i = 0, dropped = 0; i < num; i++){
+		entry = sorted[i];
+
+		/* a later route of the same prefix and id was a replace */
+		ret = fib_table_add(fib_new, entry, desc);
+		if(ret < 0 && !entry->refcount)
+			ret = fib_table_replace(fib_new, entry);
+		if(ret < 0){
+			/* a route already installed must make it across */
+			if(entry->refcount)
+				goto err_table_add;
+
+			fib_entry_free(entry);
+			dropped++;
+		}
+	}
+
+	free(sorted);
+	free(entries);
+	fib_qsbr_set(fib_new, fib->qsbr);
+
+	if(num_dropped)
+		*num_dropped = dropped;
+	return fib_new;
+
+err_table_add:
+	for(; i < num; i++){
+		if(!sorted[i]->refcount)
+			fib_entry_free(sorted[i]);
+	}
+	fib_release(fib_new);
+	free(sorted);
+	free(entries);
+	return NULL;
+
+err_entry_alloc:
+	while(tail-- > entries + fib->num_routes){
+		fib_entry_free(*tail);
+	}
+err_buf_alloc:
+	free(sorted);
+	free(entries);
+	fib_release(fib_new);
+err_fib_alloc:
+err_fib_aggregated:
+	return NULL;
+}
+
+/*
+ * Releases a generation replaced by fib_build() once no reader
+ * can hold it. Its own deferred releases were queued before.
+ */
+void fib_retire(struct fib *fib)
+{
+	qsbr_call(fib->qsbr, fib_retire_release, fib, 0);
+	return;
+}
+
+static void fib_retire_release(void *ptr, unsigned long data)
+{
+	struct fib *fib = ptr;
+
+	fib_qsbr_set(fib, NULL);
+	fib_release(fib);
+	return;
+}
+
 struct fib_entry *fib_lookup(struct fib *fib, void *destination)
 {
 	struct lpm_entry *entry;
 
-	entry = lpm_lookup(&fib->table, destination);
+	switch(fib->engine){
+	case FIB_ENGINE_DIR24:
+		return dir24_lookup(fib->table.dir24, destination);
+	case FIB_ENGINE_LPM6:
+	case FIB_ENGINE_LPM6_INET:
+		return lpm6_lookup(fib->table.lpm6, destination);
+	default:
+		break;
+	}
+
+	entry = lpm_lookup(fib->table.lpm, destination);
 	if(!entry)
 		goto err_lpm_lookup;
 
@@ -219,6 +761,31 @@ err_lpm_lookup:
 	return NULL;
 }
 
+void fib_lookup_bulk(struct fib *fib, void **destinations,
+	struct fib_entry **results, unsigned int num)
+{
+	int i;
+
+	switch(fib->engine){
+	case FIB_ENGINE_DIR24:
+		dir24_lookup_bulk(fib->table.dir24, destinations,
+			(void **)results, num);
+		break;
+	case FIB_ENGINE_LPM6:
+	case FIB_ENGINE_LPM6_INET:
+		lpm6_lookup_bulk(fib->table.lpm6, destinations,
+			(void **)results, num);
+		break;
+	default:
+		for(i = 0; i < num; i++){
+			results[i] = fib_lookup(fib, destinations[i]);
+		}
+		break;
+	}
+
+	return;
+}
+
 static int fib_entry_identify(void *ptr, unsigned int id,
 	unsigned int prefix_len)
 {
@@ -234,16 +801,6 @@ static int fib_entry_identify(void *ptr, unsigned int id,
 	}
 }
 
-static int fib_entry_compare(void *ptr, unsigned int prefix_len)
-{
-	struct fib_entry *entry;
-
-	entry = ptr;
-
-	return entry->prefix_len > prefix_len ?
-		1 : 0;
-}
-
 static void fib_entry_pull(void *ptr)
 {
 	struct fib_entry *entry;
@@ -262,6 +819,6 @@ static void fib_entry_put(void *ptr)
 	entry->refcount--;
 
 	if(!entry->refcount){
-		ixmap_mem_free(entry);
+		fib_entry_free(entry);
 	}
 }
@@ -4,11 +4,36 @@
 #include <pthread.h>
 #include "linux/list.h"
 #include "lpm.h"
+#include "dir24.h"
+#include "lpm6.h"
+#include "qsbr.h"
+#include "fibagg.h"
+#include "nexthop.h"
+#include "adj.h"
+#include "stats.h"
 
+#define FIB_PREFIX_LEN_MAX	128
+#define FIB_ID_MULTIPATH	0 /* no ifindex is 0 */
+
+/* types from FIB_TYPE_BLACKHOLE on drop what they match */
 enum fib_type {
 	FIB_TYPE_FORWARD = 0,
 	FIB_TYPE_LINK,
-	FIB_TYPE_LOCAL
+	FIB_TYPE_LOCAL,
+	FIB_TYPE_BLACKHOLE,
+	FIB_TYPE_UNREACHABLE,	/* the kernel may answer with ICMP */
+	FIB_TYPE_PROHIBIT
+};
+
+/*
+ * DIR24 and LPM6 may be shared by threads reading under qsbr,
+ * LPM frees its nodes at once and stays private to one thread.
+ */
+enum fib_engine {
+	FIB_ENGINE_LPM = 0,	/* 16-8-8 multibit trie, any family */
+	FIB_ENGINE_DIR24,	/* DIR-24-8 flat table, AF_INET only */
+	FIB_ENGINE_LPM6,	/* binary search on lengths, AF_INET6 only */
+	FIB_ENGINE_LPM6_INET	/* LPM6 over 32 bit keys, AF_INET only */
 };
 
 struct fib_entry {
@@ -19,20 +44,79 @@ struct fib_entry {
 	enum fib_type		type;
 	int			id;
 	unsigned int		refcount;
+	struct nexthop_group	*group; /* ECMP, overrides nexthop and port */
+	struct adj		*adj; /* gateway over an ixmap port, or NULL */
+	struct stats_table	*stats; /* NULL if not counted */
+	unsigned int		stats_id;
+};
+
+/* a route held back for fib_build() */
+struct fib_route {
+	int			family;
+	enum fib_type		type;
+	uint8_t			prefix[16];
+	unsigned int		prefix_len;
+	uint8_t			nexthop[16];
+	int			port_index;
+	int			id;
+	struct nexthop_group	*group;
+	struct adj		*adj;
 };
 
 struct fib {
-	struct lpm_table	table;
+	enum fib_engine		engine;
+	struct qsbr		*qsbr;
+	unsigned int		num_routes; /* installed in the engine */
+	struct fibagg		*agg; /* NULL unless aggregated */
+	struct lpm6_pool	*pool; /* shared nexthop slots, or NULL */
+	struct stats_table	*stats; /* counters of its entries, or NULL */
+	union {
+		struct lpm_table	*lpm;
+		struct dir24_table	*dir24;
+		struct lpm6_table	*lpm6;
+	} table;
 };
 
-struct fib *fib_alloc(struct ixmap_desc *desc);
+struct fib *fib_alloc(struct ixmap_desc *desc, enum fib_engine engine,
+	struct qsbr *qsbr);
+struct fib *fib_alloc_pool(struct ixmap_desc *desc, enum fib_engine engine,
+	struct qsbr *qsbr, struct lpm6_pool *pool);
 void fib_release(struct fib *fib);
 int fib_route_update(struct fib *fib, int family, enum fib_type type,
 	void *prefix, unsigned int prefix_len, void *nexthop,
-	int port_index, int id, struct ixmap_desc *desc);
+	struct nexthop_group *group, struct adj *adj, int port_index, int id,
+	struct ixmap_desc *desc);
+int fib_route_replace(struct fib *fib, int family, enum fib_type type,
+	void *prefix, unsigned int prefix_len, void *nexthop,
+	struct nexthop_group *group, struct adj *adj, int port_index, int id,
+	struct ixmap_desc *desc);
 int fib_route_delete(struct fib *fib, int family,
 	void *prefix, unsigned int prefix_len,
 	int id);
+int fib_aggregate(struct fib *fib, int family, struct ixmap_desc *desc);
+struct fib_entry *fib_entry_alloc(int family, enum fib_type type,
+	void *prefix, unsigned int prefix_len, void *nexthop,
+	struct nexthop_group *group, struct adj *adj, int port_index, int id,
+	struct ixmap_desc *desc);
+void fib_entry_free(struct fib_entry *entry);
+int fib_table_add(struct fib *fib, struct fib_entry *entry,
+	struct ixmap_desc *desc);
+int fib_table_replace(struct fib *fib, struct fib_entry *entry);
+int fib_table_delete(struct fib *fib, void *prefix,
+	unsigned int prefix_len, int id);
+struct fib *fib_build(struct fib *fib, int family,
+	struct fib_route *routes, unsigned int num_routes,
+	unsigned int *num_dropped, struct ixmap_desc *desc);
+void fib_retire(struct fib *fib);
+void fib_qsbr_set(struct fib *fib, struct qsbr *qsbr);
+void fib_stats_set(struct fib *fib, struct stats_table *stats);
+void fib_entry_count(struct fib *fib, struct fib_entry *entry);
+void fib_route_walk(struct fib *fib,
+	void (*func)(void *, void *), void *arg);
+void fib_entry_walk(struct fib *fib,
+	void (*func)(void *, void *), void *arg);
 struct fib_entry *fib_lookup(struct fib *fib, void *destination);
+void fib_lookup_bulk(struct fib *fib, void **destinations,
+	struct fib_entry **results, unsigned int num);
 
 #endif /* _IXMAPFWD_FIB_H */
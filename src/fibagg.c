@@ -0,0 +1,1063 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <arpa/inet.h>
+#include <ixmap.h>
+
+#include "linux/list.h"
+#include "main.h"
+#include "fib.h"
+#include "fibagg.h"
+
+static void fibagg_key_set(struct fibagg *agg, uint32_t *key,
+	void *prefix, unsigned int prefix_len);
+static unsigned int fibagg_key_generate(void *key, unsigned int bit_len);
+static int fibagg_key_compare(void *key_tgt, void *key_ent);
+static void fibagg_prefix_delete(struct hash_entry *entry);
+static void fibagg_block_delete(struct hash_entry *entry);
+static struct fibagg_prefix *fibagg_prefix_lookup(struct fibagg *agg,
+	void *prefix, unsigned int prefix_len);
+static struct fibagg_prefix *fibagg_prefix_cover(struct fibagg *agg,
+	void *prefix, unsigned int prefix_len);
+static struct fib_entry *fibagg_prefix_best(struct fibagg_prefix *prefix);
+static struct fibagg_prefix *fibagg_prefix_alloc(struct fibagg *agg,
+	void *prefix, unsigned int prefix_len);
+static void fibagg_prefix_release(struct fibagg *agg,
+	struct fibagg_prefix *prefix);
+static int fibagg_prefix_update(struct fibagg *agg,
+	struct fibagg_prefix *prefix);
+static struct fibagg_block *fibagg_block_lookup(struct fibagg *agg,
+	void *prefix);
+static int fibagg_block_update(struct fibagg *agg,
+	struct fibagg_block *block);
+static int fibagg_short_update(struct fibagg *agg,
+	struct fibagg_prefix *prefix);
+static int fibagg_block_cascade(struct fibagg *agg,
+	struct fibagg_block *block, unsigned int prefix_len);
+static int fibagg_bit(uint8_t *prefix, unsigned int pos);
+static int fibagg_match(struct fibagg *agg, uint8_t *addr,
+	uint8_t *prefix, unsigned int prefix_len);
+static int fibagg_equal(struct fibagg *agg,
+	struct fib_entry *entry_a, struct fib_entry *entry_b);
+static int fibagg_install(struct fibagg *agg, uint8_t *prefix,
+	unsigned int prefix_len, struct fib_entry *route,
+	struct fib_entry **installed);
+static void fibagg_uninstall(struct fibagg *agg, struct fib_entry *entry);
+static struct fibagg_node *fibagg_node_alloc(uint8_t *prefix,
+	unsigned int prefix_len);
+static struct fibagg_node *fibagg_node_child(struct fibagg_node *node,
+	int bit);
+static void fibagg_node_release(struct fibagg_node *node);
+static unsigned int fibagg_node_count(struct fibagg_node *node);
+static struct fibagg_node *fibagg_trie_build(struct fibagg *agg,
+	struct fibagg_block *block);
+static int fibagg_set_find(struct fibagg *agg, struct fibagg_node *node,
+	struct fib_entry *entry);
+static int fibagg_node_merge(struct fibagg *agg, struct fibagg_node *node);
+static int fibagg_node_reduce(struct fibagg *agg, struct fibagg_node *node,
+	struct fib_entry *above);
+static void fibagg_node_select(struct fibagg *agg, struct fibagg_node *node,
+	struct fib_entry *inherit, struct fibagg_out *out, unsigned int *num);
+static int fibagg_order(struct fibagg *agg, struct fib_entry *entry,
+	struct fibagg_out *out);
+static struct fib_entry *fibagg_rib_lookup(struct fibagg *agg,
+	uint8_t *addr);
+static unsigned int fibagg_node_verify(struct fibagg *agg,
+	struct fibagg_node *node);
+
+struct fibagg *fibagg_alloc(struct fib *fib, int family,
+	struct ixmap_desc *desc)
+{
+	struct fibagg *agg;
+
+	agg = ixmap_mem_alloc(desc, sizeof(struct fibagg));
+	if(!agg)
+		goto err_agg_alloc;
+
+	switch(family){
+	case AF_INET:
+		agg->bits	= 32;
+		agg->block_len	= FIBAGG_BLOCK_INET;
+		break;
+	case AF_INET6:
+		agg->bits	= 128;
+		agg->block_len	= FIBAGG_BLOCK_INET6;
+		break;
+	default:
+		goto err_invalid_family;
+		break;
+	}
+
+	agg->fib		= fib;
+	agg->desc		= desc;
+	agg->family		= family;
+	agg->num_prefixes	= 0;
+	agg->num_routes		= 0;
+	agg->num_blocks		= 0;
+
+	hash_init(&agg->prefixes);
+	agg->prefixes.hash_entry_delete	= fibagg_prefix_delete;
+	agg->prefixes.hash_key_generate	= fibagg_key_generate;
+	agg->prefixes.hash_key_compare	= fibagg_key_compare;
+
+	hash_init(&agg->blocks);
+	agg->blocks.hash_entry_delete	= fibagg_block_delete;
+	agg->blocks.hash_key_generate	= fibagg_key_generate;
+	agg->blocks.hash_key_compare	= fibagg_key_compare;
+
+	return agg;
+
+err_invalid_family:
+	ixmap_mem_free(agg);
+err_agg_alloc:
+	return NULL;
+}
+
+/* Entries installed in the fib are left to its engine */
+void fibagg_release(struct fibagg *agg)
+{
+	hash_delete_all(&agg->prefixes);
+	hash_delete_all(&agg->blocks);
+	ixmap_mem_free(agg);
+	return;
+}
+
+static void fibagg_key_set(struct fibagg *agg, uint32_t *key,
+	void *prefix, unsigned int prefix_len)
+{
+	uint8_t *bytes = (uint8_t *)key;
+	unsigned int i;
+
+	memset(key, 0, sizeof(uint32_t) * FIBAGG_KEY_WORDS);
+	memcpy(bytes, prefix, agg->bits >> 3);
+
+	for(i = 0; i < agg->bits >> 3; i++){
+		if(prefix_len <= i * 8)
+			bytes[i] = 0;
+		else if(prefix_len < (i + 1) * 8)
+			bytes[i] &= 0xff << (8 - (prefix_len - i * 8));
+	}
+
+	key[FIBAGG_KEY_WORDS - 1] = prefix_len;
+	return;
+}
+
+static unsigned int fibagg_key_generate(void *key, unsigned int bit_len)
+{
+	uint64_t hash = 0;
+	int i;
+
+	for(i = 0; i < FIBAGG_KEY_WORDS; i++){
+		hash = (hash ^ ((uint32_t *)key)[i]) * GOLDEN_RATIO_64;
+	}
+
+	return hash >> (64 - bit_len);
+}
+
+static int fibagg_key_compare(void *key_tgt, void *key_ent)
+{
+	return memcmp(key_tgt, key_ent,
+		sizeof(uint32_t) * FIBAGG_KEY_WORDS) ? 1 : 0;
+}
+
+static void fibagg_prefix_delete(struct hash_entry *entry)
+{
+	struct fibagg_prefix *prefix;
+	struct fibagg_route *route;
+	struct hlist_node *next;
+
+	prefix = hash_entry(entry, struct fibagg_prefix, hash);
+
+	hlist_for_each_entry_safe(route, next, &prefix->head, list){
+		hlist_del(&route->list);
+		fib_entry_free(route->entry);
+		ixmap_mem_free(route);
+	}
+
+	ixmap_mem_free(prefix);
+	return;
+}
+
+static void fibagg_block_delete(struct hash_entry *entry)
+{
+	struct fibagg_block *block;
+
+	block = hash_entry(entry, struct fibagg_block, hash);
+	free(block->installed);
+	ixmap_mem_free(block);
+	return;
+}
+
+static struct fibagg_prefix *fibagg_prefix_lookup(struct fibagg *agg,
+	void *prefix, unsigned int prefix_len)
+{
+	struct hash_entry *hash_entry;
+	uint32_t key[FIBAGG_KEY_WORDS];
+
+	fibagg_key_set(agg, key, prefix, prefix_len);
+
+	hash_entry = hash_lookup(&agg->prefixes, key);
+	if(!hash_entry)
+		goto err_hash_lookup;
+
+	return hash_entry(hash_entry, struct fibagg_prefix, hash);
+
+err_hash_lookup:
+	return NULL;
+}
+
+/* Find the longest RIB prefix strictly shorter than prefix_len covering prefix */
+static struct fibagg_prefix *fibagg_prefix_cover(struct fibagg *agg,
+	void *prefix, unsigned int prefix_len)
+{
+	struct fibagg_prefix *cover;
+	int len;
+
+	for(len = prefix_len - 1; len >= 0; len--){
+		cover = fibagg_prefix_lookup(agg, prefix, len);
+		if(cover)
+			return cover;
+	}
+
+	return NULL;
+}
+
+static struct fib_entry *fibagg_prefix_best(struct fibagg_prefix *prefix)
+{
+	if(hlist_empty(&prefix->head))
+		return NULL;
+
+	return hlist_entry(prefix->head.first,
+		struct fibagg_route, list)->entry;
+}
+
+static struct fibagg_prefix *fibagg_prefix_alloc(struct fibagg *agg,
+	void *prefix, unsigned int prefix_len)
+{
+	struct fibagg_prefix *prefix_new;
+	struct fibagg_block *block;
+	int ret;
+
+	prefix_new = ixmap_mem_alloc(agg->desc, sizeof(struct fibagg_prefix));
+	if(!prefix_new)
+		goto err_prefix_alloc;
+
+	fibagg_key_set(agg, prefix_new->key, prefix, prefix_len);
+	INIT_HLIST_HEAD(&prefix_new->head);
+	prefix_new->installed = NULL;
+
+	if(prefix_len >= agg->block_len){
+		block = fibagg_block_lookup(agg, prefix);
+		if(!block){
+			block = ixmap_mem_alloc(agg->desc,
+				sizeof(struct fibagg_block));
+			if(!block)
+				goto err_block_alloc;
+
+			fibagg_key_set(agg, block->key, prefix, agg->block_len);
+			INIT_HLIST_HEAD(&block->head);
+			block->installed	= NULL;
+			block->num_installed	= 0;
+
+			hash_add(&agg->blocks, block->key, &block->hash);
+			agg->num_blocks++;
+		}
+
+		hlist_add_head(&prefix_new->list, &block->head);
+	}
+
+	ret = hash_add(&agg->prefixes, prefix_new->key, &prefix_new->hash);
+	if(ret < 0)
+		goto err_hash_add;
+
+	agg->num_prefixes++;
+	return prefix_new;
+
+err_hash_add:
+	/* an empty block is dropped by the next update of its prefixes */
+	if(prefix_len >= agg->block_len)
+		hlist_del(&prefix_new->list);
+err_block_alloc:
+	ixmap_mem_free(prefix_new);
+err_prefix_alloc:
+	return NULL;
+}
+
+static void fibagg_prefix_release(struct fibagg *agg,
+	struct fibagg_prefix *prefix)
+{
+	if(prefix->key[FIBAGG_KEY_WORDS - 1] >= agg->block_len)
+		hlist_del(&prefix->list);
+
+	hash_delete(&agg->prefixes, prefix->key);
+	agg->num_prefixes--;
+	return;
+}
+
+static struct fibagg_block *fibagg_block_lookup(struct fibagg *agg,
+	void *prefix)
+{
+	struct hash_entry *hash_entry;
+	uint32_t key[FIBAGG_KEY_WORDS];
+
+	fibagg_key_set(agg, key, prefix, agg->block_len);
+
+	hash_entry = hash_lookup(&agg->blocks, key);
+	if(!hash_entry)
+		goto err_hash_lookup;
+
+	return hash_entry(hash_entry, struct fibagg_block, hash);
+
+err_hash_lookup:
+	return NULL;
+}
+
+int fibagg_add(struct fibagg *agg, struct fib_entry *entry)
+{
+	struct fibagg_prefix *prefix;
+	struct fibagg_route *route;
+	int ret;
+
+	if(entry->prefix_len > agg->bits)
+		goto err_invalid_len;
+
+	prefix = fibagg_prefix_lookup(agg, entry->prefix, entry->prefix_len);
+	if(prefix){
+		hlist_for_each_entry(route, &prefix->head, list){
+			if(route->entry->id == entry->id)
+				goto err_route_exist;
+		}
+	}else{
+		prefix = fibagg_prefix_alloc(agg,
+			entry->prefix, entry->prefix_len);
+		if(!prefix)
+			goto err_prefix_alloc;
+	}
+
+	route = ixmap_mem_alloc(agg->desc, sizeof(struct fibagg_route));
+	if(!route)
+		goto err_route_alloc;
+
+	/* the newest route of a prefix is forwarded, like the engines do */
+	route->entry = entry;
+	hlist_add_head(&route->list, &prefix->head);
+	agg->num_routes++;
+
+	ret = fibagg_prefix_update(agg, prefix);
+	if(ret < 0)
+		goto err_update;
+
+	return 0;
+
+err_update:
+	/* the entry goes back to the caller, take it out of the RIB again */
+	hlist_del(&route->list);
+	ixmap_mem_free(route);
+	agg->num_routes--;
+	fibagg_prefix_update(agg, prefix);
+	return -1;
+
+err_route_alloc:
+	if(hlist_empty(&prefix->head))
+		fibagg_prefix_update(agg, prefix);
+err_prefix_alloc:
+err_route_exist:
+err_invalid_len:
+	return -1;
+}
+
+/* Of the routes of the prefix, the one with the id or else the newest */
+int fibagg_replace(struct fibagg *agg, struct fib_entry *entry)
+{
+	struct fibagg_prefix *prefix;
+	struct fibagg_route *route, *target;
+	struct fib_entry *entry_old;
+	int ret;
+
+	if(entry->prefix_len > agg->bits)
+		goto err_invalid_len;
+
+	prefix = fibagg_prefix_lookup(agg, entry->prefix, entry->prefix_len);
+	if(!prefix || hlist_empty(&prefix->head))
+		goto err_not_found;
+
+	target = hlist_first_entry(&prefix->head, struct fibagg_route, list);
+	hlist_for_each_entry(route, &prefix->head, list){
+		if(route->entry->id == entry->id){
+			target = route;
+			break;
+		}
+	}
+
+	entry_old = target->entry;
+	target->entry = entry;
+
+	ret = fibagg_prefix_update(agg, prefix);
+	if(ret < 0)
+		goto err_update;
+
+	/* installed entries are copies, readers never saw this one */
+	fib_entry_free(entry_old);
+	return 0;
+
+err_update:
+	target->entry = entry_old;
+	fibagg_prefix_update(agg, prefix);
+err_not_found:
+err_invalid_len:
+	return -1;
+}
+
+int fibagg_delete(struct fibagg *agg, void *prefix,
+	unsigned int prefix_len, int id)
+{
+	struct fibagg_prefix *prefix_del;
+	struct fibagg_route *route;
+
+	if(prefix_len > agg->bits)
+		goto err_invalid_len;
+
+	prefix_del = fibagg_prefix_lookup(agg, prefix, prefix_len);
+	if(!prefix_del)
+		goto err_not_found;
+
+	hlist_for_each_entry(route, &prefix_del->head, list){
+		if(route->entry->id == id)
+			break;
+	}
+
+	if(!route)
+		goto err_not_found;
+
+	hlist_del(&route->list);
+	fib_entry_free(route->entry);
+	ixmap_mem_free(route);
+	agg->num_routes--;
+
+	return fibagg_prefix_update(agg, prefix_del);
+
+err_not_found:
+err_invalid_len:
+	return -1;
+}
+
+/*
+ * Brings the fib in line with the routes of prefix,
+ * which is released here once it has none left.
+ */
+static int fibagg_prefix_update(struct fibagg *agg,
+	struct fibagg_prefix *prefix)
+{
+	struct fibagg_block *block;
+	uint8_t addr[16];
+	int ret;
+
+	if(prefix->key[FIBAGG_KEY_WORDS - 1] < agg->block_len)
+		return fibagg_short_update(agg, prefix);
+
+	memcpy(addr, prefix->key, sizeof(addr));
+	block = fibagg_block_lookup(agg, addr);
+
+	if(hlist_empty(&prefix->head))
+		fibagg_prefix_release(agg, prefix);
+
+	ret = fibagg_block_update(agg, block);
+
+	if(hlist_empty(&block->head) && !block->num_installed){
+		hash_delete(&agg->blocks, block->key);
+		agg->num_blocks--;
+	}
+
+	return ret;
+}
+
+/*
+ * A short prefix is installed as its best route. When that changes,
+ * so does the default of the blocks it is the longest cover of.
+ */
+static int fibagg_short_update(struct fibagg *agg,
+	struct fibagg_prefix *prefix)
+{
+	struct fibagg_block *block;
+	struct fib_entry *best;
+	uint8_t addr[16], bit;
+	unsigned int prefix_len, span, pos, i;
+	uint64_t n;
+	int ret = 0;
+
+	best = fibagg_prefix_best(prefix);
+	if(prefix->installed && fibagg_equal(agg, prefix->installed, best))
+		return 0;
+
+	if(prefix->installed){
+		fibagg_uninstall(agg, prefix->installed);
+		prefix->installed = NULL;
+	}
+
+	if(best){
+		ret = fibagg_install(agg, (uint8_t *)prefix->key,
+			prefix->key[FIBAGG_KEY_WORDS - 1], best,
+			&prefix->installed);
+	}
+
+	memcpy(addr, prefix->key, sizeof(addr));
+	prefix_len = prefix->key[FIBAGG_KEY_WORDS - 1];
+
+	if(!best)
+		fibagg_prefix_release(agg, prefix);
+
+	/* probe the blocks it spans when they are fewer than the existing */
+	span = agg->block_len - prefix_len;
+	if(span < 32 && (1ULL << span) <= agg->num_blocks){
+		for(n = 0; n < (1ULL << span); n++){
+			for(pos = prefix_len; pos < agg->block_len; pos++){
+				bit = 0x80 >> (pos & 7);
+				if((n >> (agg->block_len - 1 - pos)) & 1)
+					addr[pos >> 3] |= bit;
+				else
+					addr[pos >> 3] &= ~bit;
+			}
+
+			block = fibagg_block_lookup(agg, addr);
+			if(block && fibagg_block_cascade(agg,
+			block, prefix_len) < 0)
+				ret = -1;
+		}
+
+		return ret;
+	}
+
+	for(i = 0; i < HASH_SIZE; i++){
+		hlist_for_each_entry(block, &agg->blocks.head[i], hash.list){
+			if(!fibagg_match(agg, (uint8_t *)block->key,
+			addr, prefix_len))
+				continue;
+
+			if(fibagg_block_cascade(agg, block, prefix_len) < 0)
+				ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+/* Recomputes block if the short prefix_len changed is its default */
+static int fibagg_block_cascade(struct fibagg *agg,
+	struct fibagg_block *block, unsigned int prefix_len)
+{
+	struct fibagg_prefix *cover;
+
+	cover = fibagg_prefix_cover(agg, block->key, agg->block_len);
+	if(cover && cover->key[FIBAGG_KEY_WORDS - 1] > prefix_len)
+		return 0;
+
+	return fibagg_block_update(agg, block);
+}
+
+/*
+ * ORTC over the prefixes of one block: a binary trie of the block is
+ * completed so that every node has zero or two children, then
+ * 1) leaves take the route they inherit, or none,
+ * 2) going up, a node takes the intersection of its children's
+ *    nexthop sets, or their union when it is empty,
+ * 3) going down, a node only gets an entry when what it inherits
+ *    from above is not in its set.
+ * Regions without any route stay without one: a node mixing them with
+ * routed regions is never given an entry. The result replaces what
+ * the block had installed, prefixes found in both are left alone.
+ */
+static int fibagg_block_update(struct fibagg *agg,
+	struct fibagg_block *block)
+{
+	struct fibagg_node *root;
+	struct fibagg_prefix *cover;
+	struct fibagg_out *out;
+	struct fib_entry *inherit, **installed, *entry;
+	unsigned int num_out, i, j, k;
+	int cmp, ret, err = 0;
+
+	cover = fibagg_prefix_cover(agg, block->key, agg->block_len);
+	inherit = cover ? fibagg_prefix_best(cover) : NULL;
+
+	root = NULL;
+	out = NULL;
+	num_out = 0;
+
+	if(!hlist_empty(&block->head)){
+		root = fibagg_trie_build(agg, block);
+		if(!root)
+			goto err_trie_build;
+
+		ret = fibagg_node_reduce(agg, root, inherit);
+		if(ret < 0)
+			goto err_node_reduce;
+
+		out = malloc(sizeof(struct fibagg_out) * fibagg_node_count(root));
+		if(!out)
+			goto err_out_alloc;
+
+		fibagg_node_select(agg, root, inherit, out, &num_out);
+	}
+
+	installed = malloc(sizeof(struct fib_entry *)
+		* (num_out + block->num_installed + 1));
+	if(!installed)
+		goto err_installed_alloc;
+
+	/* both are in preorder, so a merge finds the unchanged entries */
+	i = j = k = 0;
+	while(i < block->num_installed || j < num_out){
+		if(i == block->num_installed)
+			cmp = 1;
+		else if(j == num_out)
+			cmp = -1;
+		else
+			cmp = fibagg_order(agg, block->installed[i], &out[j]);
+
+		if(!cmp && fibagg_equal(agg, block->installed[i], out[j].route)){
+			installed[k++] = block->installed[i];
+			i++;
+			j++;
+			continue;
+		}
+
+		if(cmp <= 0){
+			fibagg_uninstall(agg, block->installed[i]);
+			i++;
+		}
+
+		if(cmp >= 0){
+			ret = fibagg_install(agg, out[j].prefix,
+				out[j].prefix_len, out[j].route, &entry);
+			if(ret < 0)
+				err = -1;
+			else
+				installed[k++] = entry;
+			j++;
+		}
+	}
+
+	free(block->installed);
+	block->installed = installed;
+	block->num_installed = k;
+
+	free(out);
+	if(root)
+		fibagg_node_release(root);
+	return err;
+
+err_installed_alloc:
+	free(out);
+err_out_alloc:
+err_node_reduce:
+	fibagg_node_release(root);
+err_trie_build:
+	return -1;
+}
+
+static int fibagg_bit(uint8_t *prefix, unsigned int pos)
+{
+	return (prefix[pos >> 3] >> (7 - (pos & 7))) & 1;
+}
+
+static int fibagg_match(struct fibagg *agg, uint8_t *addr,
+	uint8_t *prefix, unsigned int prefix_len)
+{
+	uint32_t key_addr[FIBAGG_KEY_WORDS], key_prefix[FIBAGG_KEY_WORDS];
+
+	fibagg_key_set(agg, key_addr, addr, prefix_len);
+	fibagg_key_set(agg, key_prefix, prefix, prefix_len);
+
+	return !memcmp(key_addr, key_prefix, agg->bits >> 3);
+}
+
+/* Routes forwarding the same way, no route only equals no route */
+static int fibagg_equal(struct fibagg *agg,
+	struct fib_entry *entry_a, struct fib_entry *entry_b)
+{
+	if(!entry_a || !entry_b)
+		return entry_a == entry_b;
+
+	return entry_a->type == entry_b->type
+		&& entry_a->port_index == entry_b->port_index
+		&& entry_a->group == entry_b->group
+		&& entry_a->adj == entry_b->adj
+		&& !memcmp(entry_a->nexthop, entry_b->nexthop, agg->bits >> 3);
+}
+
+static int fibagg_install(struct fibagg *agg, uint8_t *prefix,
+	unsigned int prefix_len, struct fib_entry *route,
+	struct fib_entry **installed)
+{
+	struct fib_entry *entry;
+	int ret;
+
+	entry = fib_entry_alloc(agg->family, route->type, prefix, prefix_len,
+		route->nexthop, route->group, route->adj, route->port_index,
+		FIBAGG_ID, agg->desc);
+	if(!entry)
+		goto err_entry_alloc;
+
+	fib_entry_count(agg->fib, entry);
+
+	ret = fib_table_add(agg->fib, entry, agg->desc);
+	if(ret < 0)
+		goto err_table_add;
+
+	*installed = entry;
+	return 0;
+
+err_table_add:
+	fib_entry_free(entry);
+err_entry_alloc:
+	return -1;
+}
+
+static void fibagg_uninstall(struct fibagg *agg, struct fib_entry *entry)
+{
+	uint8_t prefix[16];
+
+	/* the engine may free entry before it is done with the key */
+	memcpy(prefix, entry->prefix, sizeof(prefix));
+	fib_table_delete(agg->fib, prefix, entry->prefix_len, FIBAGG_ID);
+	return;
+}
+
+static struct fibagg_node *fibagg_node_alloc(uint8_t *prefix,
+	unsigned int prefix_len)
+{
+	struct fibagg_node *node;
+
+	node = malloc(sizeof(struct fibagg_node));
+	if(!node)
+		return NULL;
+
+	memcpy(node->prefix, prefix, sizeof(node->prefix));
+	node->prefix_len	= prefix_len;
+	node->child[0]		= NULL;
+	node->child[1]		= NULL;
+	node->route		= NULL;
+	node->set		= NULL;
+	node->set_num		= 0;
+	node->mixed		= 0;
+
+	return node;
+}
+
+static struct fibagg_node *fibagg_node_child(struct fibagg_node *node,
+	int bit)
+{
+	struct fibagg_node *child;
+	unsigned int pos = node->prefix_len;
+
+	child = fibagg_node_alloc(node->prefix, pos + 1);
+	if(!child)
+		return NULL;
+
+	if(bit)
+		child->prefix[pos >> 3] |= 0x80 >> (pos & 7);
+
+	node->child[bit] = child;
+	return child;
+}
+
+static void fibagg_node_release(struct fibagg_node *node)
+{
+	int i;
+
+	for(i = 0; i < 2; i++){
+		if(node->child[i])
+			fibagg_node_release(node->child[i]);
+	}
+
+	free(node->set);
+	free(node);
+	return;
+}
+
+static unsigned int fibagg_node_count(struct fibagg_node *node)
+{
+	unsigned int count = 1;
+	int i;
+
+	for(i = 0; i < 2; i++){
+		if(node->child[i])
+			count += fibagg_node_count(node->child[i]);
+	}
+
+	return count;
+}
+
+static struct fibagg_node *fibagg_trie_build(struct fibagg *agg,
+	struct fibagg_block *block)
+{
+	struct fibagg_node *root, *node;
+	struct fibagg_prefix *prefix;
+	unsigned int pos;
+	int bit;
+
+	root = fibagg_node_alloc((uint8_t *)block->key, agg->block_len);
+	if(!root)
+		goto err_root_alloc;
+
+	hlist_for_each_entry(prefix, &block->head, list){
+		node = root;
+
+		for(pos = agg->block_len;
+		pos < prefix->key[FIBAGG_KEY_WORDS - 1]; pos++){
+			bit = fibagg_bit((uint8_t *)prefix->key, pos);
+			if(node->child[bit]){
+				node = node->child[bit];
+			}else{
+				node = fibagg_node_child(node, bit);
+				if(!node)
+					goto err_node_alloc;
+			}
+		}
+
+		node->route = fibagg_prefix_best(prefix);
+	}
+
+	return root;
+
+err_node_alloc:
+	fibagg_node_release(root);
+err_root_alloc:
+	return NULL;
+}
+
+static int fibagg_set_find(struct fibagg *agg, struct fibagg_node *node,
+	struct fib_entry *entry)
+{
+	unsigned int i;
+
+	for(i = 0; i < node->set_num; i++){
+		if(fibagg_equal(agg, node->set[i], entry))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int fibagg_node_merge(struct fibagg *agg, struct fibagg_node *node)
+{
+	struct fibagg_node *child_a, *child_b;
+	unsigned int i;
+
+	child_a = node->child[0];
+	child_b = node->child[1];
+
+	if(child_a->mixed || child_b->mixed){
+		node->mixed = 1;
+		return 0;
+	}
+
+	node->set = malloc(sizeof(struct fib_entry *)
+		* (child_a->set_num + child_b->set_num));
+	if(!node->set)
+		return -1;
+
+	/* no route only appears alone, never in a union */
+	if(fibagg_set_find(agg, child_a, NULL)
+	|| fibagg_set_find(agg, child_b, NULL)){
+		if(fibagg_set_find(agg, child_a, NULL)
+		&& fibagg_set_find(agg, child_b, NULL)){
+			node->set[node->set_num++] = NULL;
+		}else{
+			node->mixed = 1;
+		}
+		return 0;
+	}
+
+	for(i = 0; i < child_a->set_num; i++){
+		if(fibagg_set_find(agg, child_b, child_a->set[i]))
+			node->set[node->set_num++] = child_a->set[i];
+	}
+
+	if(node->set_num)
+		return 0;
+
+	for(i = 0; i < child_a->set_num; i++){
+		node->set[node->set_num++] = child_a->set[i];
+	}
+
+	for(i = 0; i < child_b->set_num; i++){
+		if(!fibagg_set_find(agg, child_a, child_b->set[i]))
+			node->set[node->set_num++] = child_b->set[i];
+	}
+
+	return 0;
+}
+
+static int fibagg_node_reduce(struct fibagg *agg, struct fibagg_node *node,
+	struct fib_entry *above)
+{
+	int ret, i;
+
+	if(node->route)
+		above = node->route;
+
+	if(!node->child[0] && !node->child[1]){
+		node->set = malloc(sizeof(struct fib_entry *));
+		if(!node->set)
+			return -1;
+
+		node->set[0] = above;
+		node->set_num = 1;
+		return 0;
+	}
+
+	for(i = 0; i < 2; i++){
+		if(!node->child[i] && !fibagg_node_child(node, i))
+			return -1;
+
+		ret = fibagg_node_reduce(agg, node->child[i], above);
+		if(ret < 0)
+			return -1;
+	}
+
+	return fibagg_node_merge(agg, node);
+}
+
+static void fibagg_node_select(struct fibagg *agg, struct fibagg_node *node,
+	struct fib_entry *inherit, struct fibagg_out *out, unsigned int *num)
+{
+	int i;
+
+	/* a mixed node is never under a route, inherit is none */
+	if(!node->mixed && !fibagg_set_find(agg, node, inherit)){
+		inherit = node->set[0];
+
+		memcpy(out[*num].prefix, node->prefix, sizeof(node->prefix));
+		out[*num].prefix_len	= node->prefix_len;
+		out[*num].route		= inherit;
+		(*num)++;
+	}
+
+	for(i = 0; i < 2; i++){
+		if(node->child[i])
+			fibagg_node_select(agg, node->child[i],
+				inherit, out, num);
+	}
+
+	return;
+}
+
+static int fibagg_order(struct fibagg *agg, struct fib_entry *entry,
+	struct fibagg_out *out)
+{
+	int ret;
+
+	ret = memcmp(entry->prefix, out->prefix, agg->bits >> 3);
+	if(ret)
+		return ret;
+
+	if(entry->prefix_len == out->prefix_len)
+		return 0;
+
+	return entry->prefix_len < out->prefix_len ? -1 : 1;
+}
+
+static struct fib_entry *fibagg_rib_lookup(struct fibagg *agg,
+	uint8_t *addr)
+{
+	struct fibagg_prefix *prefix;
+
+	prefix = fibagg_prefix_lookup(agg, addr, agg->bits);
+	if(!prefix)
+		prefix = fibagg_prefix_cover(agg, addr, agg->bits);
+
+	return prefix ? fibagg_prefix_best(prefix) : NULL;
+}
+
+/*
+ * Compares the fib with a plain longest match over the RIB.
+ * The prefixes of a block split it into regions where both are
+ * constant, one address of each is enough to cover the whole space.
+ * Returns the number of regions forwarded differently, or -1.
+ */
+int fibagg_verify(struct fibagg *agg)
+{
+	struct fibagg_prefix *prefix;
+	struct fibagg_block *block;
+	struct fibagg_node *root;
+	unsigned int i, mismatch = 0;
+
+	for(i = 0; i < HASH_SIZE; i++){
+		hlist_for_each_entry(prefix, &agg->prefixes.head[i], hash.list){
+			if(prefix->key[FIBAGG_KEY_WORDS - 1] >= agg->block_len)
+				continue;
+
+			if(!fibagg_equal(agg, prefix->installed,
+			fibagg_prefix_best(prefix)))
+				mismatch++;
+		}
+	}
+
+	for(i = 0; i < HASH_SIZE; i++){
+		hlist_for_each_entry(block, &agg->blocks.head[i], hash.list){
+			root = fibagg_trie_build(agg, block);
+			if(!root)
+				goto err_trie_build;
+
+			mismatch += fibagg_node_verify(agg, root);
+			fibagg_node_release(root);
+		}
+	}
+
+	return mismatch;
+
+err_trie_build:
+	return -1;
+}
+
+static unsigned int fibagg_node_verify(struct fibagg *agg,
+	struct fibagg_node *node)
+{
+	uint8_t addr[16];
+	unsigned int pos, mismatch = 0;
+	int i;
+
+	if(!node->child[0] && !node->child[1]){
+		return !fibagg_equal(agg, fibagg_rib_lookup(agg, node->prefix),
+			fib_lookup(agg->fib, node->prefix));
+	}
+
+	for(i = 0; i < 2; i++){
+		if(node->child[i]){
+			mismatch += fibagg_node_verify(agg, node->child[i]);
+			continue;
+		}
+
+		pos = node->prefix_len;
+		memcpy(addr, node->prefix, sizeof(addr));
+		if(i)
+			addr[pos >> 3] |= 0x80 >> (pos & 7);
+
+		mismatch += !fibagg_equal(agg, fibagg_rib_lookup(agg, addr),
+			fib_lookup(agg->fib, addr));
+	}
+
+	return mismatch;
+}
+
+/* Visits the RIB, routes of one prefix newest first */
+void fibagg_walk(struct fibagg *agg,
+	void (*func)(void *, void *), void *arg)
+{
+	struct fibagg_prefix *prefix;
+	struct fibagg_route *route;
+	unsigned int i;
+
+	for(i = 0; i < HASH_SIZE; i++){
+		hlist_for_each_entry(prefix, &agg->prefixes.head[i], hash.list){
+			hlist_for_each_entry(route, &prefix->head, list){
+				func(route->entry, arg);
+			}
+		}
+	}
+
+	return;
+}
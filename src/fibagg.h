@@ -0,0 +1,88 @@
+#ifndef _IXMAPFWD_FIBAGG_H
+#define _IXMAPFWD_FIBAGG_H
+
+#include <stdint.h>
+#include "linux/list.h"
+#include "hash.h"
+
+/*
+ * Optional compression between the routes learned over netlink,
+ * kept as they are (the RIB), and the FIB engine:
+ * Routes at least FIBAGG_BLOCK_* long are aggregated with ORTC per
+ * block of that length, so that the FIB holds the fewest prefixes
+ * forwarding exactly as the RIB does. Shorter routes are installed
+ * as they are and act as the default of the blocks below them.
+ * An update only recomputes its own block, or for a short route
+ * the blocks whose default it changes.
+ */
+#define FIBAGG_BLOCK_INET	16
+#define FIBAGG_BLOCK_INET6	32
+#define FIBAGG_ID		-1 /* id of the entries fibagg installs */
+#define FIBAGG_KEY_WORDS	5
+
+struct fib;
+struct fib_entry;
+
+struct fibagg_route {
+	struct hlist_node	list;
+	struct fib_entry	*entry;
+};
+
+struct fibagg_prefix {
+	struct hash_entry	hash;
+	uint32_t		key[FIBAGG_KEY_WORDS]; /* prefix, prefix_len */
+	struct hlist_head	head; /* routes, newest first */
+	struct hlist_node	list; /* in its block, unless short */
+	struct fib_entry	*installed; /* short prefix only */
+};
+
+struct fibagg_block {
+	struct hash_entry	hash;
+	uint32_t		key[FIBAGG_KEY_WORDS];
+	struct hlist_head	head; /* prefixes */
+	struct fib_entry	**installed; /* in trie preorder */
+	unsigned int		num_installed;
+};
+
+/* ORTC working trie of one block, only alive during an update */
+struct fibagg_node {
+	struct fibagg_node	*child[2];
+	struct fib_entry	*route;
+	struct fib_entry	**set; /* NULL member means no route */
+	unsigned int		set_num;
+	int			mixed;
+	uint8_t			prefix[16];
+	unsigned int		prefix_len;
+};
+
+struct fibagg_out {
+	uint8_t			prefix[16];
+	unsigned int		prefix_len;
+	struct fib_entry	*route;
+};
+
+struct fibagg {
+	struct fib		*fib;
+	struct ixmap_desc	*desc;
+	int			family;
+	unsigned int		bits;
+	unsigned int		block_len;
+	unsigned int		num_prefixes; /* RIB prefixes */
+	unsigned int		num_routes; /* RIB routes */
+	unsigned int		num_blocks;
+	struct hash_table	prefixes;
+	struct hash_table	blocks;
+};
+
+struct fibagg *fibagg_alloc(struct fib *fib, int family,
+	struct ixmap_desc *desc);
+void fibagg_release(struct fibagg *agg);
+int fibagg_add(struct fibagg *agg, struct fib_entry *entry);
+int fibagg_replace(struct fibagg *agg, struct fib_entry *entry);
+int fibagg_delete(struct fibagg *agg, void *prefix,
+	unsigned int prefix_len, int id);
+int fibagg_verify(struct fibagg *agg);
+void fibagg_walk(struct fibagg *agg,
+	void (*func)(void *, void *), void *arg);
+
+#endif /* _IXMAPFWD_FIBAGG_H */
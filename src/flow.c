@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <ixmap.h>
+
+#include "main.h"
+#include "flow.h"
+
+struct flow_cache *flow_cache_alloc(struct ixmap_desc *desc,
+	unsigned int num_entries, unsigned int tuple,
+	unsigned int *gen_shared)
+{
+	struct flow_cache *cache;
+	unsigned int num_buckets;
+
+	num_buckets = 1;
+	while(num_buckets * FLOW_WAYS < num_entries)
+		num_buckets <<= 1;
+
+	cache = ixmap_mem_alloc(desc, sizeof(struct flow_cache));
+	if(!cache)
+		goto err_cache_alloc;
+
+	cache->buckets = ixmap_mem_alloc(desc,
+		sizeof(struct flow_bucket) * num_buckets);
+	if(!cache->buckets)
+		goto err_buckets_alloc;
+
+	cache->entries = ixmap_mem_alloc(desc,
+		sizeof(struct flow_entry) * num_buckets * FLOW_WAYS);
+	if(!cache->entries)
+		goto err_entries_alloc;
+
+	memset(cache->buckets, 0, sizeof(struct flow_bucket) * num_buckets);
+	cache->mask		= num_buckets - 1;
+	cache->tuple		= tuple;
+	cache->gen_local	= 1; /* a generation is never 0 */
+	cache->gen_shared	= gen_shared;
+	cache->hits		= 0;
+	cache->misses		= 0;
+	flow_cache_begin(cache);
+
+	return cache;
+
+err_entries_alloc:
+	ixmap_mem_free(cache->buckets);
+err_buckets_alloc:
+	ixmap_mem_free(cache);
+err_cache_alloc:
+	return NULL;
+}
+
+void flow_cache_release(struct flow_cache *cache)
+{
+	ixmap_mem_free(cache->entries);
+	ixmap_mem_free(cache->buckets);
+	ixmap_mem_free(cache);
+	return;
+}
+
+/* A stale way is taken first, a live one picked by the hash otherwise */
+void flow_cache_insert(struct flow_cache *cache, uint32_t *key,
+	uint32_t hash, int port_index, uint8_t *rewrite,
+	unsigned int stats_id)
+{
+	struct flow_bucket *bucket;
+	struct flow_entry *entry;
+	unsigned int index;
+	int i, way;
+
+	index = hash & cache->mask;
+	bucket = &cache->buckets[index];
+	way = (hash >> 16) % FLOW_WAYS;
+
+	for(i = 0; i < FLOW_WAYS; i++){
+		if(bucket->gen[i] != cache->gen){
+			way = i;
+			break;
+		}
+	}
+
+	entry = &cache->entries[index * FLOW_WAYS + way];
+	memcpy(entry->key, key, sizeof(entry->key));
+	memcpy(entry->rewrite, rewrite, ADJ_REWRITE_LEN);
+	entry->port_index = port_index;
+	entry->stats_id = stats_id;
+
+	bucket->sig[way] = hash;
+	bucket->gen[way] = cache->gen;
+	return;
+}
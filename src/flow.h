@@ -0,0 +1,116 @@
+#ifndef _IXMAPFWD_FLOW_H
+#define _IXMAPFWD_FLOW_H
+
+#include <stdint.h>
+#include <string.h>
+#include "adj.h"
+
+/*
+ * Exact-match flow cache of one thread, in front of the FIB and the
+ * neighbor lookup. A flow is the ingress port and destination, or the
+ * 5-tuple, and caches the egress port and Ethernet rewrite last found
+ * for it. Buckets are one cache line of FLOW_WAYS signatures, each
+ * valid only while its generation is the current one: the FIB writer
+ * bumps gen_shared on a change of the FIB, adjacencies or neighbors,
+ * the thread gen_local for its flows to mark their neighbors again.
+ */
+#define FLOW_WAYS		8
+#define FLOW_KEY_WORDS		10 /* dst, src, ports, proto/family/port */
+
+struct flow_bucket {
+	uint32_t		sig[FLOW_WAYS];
+	uint32_t		gen[FLOW_WAYS]; /* 0 if never used */
+} __attribute__ ((aligned(64)));
+
+struct flow_entry {
+	uint32_t		key[FLOW_KEY_WORDS];
+	uint8_t			rewrite[ADJ_REWRITE_LEN];
+	int			port_index;
+	unsigned int		stats_id; /* of the route, see stats.h */
+} __attribute__ ((aligned(64)));
+
+struct flow_cache {
+	struct flow_bucket	*buckets;
+	struct flow_entry	*entries; /* FLOW_WAYS per bucket */
+	unsigned int		mask;
+	unsigned int		tuple; /* key by 5-tuple */
+	unsigned int		gen; /* taken by flow_cache_begin() */
+	unsigned int		gen_local;
+	unsigned int		*gen_shared;
+	unsigned long		hits;
+	unsigned long		misses;
+};
+
+struct flow_cache *flow_cache_alloc(struct ixmap_desc *desc,
+	unsigned int num_entries, unsigned int tuple,
+	unsigned int *gen_shared);
+void flow_cache_release(struct flow_cache *cache);
+void flow_cache_insert(struct flow_cache *cache, uint32_t *key,
+	uint32_t hash, int port_index, uint8_t *rewrite,
+	unsigned int stats_id);
+
+static inline uint32_t flow_hash(uint32_t *key)
+{
+	uint64_t hash = 0;
+	int i;
+
+	for(i = 0; i < FLOW_KEY_WORDS; i++){
+		hash = (hash ^ key[i]) * GOLDEN_RATIO_64;
+	}
+
+	return hash >> 32;
+}
+
+static inline int flow_key_equal(uint32_t *key_a, uint32_t *key_b)
+{
+	uint32_t diff = 0;
+	int i;
+
+	for(i = 0; i < FLOW_KEY_WORDS; i++){
+		diff |= key_a[i] ^ key_b[i];
+	}
+
+	return !diff;
+}
+
+/* Once per burst, before its FIB lookups */
+static inline void flow_cache_begin(struct flow_cache *cache)
+{
+	cache->gen = ACCESS_ONCE(*cache->gen_shared) + cache->gen_local;
+	smp_rmb();
+	return;
+}
+
+static inline void flow_cache_invalidate(struct flow_cache *cache)
+{
+	cache->gen_local++;
+	return;
+}
+
+static inline struct flow_entry *flow_cache_lookup(struct flow_cache *cache,
+	uint32_t *key, uint32_t hash)
+{
+	struct flow_bucket *bucket;
+	struct flow_entry *entry;
+	unsigned int index;
+	int i;
+
+	index = hash & cache->mask;
+	bucket = &cache->buckets[index];
+
+	for(i = 0; i < FLOW_WAYS; i++){
+		if(bucket->sig[i] != hash || bucket->gen[i] != cache->gen)
+			continue;
+
+		entry = &cache->entries[index * FLOW_WAYS + i];
+		if(flow_key_equal(entry->key, key)){
+			cache->hits++;
+			return entry;
+		}
+	}
+
+	cache->misses++;
+	return NULL;
+}
+
+#endif /* _IXMAPFWD_FLOW_H */
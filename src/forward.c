@@ -12,13 +12,50 @@
 #include "main.h"
 #include "forward.h"
 #include "thread.h"
+#include "netlink.h"
 
-static int forward_arp_process(struct ixmapfwd_thread *thread,
+static void forward_process_bulk(struct ixmapfwd_thread *thread,
+	unsigned int port_index, struct ixmap_packet *packet, int num_packet);
+static int forward_local_process(struct ixmapfwd_thread *thread,
 	unsigned int port_index, struct ixmap_packet *packet);
+static int forward_reject(struct ixmapfwd_thread *thread,
+	unsigned int port_index, struct ixmap_packet *packet,
+	enum fib_type type);
+static int forward_arp_process(struct ixmapfwd_thread *thread,
+	unsigned int port_index, struct ixmap_packet *packet,
+	struct local_set *locals);
+static int forward_nd_process(struct ixmapfwd_thread *thread,
+	unsigned int port_index, struct ixmap_packet *packet,
+	struct local_set *locals);
+static int forward_nd_known(struct ixmapfwd_thread *thread,
+	unsigned int port_index, int family, struct nd_request *req);
+static void forward_neigh_bulk(struct neigh_table **tables,
+	struct neigh_stats *stats, struct fib_entry **fib_entries, void **dst,
+	struct neigh_entry **neigh, unsigned int num);
 static int forward_ip_process(struct ixmapfwd_thread *thread,
-	unsigned int port_index, struct ixmap_packet *packet);
+	unsigned int port_index, struct ixmap_packet *packet,
+	struct fib_entry *fib_entry, struct neigh_entry *neigh_entry,
+	uint32_t *flow_key, uint32_t flow_hash);
 static int forward_ip6_process(struct ixmapfwd_thread *thread,
-	unsigned int port_index, struct ixmap_packet *packet);
+	unsigned int port_index, struct ixmap_packet *packet,
+	struct fib_entry *fib_entry, struct neigh_entry *neigh_entry,
+	uint32_t *flow_key, uint32_t flow_hash);
+static int forward_flow_process(struct ixmapfwd_thread *thread,
+	unsigned int port_index, struct ixmap_packet *packet, uint16_t proto,
+	int port_out, uint8_t *rewrite);
+static uint32_t forward_flow_key(struct flow_cache *cache,
+	unsigned int port_index, struct ixmap_packet *packet, uint16_t proto,
+	uint32_t *key);
+static int forward_resolve(struct ixmapfwd_thread *thread,
+	struct neigh_table *neigh, struct neigh_stats *stats, int port_out,
+	enum fib_type type, struct adj *adj, struct neigh_entry *neigh_entry,
+	void *dst, void *gateway, uint8_t *rewrite);
+static int forward_pending(struct ixmapfwd_thread *thread,
+	unsigned int port_index, struct ixmap_packet *packet, int family,
+	int port_out, void *addr);
+static uint32_t forward_hash(struct ixmap_packet *packet,
+	void *src, void *dst, unsigned int addr_len, uint8_t proto,
+	void *l4);
 
 #ifdef DEBUG
 void forward_dump(struct ixmap_packet *packet)
@@ -42,8 +79,10 @@ void forward_dump(struct ixmap_packet *packet)
 void forward_process(struct ixmapfwd_thread *thread, unsigned int port_index,
 	struct ixmap_packet *packet, int num_packet)
 {
-	struct ethhdr *eth;
-	int i, ret;
+	int base, num_bulk;
+#ifdef DDIO_UNSUPPORTED
+	int i;
+#endif
 
 	/* software prefetch is not needed when DDIO is available */
 #ifdef DDIO_UNSUPPORTED
@@ -52,30 +91,213 @@ void forward_process(struct ixmapfwd_thread *thread, unsigned int port_index,
 	}
 #endif
 
+	for(base = 0; base < num_packet; base += num_bulk){
+		num_bulk = min(num_packet - base, FORWARD_BULK);
+		forward_process_bulk(thread, port_index,
+			&packet[base], num_bulk);
+	}
+
+	return;
+}
+
+/*
+ * Destinations of a burst are collected per family first,
+ * so that their FIB lookups overlap in fib_lookup_bulk(),
+ * then those of connected hosts in neigh_lookup_bulk().
+ * A burst comes from one port, so from one VRF.
+ * Packets of a cached flow skip both the FIB and the neighbors.
+ */
+static void forward_process_bulk(struct ixmapfwd_thread *thread,
+	unsigned int port_index, struct ixmap_packet *packet, int num_packet)
+{
+	struct ethhdr		*eth;
+	struct iphdr		*ip;
+	struct ip6_hdr		*ip6;
+	uint16_t		proto[FORWARD_BULK];
+	void			*dst_inet[FORWARD_BULK];
+	void			*dst_inet6[FORWARD_BULK];
+	struct fib_entry	*fib_inet[FORWARD_BULK];
+	struct fib_entry	*fib_inet6[FORWARD_BULK];
+	struct neigh_entry	*neigh_inet[FORWARD_BULK];
+	struct neigh_entry	*neigh_inet6[FORWARD_BULK];
+	uint32_t		flow_keys[FORWARD_BULK][FLOW_KEY_WORDS];
+	uint32_t		flow_hashes[FORWARD_BULK];
+	int			flow_ports[FORWARD_BULK];
+	uint8_t			flow_rewrites[FORWARD_BULK][ADJ_REWRITE_LEN];
+	struct flow_cache	*cache;
+	struct flow_entry	*flow;
+	uint8_t			local[FORWARD_BULK];
+	struct local_set	*locals;
+	struct fib		*fib;
+	struct vrf		*vrf;
+	void			*dst;
+	unsigned int		num_inet, num_inet6, k;
+	int			family, i, ret;
+
+	num_inet = 0;
+	num_inet6 = 0;
+
+	cache = thread->flow;
+	if(cache)
+		flow_cache_begin(cache);
+
+	/* ports of a VRF have the addresses of its table, not these */
+	vrf = ACCESS_ONCE(thread->fib->vrfs->port_vrf[port_index]);
+	locals = vrf ? NULL : ACCESS_ONCE(thread->fib->locals->set);
+
 	for(i = 0; i < num_packet; i++){
 #ifdef DEBUG
 		forward_dump(&packet[i]);
 #endif
 
 		eth = (struct ethhdr *)packet[i].slot_buf;
-		switch(ntohs(eth->h_proto)){
+		proto[i] = ntohs(eth->h_proto);
+		flow_ports[i] = -1;
+		local[i] = 0;
+
+		switch(proto[i]){
+		case ETH_P_IP:
+			ip = (struct iphdr *)(packet[i].slot_buf
+				+ sizeof(struct ethhdr));
+			family = AF_INET;
+			dst = &ip->daddr;
+			break;
+		case ETH_P_IPV6:
+			ip6 = (struct ip6_hdr *)(packet[i].slot_buf
+				+ sizeof(struct ethhdr));
+			family = AF_INET6;
+			dst = &ip6->ip6_dst;
+			break;
+		default:
+			continue;
+			break;
+		}
+
+		/* a few compares instead of an LPM walk to a local route */
+		if(locals && local_lookup(locals, family, dst)){
+			local[i] = 1;
+			continue;
+		}
+
+		/*
+		 * Neighbor Solicitations are sent to a solicited-node
+		 * multicast group, not to a local address: classify them
+		 * as local here, before the FIB lookup.
+		 */
+		if(family == AF_INET6
+		&& unlikely(nd_ns_match(packet[i].slot_buf))){
+			local[i] = 1;
+			continue;
+		}
+
+		/*
+		 * The port and rewrite of a hit are copied out, because a
+		 * later miss of the same burst may insert into its way and
+		 * evict the entry.
+		 */
+		if(cache){
+			flow_hashes[i] = forward_flow_key(cache, port_index,
+				&packet[i], proto[i], flow_keys[i]);
+			flow = flow_cache_lookup(cache,
+				flow_keys[i], flow_hashes[i]);
+			if(flow){
+				if(thread->stats)
+					stats_count(thread->stats,
+						flow->stats_id,
+						packet[i].slot_size);
+				flow_ports[i] = flow->port_index;
+				memcpy(flow_rewrites[i], flow->rewrite,
+					ADJ_REWRITE_LEN);
+				continue;
+			}
+		}else{
+			/*
+			 * Without a cache the key is passed on as NULL
+			 * and the hash is never read.
+			 */
+			flow_hashes[i] = 0;
+		}
+
+		if(family == AF_INET)
+			dst_inet[num_inet++] = dst;
+		else
+			dst_inet6[num_inet6++] = dst;
+	}
+
+	/* a VRF without routes of the family drops them */
+	if(num_inet){
+		fib = vrf ? ACCESS_ONCE(vrf->fib_inet) :
+			ACCESS_ONCE(thread->fib->fib_inet);
+		if(likely(fib))
+			fib_lookup_bulk(fib, dst_inet, fib_inet, num_inet);
+		else
+			memset(fib_inet, 0, sizeof(fib_inet));
+
+		forward_neigh_bulk(thread->fib->neigh_inet,
+			&thread->neigh_stats_inet, fib_inet, dst_inet,
+			neigh_inet, num_inet);
+	}
+
+	if(num_inet6){
+		fib = vrf ? ACCESS_ONCE(vrf->fib_inet6) :
+			ACCESS_ONCE(thread->fib->fib_inet6);
+		if(likely(fib))
+			fib_lookup_bulk(fib, dst_inet6, fib_inet6, num_inet6);
+		else
+			memset(fib_inet6, 0, sizeof(fib_inet6));
+
+		forward_neigh_bulk(thread->fib->neigh_inet6,
+			&thread->neigh_stats_inet6, fib_inet6, dst_inet6,
+			neigh_inet6, num_inet6);
+	}
+
+	num_inet = 0;
+	num_inet6 = 0;
+
+	for(i = 0; i < num_packet; i++){
+		if(local[i]){
+			ret = proto[i] == ETH_P_IPV6 ?
+				forward_nd_process(thread, port_index,
+					&packet[i], locals) :
+				forward_local_process(thread,
+					port_index, &packet[i]);
+			goto packet_xmit;
+		}
+
+		if(flow_ports[i] >= 0){
+			ret = forward_flow_process(thread, port_index,
+				&packet[i], proto[i], flow_ports[i],
+				flow_rewrites[i]);
+			goto packet_xmit;
+		}
+
+		switch(proto[i]){
 		case ETH_P_ARP:
 			ret = forward_arp_process(thread,
-				port_index, &packet[i]);
+				port_index, &packet[i], locals);
 			break;
 		case ETH_P_IP:
+			k = num_inet++;
 			ret = forward_ip_process(thread,
-				port_index, &packet[i]);
+				port_index, &packet[i], fib_inet[k], neigh_inet[k],
+				cache ? flow_keys[i] : NULL, flow_hashes[i]);
 			break;
 		case ETH_P_IPV6:
+			k = num_inet6++;
 			ret = forward_ip6_process(thread,
-				port_index, &packet[i]);
+				port_index, &packet[i], fib_inet6[k],
+				neigh_inet6[k],
+				cache ? flow_keys[i] : NULL, flow_hashes[i]);
 			break;
 		default:
 			ret = -1;
 			break;
 		}
 
+packet_xmit:
+		if(ret == FORWARD_HELD)
+			continue;
+
 		if(ret < 0)
 			goto packet_drop;
 
@@ -89,6 +311,79 @@ packet_drop:
 	return;
 }
 
+/*
+ * Neighbors of the connected hosts and adjacency-less gateways of
+ * a burst, one neigh_lookup_bulk() per egress port. Destinations
+ * through a group, or not found, are left NULL for forward_resolve().
+ */
+static void forward_neigh_bulk(struct neigh_table **tables,
+	struct neigh_stats *stats, struct fib_entry **fib_entries, void **dst,
+	struct neigh_entry **neigh, unsigned int num)
+{
+	struct fib_entry	*entry;
+	void			*keys[FORWARD_BULK];
+	void			*keys_port[FORWARD_BULK];
+	struct neigh_entry	*found[FORWARD_BULK];
+	unsigned int		index[FORWARD_BULK];
+	unsigned int		index_port[FORWARD_BULK];
+	int			ports[FORWARD_BULK];
+	unsigned int		num_keys, num_port, num_rest, i;
+	int			port_out;
+
+	num_keys = 0;
+	for(i = 0; i < num; i++){
+		neigh[i] = NULL;
+
+		entry = fib_entries[i];
+		if(!entry || entry->group || entry->port_index < 0)
+			continue;
+
+		switch(entry->type){
+		case FIB_TYPE_LINK:
+			keys[num_keys] = dst[i];
+			break;
+		case FIB_TYPE_FORWARD:
+			if(likely(entry->adj))
+				continue;
+			keys[num_keys] = entry->nexthop;
+			break;
+		default:
+			continue;
+		}
+
+		ports[num_keys] = entry->port_index;
+		index[num_keys++] = i;
+	}
+
+	/* a burst rarely leaves by more than a port or two */
+	while(num_keys){
+		port_out = ports[0];
+		num_port = 0;
+		num_rest = 0;
+
+		for(i = 0; i < num_keys; i++){
+			if(ports[i] == port_out){
+				keys_port[num_port] = keys[i];
+				index_port[num_port++] = index[i];
+			}else{
+				keys[num_rest] = keys[i];
+				ports[num_rest] = ports[i];
+				index[num_rest++] = index[i];
+			}
+		}
+
+		neigh_lookup_bulk(ACCESS_ONCE(tables[port_out]), stats,
+			keys_port, found, num_port);
+		for(i = 0; i < num_port; i++){
+			neigh[index_port[i]] = found[i];
+		}
+
+		num_keys = num_rest;
+	}
+
+	return;
+}
+
 void forward_process_tun(struct ixmapfwd_thread *thread, unsigned int port_index,
 	uint8_t *read_buf, unsigned int read_size)
 {
@@ -106,6 +401,7 @@ void forward_process_tun(struct ixmapfwd_thread *thread, unsigned int port_index
 	packet.slot_buf = ixmap_slot_addr_virt(thread->buf, packet.slot_index);
 	memcpy(packet.slot_buf, read_buf, read_size);
 	packet.slot_size = read_size;
+	packet.rss_hash = 0;
 
 #ifdef DEBUG
 	forward_dump(&packet);
@@ -119,7 +415,8 @@ err_slot_size:
 	return;
 }
 
-static int forward_arp_process(struct ixmapfwd_thread *thread,
+/* ARP and packets to the router itself go to the kernel as they are */
+static int forward_local_process(struct ixmapfwd_thread *thread,
 	unsigned int port_index, struct ixmap_packet *packet)
 {
 	int fd, ret;
@@ -135,49 +432,200 @@ err_write_tun:
 	return -1;
 }
 
+/*
+ * A request for an address of the router, from a neighbor the node
+ * knows at the MAC it asks from, is answered here. Any other goes to
+ * the kernel, which learns a new sender from it and answers itself.
+ * Ports of a VRF have no locals, their requests all go.
+ */
+static int forward_arp_process(struct ixmapfwd_thread *thread,
+	unsigned int port_index, struct ixmap_packet *packet,
+	struct local_set *locals)
+{
+	struct nd_request req;
+	int ret;
+
+	if(!locals)
+		goto packet_local;
+
+	ret = nd_arp_parse(packet->slot_buf, packet->slot_size, &req);
+	if(ret < 0 || !local_lookup(locals, AF_INET, req.target)
+	|| !forward_nd_known(thread, port_index, AF_INET, &req))
+		goto packet_local;
+
+	if(nd_take(thread->nd, port_index) < 0)
+		goto packet_drop;
+
+	nd_arp_reply(packet->slot_buf,
+		ixmap_macaddr(thread->plane, port_index));
+	thread->nd->ports[port_index].arp_answered++;
+	return port_index;
+
+packet_local:
+	thread->nd->ports[port_index].punted++;
+	return forward_local_process(thread, port_index, packet);
+
+packet_drop:
+	return -1;
+}
+
+/* The same for Neighbor Solicitations, other IPv6 goes on as local */
+static int forward_nd_process(struct ixmapfwd_thread *thread,
+	unsigned int port_index, struct ixmap_packet *packet,
+	struct local_set *locals)
+{
+	struct nd_request req;
+	int ret;
+
+	if(!locals || !nd_ns_match(packet->slot_buf))
+		return forward_local_process(thread, port_index, packet);
+
+	ret = nd_ns_parse(packet->slot_buf, packet->slot_size, &req);
+	if(ret < 0 || !local_lookup(locals, AF_INET6, req.target)
+	|| !forward_nd_known(thread, port_index, AF_INET6, &req))
+		goto packet_local;
+
+	if(nd_take(thread->nd, port_index) < 0)
+		goto packet_drop;
+
+	packet->slot_size = nd_na_reply(packet->slot_buf,
+		ixmap_macaddr(thread->plane, port_index));
+	thread->nd->ports[port_index].ns_answered++;
+	return port_index;
+
+packet_local:
+	thread->nd->ports[port_index].punted++;
+	return forward_local_process(thread, port_index, packet);
+
+packet_drop:
+	return -1;
+}
+
+/* The sender of req is in the neighbor table of the node, at its MAC */
+static int forward_nd_known(struct ixmapfwd_thread *thread,
+	unsigned int port_index, int family, struct nd_request *req)
+{
+	struct neigh_table *neigh;
+	struct neigh_entry *neigh_entry;
+	struct neigh_stats *stats;
+	uint8_t mac[ETH_ALEN];
+
+	if(family == AF_INET){
+		neigh = ACCESS_ONCE(thread->fib->neigh_inet[port_index]);
+		stats = &thread->neigh_stats_inet;
+	}else{
+		neigh = ACCESS_ONCE(thread->fib->neigh_inet6[port_index]);
+		stats = &thread->neigh_stats_inet6;
+	}
+
+	neigh_entry = neigh_lookup(neigh, stats, req->sender);
+	if(!neigh_entry
+	|| neigh_load(neigh, neigh_entry, req->sender, mac) < 0)
+		return 0;
+
+	return !memcmp(mac, req->sender_mac, ETH_ALEN);
+}
+
+/*
+ * Blackholes drop silently. Unreachable and prohibited destinations
+ * go to the kernel, which has the same route and answers with ICMP,
+ * up to FORWARD_REJECT_RATE per second, and are dropped past that.
+ */
+static int forward_reject(struct ixmapfwd_thread *thread,
+	unsigned int port_index, struct ixmap_packet *packet,
+	enum fib_type type)
+{
+	switch(type){
+	case FIB_TYPE_UNREACHABLE:
+		thread->drop_unreachable++;
+		break;
+	case FIB_TYPE_PROHIBIT:
+		thread->drop_prohibit++;
+		break;
+	default:
+		thread->drop_blackhole++;
+		goto packet_drop;
+		break;
+	}
+
+	if(!thread->reject_tokens)
+		goto packet_drop;
+
+	thread->reject_tokens--;
+	thread->reject_answered++;
+	return forward_local_process(thread, port_index, packet);
+
+packet_drop:
+	return -1;
+}
+
 static int forward_ip_process(struct ixmapfwd_thread *thread,
-	unsigned int port_index, struct ixmap_packet *packet)
+	unsigned int port_index, struct ixmap_packet *packet,
+	struct fib_entry *fib_entry, struct neigh_entry *neigh_entry,
+	uint32_t *flow_key, uint32_t flow_hash)
 {
 	struct ethhdr		*eth;
 	struct iphdr		*ip;
-	struct fib_entry	*fib_entry;
-	struct neigh_entry	*neigh_entry;
-	uint8_t			*dst_mac, *src_mac;
+	struct nexthop		*nexthop;
+	struct adj		*adj;
+	uint8_t			rewrite[ADJ_REWRITE_LEN], *gateway;
 	uint32_t		check;
-	int			fd, ret;
+	enum fib_type		type;
+	int			fd, ret, port_out;
 
 	eth = (struct ethhdr *)packet->slot_buf;
 	ip = (struct iphdr *)(packet->slot_buf + sizeof(struct ethhdr));
 
-	fib_entry = fib_lookup(thread->fib_inet, &ip->daddr);
 	if(!fib_entry)
 		goto packet_drop;
 
-	if(unlikely(fib_entry->port_index < 0))
-		goto packet_local;
+	if(thread->stats)
+		stats_count(thread->stats, fib_entry->stats_id,
+			packet->slot_size);
+
+	type = fib_entry->type;
+	port_out = fib_entry->port_index;
+	gateway = fib_entry->nexthop;
+	adj = fib_entry->adj;
+
+	if(fib_entry->group){
+		nexthop = nexthop_select(fib_entry->group,
+			forward_hash(packet, &ip->saddr, &ip->daddr, 4,
+			ip->protocol, ip->frag_off & htons(IP_MF | IP_OFFMASK) ?
+			NULL : (uint8_t *)ip + (ip->ihl << 2)));
+		if(!nexthop)
+			goto packet_local;
+
+		type = nexthop->flags & NEXTHOP_F_GATEWAY ?
+			FIB_TYPE_FORWARD : FIB_TYPE_LINK;
+		port_out = nexthop->port_index;
+		gateway = nexthop->addr;
+		adj = nexthop->adj;
+	}
+
+	if(unlikely(type >= FIB_TYPE_BLACKHOLE))
+		return forward_reject(thread, port_index, packet, type);
 
-	switch(fib_entry->type){
-	case FIB_TYPE_LOCAL:
+	if(unlikely(port_out < 0))
 		goto packet_local;
-		break;
-	case FIB_TYPE_LINK:
-		neigh_entry = neigh_lookup(
-			thread->neigh_inet[fib_entry->port_index],
-			&ip->daddr);
-		break;
-	case FIB_TYPE_FORWARD:
-		neigh_entry = neigh_lookup(
-			thread->neigh_inet[fib_entry->port_index],
-			fib_entry->nexthop);
-		break;
-	default:
-		neigh_entry = NULL;
-		break;
-	}
 
-	if(!neigh_entry)
+	if(type == FIB_TYPE_LOCAL)
 		goto packet_local;
 
+	ret = forward_resolve(thread,
+		ACCESS_ONCE(thread->fib->neigh_inet[port_out]),
+		&thread->neigh_stats_inet, port_out, type, adj, neigh_entry,
+		&ip->daddr, gateway, rewrite);
+	if(ret < 0)
+		return forward_pending(thread, port_index, packet, AF_INET,
+			port_out, type == FIB_TYPE_LINK ?
+			(void *)&ip->daddr : gateway);
+
+	/* by destination alone, a group would pin all its flows to one path */
+	if(flow_key && (!fib_entry->group || thread->flow->tuple))
+		flow_cache_insert(thread->flow, flow_key, flow_hash,
+			port_out, rewrite, fib_entry->stats_id);
+
 	if(unlikely(ip->ttl == 1))
 		goto packet_local;
 
@@ -187,12 +635,9 @@ static int forward_ip_process(struct ixmapfwd_thread *thread,
 	check += htons(0x0100);
 	ip->check = check + ((check >= 0xFFFF) ? 1 : 0);
 
-	dst_mac = neigh_entry->dst_mac;
-	src_mac = ixmap_macaddr(thread->plane, fib_entry->port_index);
-	memcpy(eth->h_dest, dst_mac, ETH_ALEN);
-	memcpy(eth->h_source, src_mac, ETH_ALEN);
+	memcpy(eth, rewrite, ADJ_REWRITE_LEN);
 
-	ret = fib_entry->port_index;
+	ret = port_out;
 	return ret;
 
 packet_local:
@@ -203,14 +648,17 @@ packet_drop:
 }
 
 static int forward_ip6_process(struct ixmapfwd_thread *thread,
-	unsigned int port_index, struct ixmap_packet *packet)
+	unsigned int port_index, struct ixmap_packet *packet,
+	struct fib_entry *fib_entry, struct neigh_entry *neigh_entry,
+	uint32_t *flow_key, uint32_t flow_hash)
 {
 	struct ethhdr		*eth;
 	struct ip6_hdr		*ip6;
-	struct fib_entry	*fib_entry;
-	struct neigh_entry	*neigh_entry;
-	uint8_t			*dst_mac, *src_mac;
-	int			fd, ret;
+	struct nexthop		*nexthop;
+	struct adj		*adj;
+	uint8_t			rewrite[ADJ_REWRITE_LEN], *gateway;
+	enum fib_type		type;
+	int			fd, ret, port_out;
 
 	eth = (struct ethhdr *)packet->slot_buf;
 	ip6 = (struct ip6_hdr *)(packet->slot_buf + sizeof(struct ethhdr));
@@ -218,52 +666,336 @@ static int forward_ip6_process(struct ixmapfwd_thread *thread,
 	if(unlikely(IN6_IS_ADDR_LINKLOCAL(&ip6->ip6_dst)))
 		goto packet_local;
 
-	fib_entry = fib_lookup(thread->fib_inet6, (uint32_t *)&ip6->ip6_dst);
 	if(!fib_entry)
 		goto packet_drop;
 
-	if(unlikely(fib_entry->port_index < 0))
+	if(thread->stats)
+		stats_count(thread->stats, fib_entry->stats_id,
+			packet->slot_size);
+
+	type = fib_entry->type;
+	port_out = fib_entry->port_index;
+	gateway = fib_entry->nexthop;
+	adj = fib_entry->adj;
+
+	/* extension headers are not walked, their flows hash by address */
+	if(fib_entry->group){
+		nexthop = nexthop_select(fib_entry->group,
+			forward_hash(packet, &ip6->ip6_src, &ip6->ip6_dst, 16,
+			ip6->ip6_nxt, (uint8_t *)ip6 + sizeof(struct ip6_hdr)));
+		if(!nexthop)
+			goto packet_local;
+
+		type = nexthop->flags & NEXTHOP_F_GATEWAY ?
+			FIB_TYPE_FORWARD : FIB_TYPE_LINK;
+		port_out = nexthop->port_index;
+		gateway = nexthop->addr;
+		adj = nexthop->adj;
+	}
+
+	if(unlikely(type >= FIB_TYPE_BLACKHOLE))
+		return forward_reject(thread, port_index, packet, type);
+
+	if(unlikely(port_out < 0))
+		goto packet_local;
+
+	if(type == FIB_TYPE_LOCAL)
 		goto packet_local;
 
-	switch(fib_entry->type){
-	case FIB_TYPE_LOCAL:
+	ret = forward_resolve(thread,
+		ACCESS_ONCE(thread->fib->neigh_inet6[port_out]),
+		&thread->neigh_stats_inet6, port_out, type, adj, neigh_entry,
+		&ip6->ip6_dst, gateway, rewrite);
+	if(ret < 0)
+		return forward_pending(thread, port_index, packet, AF_INET6,
+			port_out, type == FIB_TYPE_LINK ?
+			(void *)&ip6->ip6_dst : gateway);
+
+	/* by destination alone, a group would pin all its flows to one path */
+	if(flow_key && (!fib_entry->group || thread->flow->tuple))
+		flow_cache_insert(thread->flow, flow_key, flow_hash,
+			port_out, rewrite, fib_entry->stats_id);
+
+	if(unlikely(ip6->ip6_hlim == 1))
 		goto packet_local;
+
+	ip6->ip6_hlim--;
+
+	memcpy(eth, rewrite, ADJ_REWRITE_LEN);
+
+	ret = port_out;
+	return ret;
+
+packet_local:
+	fd = thread->tun_plane->ports[port_index].fd;
+	write(fd, packet->slot_buf, packet->slot_size);
+packet_drop:
+	return -1;
+}
+
+/* The rewrite of a cached flow, only the hop limit left to check */
+static int forward_flow_process(struct ixmapfwd_thread *thread,
+	unsigned int port_index, struct ixmap_packet *packet, uint16_t proto,
+	int port_out, uint8_t *rewrite)
+{
+	struct iphdr		*ip;
+	struct ip6_hdr		*ip6;
+	uint32_t		check;
+	int			fd;
+
+	switch(proto){
+	case ETH_P_IP:
+		ip = (struct iphdr *)(packet->slot_buf
+			+ sizeof(struct ethhdr));
+		if(unlikely(ip->ttl == 1))
+			goto packet_local;
+
+		ip->ttl--;
+
+		check = ip->check;
+		check += htons(0x0100);
+		ip->check = check + ((check >= 0xFFFF) ? 1 : 0);
 		break;
-	case FIB_TYPE_LINK:
-		neigh_entry = neigh_lookup(
-			thread->neigh_inet6[fib_entry->port_index],
-			&ip6->ip6_dst);
+	case ETH_P_IPV6:
+		ip6 = (struct ip6_hdr *)(packet->slot_buf
+			+ sizeof(struct ethhdr));
+		if(unlikely(ip6->ip6_hlim == 1))
+			goto packet_local;
+
+		ip6->ip6_hlim--;
+		break;
+	default:
+		goto packet_local;
 		break;
+	}
+
+	memcpy(packet->slot_buf, rewrite, ADJ_REWRITE_LEN);
+	return port_out;
+
+packet_local:
+	fd = thread->tun_plane->ports[port_index].fd;
+	write(fd, packet->slot_buf, packet->slot_size);
+	return -1;
+}
+
+/*
+ * Flow key of an IP packet: its destination and the ingress port,
+ * which gives the VRF, with the source, protocol and ports if the
+ * cache is keyed by 5-tuple. Fragments key without ports.
+ */
+static uint32_t forward_flow_key(struct flow_cache *cache,
+	unsigned int port_index, struct ixmap_packet *packet, uint16_t proto,
+	uint32_t *key)
+{
+	struct iphdr		*ip;
+	struct ip6_hdr		*ip6;
+	uint8_t			*l4, l4_proto;
+	int			family;
+
+	memset(key, 0, sizeof(uint32_t) * FLOW_KEY_WORDS);
+
+	if(proto == ETH_P_IP){
+		ip = (struct iphdr *)(packet->slot_buf
+			+ sizeof(struct ethhdr));
+		family = AF_INET;
+		memcpy(&key[0], &ip->daddr, 4);
+		memcpy(&key[4], &ip->saddr, 4);
+		l4_proto = ip->protocol;
+		l4 = ip->frag_off & htons(IP_MF | IP_OFFMASK) ?
+			NULL : (uint8_t *)ip + (ip->ihl << 2);
+	}else{
+		ip6 = (struct ip6_hdr *)(packet->slot_buf
+			+ sizeof(struct ethhdr));
+		family = AF_INET6;
+		memcpy(&key[0], &ip6->ip6_dst, 16);
+		memcpy(&key[4], &ip6->ip6_src, 16);
+		l4_proto = ip6->ip6_nxt;
+		l4 = (uint8_t *)ip6 + sizeof(struct ip6_hdr);
+	}
+
+	if(!cache->tuple){
+		memset(&key[4], 0, sizeof(uint32_t) * 4);
+		l4_proto = 0;
+		l4 = NULL;
+	}
+
+	if(l4 && (l4_proto == IPPROTO_TCP || l4_proto == IPPROTO_UDP))
+		memcpy(&key[8], l4, 4);
+
+	key[9] = (l4_proto << 24) | (family << 16) | (port_index & 0xffff);
+	return flow_hash(key);
+}
+
+/*
+ * Destination and source MAC to put in front of the packet.
+ * Gateways take them from their adjacency, connected hosts from
+ * the neighbor table of the node, unless forward_neigh_bulk()
+ * already found neigh_entry. The MAC is copied under the entry seq,
+ * an entry deleted meanwhile counts as not found. Either is marked
+ * used for netlink_confirm().
+ */
+static int forward_resolve(struct ixmapfwd_thread *thread,
+	struct neigh_table *neigh, struct neigh_stats *stats, int port_out,
+	enum fib_type type, struct adj *adj, struct neigh_entry *neigh_entry,
+	void *dst, void *gateway, uint8_t *rewrite)
+{
+	void *key;
+
+	switch(type){
 	case FIB_TYPE_FORWARD:
-		neigh_entry = neigh_lookup(
-			thread->neigh_inet6[fib_entry->port_index],
-			fib_entry->nexthop);
+		if(likely(adj)){
+			adj_use(adj);
+			return adj_load(adj, rewrite);
+		}
+
+		key = gateway;
+		break;
+	case FIB_TYPE_LINK:
+		key = dst;
 		break;
 	default:
-		neigh_entry = NULL;
+		goto err_no_neigh;
 		break;
 	}
 
 	if(!neigh_entry)
-		goto packet_local;
+		neigh_entry = neigh_lookup(neigh, stats, key);
 
-	if(unlikely(ip6->ip6_hlim == 1))
-		goto packet_local;
+	if(!neigh_entry || neigh_load(neigh, neigh_entry, key, rewrite) < 0)
+		goto err_no_neigh;
 
-	ip6->ip6_hlim--;
+	neigh_use(neigh_entry);
+	memcpy(rewrite + ETH_ALEN, ixmap_macaddr(thread->plane, port_out),
+		ETH_ALEN);
+	return 0;
 
-	dst_mac = neigh_entry->dst_mac;
-	src_mac = ixmap_macaddr(thread->plane, fib_entry->port_index);
-	memcpy(eth->h_dest, dst_mac, ETH_ALEN);
-	memcpy(eth->h_source, src_mac, ETH_ALEN);
+err_no_neigh:
+	return -1;
+}
 
-	ret = fib_entry->port_index;
-	return ret;
+/*
+ * A packet whose next hop has no neighbor yet. The first one goes to
+ * the kernel to resolve it, those after it wait in thread->pending
+ * for forward_pending_flush(). Past PENDING_HOPS next hops the kernel
+ * takes them all as before.
+ */
+static int forward_pending(struct ixmapfwd_thread *thread,
+	unsigned int port_index, struct ixmap_packet *packet, int family,
+	int port_out, void *addr)
+{
+	struct pending_table *pending;
+	struct pending_hop *hop;
+
+	pending = thread->pending;
+
+	hop = pending_lookup(pending, family, port_out, addr);
+	if(!hop){
+		hop = pending_add(pending, family, port_out, addr,
+			netlink_now());
+		if(hop)
+			pending->punted++;
+		goto packet_local;
+	}
+
+	if(hop->num == PENDING_DEPTH)
+		goto err_hop_full;
+
+	hop->ports_in[hop->num] = port_index;
+	hop->packets[hop->num++] = *packet;
+	pending->held++;
+	return FORWARD_HELD;
 
 packet_local:
-	fd = thread->tun_plane->ports[port_index].fd;
-	write(fd, packet->slot_buf, packet->slot_size);
-packet_drop:
+	return forward_local_process(thread, port_index, packet);
+
+err_hop_full:
+	pending->drop_full++;
 	return -1;
 }
 
+/*
+ * The neighbor at addr was resolved to mac, or failed if mac is NULL.
+ * Packets held for it are sent, or dropped, at once.
+ */
+void forward_pending_flush(struct ixmapfwd_thread *thread, int family,
+	int port_out, void *addr, uint8_t *mac)
+{
+	struct pending_table *pending;
+	struct pending_hop *hop;
+	uint8_t rewrite[ADJ_REWRITE_LEN];
+	unsigned int i;
+	int ret;
+
+	pending = thread->pending;
+
+	hop = pending_lookup(pending, family, port_out, addr);
+	if(!hop)
+		return;
+
+	if(!mac){
+		pending->drop_failed += hop->num;
+		pending_drop(pending, hop, thread->buf);
+		return;
+	}
+
+	memcpy(rewrite, mac, ETH_ALEN);
+	memcpy(rewrite + ETH_ALEN, ixmap_macaddr(thread->plane, port_out),
+		ETH_ALEN);
+
+	for(i = 0; i < hop->num; i++){
+		ret = forward_flow_process(thread, hop->ports_in[i],
+			&hop->packets[i], family == AF_INET ?
+			ETH_P_IP : ETH_P_IPV6, port_out, rewrite);
+		if(ret >= 0){
+			ixmap_tx_assign(thread->plane, ret, thread->buf,
+				&hop->packets[i]);
+			pending->flushed++;
+		}
+
+		ixmap_slot_release(thread->buf, hop->packets[i].slot_index);
+	}
+
+	ixmap_tx_xmit(thread->plane, port_out);
+	pending_remove(pending, hop);
+	return;
+}
+
+/*
+ * Flow hash for ECMP: the one RSS computed over the 5-tuple,
+ * or the same tuple hashed here when the NIC gave none.
+ */
+static uint32_t forward_hash(struct ixmap_packet *packet,
+	void *src, void *dst, unsigned int addr_len, uint8_t proto,
+	void *l4)
+{
+	uint64_t hash;
+	uint32_t word;
+	unsigned int i;
+
+	if(likely(packet->rss_hash))
+		return packet->rss_hash;
+
+	hash = proto;
+	for(i = 0; i < addr_len; i += 4){
+		memcpy(&word, src + i, 4);
+		hash = (hash ^ word) * GOLDEN_RATIO_64;
+		memcpy(&word, dst + i, 4);
+		hash = (hash ^ word) * GOLDEN_RATIO_64;
+	}
+
+	/* source and destination ports lead both, unless fragmented */
+	if(!l4)
+		return hash >> 32;
+
+	switch(proto){
+	case IPPROTO_TCP:
+	case IPPROTO_UDP:
+		memcpy(&word, l4, 4);
+		hash = (hash ^ word) * GOLDEN_RATIO_64;
+		break;
+	default:
+		break;
+	}
+
+	return hash >> 32;
+}
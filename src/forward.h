@@ -3,9 +3,20 @@
 
 #include "thread.h"
 
+/* packets handed to fib_lookup_bulk() at once */
+#define FORWARD_BULK	32
+
+/* unreachable and prohibited packets handed to the kernel per second */
+#define FORWARD_REJECT_RATE	100
+
+/* returned for a packet whose slot waits in thread->pending */
+#define FORWARD_HELD	-2
+
 void forward_process(struct ixmapfwd_thread *thread, unsigned int port_index,
 	struct ixmap_packet *packet, int num_packet);
 void forward_process_tun(struct ixmapfwd_thread *thread, unsigned int port_index,
 	uint8_t *read_buf, unsigned int read_size);
+void forward_pending_flush(struct ixmapfwd_thread *thread, int family,
+	int port_out, void *addr, uint8_t *mac);
 
 #endif /* _IXMAPFWD_FORWARD_H */
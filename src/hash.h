@@ -7,6 +7,12 @@
 #define HASH_BIT 16
 #define HASH_SIZE (1 << HASH_BIT)
 
+#define GOLDEN_RATIO_PRIME_32 0x9e370001UL
+#define GOLDEN_RATIO_PRIME_64 0x9e37fffffffc0001UL
+
+/* dense multiplier for keys whose low bits are mostly zero, like prefixes */
+#define GOLDEN_RATIO_64 0x61c8864680b583ebULL
+
 #define hash_entry(ptr, type, member)	\
 	container_of(ptr, type, member)
 
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <ixmap.h>
+
+#include "main.h"
+#include "local.h"
+
+static int local_find(struct local_set *set, int family, void *addr);
+static int local_replace(struct local_table *table, struct local_set *set);
+
+struct local_table *local_table_alloc(struct ixmap_desc *desc,
+	struct qsbr *qsbr)
+{
+	struct local_table *table;
+
+	table = ixmap_mem_alloc(desc, sizeof(struct local_table));
+	if(!table)
+		goto err_table_alloc;
+
+	table->set = ixmap_mem_alloc(desc, sizeof(struct local_set));
+	if(!table->set)
+		goto err_set_alloc;
+
+	memset(table->set, 0, sizeof(struct local_set));
+	table->qsbr = qsbr;
+	return table;
+
+err_set_alloc:
+	ixmap_mem_free(table);
+err_table_alloc:
+	return NULL;
+}
+
+/* All threads must have stopped */
+void local_table_release(struct local_table *table)
+{
+	ixmap_mem_free(table->set);
+	ixmap_mem_free(table);
+	return;
+}
+
+static int local_find(struct local_set *set, int family, void *addr)
+{
+	unsigned int i;
+
+	if(family == AF_INET){
+		for(i = 0; i < set->num_inet; i++){
+			if(set->inet[i] == *(uint32_t *)addr)
+				return i;
+		}
+	}else{
+		for(i = 0; i < set->num_inet6; i++){
+			if(!memcmp(set->inet6[i], addr, 16))
+				return i;
+		}
+	}
+
+	return -1;
+}
+
+/* Pads the unused IPv4 lanes, then publishes set */
+static int local_replace(struct local_table *table, struct local_set *set)
+{
+	struct local_set *set_old;
+	unsigned int i;
+
+	for(i = set->num_inet; i < LOCAL_MAX; i++){
+		set->inet[i] = set->inet[0];
+	}
+
+	set_old = table->set;
+	smp_wmb();
+	ACCESS_ONCE(table->set) = set;
+	qsbr_free(table->qsbr, set_old);
+	return 0;
+}
+
+int local_add(struct local_table *table, int family, void *addr,
+	struct ixmap_desc *desc)
+{
+	struct local_set *set;
+
+	switch(family){
+	case AF_INET:
+		if(table->set->num_inet == LOCAL_MAX)
+			goto err_set_full;
+		break;
+	case AF_INET6:
+		if(table->set->num_inet6 == LOCAL_MAX)
+			goto err_set_full;
+		break;
+	default:
+		goto err_invalid_family;
+		break;
+	}
+
+	if(local_find(table->set, family, addr) >= 0)
+		return 0;
+
+	set = ixmap_mem_alloc(desc, sizeof(struct local_set));
+	if(!set)
+		goto err_set_alloc;
+
+	memcpy(set, table->set, sizeof(struct local_set));
+
+	if(family == AF_INET)
+		memcpy(&set->inet[set->num_inet++], addr, 4);
+	else
+		memcpy(set->inet6[set->num_inet6++], addr, 16);
+
+	return local_replace(table, set);
+
+err_set_alloc:
+err_invalid_family:
+err_set_full:
+	return -1;
+}
+
+int local_delete(struct local_table *table, int family, void *addr,
+	struct ixmap_desc *desc)
+{
+	struct local_set *set;
+	int index;
+
+	if(family != AF_INET && family != AF_INET6)
+		goto err_invalid_family;
+
+	index = local_find(table->set, family, addr);
+	if(index < 0)
+		goto err_not_found;
+
+	set = ixmap_mem_alloc(desc, sizeof(struct local_set));
+	if(!set)
+		goto err_set_alloc;
+
+	/* the last address takes the place of the deleted one */
+	memcpy(set, table->set, sizeof(struct local_set));
+
+	if(family == AF_INET){
+		set->inet[index] = set->inet[--set->num_inet];
+	}else{
+		memcpy(set->inet6[index], set->inet6[--set->num_inet6], 16);
+	}
+
+	return local_replace(table, set);
+
+err_set_alloc:
+err_not_found:
+err_invalid_family:
+	return -1;
+}
@@ -0,0 +1,86 @@
+#ifndef _IXMAPFWD_LOCAL_H
+#define _IXMAPFWD_LOCAL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#ifdef __x86_64__
+#include <emmintrin.h>
+#endif
+#include "qsbr.h"
+
+/*
+ * Addresses of the router itself, from the host routes of the local
+ * table, so that packets to them reach the TAP without an LPM walk.
+ * Readers take set once per burst. The writer replaces it whole on a
+ * change and retires the old one through qsbr.
+ */
+#define LOCAL_MAX		64 /* per family, more fall back on the FIB */
+
+struct local_set {
+	uint32_t		inet[LOCAL_MAX] __attribute__ ((aligned(16)));
+	uint8_t			inet6[LOCAL_MAX][16]
+				__attribute__ ((aligned(16)));
+	unsigned int		num_inet;
+	unsigned int		num_inet6;
+};
+
+struct local_table {
+	struct local_set	*set;
+	struct qsbr		*qsbr;
+};
+
+struct local_table *local_table_alloc(struct ixmap_desc *desc,
+	struct qsbr *qsbr);
+void local_table_release(struct local_table *table);
+int local_add(struct local_table *table, int family, void *addr,
+	struct ixmap_desc *desc);
+int local_delete(struct local_table *table, int family, void *addr,
+	struct ixmap_desc *desc);
+
+/*
+ * Lanes past num_inet repeat inet[0], so four addresses are compared
+ * at a time with nothing to mask.
+ */
+static inline int local_lookup(struct local_set *set, int family,
+	void *addr)
+{
+	unsigned int i;
+#ifdef __x86_64__
+	__m128i key, cmp;
+
+	if(family == AF_INET){
+		key = _mm_set1_epi32(*(uint32_t *)addr);
+		for(i = 0; i < set->num_inet; i += 4){
+			cmp = _mm_cmpeq_epi32(key,
+				_mm_load_si128((__m128i *)&set->inet[i]));
+			if(_mm_movemask_epi8(cmp))
+				return 1;
+		}
+	}else{
+		key = _mm_loadu_si128((__m128i *)addr);
+		for(i = 0; i < set->num_inet6; i++){
+			cmp = _mm_cmpeq_epi8(key,
+				_mm_load_si128((__m128i *)set->inet6[i]));
+			if(_mm_movemask_epi8(cmp) == 0xffff)
+				return 1;
+		}
+	}
+#else
+	if(family == AF_INET){
+		for(i = 0; i < set->num_inet; i++){
+			if(set->inet[i] == *(uint32_t *)addr)
+				return 1;
+		}
+	}else{
+		for(i = 0; i < set->num_inet6; i++){
+			if(!memcmp(set->inet6[i], addr, 16))
+				return 1;
+		}
+	}
+#endif
+
+	return 0;
+}
+
+#endif /* _IXMAPFWD_LOCAL_H */
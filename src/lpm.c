@@ -11,7 +11,7 @@
 static void lpm_init_node(struct lpm_node *node);
 static unsigned int lpm_index(void *prefix, unsigned int offset,
 	unsigned int range);
-static struct hlist_head *_lpm_lookup(void *dst,
+static struct lpm_entry *_lpm_lookup(void *dst,
 	struct lpm_node *parent, unsigned int offset);
 static int _lpm_add(struct lpm_table *table, void *prefix,
 	unsigned int prefix_len, unsigned int id,
@@ -22,13 +22,23 @@ static int _lpm_delete(struct lpm_table *table, void *prefix,
 	struct lpm_node *parent, unsigned int offset);
 static void _lpm_delete_all(struct lpm_table *table,
 	struct lpm_node *parent);
+static void _lpm_walk(struct lpm_node *nodes, unsigned int num,
+	void (*func)(void *, void *), void *arg);
 static int _lpm_traverse(struct lpm_table *table, void *prefix,
 	unsigned int prefix_len, struct lpm_node *parent,
 	unsigned int offset);
-static int lpm_entry_insert(struct lpm_table *table, struct hlist_head *head,
-	unsigned int id, unsigned int prefix_len, struct hlist_node *list);
-static int lpm_entry_delete(struct lpm_table *table, struct hlist_head *head,
-	unsigned int id, unsigned int prefix_len);
+static int lpm_node_add(struct lpm_table *table, struct lpm_node *nodes,
+	unsigned int index, unsigned int width, unsigned int offset,
+	unsigned int prefix_len, unsigned int id, void *ptr,
+	struct ixmap_desc *desc);
+static int lpm_node_delete(struct lpm_table *table, struct lpm_node *nodes,
+	unsigned int index, unsigned int width, unsigned int offset,
+	unsigned int prefix_len, unsigned int id);
+static struct lpm_entry *lpm_entry_find(struct lpm_table *table,
+	struct hlist_head *head, unsigned int id, unsigned int prefix_len);
+static struct lpm_entry *lpm_entry_cover(struct lpm_node *nodes,
+	unsigned int index, unsigned int width, unsigned int offset,
+	unsigned int prefix_len);
 static void lpm_entry_delete_all(struct lpm_table *table, struct hlist_head *head);
 
 void lpm_init(struct lpm_table *table)
@@ -47,6 +57,7 @@ void lpm_init(struct lpm_table *table)
 static void lpm_init_node(struct lpm_node *node)
 {
 	node->next_table = NULL;
+	node->entry = NULL;
 	INIT_HLIST_HEAD(&node->head);
 
 	return;
@@ -69,48 +80,43 @@ struct lpm_entry *lpm_lookup(struct lpm_table *table,
 {
 	unsigned int index;
 	struct lpm_node *node;
-	struct hlist_head *head;
 	struct lpm_entry *entry;
 
 	index = lpm_index(dst, 0, 16);
 	node = &table->node[index];
 
+	entry = NULL;
 	if(node->next_table){
-		head = _lpm_lookup(dst, node, 16);
-		if(!head){
-			head = &node->head;
-		}
-	}else{
-		head = &node->head;
+		entry = _lpm_lookup(dst, node, 16);
+	}
+
+	if(!entry){
+		entry = node->entry;
 	}
 
-	entry = hlist_first_entry_or_null(head, struct lpm_entry, list);
 	return entry;
 }
 
-static struct hlist_head *_lpm_lookup(void *dst,
+static struct lpm_entry *_lpm_lookup(void *dst,
 	struct lpm_node *parent, unsigned int offset)
 {
 	unsigned int index;
 	struct lpm_node *node;
-	struct hlist_head *head;
+	struct lpm_entry *entry;
 
 	index = lpm_index(dst, offset, 8);
 	node = &parent->next_table[index];
 
+	entry = NULL;
 	if(node->next_table){
-		head = _lpm_lookup(dst, node, offset + 8);
-		if(!head && !hlist_empty(&node->head)){
-			head = &node->head;
-		}
-	}else{
-		head = NULL;
-		if(!hlist_empty(&node->head)){
-			head = &node->head;
-		}
+		entry = _lpm_lookup(dst, node, offset + 8);
 	}
 
-	return head;
+	if(!entry){
+		entry = node->entry;
+	}
+
+	return entry;
 }
 
 int lpm_add(struct lpm_table *table, void *prefix,
@@ -119,9 +125,7 @@ int lpm_add(struct lpm_table *table, void *prefix,
 {
 	unsigned int index;
 	struct lpm_node *node;
-	struct lpm_entry *entry;
-	unsigned int range, mask;
-	int i, ret, entry_allocated = 0;
+	int ret;
 
 	index = lpm_index(prefix, 0, 16);
 
@@ -129,41 +133,16 @@ int lpm_add(struct lpm_table *table, void *prefix,
 		node = &table->node[index];
 		ret = _lpm_add(table, prefix, prefix_len, id,
 			ptr, desc, node, 16);
-		if(ret < 0)
-			goto err_lpm_add;
 	}else{
-		range = 1 << (16 - prefix_len);
-		mask = ~(range - 1);
-		index &= mask;
-
-		for(i = 0; i < range; i++, entry_allocated++){
-			node = &table->node[index | i];
-
-			entry = ixmap_mem_alloc(desc, sizeof(struct lpm_entry));
-			if(!entry)
-				goto err_lpm_add_self;
-
-			entry->ptr = ptr;
-
-			ret = lpm_entry_insert(table, &node->head, id,
-				prefix_len, &entry->list);
-			if(ret < 0)
-				goto err_entry_insert;
-
-			continue;
-err_entry_insert:
-			ixmap_mem_free(entry);
-			goto err_lpm_add_self;
-		}
+		ret = lpm_node_add(table, table->node, index, 16, 0,
+			prefix_len, id, ptr, desc);
 	}
 
+	if(ret < 0)
+		goto err_lpm_add;
+
 	return 0;
 
-err_lpm_add_self:
-	for(i = 0; i < entry_allocated; i++){
-		node = &table->node[index | i];
-		lpm_entry_delete(table, &node->head, id, prefix_len);
-	}
 err_lpm_add:
 	return -1;
 }
@@ -174,10 +153,8 @@ static int _lpm_add(struct lpm_table *table, void *prefix,
 	struct lpm_node *parent, unsigned int offset)
 {
 	struct lpm_node *node;
-	struct lpm_entry *entry;
 	unsigned int index;
-	unsigned int range, mask;
-	int i, ret, entry_allocated = 0;
+	int i, ret;
 
 	if(!parent->next_table){
 		parent->next_table = ixmap_mem_alloc(desc,
@@ -197,41 +174,16 @@ static int _lpm_add(struct lpm_table *table, void *prefix,
 		node = &parent->next_table[index];
 		ret = _lpm_add(table, prefix, prefix_len, id,
 			ptr, desc, node, offset + 8);
-		if(ret < 0)
-			goto err_lpm_add;
 	}else{
-		range = 1 << (8 - (prefix_len - offset));
-		mask = ~(range - 1);
-		index &= mask;
-
-		for(i = 0; i < range; i++){
-			node = &parent->next_table[index | i];
-
-			entry = ixmap_mem_alloc(desc, sizeof(struct lpm_entry));
-			if(!entry)
-				goto err_lpm_add_self;
-
-			entry->ptr = ptr;
-
-			ret = lpm_entry_insert(table, &node->head, id,
-				prefix_len, &entry->list);
-			if(ret < 0)
-				goto err_entry_insert;
-
-			continue;
-err_entry_insert:
-			ixmap_mem_free(entry);
-			goto err_lpm_add_self;
-		}
+		ret = lpm_node_add(table, parent->next_table, index, 8, offset,
+			prefix_len, id, ptr, desc);
 	}
 
+	if(ret < 0)
+		goto err_lpm_add;
+
 	return 0;
 
-err_lpm_add_self:
-	for(i = 0; i < entry_allocated; i++){
-		node = &parent->next_table[index | i];
-		lpm_entry_delete(table, &node->head, id, prefix_len);
-	}
 err_lpm_add:
 	for(i = 0; i < TABLE_SIZE_8; i++){
 		node = &parent->next_table[i];
@@ -245,34 +197,78 @@ err_table_alloc:
         return -1;
 }
 
+/*
+ * The route of prefix with id, or else the newest, takes ptr. Nodes
+ * point to the lpm_entry, so none of them has to be visited.
+ */
+int lpm_replace(struct lpm_table *table, void *prefix,
+	unsigned int prefix_len, unsigned int id, void *ptr)
+{
+	struct lpm_node *nodes, *node;
+	struct lpm_entry *entry, *target;
+	unsigned int index, width, offset, range;
+
+	nodes = table->node;
+	width = 16;
+	offset = 0;
+	index = lpm_index(prefix, 0, 16);
+
+	while(prefix_len > offset + width){
+		nodes = nodes[index].next_table;
+		if(!nodes)
+			goto err_not_found;
+
+		offset += width;
+		width = 8;
+		index = lpm_index(prefix, offset, 8);
+	}
+
+	range = 1 << (width - (prefix_len - offset));
+	node = &nodes[index & ~(range - 1)];
+
+	target = lpm_entry_find(table, &node->head, id, prefix_len);
+	if(!target){
+		hlist_for_each_entry(entry, &node->head, list){
+			if(entry->prefix_len == prefix_len){
+				target = entry;
+				break;
+			}
+		}
+	}
+
+	if(!target)
+		goto err_not_found;
+
+	table->entry_pull(ptr);
+	table->entry_put(target->ptr);
+	target->ptr = ptr;
+
+	return 0;
+
+err_not_found:
+	return -1;
+}
+
 int lpm_delete(struct lpm_table *table, void *prefix,
 	unsigned int prefix_len, unsigned int id)
 {
 	unsigned int index;
 	struct lpm_node *node;
-	unsigned int range, mask;
-	int i, ret;
+	int ret;
 
 	index = lpm_index(prefix, 0, 16);
 
 	if(prefix_len > 16){
 		node = &table->node[index];
 		ret = _lpm_delete(table, prefix, prefix_len, id, node, 16);
-		if(ret < 0)
-			goto err_delete;
 	}else{
-		range = 1 << (16 - prefix_len);
-		mask = ~(range - 1);
-		index &= mask;
-
-		for(i = 0; i < range; i++){
-			node = &table->node[index | i];
-			ret = lpm_entry_delete(table, &node->head, id, prefix_len);
-			if(ret < 0)
-				goto err_delete;
-		}
+		ret = lpm_node_delete(table, table->node, index, 16, 0,
+			prefix_len, id);
 	}
 
+	if(ret < 0)
+		goto err_delete;
+
 	return 0;
 
 err_delete:
@@ -285,7 +281,6 @@ static int _lpm_delete(struct lpm_table *table, void *prefix,
 {
 	struct lpm_node *node;
 	unsigned int index;
-	unsigned int range, mask;
 	int i, ret;
 
 	if(!parent->next_table)
@@ -296,21 +291,14 @@ static int _lpm_delete(struct lpm_table *table, void *prefix,
 	if(prefix_len - offset > 8){
 		node = &parent->next_table[index];
 		ret = _lpm_delete(table, prefix, prefix_len, id, node, offset + 8);
-		if(ret < 0)
-			goto err_delete;
 	}else{
-		range = 1 << (8 - (prefix_len - offset));
-		mask = ~(range - 1);
-		index &= mask;
-
-		for(i = 0; i < range; i++){
-			node = &parent->next_table[index | i];
-			ret = lpm_entry_delete(table, &node->head, id, prefix_len);
-			if(ret < 0)
-				goto err_delete;
-		}
+		ret = lpm_node_delete(table, parent->next_table, index, 8, offset,
+			prefix_len, id);
 	}
 
+	if(ret < 0)
+		goto err_delete;
+
 	for(i = 0; i < TABLE_SIZE_8; i++){
 		node = &parent->next_table[i];
 		if(node->next_table || !hlist_empty(&node->head)){
@@ -338,6 +326,7 @@ void lpm_delete_all(struct lpm_table *table)
 		if(!hlist_empty(&node->head)){
 			lpm_entry_delete_all(table, &node->head);
 		}
+		node->entry = NULL;
 	}
 
 	return;
@@ -367,6 +356,38 @@ out:
 	return;
 }
 
+/*
+ * Calls func on the ptr of every route. Routes sharing a prefix
+ * come one after another, newest first.
+ */
+void lpm_walk(struct lpm_table *table,
+	void (*func)(void *, void *), void *arg)
+{
+	_lpm_walk(table->node, TABLE_SIZE_16, func, arg);
+	return;
+}
+
+static void _lpm_walk(struct lpm_node *nodes, unsigned int num,
+	void (*func)(void *, void *), void *arg)
+{
+	struct lpm_node *node;
+	struct lpm_entry *entry;
+	int i;
+
+	for(i = 0; i < num; i++){
+		node = &nodes[i];
+		if(node->next_table){
+			_lpm_walk(node->next_table, TABLE_SIZE_8, func, arg);
+		}
+
+		hlist_for_each_entry(entry, &node->head, list){
+			func(entry->ptr, arg);
+		}
+	}
+
+	return;
+}
+
 int lpm_traverse(struct lpm_table *table, void *prefix,
 	unsigned int prefix_len)
 {
@@ -432,54 +453,134 @@ err_traverse:
 	return -1;
 }
 
-static int lpm_entry_insert(struct lpm_table *table, struct hlist_head *head,
-	unsigned int id, unsigned int prefix_len, struct hlist_node *list)
+/*
+ * Installs a route ending at this level. The route only overwrites
+ * the nodes of its range not held by a more specific one, so the
+ * cost is bounded by the range: at most 2^16 pointer stores at the
+ * first level and 2^8 below it, with a single allocation.
+ */
+static int lpm_node_add(struct lpm_table *table, struct lpm_node *nodes,
+	unsigned int index, unsigned int width, unsigned int offset,
+	unsigned int prefix_len, unsigned int id, void *ptr,
+	struct ixmap_desc *desc)
 {
-	struct lpm_entry *entry_lpm;
-	struct hlist_node *prior;
+	struct lpm_node *node;
+	struct lpm_entry *entry;
+	unsigned int range;
+	int i;
 
-	prior = NULL;
+	range = 1 << (width - (prefix_len - offset));
+	index &= ~(range - 1);
+	node = &nodes[index];
 
-	hlist_for_each_entry(entry_lpm, head, list){
-		if(!table->entry_identify(entry_lpm->ptr, id, prefix_len)){
-			goto err_entry_exist;
-		}
+	entry = lpm_entry_find(table, &node->head, id, prefix_len);
+	if(entry)
+		goto err_entry_exist;
+
+	entry = ixmap_mem_alloc(desc, sizeof(struct lpm_entry));
+	if(!entry)
+		goto err_entry_alloc;
 
-		if(table->entry_compare(entry_lpm->ptr, prefix_len)){
-			prior = &entry_lpm->list;
+	entry->ptr = ptr;
+	entry->prefix_len = prefix_len;
+
+	table->entry_pull(entry->ptr);
+	hlist_add_head(&entry->list, &node->head);
+
+	/* equal length is overwritten, the latest route takes precedence */
+	for(i = 0; i < range; i++){
+		node = &nodes[index | i];
+		if(!node->entry
+		|| node->entry->prefix_len <= prefix_len){
+			node->entry = entry;
 		}
 	}
 
-	entry_lpm = hlist_entry(list, struct lpm_entry, list);
-	table->entry_pull(entry_lpm->ptr);
-	prior ? hlist_add_behind(list, prior)
-		: hlist_add_head(list, head);
-
 	return 0;
 
+err_entry_alloc:
 err_entry_exist:
 	return -1;
 }
 
-static int lpm_entry_delete(struct lpm_table *table, struct hlist_head *head,
-	unsigned int id, unsigned int prefix_len)
+/*
+ * Nodes held by the deleted route fall back to the most specific
+ * remaining route covering the whole range, found with at most
+ * one anchor list walk per shorter length of this level.
+ */
+static int lpm_node_delete(struct lpm_table *table, struct lpm_node *nodes,
+	unsigned int index, unsigned int width, unsigned int offset,
+	unsigned int prefix_len, unsigned int id)
 {
-	struct lpm_entry *entry_lpm;
-	struct hlist_node *list_n;
+	struct lpm_node *node;
+	struct lpm_entry *entry, *cover;
+	unsigned int range;
+	int i;
 
-	hlist_for_each_entry_safe(entry_lpm, list_n, head, list){
-		if(!table->entry_identify(entry_lpm->ptr, id, prefix_len)){
-			hlist_del(&entry_lpm->list);
-			table->entry_put(entry_lpm->ptr);
-			ixmap_mem_free(entry_lpm);
+	range = 1 << (width - (prefix_len - offset));
+	index &= ~(range - 1);
+	node = &nodes[index];
 
-			return 0;
+	entry = lpm_entry_find(table, &node->head, id, prefix_len);
+	if(!entry)
+		goto err_entry_find;
+
+	hlist_del(&entry->list);
+	cover = lpm_entry_cover(nodes, index, width, offset, prefix_len);
+
+	for(i = 0; i < range; i++){
+		node = &nodes[index | i];
+		if(node->entry == entry){
+			node->entry = cover;
 		}
 	}
 
+	table->entry_put(entry->ptr);
+	ixmap_mem_free(entry);
+
+	return 0;
+
+err_entry_find:
 	return -1;
 }
 
+static struct lpm_entry *lpm_entry_find(struct lpm_table *table,
+	struct hlist_head *head, unsigned int id, unsigned int prefix_len)
+{
+	struct lpm_entry *entry;
+
+	hlist_for_each_entry(entry, head, list){
+		if(!table->entry_identify(entry->ptr, id, prefix_len)){
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+static struct lpm_entry *lpm_entry_cover(struct lpm_node *nodes,
+	unsigned int index, unsigned int width, unsigned int offset,
+	unsigned int prefix_len)
+{
+	struct lpm_node *node;
+	struct lpm_entry *entry;
+	int len, len_min;
+
+	/* the first level also holds the default route */
+	len_min = offset ? offset + 1 : 0;
+
+	for(len = prefix_len; len >= len_min; len--){
+		node = &nodes[index & ~((1 << (width - (len - offset))) - 1)];
+		hlist_for_each_entry(entry, &node->head, list){
+			if(entry->prefix_len == len){
+				return entry;
+			}
+		}
+	}
+
+	return NULL;
+}
+
 static void lpm_entry_delete_all(struct lpm_table *table, struct hlist_head *head)
 {
 	struct lpm_entry *entry_lpm;
@@ -6,13 +6,21 @@
 #define TABLE_SIZE_16 (1 << 16)
 #define TABLE_SIZE_8 (1 << 8)
 
+/*
+ * A route is held by one lpm_entry, anchored to the first node
+ * of the range it covers at its level. Every node of that range
+ * points to the most specific entry covering it, so a route
+ * costs one pointer store per node instead of a heap object.
+ */
 struct lpm_entry {
 	struct hlist_node	list;
 	void			*ptr;
+	unsigned int		prefix_len;
 };
 
 struct lpm_node {
 	struct hlist_head	head;
+	struct lpm_entry	*entry;
 	struct lpm_node		*next_table;
 };
 
@@ -26,10 +34,6 @@ struct lpm_table {
 				unsigned int,
 				unsigned int
 				);
-	int			(*entry_compare)(
-				void *,
-				unsigned int
-				);
 	void	 		(*entry_pull)(
 				void *
 				);
@@ -44,9 +48,13 @@ struct lpm_entry *lpm_lookup(struct lpm_table *table,
 int lpm_add(struct lpm_table *table, void *prefix,
 	unsigned int prefix_len, unsigned int id,
 	void *ptr, struct ixmap_desc *desc);
+int lpm_replace(struct lpm_table *table, void *prefix,
+	unsigned int prefix_len, unsigned int id, void *ptr);
 int lpm_delete(struct lpm_table *table, void *prefix,
 	unsigned int prefix_len, unsigned int id);
 void lpm_delete_all(struct lpm_table *table);
+void lpm_walk(struct lpm_table *table,
+	void (*func)(void *, void *), void *arg);
 int lpm_traverse(struct lpm_table *table, void *prefix,
 	unsigned int prefix_len);
 
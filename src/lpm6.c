@@ -0,0 +1,1315 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <endian.h>
+#include <stddef.h>
+
+#include "main.h"
+#include "hash.h"
+#include "lpm6.h"
+
+static inline void lpm6_load(struct lpm6_table *table, void *addr,
+	uint64_t *hi, uint64_t *lo);
+static void lpm6_key(struct lpm6_table *table, void *prefix,
+	unsigned int prefix_len, uint64_t *key);
+static unsigned int lpm6_bit(uint64_t *key, unsigned int pos);
+static unsigned int lpm6_common(uint64_t *key_a, uint64_t *key_b,
+	unsigned int len_max);
+static struct lpm6_node *lpm6_node_alloc(struct lpm6_table *table,
+	uint64_t *key, unsigned int len, struct ixmap_desc *desc);
+static struct lpm6_node *lpm6_node_lookup(struct lpm6_table *table,
+	uint64_t *key, unsigned int len);
+static struct lpm6_node *lpm6_node_insert(struct lpm6_table *table,
+	uint64_t *key, unsigned int len, struct ixmap_desc *desc);
+static void lpm6_node_remove(struct lpm6_table *table,
+	struct lpm6_node *node);
+static struct lpm6_node *lpm6_node_cover(struct lpm6_table *table,
+	uint64_t *key, unsigned int len);
+static void lpm6_node_release_all(struct lpm6_table *table,
+	struct lpm6_node *node);
+static void _lpm6_walk(struct lpm6_node *node,
+	void (*func)(void *, void *), void *arg);
+static unsigned int lpm6_hash_key(struct lpm6_hash *hash,
+	uint64_t hi, uint64_t lo, unsigned int len);
+static int lpm6_hash_alloc(struct lpm6_hash **hash, unsigned int bit,
+	struct ixmap_desc *desc);
+static void lpm6_hash_release(void *ptr, unsigned long data);
+static int lpm6_hash_grow(struct lpm6_table *table,
+	struct lpm6_hash **hash, struct ixmap_desc *desc);
+static int lpm6_hash_insert(struct lpm6_table *table,
+	struct lpm6_hash **hash, struct lpm6_node *node,
+	struct ixmap_desc *desc);
+static void lpm6_hash_remove(struct lpm6_table *table,
+	struct lpm6_hash *hash, struct lpm6_node *node,
+	struct lpm6_node *cover);
+static int lpm6_hash_rebuild(struct lpm6_table *table,
+	struct lpm6_hash **hash, struct lpm6_node *node,
+	struct ixmap_desc *desc);
+static struct lpm6_slot *lpm6_slot_probe(struct lpm6_hash *hash,
+	unsigned int index, uint64_t hi, uint64_t lo, unsigned int len);
+static struct lpm6_slot *lpm6_slot_find(struct lpm6_hash *hash,
+	uint64_t hi, uint64_t lo, unsigned int len);
+static struct lpm6_slot *lpm6_slot_get(struct lpm6_table *table,
+	struct lpm6_hash **hash, uint64_t *key, unsigned int len,
+	struct ixmap_desc *desc);
+static void lpm6_slot_remove(struct lpm6_hash *hash,
+	struct lpm6_slot *slot);
+static unsigned int lpm6_marker_path(struct lpm6_hash *hash,
+	unsigned int len, unsigned int *path);
+static int lpm6_len_present(struct lpm6_hash *hash, unsigned int len);
+static int lpm6_rebuild(struct lpm6_table *table,
+	struct ixmap_desc *desc);
+static void lpm6_subtree_raise(struct lpm6_table *table,
+	struct lpm6_node *node, struct lpm6_node *top);
+static void lpm6_subtree_lower(struct lpm6_table *table,
+	struct lpm6_node *node, struct lpm6_node *top,
+	struct lpm6_node *cover);
+static void lpm6_nexthop_release(void *ptr, unsigned long index);
+static void lpm6_entry_release(void *ptr, unsigned long data);
+static void lpm6_write_begin(struct lpm6_table *table);
+static void lpm6_write_end(struct lpm6_table *table);
+static unsigned int lpm6_read_begin(struct lpm6_table *table);
+static int lpm6_read_retry(struct lpm6_table *table, unsigned int seq);
+
+struct lpm6_pool *lpm6_pool_alloc(struct ixmap_desc *desc)
+{
+	struct lpm6_pool *pool;
+	int i;
+
+	pool = ixmap_mem_alloc(desc, sizeof(struct lpm6_pool));
+	if(!pool)
+		goto err_pool_alloc;
+
+	pool->nexthop = ixmap_mem_alloc(desc,
+		sizeof(void *) * LPM6_NEXTHOP_MAX);
+	if(!pool->nexthop)
+		goto err_nexthop_alloc;
+
+	pool->free = ixmap_mem_alloc(desc,
+		sizeof(uint32_t) * LPM6_NEXTHOP_MAX);
+	if(!pool->free)
+		goto err_free_alloc;
+
+	for(i = 0; i < LPM6_NEXTHOP_MAX; i++){
+		pool->free[i] = LPM6_NEXTHOP_MAX - 1 - i;
+	}
+	pool->free_num = LPM6_NEXTHOP_MAX;
+
+	return pool;
+
+err_free_alloc:
+	ixmap_mem_free(pool->nexthop);
+err_nexthop_alloc:
+	ixmap_mem_free(pool);
+err_pool_alloc:
+	return NULL;
+}
+
+/* The tables drawing from pool must be destroyed first */
+void lpm6_pool_release(struct lpm6_pool *pool)
+{
+	ixmap_mem_free(pool->free);
+	ixmap_mem_free(pool->nexthop);
+	ixmap_mem_free(pool);
+	return;
+}
+
+/* Without a pool the table gets one of its own */
+int lpm6_init(struct lpm6_table *table, unsigned int bits,
+	struct lpm6_pool *pool, struct ixmap_desc *desc)
+{
+	int i, ret;
+
+	if(bits != 32 && bits != LPM6_LEN_MAX)
+		goto err_invalid_bits;
+
+	ret = lpm6_hash_alloc(&table->hash, LPM6_HASH_BIT_INIT, desc);
+	if(ret < 0)
+		goto err_hash_alloc;
+
+	table->pool_private = !pool;
+	if(!pool){
+		pool = lpm6_pool_alloc(desc);
+		if(!pool)
+			goto err_pool_alloc;
+	}
+
+	table->pool = pool;
+	table->nexthop = pool->nexthop;
+	table->bits = bits;
+
+	for(i = 0; i <= LPM6_LEN_MAX; i++){
+		table->mask[i][0] = i >= 64 ? ~0ULL :
+			(i ? ~0ULL << (64 - i) : 0);
+		table->mask[i][1] = i <= 64 ? 0 :
+			~0ULL << (128 - i);
+		table->len_refcnt[i] = 0;
+	}
+
+	table->root = NULL;
+	table->seq = 0;
+	table->qsbr = NULL;
+	return 0;
+
+err_pool_alloc:
+	lpm6_hash_release(table->hash, 0);
+err_hash_alloc:
+err_invalid_bits:
+	return -1;
+}
+
+void lpm6_destroy(struct lpm6_table *table)
+{
+	lpm6_delete_all(table);
+
+	if(table->pool_private)
+		lpm6_pool_release(table->pool);
+	lpm6_hash_release(table->hash, 0);
+	return;
+}
+
+/* an IPv4 address takes the top of the key, as if ::/96 was prepended */
+static inline void lpm6_load(struct lpm6_table *table, void *addr,
+	uint64_t *hi, uint64_t *lo)
+{
+	if(table->bits == 32){
+		*hi = (uint64_t)be32toh(*(uint32_t *)addr) << 32;
+		*lo = 0;
+	}else{
+		*hi = be64toh(((uint64_t *)addr)[0]);
+		*lo = be64toh(((uint64_t *)addr)[1]);
+	}
+
+	return;
+}
+
+static void lpm6_key(struct lpm6_table *table, void *prefix,
+	unsigned int prefix_len, uint64_t *key)
+{
+	lpm6_load(table, prefix, &key[0], &key[1]);
+	key[0] &= table->mask[prefix_len][0];
+	key[1] &= table->mask[prefix_len][1];
+	return;
+}
+
+static unsigned int lpm6_bit(uint64_t *key, unsigned int pos)
+{
+	return pos < 64 ?
+		(key[0] >> (63 - pos)) & 1 : (key[1] >> (127 - pos)) & 1;
+}
+
+static unsigned int lpm6_common(uint64_t *key_a, uint64_t *key_b,
+	unsigned int len_max)
+{
+	uint64_t diff;
+	unsigned int len;
+
+	diff = key_a[0] ^ key_b[0];
+	if(diff){
+		len = __builtin_clzll(diff);
+	}else{
+		diff = key_a[1] ^ key_b[1];
+		len = diff ? 64 + __builtin_clzll(diff) : 128;
+	}
+
+	return min(len, len_max);
+}
+
+static struct lpm6_node *lpm6_node_alloc(struct lpm6_table *table,
+	uint64_t *key, unsigned int len, struct ixmap_desc *desc)
+{
+	struct lpm6_node *node;
+
+	node = ixmap_mem_alloc(desc, sizeof(struct lpm6_node));
+	if(!node)
+		goto err_node_alloc;
+
+	node->key[0]	= key[0] & table->mask[len][0];
+	node->key[1]	= key[1] & table->mask[len][1];
+	node->len	= len;
+	node->child[0]	= NULL;
+	node->child[1]	= NULL;
+	node->parent	= NULL;
+	node->index	= LPM6_BMP_NONE;
+	INIT_HLIST_HEAD(&node->head);
+
+	return node;
+
+err_node_alloc:
+	return NULL;
+}
+
+static struct lpm6_node *lpm6_node_lookup(struct lpm6_table *table,
+	uint64_t *key, unsigned int len)
+{
+	struct lpm6_node *node;
+
+	node = table->root;
+	while(node && node->len <= len){
+		if(lpm6_common(node->key, key, node->len) < node->len)
+			break;
+
+		if(node->len == len)
+			return node;
+
+		node = node->child[lpm6_bit(key, node->len)];
+	}
+
+	return NULL;
+}
+
+static struct lpm6_node *lpm6_node_insert(struct lpm6_table *table,
+	uint64_t *key, unsigned int len, struct ixmap_desc *desc)
+{
+	struct lpm6_node **link, *node, *parent, *leaf, *glue;
+	unsigned int common;
+
+	parent = NULL;
+	link = &table->root;
+
+	while((node = *link)){
+		common = lpm6_common(node->key, key, min(node->len, len));
+
+		if(common < node->len){
+			leaf = lpm6_node_alloc(table, key, len, desc);
+			if(!leaf)
+				goto err_leaf_alloc;
+
+			if(common == len){
+				/* new prefix covers the existing node */
+				leaf->child[lpm6_bit(node->key, len)] = node;
+				leaf->parent = parent;
+				node->parent = leaf;
+				*link = leaf;
+				return leaf;
+			}
+
+			glue = lpm6_node_alloc(table, key, common, desc);
+			if(!glue)
+				goto err_glue_alloc;
+
+			glue->child[lpm6_bit(key, common)] = leaf;
+			glue->child[lpm6_bit(node->key, common)] = node;
+			glue->parent = parent;
+			leaf->parent = glue;
+			node->parent = glue;
+			*link = glue;
+			return leaf;
+
+err_glue_alloc:
+			ixmap_mem_free(leaf);
+			goto err_leaf_alloc;
+		}
+
+		if(node->len == len)
+			return node;
+
+		parent = node;
+		link = &node->child[lpm6_bit(key, node->len)];
+	}
+
+	leaf = lpm6_node_alloc(table, key, len, desc);
+	if(!leaf)
+		goto err_leaf_alloc;
+
+	leaf->parent = parent;
+	*link = leaf;
+	return leaf;
+
+err_leaf_alloc:
+	return NULL;
+}
+
+/* Release nodes which no longer carry a prefix nor branch */
+static void lpm6_node_remove(struct lpm6_table *table,
+	struct lpm6_node *node)
+{
+	struct lpm6_node **link, *child, *parent;
+
+	while(node && hlist_empty(&node->head)
+	&& !(node->child[0] && node->child[1])){
+		child = node->child[0] ? node->child[0] : node->child[1];
+		parent = node->parent;
+		link = parent ? &parent->child[parent->child[1] == node]
+			: &table->root;
+
+		*link = child;
+		if(child)
+			child->parent = parent;
+
+		ixmap_mem_free(node);
+		node = parent;
+	}
+
+	return;
+}
+
+/* Find the longest prefix strictly shorter than len covering key */
+static struct lpm6_node *lpm6_node_cover(struct lpm6_table *table,
+	uint64_t *key, unsigned int len)
+{
+	struct lpm6_node *node, *cover;
+
+	cover = NULL;
+	node = table->root;
+
+	while(node && node->len < len){
+		if(lpm6_common(node->key, key, node->len) < node->len)
+			break;
+
+		if(!hlist_empty(&node->head))
+			cover = node;
+
+		if(node->len == LPM6_LEN_MAX)
+			break;
+
+		node = node->child[lpm6_bit(key, node->len)];
+	}
+
+	return cover;
+}
+
+static void lpm6_node_release_all(struct lpm6_table *table,
+	struct lpm6_node *node)
+{
+	struct lpm6_entry *entry;
+	struct hlist_node *next;
+	int i;
+
+	if(!node)
+		return;
+
+	for(i = 0; i < 2; i++){
+		lpm6_node_release_all(table, node->child[i]);
+	}
+
+	/* the pool may be shared, so slots go back one by one */
+	if(!hlist_empty(&node->head))
+		table->pool->free[table->pool->free_num++] = node->index;
+
+	hlist_for_each_entry_safe(entry, next, &node->head, list){
+		hlist_del(&entry->list);
+		table->entry_put(entry->ptr);
+		ixmap_mem_free(entry);
+	}
+
+	ixmap_mem_free(node);
+	return;
+}
+
+static unsigned int lpm6_hash_key(struct lpm6_hash *hash,
+	uint64_t hi, uint64_t lo, unsigned int len)
+{
+	uint64_t key;
+
+	key = (hi ^ (lo * GOLDEN_RATIO_64) ^ len)
+		* GOLDEN_RATIO_64;
+
+	/* High bits are more random, so use them. */
+	return key >> hash->shift;
+}
+
+static int lpm6_hash_alloc(struct lpm6_hash **hash, unsigned int bit,
+	struct ixmap_desc *desc)
+{
+	struct lpm6_hash *hash_new;
+
+	hash_new = ixmap_mem_alloc(desc, sizeof(struct lpm6_hash));
+	if(!hash_new)
+		goto err_hash_alloc;
+
+	hash_new->slot = ixmap_mem_alloc(desc,
+		sizeof(struct lpm6_slot) << bit);
+	if(!hash_new->slot)
+		goto err_slot_alloc;
+
+	memset(hash_new->slot, 0, sizeof(struct lpm6_slot) << bit);
+	hash_new->size		= 1 << bit;
+	hash_new->used		= 0;
+	hash_new->shift		= 64 - bit;
+	hash_new->lens_num	= 0;
+
+	*hash = hash_new;
+	return 0;
+
+err_slot_alloc:
+	ixmap_mem_free(hash_new);
+err_hash_alloc:
+	return -1;
+}
+
+static void lpm6_hash_release(void *ptr, unsigned long data)
+{
+	struct lpm6_hash *hash = ptr;
+
+	ixmap_mem_free(hash->slot);
+	ixmap_mem_free(hash);
+	return;
+}
+
+static int lpm6_hash_grow(struct lpm6_table *table,
+	struct lpm6_hash **hash, struct ixmap_desc *desc)
+{
+	struct lpm6_hash *hash_old, *hash_new;
+	unsigned int index;
+	int i, ret;
+
+	hash_old = *hash;
+
+	ret = lpm6_hash_alloc(&hash_new, 64 - hash_old->shift + 1, desc);
+	if(ret < 0)
+		goto err_hash_alloc;
+
+	hash_new->used		= hash_old->used;
+	hash_new->lens_num	= hash_old->lens_num;
+	memcpy(hash_new->lens, hash_old->lens, sizeof(hash_old->lens));
+
+	for(i = 0; i < hash_old->size; i++){
+		if(!hash_old->slot[i].used)
+			continue;
+
+		index = lpm6_hash_key(hash_new, hash_old->slot[i].key[0],
+			hash_old->slot[i].key[1], hash_old->slot[i].len);
+		while(hash_new->slot[index].used){
+			index = (index + 1) & (hash_new->size - 1);
+		}
+
+		hash_new->slot[index] = hash_old->slot[i];
+	}
+
+	/* the new generation is complete before lookups can load it */
+	smp_wmb();
+	*hash = hash_new;
+
+	qsbr_call(table->qsbr, lpm6_hash_release, hash_old, 0);
+	return 0;
+
+err_hash_alloc:
+	return -1;
+}
+
+static struct lpm6_slot *lpm6_slot_probe(struct lpm6_hash *hash,
+	unsigned int index, uint64_t hi, uint64_t lo, unsigned int len)
+{
+	struct lpm6_slot *slot;
+
+	while(1){
+		slot = &hash->slot[index];
+		if(!slot->used)
+			break;
+
+		if(slot->key[0] == hi
+		&& slot->key[1] == lo
+		&& slot->len == len)
+			return slot;
+
+		index = (index + 1) & (hash->size - 1);
+	}
+
+	return NULL;
+}
+
+static struct lpm6_slot *lpm6_slot_find(struct lpm6_hash *hash,
+	uint64_t hi, uint64_t lo, unsigned int len)
+{
+	return lpm6_slot_probe(hash, lpm6_hash_key(hash, hi, lo, len),
+		hi, lo, len);
+}
+
+static struct lpm6_slot *lpm6_slot_get(struct lpm6_table *table,
+	struct lpm6_hash **hash, uint64_t *key, unsigned int len,
+	struct ixmap_desc *desc)
+{
+	struct lpm6_slot *slot;
+	struct lpm6_node *cover;
+	uint64_t hi, lo;
+	unsigned int index;
+	int ret;
+
+	hi = key[0] & table->mask[len][0];
+	lo = key[1] & table->mask[len][1];
+
+	slot = lpm6_slot_find(*hash, hi, lo, len);
+	if(slot)
+		goto out;
+
+	/* keep the load factor at or below 50% */
+	if(((*hash)->used + 1) * 2 > (*hash)->size){
+		ret = lpm6_hash_grow(table, hash, desc);
+		if(ret < 0)
+			goto err_hash_grow;
+	}
+
+	index = lpm6_hash_key(*hash, hi, lo, len);
+	while((*hash)->slot[index].used){
+		index = (index + 1) & ((*hash)->size - 1);
+	}
+
+	slot = &(*hash)->slot[index];
+	cover = lpm6_node_cover(table, key, len + 1);
+
+	slot->key[0]	= hi;
+	slot->key[1]	= lo;
+	slot->len	= len;
+	slot->bmp	= cover ? cover->index : LPM6_BMP_NONE;
+	slot->bmp_len	= cover ? cover->len : 0;
+	slot->real	= 0;
+	slot->marker	= 0;
+	slot->used	= 1;
+	(*hash)->used++;
+
+out:
+	return slot;
+
+err_hash_grow:
+	return NULL;
+}
+
+static void lpm6_slot_remove(struct lpm6_hash *hash,
+	struct lpm6_slot *slot)
+{
+	unsigned int i, j, home, mask;
+
+	mask = hash->size - 1;
+	i = slot - hash->slot;
+	j = i;
+
+	/* backward shift deletion keeps probe sequences intact */
+	while(1){
+		j = (j + 1) & mask;
+		if(!hash->slot[j].used)
+			break;
+
+		home = lpm6_hash_key(hash, hash->slot[j].key[0],
+			hash->slot[j].key[1], hash->slot[j].len);
+
+		if(i <= j ? (i < home && home <= j)
+			: (i < home || home <= j))
+			continue;
+
+		hash->slot[i] = hash->slot[j];
+		i = j;
+	}
+
+	memset(&hash->slot[i], 0, sizeof(struct lpm6_slot));
+	hash->used--;
+	return;
+}
+
+/* Lengths probed before reaching len where the search has to go longer */
+static unsigned int lpm6_marker_path(struct lpm6_hash *hash,
+	unsigned int len, unsigned int *path)
+{
+	int low, high, mid;
+	unsigned int num = 0;
+
+	low = 0;
+	high = hash->lens_num - 1;
+
+	while(low <= high){
+		mid = (low + high) >> 1;
+
+		if(hash->lens[mid] == len)
+			break;
+
+		if(hash->lens[mid] < len){
+			path[num++] = hash->lens[mid];
+			low = mid + 1;
+		}else{
+			high = mid - 1;
+		}
+	}
+
+	return num;
+}
+
+static int lpm6_len_present(struct lpm6_hash *hash, unsigned int len)
+{
+	int i;
+
+	for(i = 0; i < hash->lens_num; i++){
+		if(hash->lens[i] == len)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int lpm6_hash_insert(struct lpm6_table *table,
+	struct lpm6_hash **hash, struct lpm6_node *node,
+	struct ixmap_desc *desc)
+{
+	struct lpm6_slot *slot;
+	unsigned int path[LPM6_PROBE_MAX];
+	unsigned int num, i, marker_assigned = 0;
+
+	num = lpm6_marker_path(*hash, node->len, path);
+
+	for(i = 0; i < num; i++, marker_assigned++){
+		slot = lpm6_slot_get(table, hash, node->key, path[i], desc);
+		if(!slot)
+			goto err_slot_get;
+
+		slot->marker++;
+	}
+
+	slot = lpm6_slot_get(table, hash, node->key, node->len, desc);
+	if(!slot)
+		goto err_slot_get;
+
+	slot->real	= 1;
+	slot->bmp	= node->index;
+	slot->bmp_len	= node->len;
+
+	return 0;
+
+err_slot_get:
+	for(i = 0; i < marker_assigned; i++){
+		slot = lpm6_slot_find(*hash,
+			node->key[0] & table->mask[path[i]][0],
+			node->key[1] & table->mask[path[i]][1], path[i]);
+
+		if(!--slot->marker && !slot->real)
+			lpm6_slot_remove(*hash, slot);
+	}
+	return -1;
+}
+
+static void lpm6_hash_remove(struct lpm6_table *table,
+	struct lpm6_hash *hash, struct lpm6_node *node,
+	struct lpm6_node *cover)
+{
+	struct lpm6_slot *slot;
+	unsigned int path[LPM6_PROBE_MAX];
+	unsigned int num, i;
+
+	slot = lpm6_slot_find(hash, node->key[0], node->key[1], node->len);
+	slot->real = 0;
+
+	if(slot->marker){
+		slot->bmp	= cover ? cover->index : LPM6_BMP_NONE;
+		slot->bmp_len	= cover ? cover->len : 0;
+	}else{
+		lpm6_slot_remove(hash, slot);
+	}
+
+	num = lpm6_marker_path(hash, node->len, path);
+
+	for(i = 0; i < num; i++){
+		slot = lpm6_slot_find(hash,
+			node->key[0] & table->mask[path[i]][0],
+			node->key[1] & table->mask[path[i]][1], path[i]);
+
+		if(!--slot->marker && !slot->real)
+			lpm6_slot_remove(hash, slot);
+	}
+
+	return;
+}
+
+static int lpm6_hash_rebuild(struct lpm6_table *table,
+	struct lpm6_hash **hash, struct lpm6_node *node,
+	struct ixmap_desc *desc)
+{
+	int i, ret;
+
+	if(!node)
+		return 0;
+
+	if(!hlist_empty(&node->head)){
+		ret = lpm6_hash_insert(table, hash, node, desc);
+		if(ret < 0)
+			return -1;
+	}
+
+	for(i = 0; i < 2; i++){
+		ret = lpm6_hash_rebuild(table, hash, node->child[i], desc);
+		if(ret < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * A new prefix length changes the shape of the binary search,
+ * so every marker is placed again into a fresh hash.
+ * Lengths left without prefixes are dropped here as well.
+ */
+static int lpm6_rebuild(struct lpm6_table *table,
+	struct ixmap_desc *desc)
+{
+	struct lpm6_hash *hash, *hash_old;
+	unsigned int bit;
+	int i, ret;
+
+	for(bit = LPM6_HASH_BIT_INIT; (1 << bit) < table->hash->used; bit++);
+
+	ret = lpm6_hash_alloc(&hash, bit, desc);
+	if(ret < 0)
+		goto err_hash_alloc;
+
+	for(i = 0; i <= LPM6_LEN_MAX; i++){
+		if(table->len_refcnt[i])
+			hash->lens[hash->lens_num++] = i;
+	}
+
+	ret = lpm6_hash_rebuild(table, &hash, table->root, desc);
+	if(ret < 0)
+		goto err_hash_rebuild;
+
+	/* lookups keep running on the old generation until the swap */
+	hash_old = table->hash;
+	smp_wmb();
+	table->hash = hash;
+
+	qsbr_call(table->qsbr, lpm6_hash_release, hash_old, 0);
+	return 0;
+
+err_hash_rebuild:
+	lpm6_hash_release(hash, 0);
+err_hash_alloc:
+	return -1;
+}
+
+/* Let markers below a new prefix inherit it as best matching prefix */
+static void lpm6_subtree_raise(struct lpm6_table *table,
+	struct lpm6_node *node, struct lpm6_node *top)
+{
+	struct lpm6_node *child;
+	struct lpm6_slot *slot;
+	unsigned int path[LPM6_PROBE_MAX];
+	unsigned int num, i;
+	int j;
+
+	for(j = 0; j < 2; j++){
+		child = node->child[j];
+		if(!child)
+			continue;
+
+		if(!hlist_empty(&child->head)){
+			num = lpm6_marker_path(table->hash, child->len, path);
+
+			for(i = 0; i < num; i++){
+				if(path[i] <= top->len)
+					continue;
+
+				slot = lpm6_slot_find(table->hash,
+					child->key[0] & table->mask[path[i]][0],
+					child->key[1] & table->mask[path[i]][1],
+					path[i]);
+
+				if(slot->bmp == LPM6_BMP_NONE
+				|| slot->bmp_len < top->len){
+					slot->bmp	= top->index;
+					slot->bmp_len	= top->len;
+				}
+			}
+		}
+
+		lpm6_subtree_raise(table, child, top);
+	}
+
+	return;
+}
+
+/* Hand markers below a removed prefix over to its covering prefix */
+static void lpm6_subtree_lower(struct lpm6_table *table,
+	struct lpm6_node *node, struct lpm6_node *top,
+	struct lpm6_node *cover)
+{
+	struct lpm6_node *child;
+	struct lpm6_slot *slot;
+	unsigned int path[LPM6_PROBE_MAX];
+	unsigned int num, i;
+	int j;
+
+	for(j = 0; j < 2; j++){
+		child = node->child[j];
+		if(!child)
+			continue;
+
+		if(!hlist_empty(&child->head)){
+			num = lpm6_marker_path(table->hash, child->len, path);
+
+			for(i = 0; i < num; i++){
+				if(path[i] <= top->len)
+					continue;
+
+				slot = lpm6_slot_find(table->hash,
+					child->key[0] & table->mask[path[i]][0],
+					child->key[1] & table->mask[path[i]][1],
+					path[i]);
+
+				if(slot->bmp == top->index){
+					slot->bmp	= cover ?
+						cover->index : LPM6_BMP_NONE;
+					slot->bmp_len	= cover ? cover->len : 0;
+				}
+			}
+		}
+
+		lpm6_subtree_lower(table, child, top, cover);
+	}
+
+	return;
+}
+
+static void lpm6_nexthop_release(void *ptr, unsigned long index)
+{
+	struct lpm6_table *table = ptr;
+
+	table->pool->free[table->pool->free_num++] = index;
+	return;
+}
+
+static void lpm6_entry_release(void *ptr, unsigned long data)
+{
+	struct lpm6_table *table = (struct lpm6_table *)data;
+
+	table->entry_put(ptr);
+	return;
+}
+
+static void lpm6_write_begin(struct lpm6_table *table)
+{
+	table->seq++;
+	smp_wmb();
+	return;
+}
+
+static void lpm6_write_end(struct lpm6_table *table)
+{
+	smp_wmb();
+	table->seq++;
+	return;
+}
+
+static unsigned int lpm6_read_begin(struct lpm6_table *table)
+{
+	unsigned int seq;
+
+	while((seq = table->seq) & 1){
+		cpu_relax();
+	}
+
+	smp_rmb();
+	return seq;
+}
+
+static int lpm6_read_retry(struct lpm6_table *table, unsigned int seq)
+{
+	smp_rmb();
+	return table->seq != seq;
+}
+
+void *lpm6_lookup(struct lpm6_table *table, void *dst)
+{
+	struct lpm6_hash *hash;
+	struct lpm6_slot *slot;
+	uint64_t hi, lo;
+	uint32_t bmp;
+	unsigned int len, seq;
+	int low, high, mid;
+
+	lpm6_load(table, dst, &hi, &lo);
+
+retry:
+	seq = lpm6_read_begin(table);
+	hash = table->hash;
+
+	bmp = LPM6_BMP_NONE;
+	low = 0;
+	high = hash->lens_num - 1;
+
+	while(low <= high){
+		mid = (low + high) >> 1;
+		len = hash->lens[mid];
+
+		slot = lpm6_slot_find(hash, hi & table->mask[len][0],
+			lo & table->mask[len][1], len);
+		if(slot){
+			bmp = slot->bmp;
+			low = mid + 1;
+		}else{
+			high = mid - 1;
+		}
+	}
+
+	if(lpm6_read_retry(table, seq))
+		goto retry;
+
+	if(bmp == LPM6_BMP_NONE)
+		goto err_not_found;
+
+	return table->nexthop[bmp];
+
+err_not_found:
+	return NULL;
+}
+
+/*
+ * Run the binary searches of a burst in lockstep: every round
+ * prefetches the slot each search probes next, then probes them all.
+ */
+void lpm6_lookup_bulk(struct lpm6_table *table, void **dst,
+	void **ptr, unsigned int num)
+{
+	struct lpm6_hash *hash;
+	struct lpm6_slot *slot;
+	uint64_t hi[LPM6_LOOKUP_BULK], lo[LPM6_LOOKUP_BULK];
+	uint32_t bmp[LPM6_LOOKUP_BULK];
+	unsigned int index[LPM6_LOOKUP_BULK];
+	int low[LPM6_LOOKUP_BULK], high[LPM6_LOOKUP_BULK];
+	unsigned int base, num_bulk, len, active, seq;
+	int i, mid;
+
+	for(base = 0; base < num; base += num_bulk){
+		num_bulk = min(num - base, (unsigned int)LPM6_LOOKUP_BULK);
+
+		for(i = 0; i < num_bulk; i++){
+			lpm6_load(table, dst[base + i], &hi[i], &lo[i]);
+		}
+
+retry:
+		seq = lpm6_read_begin(table);
+		hash = table->hash;
+
+		for(i = 0; i < num_bulk; i++){
+			bmp[i] = LPM6_BMP_NONE;
+			low[i] = 0;
+			high[i] = hash->lens_num - 1;
+		}
+
+		do{
+			for(i = 0; i < num_bulk; i++){
+				if(low[i] > high[i])
+					continue;
+
+				mid = (low[i] + high[i]) >> 1;
+				len = hash->lens[mid];
+				index[i] = lpm6_hash_key(hash,
+					hi[i] & table->mask[len][0],
+					lo[i] & table->mask[len][1], len);
+				prefetch(&hash->slot[index[i]]);
+			}
+
+			active = 0;
+			for(i = 0; i < num_bulk; i++){
+				if(low[i] > high[i])
+					continue;
+
+				mid = (low[i] + high[i]) >> 1;
+				len = hash->lens[mid];
+				slot = lpm6_slot_probe(hash, index[i],
+					hi[i] & table->mask[len][0],
+					lo[i] & table->mask[len][1], len);
+				if(slot){
+					bmp[i] = slot->bmp;
+					low[i] = mid + 1;
+				}else{
+					high[i] = mid - 1;
+				}
+
+				if(low[i] <= high[i])
+					active++;
+			}
+		}while(active);
+
+		if(lpm6_read_retry(table, seq))
+			goto retry;
+
+		for(i = 0; i < num_bulk; i++){
+			if(bmp[i] != LPM6_BMP_NONE)
+				prefetch(&table->nexthop[bmp[i]]);
+		}
+
+		for(i = 0; i < num_bulk; i++){
+			ptr[base + i] = bmp[i] != LPM6_BMP_NONE ?
+				table->nexthop[bmp[i]] : NULL;
+		}
+	}
+
+	return;
+}
+
+int lpm6_add(struct lpm6_table *table, void *prefix,
+	unsigned int prefix_len, unsigned int id,
+	void *ptr, struct ixmap_desc *desc)
+{
+	struct lpm6_node *node;
+	struct lpm6_entry *entry, *entry_lpm6;
+	uint64_t key[2];
+	int ret, node_real;
+
+	if(prefix_len > table->bits)
+		goto err_invalid_len;
+
+	lpm6_key(table, prefix, prefix_len, key);
+
+	node = lpm6_node_insert(table, key, prefix_len, desc);
+	if(!node)
+		goto err_node_insert;
+
+	node_real = !hlist_empty(&node->head);
+	if(node_real){
+		hlist_for_each_entry(entry_lpm6, &node->head, list){
+			if(!table->entry_identify(entry_lpm6->ptr,
+			id, prefix_len))
+				goto err_entry_exist;
+		}
+	}else{
+		if(!table->pool->free_num)
+			goto err_nexthop_exhausted;
+	}
+
+	entry = ixmap_mem_alloc(desc, sizeof(struct lpm6_entry));
+	if(!entry)
+		goto err_entry_alloc;
+
+	entry->ptr = ptr;
+	hlist_add_head(&entry->list, &node->head);
+
+	if(!node_real){
+		node->index = table->pool->free[table->pool->free_num - 1];
+		table->nexthop[node->index] = ptr;
+		table->len_refcnt[prefix_len]++;
+
+		if(!lpm6_len_present(table->hash, prefix_len)){
+			ret = lpm6_rebuild(table, desc);
+		}else{
+			lpm6_write_begin(table);
+			ret = lpm6_hash_insert(table, &table->hash,
+				node, desc);
+			if(!ret)
+				lpm6_subtree_raise(table, node, node);
+			lpm6_write_end(table);
+		}
+
+		if(ret < 0)
+			goto err_hash_insert;
+
+		table->pool->free_num--;
+	}
+
+	/* the newest entry takes precedence as lpm_entry_insert() does */
+	table->entry_pull(ptr);
+	table->nexthop[node->index] = ptr;
+
+	return 0;
+
+err_hash_insert:
+	table->len_refcnt[prefix_len]--;
+	hlist_del(&entry->list);
+	ixmap_mem_free(entry);
+err_entry_alloc:
+err_nexthop_exhausted:
+	if(!node_real)
+		lpm6_node_remove(table, node);
+err_entry_exist:
+err_node_insert:
+err_invalid_len:
+	return -1;
+}
+
+/* As dir24_replace(), the hash tables are left as they are */
+int lpm6_replace(struct lpm6_table *table, void *prefix,
+	unsigned int prefix_len, unsigned int id, void *ptr)
+{
+	struct lpm6_node *node;
+	struct lpm6_entry *entry, *target;
+	uint64_t key[2];
+	void *ptr_old;
+
+	if(prefix_len > table->bits)
+		goto err_not_found;
+
+	lpm6_key(table, prefix, prefix_len, key);
+
+	node = lpm6_node_lookup(table, key, prefix_len);
+	if(!node || hlist_empty(&node->head))
+		goto err_not_found;
+
+	target = hlist_first_entry(&node->head, struct lpm6_entry, list);
+	hlist_for_each_entry(entry, &node->head, list){
+		if(!table->entry_identify(entry->ptr, id, prefix_len)){
+			target = entry;
+			break;
+		}
+	}
+
+	ptr_old = target->ptr;
+	table->entry_pull(ptr);
+	target->ptr = ptr;
+
+	if(target == hlist_first_entry(&node->head,
+	struct lpm6_entry, list)){
+		smp_wmb();
+		ACCESS_ONCE(table->nexthop[node->index]) = ptr;
+	}
+
+	qsbr_call(table->qsbr, lpm6_entry_release,
+		ptr_old, (unsigned long)table);
+	return 0;
+
+err_not_found:
+	return -1;
+}
+
+int lpm6_delete(struct lpm6_table *table, void *prefix,
+	unsigned int prefix_len, unsigned int id)
+{
+	struct lpm6_node *node, *cover;
+	struct lpm6_entry *entry, *target;
+	uint64_t key[2];
+
+	if(prefix_len > table->bits)
+		goto err_not_found;
+
+	lpm6_key(table, prefix, prefix_len, key);
+
+	node = lpm6_node_lookup(table, key, prefix_len);
+	if(!node)
+		goto err_not_found;
+
+	target = NULL;
+	hlist_for_each_entry(entry, &node->head, list){
+		if(!table->entry_identify(entry->ptr, id, prefix_len)){
+			target = entry;
+			break;
+		}
+	}
+
+	if(!target)
+		goto err_not_found;
+
+	hlist_del(&target->list);
+
+	if(!hlist_empty(&node->head)){
+		entry = hlist_first_entry(&node->head,
+			struct lpm6_entry, list);
+		table->nexthop[node->index] = entry->ptr;
+	}else{
+		cover = lpm6_node_cover(table, key, prefix_len);
+
+		lpm6_write_begin(table);
+		lpm6_subtree_lower(table, node, node, cover);
+		lpm6_hash_remove(table, table->hash, node, cover);
+		lpm6_write_end(table);
+
+		table->len_refcnt[prefix_len]--;
+		qsbr_call(table->qsbr, lpm6_nexthop_release,
+			table, node->index);
+		lpm6_node_remove(table, node);
+	}
+
+	qsbr_call(table->qsbr, lpm6_entry_release,
+		target->ptr, (unsigned long)table);
+	ixmap_mem_free(target);
+
+	return 0;
+
+err_not_found:
+	return -1;
+}
+
+void lpm6_delete_all(struct lpm6_table *table)
+{
+	int i;
+
+	/*
+	 * No lookup may run any longer, and pending releases
+	 * must be back in the pool before the slots of nodes.
+	 */
+	if(table->qsbr)
+		qsbr_synchronize(table->qsbr);
+
+	lpm6_node_release_all(table, table->root);
+	table->root = NULL;
+
+	memset(table->hash->slot, 0,
+		sizeof(struct lpm6_slot) * table->hash->size);
+	table->hash->used = 0;
+	table->hash->lens_num = 0;
+
+	for(i = 0; i <= LPM6_LEN_MAX; i++){
+		table->len_refcnt[i] = 0;
+	}
+
+	return;
+}
+
+/*
+ * Calls func on the ptr of every route. Routes sharing a prefix
+ * come one after another, newest first.
+ */
+void lpm6_walk(struct lpm6_table *table,
+	void (*func)(void *, void *), void *arg)
+{
+	_lpm6_walk(table->root, func, arg);
+	return;
+}
+
+static void _lpm6_walk(struct lpm6_node *node,
+	void (*func)(void *, void *), void *arg)
+{
+	struct lpm6_entry *entry;
+	int i;
+
+	if(!node)
+		return;
+
+	for(i = 0; i < 2; i++){
+		_lpm6_walk(node->child[i], func, arg);
+	}
+
+	hlist_for_each_entry(entry, &node->head, list){
+		func(entry->ptr, arg);
+	}
+
+	return;
+}
+
+void lpm6_stats(struct lpm6_table *table, struct lpm6_stats *stats)
+{
+	struct lpm6_hash *hash;
+	int i, low, high, mid;
+
+	hash = table->hash;
+	memset(stats, 0, sizeof(struct lpm6_stats));
+
+	for(i = 0; i < hash->size; i++){
+		if(!hash->slot[i].used)
+			continue;
+
+		if(hash->slot[i].real){
+			stats->prefixes++;
+			stats->count[hash->slot[i].len]++;
+		}else{
+			stats->markers++;
+		}
+	}
+
+	stats->lengths	= hash->lens_num;
+	stats->slots	= hash->size;
+
+	/* probes spent by a lookup whose best match has this length */
+	for(i = 0; i < hash->lens_num; i++){
+		low = 0;
+		high = hash->lens_num - 1;
+
+		while(low <= high){
+			mid = (low + high) >> 1;
+			stats->probes[hash->lens[i]]++;
+
+			if(hash->lens[mid] <= hash->lens[i]){
+				low = mid + 1;
+			}else{
+				high = mid - 1;
+			}
+		}
+	}
+
+	return;
+}
@@ -0,0 +1,129 @@
+#ifndef _IXMAPFWD_LPM6_H
+#define _IXMAPFWD_LPM6_H
+
+#include <stdint.h>
+#include "linux/list.h"
+#include "qsbr.h"
+
+/*
+ * IPv6 lookup by binary search on prefix lengths:
+ * Every prefix and every marker placed on its search path lives in
+ * one open addressing hash keyed by (prefix, length). Markers carry
+ * their best matching prefix, so a lookup costs at most
+ * ceil(log2(number of distinct lengths + 1)) hash probes.
+ * A table of 32 bit keys serves IPv4 the same way, its memory
+ * follows its routes where DIR24 of its own needs 64MB from the start.
+ */
+#define LPM6_LEN_MAX		128
+#define LPM6_PROBE_MAX		8
+#define LPM6_HASH_BIT_INIT	10
+#define LPM6_NEXTHOP_MAX	((1 << 20) - 8)
+#define LPM6_BMP_NONE		0xffffffff
+#define LPM6_LOOKUP_BULK	32
+
+struct lpm6_entry {
+	struct hlist_node	list;
+	void			*ptr;
+};
+
+/* control plane: path compressed binary trie of prefixes */
+struct lpm6_node {
+	uint64_t		key[2];
+	unsigned int		len;
+	struct lpm6_node	*child[2];
+	struct lpm6_node	*parent;
+	struct hlist_head	head; /* empty for glue node */
+	uint32_t		index;
+};
+
+/* data plane: 32 bytes, two slots per cache line */
+struct lpm6_slot {
+	uint64_t		key[2];
+	uint32_t		bmp;
+	uint8_t			len;
+	uint8_t			bmp_len;
+	uint8_t			used;
+	uint8_t			real;
+	uint32_t		marker;
+	uint32_t		reserved;
+};
+
+/*
+ * Nexthop slots, the only part sized for the largest table.
+ * Tables updated by one writer may draw from one pool.
+ */
+struct lpm6_pool {
+	void			**nexthop;
+	uint32_t		*free;
+	unsigned int		free_num;
+};
+
+struct lpm6_hash {
+	struct lpm6_slot	*slot;
+	unsigned int		size;
+	unsigned int		used;
+	unsigned int		shift;
+	unsigned int		lens_num;
+	uint8_t			lens[LPM6_LEN_MAX + 1];
+};
+
+/*
+ * Lookups load the hash once and run against that generation.
+ * Growing or reshaping it publishes a new generation and retires
+ * the old one through qsbr. Slots moved in place are covered by seq,
+ * odd while the writer is inside, and the lookup is retried.
+ */
+struct lpm6_table {
+	struct lpm6_hash	*hash;
+	volatile unsigned int	seq;
+	struct qsbr		*qsbr; /* NULL when private to one thread */
+	unsigned int		bits; /* 128, or 32 for IPv4 */
+	void			**nexthop; /* of pool */
+	struct lpm6_pool	*pool;
+	int			pool_private;
+	struct lpm6_node	*root;
+	unsigned int		len_refcnt[LPM6_LEN_MAX + 1];
+	uint64_t		mask[LPM6_LEN_MAX + 1][2];
+	int			(*entry_identify)(
+				void *,
+				unsigned int,
+				unsigned int
+				);
+	void	 		(*entry_pull)(
+				void *
+				);
+	void			(*entry_put)(
+				void *
+				);
+};
+
+struct lpm6_stats {
+	unsigned int		prefixes;
+	unsigned int		markers;
+	unsigned int		lengths;
+	unsigned int		slots;
+	unsigned int		count[LPM6_LEN_MAX + 1];
+	unsigned int		probes[LPM6_LEN_MAX + 1];
+};
+
+struct lpm6_pool *lpm6_pool_alloc(struct ixmap_desc *desc);
+void lpm6_pool_release(struct lpm6_pool *pool);
+int lpm6_init(struct lpm6_table *table, unsigned int bits,
+	struct lpm6_pool *pool, struct ixmap_desc *desc);
+void lpm6_destroy(struct lpm6_table *table);
+void *lpm6_lookup(struct lpm6_table *table, void *dst);
+void lpm6_lookup_bulk(struct lpm6_table *table, void **dst,
+	void **ptr, unsigned int num);
+int lpm6_add(struct lpm6_table *table, void *prefix,
+	unsigned int prefix_len, unsigned int id,
+	void *ptr, struct ixmap_desc *desc);
+int lpm6_replace(struct lpm6_table *table, void *prefix,
+	unsigned int prefix_len, unsigned int id, void *ptr);
+int lpm6_delete(struct lpm6_table *table, void *prefix,
+	unsigned int prefix_len, unsigned int id);
+void lpm6_delete_all(struct lpm6_table *table);
+void lpm6_walk(struct lpm6_table *table,
+	void (*func)(void *, void *), void *arg);
+void lpm6_stats(struct lpm6_table *table, struct lpm6_stats *stats);
+
+#endif /* _IXMAPFWD_LPM6_H */
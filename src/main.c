@@ -13,16 +13,30 @@
 #include <sys/socket.h>
 #include <stdarg.h>
 #include <syslog.h>
+#include <numa.h>
 #include <ixmap.h>
 
 #include "linux/list.h"
 #include "main.h"
 #include "thread.h"
+#include "snapshot.h"
+#include "netlink.h"
+#include "forward.h"
 
 static void usage();
 static int ixmapfwd_thread_create(struct ixmapfwd *ixmapfwd,
 	struct ixmapfwd_thread *thread, int thread_index);
 static void ixmapfwd_thread_kill(struct ixmapfwd_thread *thread);
+static int ixmapfwd_node(int core_id);
+static int ixmapfwd_fib_alloc(struct ixmapfwd *ixmapfwd,
+	struct ixmapfwd_thread *threads);
+static void ixmapfwd_fib_release(struct ixmapfwd *ixmapfwd);
+static int ixmapfwd_neigh_alloc(struct ixmapfwd_fib *fib,
+	unsigned int num_ports, struct ixmap_desc *desc);
+static void ixmapfwd_neigh_release(struct ixmapfwd_fib *fib,
+	unsigned int num_ports);
+static int ixmapfwd_snapshot_load(struct ixmapfwd *ixmapfwd,
+	struct ixmapfwd_thread *threads);
 static int ixmapfwd_set_signal(sigset_t *sigset);
 
 char *optarg;
@@ -36,6 +50,13 @@ static void usage()
 	printf("  -m [n] : MTU length (default=1522)\n");
 	printf("  -c [n] : Number of packet buffer per port\n");
 	printf("  -p : Promiscuous mode (default=disabled)\n");
+	printf("  -a : Aggregate routes in the FIB (default=disabled)\n");
+	printf("  -s [path] : Snapshot file to restart from and save to\n");
+	printf("  -S [n] : Seconds between snapshots (default=0, at exit only)\n");
+	printf("  -f [n] : Flow cache entries per core (default=0, disabled)\n");
+	printf("  -F : Key the flow cache by 5-tuple, not destination\n");
+	printf("  -r [n] : Routes counted per node, SIGUSR2 logs them "
+		"(default=0, disabled)\n");
 	printf("  -h : Show this help\n");
 	printf("\n");
 	return;
@@ -60,8 +81,15 @@ int main(int argc, char **argv)
 	ixmapfwd.mtu_frame	= 0; /* MTU=1522 is used by default. */
 	ixmapfwd.intr_rate	= IXGBE_20K_ITR;
 	ixmapfwd.buf_count	= 8192; /* number of per port packet buffer */
-
-	while ((opt = getopt(argc, argv, "t:n:m:c:ph")) != -1) {
+	ixmapfwd.fib_aggregate	= 0;
+	ixmapfwd.snapshot_path	= NULL;
+	ixmapfwd.snapshot_interval = 0;
+	ixmapfwd.snapshot	= NULL;
+	ixmapfwd.flow_entries	= 0;
+	ixmapfwd.flow_tuple	= 0;
+	ixmapfwd.stats_routes	= 0;
+
+	while ((opt = getopt(argc, argv, "t:n:m:c:pas:S:f:Fr:h")) != -1) {
 		switch(opt){
 		case 't':
 			if(sscanf(optarg, "%u", &ixmapfwd.num_cores) < 1){
@@ -94,6 +122,36 @@ int main(int argc, char **argv)
 		case 'p':
 			ixmapfwd.promisc = 1;
 			break;
+		case 'a':
+			ixmapfwd.fib_aggregate = 1;
+			break;
+		case 's':
+			ixmapfwd.snapshot_path = optarg;
+			break;
+		case 'S':
+			if(sscanf(optarg, "%u", &ixmapfwd.snapshot_interval) < 1){
+				printf("Invalid snapshot interval\n");
+				ret = -1;
+				goto err_arg;
+			}
+			break;
+		case 'f':
+			if(sscanf(optarg, "%u", &ixmapfwd.flow_entries) < 1){
+				printf("Invalid number of flow cache entries\n");
+				ret = -1;
+				goto err_arg;
+			}
+			break;
+		case 'F':
+			ixmapfwd.flow_tuple = 1;
+			break;
+		case 'r':
+			if(sscanf(optarg, "%u", &ixmapfwd.stats_routes) < 1){
+				printf("Invalid number of counted routes\n");
+				ret = -1;
+				goto err_arg;
+			}
+			break;
 		case 'h':
 			usage();
 			ret = 0;
@@ -155,6 +213,12 @@ int main(int argc, char **argv)
 		}
 	}
 
+	ret = ixmapfwd_fib_alloc(&ixmapfwd, threads);
+	if(ret < 0){
+		ixmapfwd_log(LOG_ERR, "failed to allocate fib");
+		goto err_fib_alloc;
+	}
+
 	for(i = 0; i < ixmapfwd.num_ports; i++){
 		ixmap_configure_rx(ixmapfwd.ih_array[i]);
 		ixmap_configure_tx(ixmapfwd.ih_array[i]);
@@ -174,6 +238,14 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/* a missing or stale file only means a cold start */
+	if(ixmapfwd.snapshot_path){
+		ret = ixmapfwd_snapshot_load(&ixmapfwd, threads);
+		if(ret < 0)
+			ixmapfwd_log(LOG_INFO, "no snapshot loaded from %s",
+				ixmapfwd.snapshot_path);
+	}
+
 	ret = ixmapfwd_set_signal(&sigset);
 	if(ret != 0){
 		goto err_set_signal;
@@ -221,9 +293,19 @@ err_buf_alloc:
 	}
 
 	while(1){
-		if(sigwait(&sigset, &signal) == 0){
-			break;
+		if(sigwait(&sigset, &signal) != 0)
+			continue;
+
+		/* not an exit, the writers log their route counters */
+		if(signal == SIGUSR2){
+			for(i = 0; i < ixmapfwd.num_cores; i++){
+				if(threads[i].fib_writer)
+					pthread_kill(threads[i].tid, SIGUSR2);
+			}
+			continue;
 		}
+
+		break;
 	}
 	ret = 0;
 
@@ -242,6 +324,10 @@ err_tun_open:
 	for(i = 0; i < tun_assigned; i++){
 		tun_close(&ixmapfwd, i);
 	}
+	if(ixmapfwd.snapshot)
+		snapshot_close(ixmapfwd.snapshot);
+	ixmapfwd_fib_release(&ixmapfwd);
+err_fib_alloc:
 err_desc_alloc:
 	for(i = 0; i < desc_assigned; i++){
 		ixmap_desc_release(ixmapfwd.ih_array,
@@ -271,6 +357,26 @@ static int ixmapfwd_thread_create(struct ixmapfwd *ixmapfwd,
 	thread->index		= thread_index;
 	thread->num_ports	= ixmapfwd->num_ports;
 	thread->ptid		= pthread_self();
+	thread->netlink_fd	= -1;
+	thread->resync_seq	= 0;
+	thread->resync_neigh_inet = NULL;
+	thread->resync_neigh_inet6 = NULL;
+	thread->snapshot	= ixmapfwd->snapshot;
+	thread->netlink_lost	= 0;
+	thread->snapshot_path	= ixmapfwd->snapshot_path;
+	thread->snapshot_interval = ixmapfwd->snapshot_interval;
+	thread->snapshot_stamp	= 0;
+	thread->flow		= NULL;
+	thread->flow_entries	= ixmapfwd->flow_entries;
+	thread->flow_tuple	= ixmapfwd->flow_tuple;
+	thread->drop_blackhole	= 0;
+	thread->drop_unreachable = 0;
+	thread->drop_prohibit	= 0;
+	thread->reject_answered	= 0;
+	thread->reject_tokens	= FORWARD_REJECT_RATE;
+	thread->reject_stamp	= 0;
+	memset(&thread->neigh_stats_inet, 0, sizeof(struct neigh_stats));
+	memset(&thread->neigh_stats_inet6, 0, sizeof(struct neigh_stats));
 
 	ret = pthread_create(&thread->tid, NULL, thread_process_interrupt, thread);
 	if(ret < 0){
@@ -294,6 +400,321 @@ err_pthread_create:
 	return -1;
 }
 
+static int ixmapfwd_node(int core_id)
+{
+	int node;
+
+	node = numa_node_of_cpu(core_id);
+	return node < 0 ? 0 : node;
+}
+
+/*
+ * One FIB per NUMA node, allocated from the descriptor memory of
+ * the first thread on the node. That thread applies route updates
+ * and the others only read it, see qsbr.h.
+ */
+static int ixmapfwd_fib_alloc(struct ixmapfwd *ixmapfwd,
+	struct ixmapfwd_thread *threads)
+{
+	struct ixmapfwd_fib *fib;
+	struct ixmap_desc *desc;
+	int i, node, ret;
+
+	ixmapfwd->num_nodes = numa_max_node() + 1;
+	for(i = 0; i < ixmapfwd->num_cores; i++){
+		if(ixmapfwd_node(i) >= ixmapfwd->num_nodes)
+			ixmapfwd->num_nodes = ixmapfwd_node(i) + 1;
+	}
+
+	ixmapfwd->fib_array = malloc(sizeof(struct ixmapfwd_fib)
+		* ixmapfwd->num_nodes);
+	if(!ixmapfwd->fib_array)
+		goto err_fib_array;
+
+	for(node = 0; node < ixmapfwd->num_nodes; node++){
+		fib = &ixmapfwd->fib_array[node];
+		fib->fib_inet		= NULL;
+		fib->fib_inet6		= NULL;
+		fib->qsbr		= NULL;
+		fib->writer		= -1;
+		fib->num_threads	= 0;
+		fib->threads_assigned	= 0;
+		fib->bulk.routes	= NULL;
+		fib->bulk.num		= 0;
+		fib->bulk.size		= 0;
+		fib->bulk_stamp		= 0;
+		fib->bulk_count		= 0;
+		fib->resync_inet	= NULL;
+		fib->resync_inet6	= NULL;
+		fib->resync_bulk.routes	= NULL;
+		fib->resync_bulk.num	= 0;
+		fib->resync_bulk.size	= 0;
+		fib->nexthops		= NULL;
+		fib->vrfs		= NULL;
+		fib->adjs		= NULL;
+		fib->neigh_inet		= NULL;
+		fib->neigh_inet6	= NULL;
+		fib->flow_gen		= 0;
+		fib->locals		= NULL;
+		fib->stats		= NULL;
+	}
+
+	for(i = 0; i < ixmapfwd->num_cores; i++){
+		fib = &ixmapfwd->fib_array[ixmapfwd_node(i)];
+		if(fib->writer < 0)
+			fib->writer = i;
+		fib->num_threads++;
+	}
+
+	for(node = 0; node < ixmapfwd->num_nodes; node++){
+		fib = &ixmapfwd->fib_array[node];
+		if(fib->writer < 0)
+			continue;
+
+		desc = threads[fib->writer].desc;
+
+		fib->qsbr = qsbr_alloc(desc, fib->num_threads);
+		if(!fib->qsbr)
+			goto err_fib_alloc;
+
+		fib->nexthops = nexthop_table_alloc(desc);
+		if(!fib->nexthops)
+			goto err_fib_alloc;
+
+		fib->adjs = adj_table_alloc(ixmapfwd->num_ports, desc);
+		if(!fib->adjs)
+			goto err_fib_alloc;
+
+		ret = ixmapfwd_neigh_alloc(fib, ixmapfwd->num_ports, desc);
+		if(ret < 0)
+			goto err_fib_alloc;
+
+		/* gateways resolve from here as their routes come */
+		for(i = 0; i < ixmapfwd->num_ports; i++){
+			adj_table_port_mac(fib->adjs, i,
+				ixmap_macaddr_default(ixmapfwd->ih_array[i]));
+		}
+		adj_table_neigh(fib->adjs, fib->neigh_inet, fib->neigh_inet6);
+
+		fib->locals = local_table_alloc(desc, fib->qsbr);
+		if(!fib->locals)
+			goto err_fib_alloc;
+
+		if(ixmapfwd->stats_routes){
+			fib->stats = stats_table_alloc(desc,
+				ixmapfwd->stats_routes, fib->num_threads);
+			if(!fib->stats)
+				goto err_fib_alloc;
+		}
+
+		fib->fib_inet = fib_alloc(desc, FIB_ENGINE_DIR24, fib->qsbr);
+		if(!fib->fib_inet)
+			goto err_fib_alloc;
+
+		fib->fib_inet6 = fib_alloc(desc, FIB_ENGINE_LPM6, fib->qsbr);
+		if(!fib->fib_inet6)
+			goto err_fib_alloc;
+
+		fib_stats_set(fib->fib_inet, fib->stats);
+		fib_stats_set(fib->fib_inet6, fib->stats);
+
+		if(ixmapfwd->fib_aggregate){
+			if(fib_aggregate(fib->fib_inet, AF_INET, desc) < 0
+			|| fib_aggregate(fib->fib_inet6, AF_INET6, desc) < 0)
+				goto err_fib_alloc;
+		}
+
+		fib->vrfs = vrf_table_alloc(ixmapfwd->num_ports, fib->qsbr,
+			fib->stats, ixmapfwd->fib_aggregate, desc);
+		if(!fib->vrfs)
+			goto err_fib_alloc;
+	}
+
+	/* the writer is the first thread of its node and gets readers[0] */
+	for(i = 0; i < ixmapfwd->num_cores; i++){
+		fib = &ixmapfwd->fib_array[ixmapfwd_node(i)];
+
+		threads[i].fib		= fib;
+		threads[i].qsbr		= fib->qsbr;
+		threads[i].qsbr_reader	=
+			&fib->qsbr->readers[fib->threads_assigned];
+		threads[i].stats	= fib->stats ?
+			fib->stats->counters[fib->threads_assigned] : NULL;
+		threads[i].fib_writer	= (fib->writer == i);
+		fib->threads_assigned++;
+	}
+
+	return 0;
+
+err_fib_alloc:
+	ixmapfwd_fib_release(ixmapfwd);
+err_fib_array:
+	return -1;
+}
+
+/* All threads must have stopped */
+static void ixmapfwd_fib_release(struct ixmapfwd *ixmapfwd)
+{
+	struct ixmapfwd_fib *fib;
+	int node;
+
+	for(node = 0; node < ixmapfwd->num_nodes; node++){
+		fib = &ixmapfwd->fib_array[node];
+
+		if(fib->locals)
+			local_table_release(fib->locals);
+		if(fib->vrfs)
+			vrf_table_release(fib->vrfs);
+		if(fib->fib_inet6)
+			fib_release(fib->fib_inet6);
+		if(fib->fib_inet)
+			fib_release(fib->fib_inet);
+		if(fib->nexthops)
+			nexthop_table_release(fib->nexthops);
+		if(fib->adjs)
+			adj_table_release(fib->adjs);
+		if(fib->neigh_inet)
+			ixmapfwd_neigh_release(fib, ixmapfwd->num_ports);
+		if(fib->stats)
+			stats_table_release(fib->stats);
+		if(fib->qsbr)
+			qsbr_release(fib->qsbr);
+
+		free(fib->bulk.routes);
+		free(fib->resync_bulk.routes);
+	}
+
+	free(ixmapfwd->fib_array);
+	return;
+}
+
+/*
+ * Neighbor tables of every port, shared by the threads of the node
+ * like its FIB and written by its writer alone, see neigh.h. Those
+ * allocated before a failure go with ixmapfwd_neigh_release().
+ */
+static int ixmapfwd_neigh_alloc(struct ixmapfwd_fib *fib,
+	unsigned int num_ports, struct ixmap_desc *desc)
+{
+	unsigned int i;
+
+	fib->neigh_inet = ixmap_mem_alloc(desc,
+		sizeof(struct neigh_table *) * num_ports);
+	if(!fib->neigh_inet)
+		goto err_neigh_table_inet;
+
+	fib->neigh_inet6 = ixmap_mem_alloc(desc,
+		sizeof(struct neigh_table *) * num_ports);
+	if(!fib->neigh_inet6)
+		goto err_neigh_table_inet6;
+
+	memset(fib->neigh_inet, 0, sizeof(struct neigh_table *) * num_ports);
+	memset(fib->neigh_inet6, 0, sizeof(struct neigh_table *) * num_ports);
+
+	for(i = 0; i < num_ports; i++){
+		fib->neigh_inet[i] = neigh_alloc(desc, AF_INET, fib->qsbr);
+		if(!fib->neigh_inet[i])
+			goto err_neigh_alloc;
+
+		fib->neigh_inet6[i] = neigh_alloc(desc, AF_INET6, fib->qsbr);
+		if(!fib->neigh_inet6[i])
+			goto err_neigh_alloc;
+	}
+
+	return 0;
+
+err_neigh_alloc:
+err_neigh_table_inet6:
+err_neigh_table_inet:
+	return -1;
+}
+
+static void ixmapfwd_neigh_release(struct ixmapfwd_fib *fib,
+	unsigned int num_ports)
+{
+	unsigned int i;
+
+	for(i = 0; fib->neigh_inet6 && i < num_ports; i++){
+		if(fib->neigh_inet6[i])
+			neigh_release(fib->neigh_inet6[i]);
+		if(fib->neigh_inet[i])
+			neigh_release(fib->neigh_inet[i]);
+	}
+
+	if(fib->neigh_inet6)
+		ixmap_mem_free(fib->neigh_inet6);
+	ixmap_mem_free(fib->neigh_inet);
+	return;
+}
+
+/*
+ * Warm start: FIB and neighbors of each node filled from the snapshot
+ * before any thread runs, so forwarding does not wait for the kernel.
+ * The writers reconcile both with netlink_resync().
+ */
+static int ixmapfwd_snapshot_load(struct ixmapfwd *ixmapfwd,
+	struct ixmapfwd_thread *threads)
+{
+	struct ixmapfwd_fib *fib;
+	struct ixmap_desc *desc;
+	unsigned int *ifindex;
+	unsigned long start;
+	int i, node, num_inet, num_inet6, num_neighs;
+
+	ixmapfwd->snapshot = snapshot_open(ixmapfwd->snapshot_path);
+	if(!ixmapfwd->snapshot)
+		goto err_snapshot_open;
+
+	ifindex = malloc(sizeof(unsigned int) * ixmapfwd->num_ports);
+	if(!ifindex)
+		goto err_ifindex_alloc;
+
+	for(i = 0; i < ixmapfwd->num_ports; i++){
+		ifindex[i] = ixmapfwd->tunh_array[i]->ifindex;
+	}
+
+	for(node = 0; node < ixmapfwd->num_nodes; node++){
+		fib = &ixmapfwd->fib_array[node];
+		if(fib->writer < 0)
+			continue;
+
+		desc = threads[fib->writer].desc;
+		start = netlink_now();
+
+		/* first, so that the gateways of the routes resolve */
+		num_neighs = snapshot_load_neigh(ixmapfwd->snapshot,
+			fib->neigh_inet, fib->neigh_inet6,
+			ixmapfwd->num_ports, desc);
+		if(num_neighs < 0)
+			goto err_load_fib;
+
+		num_inet = snapshot_load_fib(ixmapfwd->snapshot,
+			&fib->fib_inet, fib->adjs, AF_INET, ifindex,
+			ixmapfwd->num_ports, desc);
+		num_inet6 = snapshot_load_fib(ixmapfwd->snapshot,
+			&fib->fib_inet6, fib->adjs, AF_INET6, ifindex,
+			ixmapfwd->num_ports, desc);
+		if(num_inet < 0 || num_inet6 < 0)
+			goto err_load_fib;
+
+		ixmapfwd_log(LOG_INFO, "node %d loaded %d routes and "
+			"%d neighbors from snapshot in %lu ms", node,
+			num_inet + num_inet6, num_neighs,
+			netlink_now() - start);
+	}
+
+	free(ifindex);
+	return 0;
+
+err_load_fib:
+	free(ifindex);
+err_ifindex_alloc:
+	snapshot_close(ixmapfwd->snapshot);
+	ixmapfwd->snapshot = NULL;
+err_snapshot_open:
+	return -1;
+}
+
 void ixmapfwd_log(int level, char *fmt, ...){
 	va_list args;
 	va_start(args, fmt);
@@ -339,6 +760,10 @@ static int ixmapfwd_set_signal(sigset_t *sigset)
 	if(ret != 0)
 		return -1;
 
+	ret = sigaddset(sigset, SIGUSR2);
+	if(ret != 0)
+		return -1;
+
 	ret = pthread_sigmask(SIG_BLOCK, sigset, NULL);
 	if(ret != 0)
 		return -1;
@@ -26,6 +26,14 @@
 #define prefetch(x)	__builtin_prefetch(x, 0)
 #define prefetchw(x)	__builtin_prefetch(x, 1)
 
+/* x86 keeps loads and stores in order, only the compiler must not move them */
+#define barrier()	asm volatile("" ::: "memory")
+#define smp_rmb()	barrier()
+#define smp_wmb()	barrier()
+#define smp_mb()	__sync_synchronize()
+#define cpu_relax()	asm volatile("pause" ::: "memory")
+#define ACCESS_ONCE(x)	(*(volatile typeof(x) *)&(x))
+
 #define PROCESS_NAME "ixmap"
 #define SYSLOG_FACILITY LOG_DAEMON
 #define IXMAP_RX_BUDGET 1024
@@ -38,9 +46,18 @@ struct ixmapfwd {
 	unsigned int		num_cores;
 	unsigned int		num_ports;
 	unsigned int		promisc;
+	unsigned int		fib_aggregate;
 	unsigned int		mtu_frame;
 	unsigned int		buf_count;
 	unsigned short		intr_rate;
+	char			*snapshot_path;
+	unsigned int		snapshot_interval;
+	struct snapshot		*snapshot;
+	unsigned int		flow_entries; /* per thread, 0 if no cache */
+	unsigned int		flow_tuple;
+	unsigned int		stats_routes; /* per node, 0 if not counted */
+	struct ixmapfwd_fib	*fib_array; /* per NUMA node */
+	unsigned int		num_nodes;
 };
 
 void ixmapfwd_log(int level, char *fmt, ...);
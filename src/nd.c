@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <arpa/inet.h>
+#include <net/if_arp.h>
+#include <ixmap.h>
+
+#include "main.h"
+#include "nd.h"
+
+/* As on the wire, struct ether_arp would pull in a second ethhdr */
+struct nd_arp {
+	struct arphdr		hdr;
+	uint8_t			sha[ETH_ALEN];
+	uint8_t			spa[4];
+	uint8_t			tha[ETH_ALEN];
+	uint8_t			tpa[4];
+} __attribute__ ((packed));
+
+/* Neighbor Advertisement with its target link-layer address */
+struct nd_na {
+	struct nd_neighbor_advert	advert;
+	struct nd_opt_hdr		opt;
+	uint8_t				mac[ETH_ALEN];
+} __attribute__ ((packed));
+
+static uint16_t nd_csum(struct ip6_hdr *ip6, void *data, unsigned int len);
+
+struct nd_table *nd_alloc(struct ixmap_desc *desc, unsigned int num_ports)
+{
+	struct nd_table *nd;
+
+	nd = ixmap_mem_alloc(desc, sizeof(struct nd_table));
+	if(!nd)
+		goto err_nd_alloc;
+
+	nd->ports = ixmap_mem_alloc(desc, sizeof(struct nd_port) * num_ports);
+	if(!nd->ports)
+		goto err_ports_alloc;
+
+	memset(nd->ports, 0, sizeof(struct nd_port) * num_ports);
+	nd->num_ports = num_ports;
+	nd->stamp = 0;
+	nd_refill(nd, 0);
+	return nd;
+
+err_ports_alloc:
+	ixmap_mem_free(nd);
+err_nd_alloc:
+	return NULL;
+}
+
+void nd_release(struct nd_table *nd)
+{
+	ixmap_mem_free(nd->ports);
+	ixmap_mem_free(nd);
+	return;
+}
+
+void nd_refill(struct nd_table *nd, unsigned long now)
+{
+	unsigned int i;
+
+	for(i = 0; i < nd->num_ports; i++){
+		nd->ports[i].tokens = ND_RATE;
+	}
+
+	nd->taken = 0;
+	nd->stamp = now;
+	return;
+}
+
+/*
+ * An Ethernet/IPv4 request, not a probe nor an announcement: those
+ * carry no sender address of their own, and are the kernel's to see.
+ */
+int nd_arp_parse(uint8_t *frame, unsigned int size,
+	struct nd_request *req)
+{
+	struct nd_arp *arp;
+
+	if(size < sizeof(struct ethhdr) + sizeof(struct nd_arp))
+		goto err_invalid;
+
+	arp = (struct nd_arp *)(frame + sizeof(struct ethhdr));
+	if(arp->hdr.ar_hrd != htons(ARPHRD_ETHER)
+	|| arp->hdr.ar_pro != htons(ETH_P_IP)
+	|| arp->hdr.ar_hln != ETH_ALEN
+	|| arp->hdr.ar_pln != 4
+	|| arp->hdr.ar_op != htons(ARPOP_REQUEST))
+		goto err_invalid;
+
+	if(!memcmp(arp->spa, "\0\0\0\0", 4)
+	|| !memcmp(arp->spa, arp->tpa, 4))
+		goto err_invalid;
+
+	req->sender	= arp->spa;
+	req->target	= arp->tpa;
+	req->sender_mac	= arp->sha;
+	return 0;
+
+err_invalid:
+	return -1;
+}
+
+/* The sender becomes the target, mac answers for the address asked */
+void nd_arp_reply(uint8_t *frame, uint8_t *mac)
+{
+	struct ethhdr *eth;
+	struct nd_arp *arp;
+	uint8_t addr[4];
+
+	eth = (struct ethhdr *)frame;
+	arp = (struct nd_arp *)(frame + sizeof(struct ethhdr));
+
+	memcpy(eth->h_dest, eth->h_source, ETH_ALEN);
+	memcpy(eth->h_source, mac, ETH_ALEN);
+
+	arp->hdr.ar_op = htons(ARPOP_REPLY);
+	memcpy(arp->tha, arp->sha, ETH_ALEN);
+	memcpy(arp->sha, mac, ETH_ALEN);
+	memcpy(addr, arp->tpa, 4);
+	memcpy(arp->tpa, arp->spa, 4);
+	memcpy(arp->spa, addr, 4);
+	return;
+}
+
+/*
+ * A solicitation valid as RFC 4861 7.1.1 has it, from an address of
+ * its own: one for duplicate address detection comes from :: and is
+ * answered to all nodes, which is left to the kernel. Options are
+ * only checked for their length, the MAC answered to is the one the
+ * frame came from.
+ */
+int nd_ns_parse(uint8_t *frame, unsigned int size,
+	struct nd_request *req)
+{
+	struct ethhdr *eth;
+	struct ip6_hdr *ip6;
+	struct nd_neighbor_solicit *ns;
+	struct nd_opt_hdr *opt;
+	unsigned int len, offset;
+
+	if(size < sizeof(struct ethhdr) + sizeof(struct ip6_hdr)
+		+ sizeof(struct nd_neighbor_solicit))
+		goto err_invalid;
+
+	eth = (struct ethhdr *)frame;
+	ip6 = (struct ip6_hdr *)(frame + sizeof(struct ethhdr));
+	ns = (struct nd_neighbor_solicit *)(ip6 + 1);
+	len = ntohs(ip6->ip6_plen);
+
+	if(len < sizeof(struct nd_neighbor_solicit)
+	|| sizeof(struct ethhdr) + sizeof(struct ip6_hdr) + len > size)
+		goto err_invalid;
+
+	if(ip6->ip6_hlim != 255 || ns->nd_ns_code != 0
+	|| IN6_IS_ADDR_MULTICAST(&ns->nd_ns_target)
+	|| IN6_IS_ADDR_UNSPECIFIED(&ip6->ip6_src))
+		goto err_invalid;
+
+	for(offset = sizeof(struct nd_neighbor_solicit); offset < len;
+	offset += opt->nd_opt_len * 8){
+		opt = (struct nd_opt_hdr *)((uint8_t *)ns + offset);
+		if(offset + sizeof(struct nd_opt_hdr) > len
+		|| !opt->nd_opt_len)
+			goto err_invalid;
+	}
+
+	if(offset != len || nd_csum(ip6, ns, len))
+		goto err_invalid;
+
+	req->sender	= &ip6->ip6_src;
+	req->target	= &ns->nd_ns_target;
+	req->sender_mac	= eth->h_source;
+	return 0;
+
+err_invalid:
+	return -1;
+}
+
+/*
+ * Solicited advertisement from the target to the solicitor, as a
+ * router, overriding what it had. Returns the size of the frame.
+ */
+unsigned int nd_na_reply(uint8_t *frame, uint8_t *mac)
+{
+	struct ethhdr *eth;
+	struct ip6_hdr *ip6;
+	struct nd_na *na;
+	struct in6_addr target;
+
+	eth = (struct ethhdr *)frame;
+	ip6 = (struct ip6_hdr *)(frame + sizeof(struct ethhdr));
+	na = (struct nd_na *)(ip6 + 1);
+
+	memcpy(eth->h_dest, eth->h_source, ETH_ALEN);
+	memcpy(eth->h_source, mac, ETH_ALEN);
+
+	/* the target stays where it was in the solicitation */
+	memcpy(&target, &na->advert.nd_na_target, sizeof(struct in6_addr));
+	memcpy(&ip6->ip6_dst, &ip6->ip6_src, sizeof(struct in6_addr));
+	memcpy(&ip6->ip6_src, &target, sizeof(struct in6_addr));
+	ip6->ip6_flow = htonl(6 << 28);
+	ip6->ip6_plen = htons(sizeof(struct nd_na));
+	ip6->ip6_hlim = 255;
+
+	na->advert.nd_na_type		= ND_NEIGHBOR_ADVERT;
+	na->advert.nd_na_code		= 0;
+	na->advert.nd_na_cksum		= 0;
+	na->advert.nd_na_flags_reserved	= ND_NA_FLAG_ROUTER
+		| ND_NA_FLAG_SOLICITED | ND_NA_FLAG_OVERRIDE;
+	na->opt.nd_opt_type		= ND_OPT_TARGET_LINKADDR;
+	na->opt.nd_opt_len		= 1;
+	memcpy(na->mac, mac, ETH_ALEN);
+	na->advert.nd_na_cksum		= nd_csum(ip6, na, sizeof(struct nd_na));
+
+	return sizeof(struct ethhdr) + sizeof(struct ip6_hdr)
+		+ sizeof(struct nd_na);
+}
+
+/* ICMPv6 checksum over the pseudo-header, 0 for a valid one */
+static uint16_t nd_csum(struct ip6_hdr *ip6, void *data, unsigned int len)
+{
+	uint16_t *words;
+	uint32_t sum;
+	unsigned int i;
+
+	sum = htons(len) + htons(IPPROTO_ICMPV6);
+
+	words = (uint16_t *)&ip6->ip6_src;
+	for(i = 0; i < sizeof(struct in6_addr); i++){
+		sum += words[i];
+	}
+
+	words = data;
+	for(i = 0; i < len / 2; i++){
+		sum += words[i];
+	}
+
+	if(len & 1)
+		sum += htons(((uint8_t *)data)[len - 1] << 8);
+
+	while(sum >> 16){
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+
+	return ~sum;
+}
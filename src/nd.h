@@ -0,0 +1,80 @@
+#ifndef _IXMAPFWD_ND_H
+#define _IXMAPFWD_ND_H
+
+#include <stdint.h>
+#include <linux/if_ether.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+#include <ixmap.h>
+
+/*
+ * ARP requests and IPv6 Neighbor Solicitations for the addresses of
+ * the router, answered by the thread that received them: the request
+ * is rewritten in place into its reply and sent back out of its port.
+ * Each port of a thread answers up to ND_RATE per second, past which
+ * requests are dropped, see forward_arp_process().
+ */
+#define ND_RATE			1000 /* answers per second, port and thread */
+
+struct nd_port {
+	unsigned int		tokens;
+	unsigned long		arp_answered;
+	unsigned long		ns_answered;
+	unsigned long		punted; /* to the kernel, see forward.c */
+	unsigned long		limited; /* dropped past ND_RATE */
+};
+
+struct nd_table {
+	struct nd_port		*ports;
+	unsigned int		num_ports;
+	unsigned int		taken; /* some token since the last refill */
+	unsigned long		stamp; /* last refill, in ms */
+};
+
+/* What a request asks, pointing into its frame */
+struct nd_request {
+	void			*sender; /* IPv4 or IPv6 address */
+	void			*target;
+	uint8_t			*sender_mac;
+};
+
+struct nd_table *nd_alloc(struct ixmap_desc *desc, unsigned int num_ports);
+void nd_release(struct nd_table *nd);
+void nd_refill(struct nd_table *nd, unsigned long now);
+int nd_arp_parse(uint8_t *frame, unsigned int size,
+	struct nd_request *req);
+void nd_arp_reply(uint8_t *frame, uint8_t *mac);
+int nd_ns_parse(uint8_t *frame, unsigned int size,
+	struct nd_request *req);
+unsigned int nd_na_reply(uint8_t *frame, uint8_t *mac);
+
+/* Solicitations come to multicast groups, not to a local address */
+static inline int nd_ns_match(uint8_t *frame)
+{
+	struct ip6_hdr *ip6;
+	struct icmp6_hdr *icmp6;
+
+	ip6 = (struct ip6_hdr *)(frame + sizeof(struct ethhdr));
+	icmp6 = (struct icmp6_hdr *)(ip6 + 1);
+
+	return ip6->ip6_nxt == IPPROTO_ICMPV6
+		&& icmp6->icmp6_type == ND_NEIGHBOR_SOLICIT;
+}
+
+/* One token of the port, -1 counted as limited if none is left */
+static inline int nd_take(struct nd_table *nd, unsigned int port_index)
+{
+	struct nd_port *port = &nd->ports[port_index];
+
+	if(!port->tokens){
+		port->limited++;
+		return -1;
+	}
+
+	port->tokens--;
+	nd->taken = 1;
+	return 0;
+}
+
+#endif /* _IXMAPFWD_ND_H */
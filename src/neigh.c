@@ -5,18 +5,33 @@
 #include <netinet/ip.h>
 #include <arpa/inet.h>
 #include <stddef.h>
+#include <time.h>
+#ifdef __x86_64__
+#include <nmmintrin.h>
+#endif
 #include <ixmap.h>
 
 #include "main.h"
+#include "hash.h"
 #include "neigh.h"
 
-static void neigh_entry_delete(struct hash_entry *entry);
-static unsigned int neigh_key_generate_v4(void *key,
-	unsigned int bit_len);
-static unsigned int neigh_key_generate_v6(void *key,
-	unsigned int bit_len);
-static int neigh_key_compare_v4(void *key_tgt, void *key_ent);
-static int neigh_key_compare_v6(void *key_tgt, void *key_ent);
+static uint32_t neigh_seed(struct neigh_table *neigh);
+static struct neigh_layout *neigh_layout_alloc(struct ixmap_desc *desc,
+	unsigned int num_buckets);
+static void neigh_layout_free(void *ptr, unsigned long data);
+static void neigh_release_deferred(void *ptr, unsigned long data);
+static void neigh_bucket_put(struct neigh_bucket *bucket, int way,
+	uint16_t sig, uint32_t index);
+static int neigh_find(struct neigh_table *neigh, void *key,
+	struct neigh_bucket **bucket_ret);
+static int neigh_insert(struct neigh_table *neigh,
+	struct neigh_layout *layout, uint32_t index);
+static int neigh_grow(struct neigh_table *neigh, uint32_t index,
+	struct ixmap_desc *desc);
+static void neigh_entry_free(struct neigh_table *neigh,
+	struct neigh_layout *layout, uint32_t index);
+static void neigh_entry_begin(struct neigh_entry *entry);
+static void neigh_entry_end(struct neigh_entry *entry);
 
 #ifdef DEBUG
 static void neigh_add_print(int family,
@@ -86,161 +101,756 @@ static void neigh_delete_print(int family,
 }
 #endif
 
-struct neigh_table *neigh_alloc(struct ixmap_desc *desc, int family)
+/*
+ * The lookup path is inlined in one instance per key length and hash,
+ * see NEIGH_LOOKUP_DEFINE(). Helpers taking key_len get it constant
+ * there, and from the table on the control path.
+ */
+#define neigh_inline	inline __attribute__((always_inline))
+
+static neigh_inline uint32_t neigh_hash_mul4(void *key, uint32_t seed)
+{
+	return ((seed ^ *(uint32_t *)key) * GOLDEN_RATIO_64) >> 32;
+}
+
+static neigh_inline uint32_t neigh_hash_mul16(void *key, uint32_t seed)
+{
+	uint64_t hash = seed;
+	int i;
+
+	for(i = 0; i < 4; i++){
+		hash = (hash ^ ((uint32_t *)key)[i]) * GOLDEN_RATIO_64;
+	}
+
+	return hash >> 32;
+}
+
+#ifdef __x86_64__
+/* CRC32C spreads every input bit over the result, zeros included */
+__attribute__((target("sse4.2")))
+static neigh_inline uint32_t neigh_hash_crc4(void *key, uint32_t seed)
+{
+	return _mm_crc32_u32(seed, *(uint32_t *)key);
+}
+
+__attribute__((target("sse4.2")))
+static neigh_inline uint32_t neigh_hash_crc16(void *key, uint32_t seed)
+{
+	uint64_t hash = seed;
+
+	hash = _mm_crc32_u64(hash, ((uint64_t *)key)[0]);
+	hash = _mm_crc32_u64(hash, ((uint64_t *)key)[1]);
+	return hash;
+}
+#endif
+
+/* 16 bits of the hash, the bucket comes from the others */
+static neigh_inline uint16_t neigh_sig(uint32_t hash)
+{
+	uint16_t sig = hash >> 16;
+
+	return sig == NEIGH_SIG_EMPTY ? 1 : sig;
+}
+
+/* Never the bucket itself, and back to it from the other one */
+static neigh_inline unsigned int neigh_bucket_alt(struct neigh_layout *layout,
+	unsigned int bucket_index, uint16_t sig)
+{
+	return (bucket_index ^ (sig | 1)) & layout->mask;
+}
+
+static neigh_inline int neigh_key_equal(void *key_ent, void *key,
+	unsigned int key_len)
+{
+#ifdef __x86_64__
+	__m128i cmp;
+#endif
+
+	if(key_len == 4)
+		return *(uint32_t *)key_ent == *(uint32_t *)key;
+
+#ifdef __x86_64__
+	cmp = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)key_ent),
+		_mm_loadu_si128((__m128i *)key));
+	return _mm_movemask_epi8(cmp) == 0xffff;
+#else
+	return !((((uint64_t *)key_ent)[0] ^ ((uint64_t *)key)[0])
+		| (((uint64_t *)key_ent)[1] ^ ((uint64_t *)key)[1]));
+#endif
+}
+
+/* Ways holding sig, two bits each as _mm_movemask_epi8() gives them */
+static neigh_inline unsigned int neigh_bucket_match(
+	struct neigh_bucket *bucket, uint16_t sig)
+{
+	unsigned int match;
+#ifdef __x86_64__
+	__m128i cmp;
+
+	cmp = _mm_cmpeq_epi16(_mm_set1_epi16(sig),
+		_mm_load_si128((__m128i *)bucket->sig));
+	match = _mm_movemask_epi8(cmp);
+#else
+	int i;
+
+	match = 0;
+	for(i = 0; i < NEIGH_WAYS; i++){
+		if(bucket->sig[i] == sig)
+			match |= 3 << (i * 2);
+	}
+#endif
+
+	return match;
+}
+
+/* The entry of key among the matching ways, NULL without it */
+static neigh_inline struct neigh_entry *neigh_bucket_search(
+	struct neigh_layout *layout, struct neigh_stats *stats,
+	struct neigh_bucket *bucket, unsigned int match, void *key,
+	unsigned int key_len, int *way_ret)
+{
+	struct neigh_entry *entry;
+	int way;
+
+	stats->probes++;
+
+	while(match){
+		way = __builtin_ctz(match) >> 1;
+		match &= ~(3 << (way * 2));
+
+		entry = &layout->entries[bucket->index[way]];
+		if(neigh_key_equal(entry->dst_addr, key, key_len)){
+			*way_ret = way;
+			return entry;
+		}
+
+		stats->collisions++;
+	}
+
+	return NULL;
+}
+
+/* The entry of key, with its bucket and way, NULL without it */
+static neigh_inline struct neigh_entry *neigh_find_hashed(
+	struct neigh_layout *layout, struct neigh_stats *stats, void *key,
+	uint32_t hash, unsigned int key_len,
+	struct neigh_bucket **bucket_ret, int *way_ret)
+{
+	struct neigh_bucket *bucket;
+	struct neigh_entry *entry;
+	unsigned int bucket_index;
+	uint16_t sig;
+	int i;
+
+	sig = neigh_sig(hash);
+	bucket_index = hash & layout->mask;
+	stats->lookups++;
+
+	for(i = 0; i < 2; i++){
+		bucket = &layout->buckets[bucket_index];
+		entry = neigh_bucket_search(layout, stats, bucket,
+			neigh_bucket_match(bucket, sig), key, key_len, way_ret);
+		if(entry){
+			*bucket_ret = bucket;
+			return entry;
+		}
+
+		bucket_index = neigh_bucket_alt(layout, bucket_index, sig);
+	}
+
+	return NULL;
+}
+
+/* Waits out the writer moving entries, see neigh_insert() */
+static neigh_inline unsigned int neigh_moves_begin(struct neigh_table *neigh)
+{
+	unsigned int moves;
+
+	while(unlikely((moves = neigh->moves) & 1))
+		cpu_relax();
+
+	smp_rmb();
+	return moves;
+}
+
+/* A miss is only trusted if no entry moved during the lookup */
+static neigh_inline int neigh_moves_retry(struct neigh_table *neigh,
+	unsigned int moves)
+{
+	smp_rmb();
+	return unlikely(neigh->moves != moves);
+}
+
+/*
+ * Up to NEIGH_BULK lookups in three passes, so that their misses
+ * overlap: every bucket is prefetched once hashed, every entry once
+ * its signature matched, and keys are compared last. The other bucket
+ * of a key is only read when the first does not hold it.
+ */
+static neigh_inline void neigh_lookup_bulk_hashed(struct neigh_layout *layout,
+	struct neigh_stats *stats, void **dst, struct neigh_entry **entries,
+	uint32_t *hash, unsigned int num, unsigned int key_len)
+{
+	struct neigh_bucket *bucket[NEIGH_BULK];
+	unsigned int bucket_index[NEIGH_BULK], match[NEIGH_BULK], i;
+	uint16_t sig[NEIGH_BULK];
+	int way;
+
+	for(i = 0; i < num; i++){
+		sig[i] = neigh_sig(hash[i]);
+		bucket_index[i] = hash[i] & layout->mask;
+		bucket[i] = &layout->buckets[bucket_index[i]];
+		prefetch(bucket[i]);
+	}
+
+	for(i = 0; i < num; i++){
+		match[i] = neigh_bucket_match(bucket[i], sig[i]);
+		if(match[i])
+			prefetch(&layout->entries[bucket[i]->index[
+				__builtin_ctz(match[i]) >> 1]]);
+	}
+
+	for(i = 0; i < num; i++){
+		entries[i] = neigh_bucket_search(layout, stats, bucket[i],
+			match[i], dst[i], key_len, &way);
+		if(entries[i])
+			continue;
+
+		bucket[i] = &layout->buckets[neigh_bucket_alt(layout,
+			bucket_index[i], sig[i])];
+		entries[i] = neigh_bucket_search(layout, stats, bucket[i],
+			neigh_bucket_match(bucket[i], sig[i]),
+			dst[i], key_len, &way);
+	}
+
+	stats->lookups += num;
+	return;
+}
+
+/*
+ * One hash and one single and bulk lookup per key length and hash
+ * function, with nothing left to call through a pointer inside. The
+ * hash takes the target of its instructions along in attr. Misses
+ * of a burst during which entries moved are looked up again alone.
+ */
+#define NEIGH_LOOKUP_DEFINE(name, attr, key_len)			\
+attr static uint32_t neigh_hash_##name##_call(void *key,		\
+	uint32_t seed)							\
+{									\
+	return neigh_hash_##name(key, seed);				\
+}									\
+									\
+attr static struct neigh_entry *neigh_lookup_##name(			\
+	struct neigh_table *neigh, struct neigh_stats *stats,		\
+	void *key)							\
+{									\
+	struct neigh_bucket *bucket;					\
+	struct neigh_entry *entry;					\
+	unsigned int moves;						\
+	uint32_t hash;							\
+	int way;							\
+									\
+	hash = neigh_hash_##name(key, neigh->seed);			\
+									\
+	do{								\
+		moves = neigh_moves_begin(neigh);			\
+		entry = neigh_find_hashed(ACCESS_ONCE(neigh->layout),	\
+			stats, key, hash, key_len, &bucket, &way);	\
+		if(entry)						\
+			return entry;					\
+	}while(neigh_moves_retry(neigh, moves));			\
+									\
+	return NULL;							\
+}									\
+									\
+attr static void neigh_lookup_bulk_##name(struct neigh_table *neigh,	\
+	struct neigh_stats *stats, void **dst,				\
+	struct neigh_entry **entries, unsigned int num)			\
+{									\
+	uint32_t hash[NEIGH_BULK];					\
+	unsigned int base, num_bulk, moves, i;				\
+									\
+	for(base = 0; base < num; base += num_bulk){			\
+		num_bulk = min(num - base, (unsigned int)NEIGH_BULK);	\
+		for(i = 0; i < num_bulk; i++){				\
+			hash[i] = neigh_hash_##name(dst[base + i],	\
+				neigh->seed);				\
+		}							\
+									\
+		moves = neigh_moves_begin(neigh);			\
+		neigh_lookup_bulk_hashed(ACCESS_ONCE(neigh->layout),	\
+			stats, &dst[base], &entries[base], hash,	\
+			num_bulk, key_len);				\
+		if(!neigh_moves_retry(neigh, moves))			\
+			continue;					\
+									\
+		for(i = base; i < base + num_bulk; i++){		\
+			if(!entries[i])					\
+				entries[i] = neigh_lookup_##name(	\
+					neigh, stats, dst[i]);		\
+		}							\
+	}								\
+}
+
+NEIGH_LOOKUP_DEFINE(mul4, , 4)
+NEIGH_LOOKUP_DEFINE(mul16, , 16)
+#ifdef __x86_64__
+NEIGH_LOOKUP_DEFINE(crc4, __attribute__((target("sse4.2"))), 4)
+NEIGH_LOOKUP_DEFINE(crc16, __attribute__((target("sse4.2"))), 16)
+#endif
+
+struct neigh_table *neigh_alloc(struct ixmap_desc *desc, int family,
+	struct qsbr *qsbr)
 {
 	struct neigh_table *neigh;
+	unsigned int i;
 
 	neigh = ixmap_mem_alloc(desc, sizeof(struct neigh_table));
 	if(!neigh)
 		goto err_neigh_alloc;
 
-	hash_init(&neigh->table);
-	neigh->table.hash_entry_delete = neigh_entry_delete;
+	memset(neigh, 0, sizeof(struct neigh_table));
 
 	switch(family){
 	case AF_INET:
-		neigh->table.hash_key_generate =
-			neigh_key_generate_v4;
-		neigh->table.hash_key_compare =
-			neigh_key_compare_v4;
+		neigh->key_len = 4;
 		break;
 	case AF_INET6:
-		neigh->table.hash_key_generate =
-			neigh_key_generate_v6;
-		neigh->table.hash_key_compare =
-			neigh_key_compare_v6;
+		neigh->key_len = 16;
 		break;
 	default:
 		goto err_invalid_family;
 		break;
 	}
 
+	neigh->layout = neigh_layout_alloc(desc, NEIGH_BUCKETS_MIN);
+	if(!neigh->layout)
+		goto err_layout_alloc;
+
+	neigh->free = NEIGH_INDEX_NONE;
+	for(i = NEIGH_BUCKETS_MIN * NEIGH_WAYS; i-- > 0;){
+		neigh_entry_free(neigh, neigh->layout, i);
+	}
+
+	neigh->qsbr = qsbr;
+	neigh->seed = neigh_seed(neigh);
+
+	if(neigh->key_len == 4){
+		neigh->hash		= neigh_hash_mul4_call;
+		neigh->lookup		= neigh_lookup_mul4;
+		neigh->lookup_bulk	= neigh_lookup_bulk_mul4;
+	}else{
+		neigh->hash		= neigh_hash_mul16_call;
+		neigh->lookup		= neigh_lookup_mul16;
+		neigh->lookup_bulk	= neigh_lookup_bulk_mul16;
+	}
+
+#ifdef __x86_64__
+	if(__builtin_cpu_supports("sse4.2") && neigh->key_len == 4){
+		neigh->hash		= neigh_hash_crc4_call;
+		neigh->lookup		= neigh_lookup_crc4;
+		neigh->lookup_bulk	= neigh_lookup_bulk_crc4;
+	}else if(__builtin_cpu_supports("sse4.2")){
+		neigh->hash		= neigh_hash_crc16_call;
+		neigh->lookup		= neigh_lookup_crc16;
+		neigh->lookup_bulk	= neigh_lookup_bulk_crc16;
+	}
+#endif
+
 	return neigh;
 
+err_layout_alloc:
 err_invalid_family:
 	ixmap_mem_free(neigh);
 err_neigh_alloc:
 	return NULL;
 }
 
+/* No reader may look the table up any longer */
 void neigh_release(struct neigh_table *neigh)
 {
-	hash_delete_all(&neigh->table);
+	neigh_layout_free(neigh->layout, 0);
 	ixmap_mem_free(neigh);
 	return;
 }
 
-static void neigh_entry_delete(struct hash_entry *entry)
+/* Released once the readers that may still look it up are done */
+void neigh_retire(struct neigh_table *neigh)
 {
-	struct neigh_entry *neigh_entry;
+	qsbr_call(neigh->qsbr, neigh_release_deferred, neigh, 0);
+	return;
+}
 
-	neigh_entry = hash_entry(entry, struct neigh_entry, hash);
-	ixmap_mem_free(neigh_entry);
+static void neigh_release_deferred(void *ptr, unsigned long data)
+{
+	neigh_release(ptr);
 	return;
 }
 
-static unsigned int neigh_key_generate_v4(void *key, unsigned int bit_len)
+/* Differs between tables, so no set of addresses collides everywhere */
+static uint32_t neigh_seed(struct neigh_table *neigh)
 {
-	/* On some cpus multiply is faster, on others gcc will do shifts */
-	uint32_t hash = *((uint32_t *)key) * GOLDEN_RATIO_PRIME_32;
+	struct timespec ts;
+	uint64_t seed;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	seed = (ts.tv_sec * 1000000000ULL + ts.tv_nsec)
+		^ (uintptr_t)neigh;
 
-	/* High bits are more random, so use them. */
-	return hash >> (32 - bit_len);
+	return (seed * GOLDEN_RATIO_64) >> 32;
 }
 
-static unsigned int neigh_key_generate_v6(void *key, unsigned int bit_len)
+/* Empty buckets, and entries left for the caller to fill */
+static struct neigh_layout *neigh_layout_alloc(struct ixmap_desc *desc,
+	unsigned int num_buckets)
 {
-	uint64_t hash = ((uint64_t *)key)[0] * ((uint64_t *)key)[1];
-	hash *= GOLDEN_RATIO_PRIME_64;
+	struct neigh_layout *layout;
+
+	layout = ixmap_mem_alloc(desc, sizeof(struct neigh_layout));
+	if(!layout)
+		goto err_layout_alloc;
+
+	layout->buckets = ixmap_mem_alloc(desc,
+		sizeof(struct neigh_bucket) * num_buckets);
+	if(!layout->buckets)
+		goto err_buckets_alloc;
+
+	layout->entries = ixmap_mem_alloc(desc,
+		sizeof(struct neigh_entry) * num_buckets * NEIGH_WAYS);
+	if(!layout->entries)
+		goto err_entries_alloc;
+
+	memset(layout->buckets, 0, sizeof(struct neigh_bucket) * num_buckets);
+	memset(layout->entries, 0,
+		sizeof(struct neigh_entry) * num_buckets * NEIGH_WAYS);
+	layout->mask = num_buckets - 1;
+	return layout;
+
+err_entries_alloc:
+	ixmap_mem_free(layout->buckets);
+err_buckets_alloc:
+	ixmap_mem_free(layout);
+err_layout_alloc:
+	return NULL;
+}
 
-	return hash >> (64 - bit_len);
+static void neigh_layout_free(void *ptr, unsigned long data)
+{
+	struct neigh_layout *layout = ptr;
+
+	ixmap_mem_free(layout->entries);
+	ixmap_mem_free(layout->buckets);
+	ixmap_mem_free(layout);
+	return;
 }
 
-static int neigh_key_compare_v4(void *key_tgt, void *key_ent)
+/* The signature last, a reader matching it finds the index set */
+static void neigh_bucket_put(struct neigh_bucket *bucket, int way,
+	uint16_t sig, uint32_t index)
 {
-	return ((uint32_t *)key_tgt)[0] ^ ((uint32_t *)key_ent)[0] ?
-		1 : 0;
+	bucket->index[way] = index;
+	smp_wmb();
+	bucket->sig[way] = sig;
+	return;
 }
 
-static int neigh_key_compare_v6(void *key_tgt, void *key_ent)
+/* The way of key in *bucket_ret, -1 without it. Writer only */
+static int neigh_find(struct neigh_table *neigh, void *key,
+	struct neigh_bucket **bucket_ret)
 {
-	return ((uint64_t *)key_tgt)[0] ^ ((uint64_t *)key_ent)[0] ?
-		1 : (((uint64_t *)key_tgt)[1] ^ ((uint64_t *)key_ent)[1] ?
-		1 : 0);
+	int way;
+
+	if(!neigh_find_hashed(neigh->layout, &neigh->control, key,
+	neigh->hash(key, neigh->seed), neigh->key_len, bucket_ret, &way))
+		return -1;
+
+	return way;
 }
 
+/*
+ * Places the entry at index, moving residents to their other bucket
+ * on the way, with moves odd meanwhile. After NEIGH_KICKS_MAX moves
+ * they are undone, so that no key but the new one is left out.
+ */
+static int neigh_insert(struct neigh_table *neigh,
+	struct neigh_layout *layout, uint32_t index)
+{
+	struct neigh_bucket *bucket, *path[NEIGH_KICKS_MAX];
+	unsigned int bucket_index, match, kicks;
+	uint32_t hash, index_kick;
+	uint16_t sig, sig_kick;
+	int way, ways[NEIGH_KICKS_MAX], ret;
+
+	hash = neigh->hash(layout->entries[index].dst_addr, neigh->seed);
+	sig = neigh_sig(hash);
+	bucket_index = hash & layout->mask;
+
+	for(kicks = 0; kicks < 2; kicks++){
+		bucket = &layout->buckets[bucket_index];
+		match = neigh_bucket_match(bucket, NEIGH_SIG_EMPTY);
+		if(match){
+			neigh_bucket_put(bucket, __builtin_ctz(match) >> 1,
+				sig, index);
+			return 0;
+		}
+
+		bucket_index = neigh_bucket_alt(layout, bucket_index, sig);
+	}
+
+	neigh->moves++;
+	smp_wmb();
+
+	ret = -1;
+	for(kicks = 0; kicks < NEIGH_KICKS_MAX; kicks++){
+		bucket = &layout->buckets[bucket_index];
+		match = neigh_bucket_match(bucket, NEIGH_SIG_EMPTY);
+		if(match){
+			neigh_bucket_put(bucket, __builtin_ctz(match) >> 1,
+				sig, index);
+			ret = 0;
+			break;
+		}
+
+		way = (sig ^ kicks) % NEIGH_WAYS;
+		sig_kick = bucket->sig[way];
+		index_kick = bucket->index[way];
+		bucket->sig[way] = sig;
+		bucket->index[way] = index;
+		path[kicks] = bucket;
+		ways[kicks] = way;
+
+		sig = sig_kick;
+		index = index_kick;
+		bucket_index = neigh_bucket_alt(layout, bucket_index, sig);
+		neigh->kicks++;
+	}
+
+	/* back along the path, the new entry comes out last */
+	while(ret < 0 && kicks-- > 0){
+		bucket = path[kicks];
+		way = ways[kicks];
+		sig_kick = bucket->sig[way];
+		index_kick = bucket->index[way];
+		bucket->sig[way] = sig;
+		bucket->index[way] = index;
+
+		sig = sig_kick;
+		index = index_kick;
+	}
+
+	smp_wmb();
+	neigh->moves++;
+	return ret;
+}
+
+/*
+ * A layout with twice the buckets and entries, holding every entry of
+ * the current one and the one at index, if any, published once full.
+ * Entries keep their index. Readers of the old layout find the table
+ * as it was until they are done with it.
+ */
+static int neigh_grow(struct neigh_table *neigh, uint32_t index,
+	struct ixmap_desc *desc)
+{
+	struct neigh_layout *layout_old, *layout;
+	struct neigh_bucket *bucket;
+	unsigned int num_buckets, size_old, i;
+	int way, ret;
+
+	layout_old = neigh->layout;
+	size_old = (layout_old->mask + 1) * NEIGH_WAYS;
+
+	for(num_buckets = (layout_old->mask + 1) * 2;
+	num_buckets <= (1 << 16); num_buckets *= 2){
+		layout = neigh_layout_alloc(desc, num_buckets);
+		if(!layout)
+			goto err_layout_alloc;
+
+		memcpy(layout->entries, layout_old->entries,
+			sizeof(struct neigh_entry) * size_old);
+
+		ret = index == NEIGH_INDEX_NONE ? 0 :
+			neigh_insert(neigh, layout, index);
+		for(i = 0; !ret && i <= layout_old->mask; i++){
+			bucket = &layout_old->buckets[i];
+			for(way = 0; !ret && way < NEIGH_WAYS; way++){
+				if(bucket->sig[way] == NEIGH_SIG_EMPTY)
+					continue;
+
+				ret = neigh_insert(neigh, layout,
+					bucket->index[way]);
+			}
+		}
+
+		if(!ret)
+			break;
+
+		neigh_layout_free(layout, 0);
+	}
+
+	if(num_buckets > (1 << 16))
+		goto err_layout_alloc;
+
+	/* new indexes go to the chain after those still free */
+	for(i = num_buckets * NEIGH_WAYS; i-- > size_old;){
+		neigh_entry_free(neigh, layout, i);
+	}
+
+	smp_wmb();
+	ACCESS_ONCE(neigh->layout) = layout;
+	neigh->grows++;
+
+	qsbr_call(neigh->qsbr, neigh_layout_free, layout_old, 0);
+	return 0;
+
+err_layout_alloc:
+	return -1;
+}
+
+/* Pushed on the free chain, past readers see the key cleared */
+static void neigh_entry_free(struct neigh_table *neigh,
+	struct neigh_layout *layout, uint32_t index)
+{
+	struct neigh_entry *entry;
+
+	entry = &layout->entries[index];
+
+	neigh_entry_begin(entry);
+	memset(entry->dst_addr, 0, sizeof(entry->dst_addr));
+	entry->next = neigh->free;
+	neigh_entry_end(entry);
+
+	neigh->free = index;
+	return;
+}
+
+static void neigh_entry_begin(struct neigh_entry *entry)
+{
+	entry->seq++;
+	smp_wmb();
+	return;
+}
+
+static void neigh_entry_end(struct neigh_entry *entry)
+{
+	smp_wmb();
+	entry->seq++;
+	return;
+}
+
+/* A known neighbor takes the new address, a MAC write under its seq */
 int neigh_add(struct neigh_table *neigh, int family,
 	void *dst_addr, void *mac_addr, struct ixmap_desc *desc) 
 {
+	struct neigh_bucket *bucket;
 	struct neigh_entry *neigh_entry;
-	int ret;
-
-	neigh_entry = ixmap_mem_alloc(desc, sizeof(struct neigh_entry));
-	if(!neigh_entry)
-		goto err_alloc_entry;
+	uint32_t index;
+	int way, ret;
 
-	memcpy(neigh_entry->dst_mac, mac_addr, ETH_ALEN);
-	switch(family){
-	case AF_INET:
-		memcpy(neigh_entry->dst_addr, dst_addr, 4);
-		break;
-	case AF_INET6:
-		memcpy(neigh_entry->dst_addr, dst_addr, 16);
-		break;
-	default:
+	if(family != (neigh->key_len == 4 ? AF_INET : AF_INET6))
 		goto err_invalid_family;
-		break;
-	}
 
 #ifdef DEBUG
 	neigh_add_print(family, dst_addr, mac_addr);
 #endif
 
-	ret = hash_add(&neigh->table, neigh_entry->dst_addr, &neigh_entry->hash);
-	if(ret < 0)
-		goto err_hash_add;
+	way = neigh_find(neigh, dst_addr, &bucket);
+	if(way >= 0){
+		neigh_entry = &neigh->layout->entries[bucket->index[way]];
+		neigh_entry_begin(neigh_entry);
+		memcpy(neigh_entry->dst_mac, mac_addr, ETH_ALEN);
+		neigh_entry_end(neigh_entry);
+		return 0;
+	}
+
+	if(neigh->free == NEIGH_INDEX_NONE){
+		ret = neigh_grow(neigh, NEIGH_INDEX_NONE, desc);
+		if(ret < 0)
+			goto err_grow;
+	}
+
+	index = neigh->free;
+	neigh_entry = &neigh->layout->entries[index];
+	neigh->free = neigh_entry->next;
 
+	neigh_entry_begin(neigh_entry);
+	memcpy(neigh_entry->dst_addr, dst_addr, neigh->key_len);
+	memcpy(neigh_entry->dst_mac, mac_addr, ETH_ALEN);
+	neigh_entry->used = 0;
+	neigh_entry_end(neigh_entry);
+
+	ret = neigh_insert(neigh, neigh->layout, index);
+	if(ret < 0){
+		ret = neigh_grow(neigh, index, desc);
+		if(ret < 0)
+			goto err_insert;
+	}
+
+	neigh->num_entries++;
 	return 0;
 
-err_hash_add:
+err_insert:
+	neigh_entry_free(neigh, neigh->layout, index);
+err_grow:
 err_invalid_family:
-	ixmap_mem_free(neigh_entry);
-err_alloc_entry:
 	return -1;
 }
 
 int neigh_delete(struct neigh_table *neigh, int family,
 	void *dst_addr)
 {
-	int ret;
+	struct neigh_bucket *bucket;
+	int way;
 
 #ifdef DEBUG
 	neigh_delete_print(family, dst_addr);
 #endif
 
-	ret = hash_delete(&neigh->table, dst_addr);
-	if(ret < 0)
-		goto err_hash_delete;
+	way = neigh_find(neigh, dst_addr, &bucket);
+	if(way < 0)
+		goto err_not_found;
 
+	bucket->sig[way] = NEIGH_SIG_EMPTY;
+	neigh_entry_free(neigh, neigh->layout, bucket->index[way]);
+	neigh->num_entries--;
 	return 0;
 
-err_hash_delete:
+err_not_found:
 	return -1;
 }
 
-struct neigh_entry *neigh_lookup(struct neigh_table *neigh,
-	void *dst_addr)
+/* Writer only, its view of the table needs no retry nor seq */
+struct neigh_entry *neigh_get(struct neigh_table *neigh, void *dst_addr)
 {
-	struct hash_entry *hash_entry;
-	struct neigh_entry *neigh_entry;
+	struct neigh_bucket *bucket;
+	int way;
 
-	hash_entry = hash_lookup(&neigh->table, dst_addr);
-	if(!hash_entry)
-		goto err_hash_lookup;
+	way = neigh_find(neigh, dst_addr, &bucket);
+	if(way < 0)
+		return NULL;
 
-	neigh_entry = hash_entry(hash_entry, struct neigh_entry, hash);
-	return neigh_entry;
+	return &neigh->layout->entries[bucket->index[way]];
+}
 
-err_hash_lookup:
-	return NULL;
+void neigh_walk(struct neigh_table *neigh,
+	void (*func)(struct neigh_entry *, void *), void *arg)
+{
+	struct neigh_layout *layout;
+	struct neigh_bucket *bucket;
+	unsigned int i;
+	int way;
+
+	layout = neigh->layout;
+
+	for(i = 0; i <= layout->mask; i++){
+		bucket = &layout->buckets[i];
+		for(way = 0; way < NEIGH_WAYS; way++){
+			if(bucket->sig[way] == NEIGH_SIG_EMPTY)
+				continue;
+
+			func(&layout->entries[bucket->index[way]], arg);
+		}
+	}
+
+	return;
 }
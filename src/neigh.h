@@ -1,30 +1,147 @@
 #ifndef _IXMAPFWD_NEIGH_H
 #define _IXMAPFWD_NEIGH_H
 
+#include <stdint.h>
+#include <string.h>
 #include <linux/if_ether.h>
 #include <pthread.h>
-#include "hash.h"
+#include "qsbr.h"
 
-#define GOLDEN_RATIO_PRIME_32 0x9e370001UL
-#define GOLDEN_RATIO_PRIME_64 0x9e37fffffffc0001UL
+/*
+ * Neighbors of one port and family, shared by the threads of a NUMA
+ * node and changed by its FIB writer alone. A bucketized cuckoo hash:
+ * a bucket is one cache line of NEIGH_WAYS 16 bit signatures and the
+ * entries they stand for. A key lives in one of two buckets, the other
+ * derived from the one it is in and its signature, so it moves without
+ * being hashed again. The table starts small and doubles when an
+ * insert finds no room.
+ *
+ * Lookups take no lock. An entry is read under its seq, see
+ * neigh_load(), and a lookup missing while moves changed tries again,
+ * as the key may have been on its way to its other bucket. A table
+ * grows into a new layout, the old one is retired through qsbr.
+ */
+#define NEIGH_WAYS		8
+#define NEIGH_BUCKETS_MIN	2
+#define NEIGH_KICKS_MAX		64 /* moves before the table grows */
+#define NEIGH_SIG_EMPTY		0
+#define NEIGH_INDEX_NONE	((uint32_t)-1)
+#define NEIGH_BULK		32 /* lookups in flight in neigh_lookup_bulk() */
 
-struct neigh_table {
-	struct hash_table	table;
-};
+struct neigh_bucket {
+	uint16_t		sig[NEIGH_WAYS];
+	uint32_t		index[NEIGH_WAYS]; /* into entries */
+} __attribute__ ((aligned(64)));
 
+/* two per cache line, none across two */
 struct neigh_entry {
-	struct hash_entry	hash;
-	uint8_t			dst_mac[ETH_ALEN];
 	uint32_t		dst_addr[4];
+	uint8_t			dst_mac[ETH_ALEN];
+	uint8_t			used; /* by any core of the node, see neigh_use() */
+	volatile unsigned int	seq; /* odd while the writer is inside */
+	uint32_t		next; /* free chain */
+} __attribute__ ((aligned(32)));
+
+/* What a lookup reads, replaced whole when the table grows */
+struct neigh_layout {
+	struct neigh_bucket	*buckets;
+	struct neigh_entry	*entries; /* NEIGH_WAYS per bucket */
+	unsigned int		mask;
 };
 
-struct neigh_table *neigh_alloc(struct ixmap_desc *desc, int family);
+/* How the hash does for one reader, see thread_print_neigh() */
+struct neigh_stats {
+	unsigned long		lookups;
+	unsigned long		probes; /* buckets read */
+	unsigned long		collisions; /* signatures of other keys */
+};
+
+struct neigh_table {
+	struct neigh_layout	*layout;
+	volatile unsigned int	moves; /* odd while entries change bucket */
+	unsigned int		key_len;
+	uint32_t		seed;
+	uint32_t		(*hash)(
+				void *,
+				uint32_t
+				);
+	struct neigh_entry	*(*lookup)(
+				struct neigh_table *,
+				struct neigh_stats *,
+				void *
+				);
+	void			(*lookup_bulk)(
+				struct neigh_table *,
+				struct neigh_stats *,
+				void **,
+				struct neigh_entry **,
+				unsigned int
+				);
+
+	/* the writer's */
+	uint32_t		free;
+	unsigned int		num_entries;
+	struct qsbr		*qsbr; /* NULL if never shared */
+	struct neigh_stats	control; /* lookups of neigh_add() and such */
+	unsigned long		kicks; /* entries moved to their other bucket */
+	unsigned int		grows;
+};
+
+struct neigh_table *neigh_alloc(struct ixmap_desc *desc, int family,
+	struct qsbr *qsbr);
 void neigh_release(struct neigh_table *neigh);
+void neigh_retire(struct neigh_table *neigh);
 int neigh_add(struct neigh_table *neigh, int family,
 	void *dst_addr, void *mac_addr, struct ixmap_desc *desc);
 int neigh_delete(struct neigh_table *neigh, int family,
 	void *dst_addr);
-struct neigh_entry *neigh_lookup(struct neigh_table *neigh,
-	void *dst_addr);
+struct neigh_entry *neigh_get(struct neigh_table *neigh, void *dst_addr);
+void neigh_walk(struct neigh_table *neigh,
+	void (*func)(struct neigh_entry *, void *), void *arg);
+
+/* Instances for the family and CPU of the table, see neigh_alloc() */
+static inline struct neigh_entry *neigh_lookup(struct neigh_table *neigh,
+	struct neigh_stats *stats, void *dst_addr)
+{
+	return neigh->lookup(neigh, stats, dst_addr);
+}
+
+static inline void neigh_lookup_bulk(struct neigh_table *neigh,
+	struct neigh_stats *stats, void **dst, struct neigh_entry **entries,
+	unsigned int num)
+{
+	neigh->lookup_bulk(neigh, stats, dst, entries, num);
+	return;
+}
+
+/* Copies the MAC of a looked up entry, -1 if it was taken meanwhile */
+static inline int neigh_load(struct neigh_table *neigh,
+	struct neigh_entry *entry, void *dst_addr, uint8_t *mac)
+{
+	unsigned int seq;
+	int equal;
+
+	do{
+		seq = entry->seq;
+		smp_rmb();
+		equal = !memcmp(entry->dst_addr, dst_addr, neigh->key_len);
+		memcpy(mac, entry->dst_mac, ETH_ALEN);
+		smp_rmb();
+	}while(unlikely((seq & 1) || seq != entry->seq));
+
+	return equal ? 0 : -1;
+}
+
+/*
+ * Marks the neighbor as forwarded to for netlink_confirm(). Every
+ * core of the node shares the mark, see there for what that costs.
+ */
+static inline void neigh_use(struct neigh_entry *entry)
+{
+	if(unlikely(!ACCESS_ONCE(entry->used)))
+		ACCESS_ONCE(entry->used) = 1;
+
+	return;
+}
 
 #endif /* _IXMAPFWD_NEIGH_H */
@@ -4,9 +4,12 @@
 #include <sys/socket.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
+#include <linux/if_link.h>
+#include <net/if.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <syslog.h>
+#include <time.h>
 #include <linux/if_ether.h>
 
 #include "main.h"
@@ -15,26 +18,95 @@
 #include "fib.h"
 #include "neigh.h"
 #include "iftap.h"
+#include "forward.h"
 
-static void netlink_route(struct ixmapfwd_thread *thread, struct nlmsghdr *nlh);
-static void netlink_neigh(struct ixmapfwd_thread *thread, struct nlmsghdr *nlh);
+/* RTM_NEWNEIGH requests of netlink_confirm(), sent when buf is full */
+struct netlink_confirm {
+	struct ixmapfwd_thread	*thread;
+	uint8_t			buf[NETLINK_CONFIRM_SIZE];
+	unsigned int		len;
+	unsigned int		num;
+	int			family; /* of the table walked */
+	int			ifindex;
+};
+
+static void netlink_route(struct ixmapfwd_thread *thread, struct nlmsghdr *nlh,
+	int bulk, int dump);
+static void netlink_route_apply(struct ixmapfwd_thread *thread,
+	struct fib *fib, int type, int replace, struct fib_route *route);
+static void netlink_route_vrf(struct ixmapfwd_thread *thread, int type,
+	int replace, uint32_t table, struct fib_route *route);
+static void netlink_link(struct ixmapfwd_thread *thread, struct nlmsghdr *nlh);
+static uint32_t netlink_link_vrf(struct rtattr *link_attr);
+static void netlink_neigh(struct ixmapfwd_thread *thread, struct nlmsghdr *nlh,
+	int dump);
+static void netlink_neigh_apply(struct neigh_table *neigh, int type,
+	int family, void *dst_addr, void *dst_mac, struct ixmap_desc *desc);
+static int netlink_multipath(struct ixmapfwd_thread *thread,
+	struct rtattr *route_attr, struct nexthop *nexthops);
+static int netlink_bulk_check(struct ixmapfwd_thread *thread,
+	uint8_t *read_buf, int read_size);
+static unsigned int netlink_route_count(struct ixmapfwd_thread *thread,
+	uint8_t *read_buf, int read_size);
+static int netlink_bulk_hold(struct ixmapfwd_bulk *bulk,
+	struct fib_route *route);
+static void netlink_bulk_clear(struct ixmapfwd_bulk *bulk);
+static void netlink_bulk_add(struct ixmapfwd_thread *thread,
+	struct fib_route *route);
+static unsigned int netlink_bulk_swap(struct ixmapfwd_thread *thread,
+	struct fib **fib_ptr, int family, struct ixmapfwd_bulk *bulk);
+static void netlink_resync_apply(struct ixmapfwd_thread *thread, int type,
+	int replace, struct fib_route *route);
+static unsigned int netlink_resync_flush(struct ixmapfwd_thread *thread);
+static int netlink_dump_request(struct ixmapfwd_thread *thread, int type);
+static void netlink_flow_invalidate(struct ixmapfwd_thread *thread);
+static int netlink_resync_route(struct ixmapfwd_thread *thread);
+static int netlink_resync_neigh(struct ixmapfwd_thread *thread);
+static void netlink_resync_done(struct ixmapfwd_thread *thread);
+static void netlink_resync_abort(struct ixmapfwd_thread *thread);
+static void netlink_confirm_neigh(struct neigh_entry *neigh_entry, void *arg);
+static void netlink_confirm_adj(struct adj *adj, void *arg);
+static void netlink_confirm_add(struct netlink_confirm *confirm, int family,
+	int ifindex, void *addr);
+static void netlink_confirm_send(struct netlink_confirm *confirm);
 
 void netlink_process(struct ixmapfwd_thread *thread,
 	uint8_t *read_buf, int read_size)
 {
 	struct nlmsghdr *nlh;
+	int bulk, dump;
+
+	bulk = thread->fib_writer
+		&& netlink_bulk_check(thread, read_buf, read_size);
 
 	nlh = (struct nlmsghdr *)read_buf;
 
 	while(NLMSG_OK(nlh, read_size)){
+		/* answers to our dump, not changes made meanwhile */
+		dump = thread->resync_seq
+			&& nlh->nlmsg_seq == thread->resync_seq
+			&& nlh->nlmsg_pid == thread->netlink_pid;
+
 		switch(nlh->nlmsg_type){
 		case RTM_NEWROUTE:
 		case RTM_DELROUTE:
-			netlink_route(thread, nlh);
+			netlink_route(thread, nlh, bulk, dump);
 			break;
 		case RTM_NEWNEIGH:
 		case RTM_DELNEIGH:
-			netlink_neigh(thread, nlh);
+			netlink_neigh(thread, nlh, dump);
+			break;
+		case RTM_NEWLINK:
+		case RTM_DELLINK:
+			netlink_link(thread, nlh);
+			break;
+		case NLMSG_DONE:
+			if(dump)
+				netlink_resync_done(thread);
+			break;
+		case NLMSG_ERROR:
+			if(dump)
+				netlink_resync_abort(thread);
 			break;
 		default:
 			ixmapfwd_log(LOG_ERR, "unknown type netlink message");
@@ -44,27 +116,94 @@ void netlink_process(struct ixmapfwd_thread *thread,
 		nlh = NLMSG_NEXT(nlh, read_size);
 	}
 
+	/* one dump at a time, see netlink_overrun() */
+	if(thread->netlink_lost && !thread->resync_seq)
+		netlink_overrun(thread);
+
+	netlink_flow_invalidate(thread);
+	return;
+}
+
+/*
+ * Flows cached from what changed go back to the FIB. Routes and
+ * neighbors are both shared on the node, so the writer ends them on
+ * every thread of it at once, its own included.
+ */
+static void netlink_flow_invalidate(struct ixmapfwd_thread *thread)
+{
+	smp_wmb();
+	ACCESS_ONCE(thread->fib->flow_gen)++;
 	return;
 }
 
-static void netlink_route(struct ixmapfwd_thread *thread, struct nlmsghdr *nlh)
+/*
+ * Each route notification comes in a read of its own, so a BGP session
+ * coming up only shows as a burst across reads: route additions are
+ * counted over windows of NETLINK_BULK_QUIET ms. The window starts at
+ * bulk_stamp while no route is held back.
+ */
+static int netlink_bulk_check(struct ixmapfwd_thread *thread,
+	uint8_t *read_buf, int read_size)
+{
+	struct ixmapfwd_fib *fib;
+	unsigned long now;
+
+	fib = thread->fib;
+	now = netlink_now();
+
+	if(!fib->bulk.num && now - fib->bulk_stamp >= NETLINK_BULK_QUIET){
+		fib->bulk_stamp = now;
+		fib->bulk_count = 0;
+	}
+
+	fib->bulk_count += netlink_route_count(thread, read_buf, read_size);
+	return fib->bulk.num || fib->bulk_count >= NETLINK_BULK_MIN;
+}
+
+/* answers to our dump are built apart, see netlink_resync_apply() */
+static unsigned int netlink_route_count(struct ixmapfwd_thread *thread,
+	uint8_t *read_buf, int read_size)
+{
+	struct nlmsghdr *nlh;
+	unsigned int count;
+
+	count = 0;
+	nlh = (struct nlmsghdr *)read_buf;
+
+	while(NLMSG_OK(nlh, read_size)){
+		if(nlh->nlmsg_type == RTM_NEWROUTE
+		&& !(thread->resync_seq
+		&& nlh->nlmsg_seq == thread->resync_seq
+		&& nlh->nlmsg_pid == thread->netlink_pid))
+			count++;
+
+		nlh = NLMSG_NEXT(nlh, read_size);
+	}
+
+	return count;
+}
+
+static void netlink_route(struct ixmapfwd_thread *thread, struct nlmsghdr *nlh,
+	int bulk, int dump)
 {
 	struct rtmsg *route_entry;
 	struct rtattr *route_attr;
 	struct fib *fib;
-	int route_attr_len, family;
-	uint8_t prefix[16] = {};
-	uint8_t nexthop[16] = {};
-	unsigned int prefix_len;
-	int ifindex, port_index, i;
-	enum fib_type type;
+	struct fib_route route = {};
+	struct nexthop nexthops[NEXTHOP_MAX];
+	uint32_t table;
+	int route_attr_len, ifindex, num_nexthops, replace, i;
 
 	route_entry = (struct rtmsg *)NLMSG_DATA(nlh);
-	family		= route_entry->rtm_family;
-	prefix_len	= route_entry->rtm_dst_len;
-	ifindex		= -1;
-	port_index	= -1;
-	type		= FIB_TYPE_LINK;
+	replace = nlh->nlmsg_type == RTM_NEWROUTE
+		&& (nlh->nlmsg_flags & NLM_F_REPLACE);
+	route.family		= route_entry->rtm_family;
+	route.prefix_len	= route_entry->rtm_dst_len;
+	route.port_index	= -1;
+	route.type		= FIB_TYPE_LINK;
+	ifindex			= -1;
+	num_nexthops		= 0;
+	table			= route_entry->rtm_table;
 
 	route_attr = (struct rtattr *)RTM_RTA(route_entry);
 	route_attr_len = RTM_PAYLOAD(nlh);
@@ -72,17 +211,25 @@ static void netlink_route(struct ixmapfwd_thread *thread, struct nlmsghdr *nlh)
 	while(RTA_OK(route_attr, route_attr_len)){
 		switch(route_attr->rta_type){
 		case RTA_DST:
-			memcpy(prefix, RTA_DATA(route_attr),
+			memcpy(route.prefix, RTA_DATA(route_attr),
 				RTA_PAYLOAD(route_attr));
 			break;
 		case RTA_GATEWAY:
-			memcpy(nexthop, RTA_DATA(route_attr),
+			memcpy(route.nexthop, RTA_DATA(route_attr),
 				RTA_PAYLOAD(route_attr));
-			type = FIB_TYPE_FORWARD;
+			route.type = FIB_TYPE_FORWARD;
 			break;
 		case RTA_OIF:
 			ifindex = *(int *)RTA_DATA(route_attr);
 			break;
+		case RTA_TABLE:
+			/* rtm_table only holds ids below 256 */
+			table = *(uint32_t *)RTA_DATA(route_attr);
+			break;
+		case RTA_MULTIPATH:
+			num_nexthops = netlink_multipath(thread,
+				route_attr, nexthops);
+			break;
 		default:
 			break;
 		}
@@ -90,62 +237,472 @@ static void netlink_route(struct ixmapfwd_thread *thread, struct nlmsghdr *nlh)
 		route_attr = RTA_NEXT(route_attr, route_attr_len);
 	}
 
-	if(route_entry->rtm_table == RT_TABLE_LOCAL)
-		type = FIB_TYPE_LOCAL;
+	/* a VRF table holds the local routes of its own addresses */
+	if(table == RT_TABLE_LOCAL
+	|| route_entry->rtm_type == RTN_LOCAL
+	|| route_entry->rtm_type == RTN_BROADCAST)
+		route.type = FIB_TYPE_LOCAL;
+
+	/* dropped without a trip to the TAP, RTBH among them */
+	switch(route_entry->rtm_type){
+	case RTN_BLACKHOLE:
+		route.type = FIB_TYPE_BLACKHOLE;
+		break;
+	case RTN_UNREACHABLE:
+		route.type = FIB_TYPE_UNREACHABLE;
+		break;
+	case RTN_PROHIBIT:
+		route.type = FIB_TYPE_PROHIBIT;
+		break;
+	default:
+		break;
+	}
 
 	for(i = 0; i < thread->num_ports; i++){
 		if(thread->tun_plane->ports[i].ifindex == ifindex){
-			port_index = i;
+			route.port_index = i;
 			break;
 		}
 	}
+	route.id = ifindex;
 
-	switch(family){
+	switch(route.family){
 	case AF_INET:
-		fib = thread->fib_inet;
-		break;
 	case AF_INET6:
-		fib = thread->fib_inet6;
 		break;
 	default:
 		goto out;
 		break;
 	}
 
-	switch(nlh->nlmsg_type){
+	/* one path is an ordinary route, more make a group */
+	if(num_nexthops == 1){
+		route.port_index = nexthops[0].port_index;
+		route.id = nexthops[0].ifindex;
+		if(nexthops[0].flags & NEXTHOP_F_GATEWAY){
+			memcpy(route.nexthop, nexthops[0].addr, 16);
+			route.type = FIB_TYPE_FORWARD;
+		}
+	}else if(num_nexthops > 1){
+		route.type = FIB_TYPE_FORWARD;
+		route.id = FIB_ID_MULTIPATH;
+
+		if(nlh->nlmsg_type == RTM_DELROUTE){
+			nexthop_table_delete(thread->fib->nexthops, table,
+				route.family, route.prefix, route.prefix_len);
+		}else{
+			/* members through a gateway share its adjacency */
+			for(i = 0; i < num_nexthops; i++){
+				if(nexthops[i].flags & NEXTHOP_F_GATEWAY)
+					nexthops[i].adj = adj_get(
+						thread->fib->adjs, route.family,
+						nexthops[i].port_index,
+						nexthops[i].addr, thread->desc);
+			}
+
+			/* flows on members kept keep their buckets */
+			route.group = nexthop_group_alloc(nexthops,
+				num_nexthops, nexthop_table_lookup(
+				thread->fib->nexthops, table, route.family,
+				route.prefix, route.prefix_len), thread->desc);
+			if(!route.group)
+				goto out;
+
+			nexthop_table_update(thread->fib->nexthops, table,
+				route.family, route.prefix, route.prefix_len,
+				route.group, thread->desc);
+		}
+	}
+
+	/* routes through one gateway share its adjacency */
+	if(nlh->nlmsg_type == RTM_NEWROUTE && !route.group
+	&& route.type == FIB_TYPE_FORWARD)
+		route.adj = adj_get(thread->fib->adjs, route.family,
+			route.port_index, route.nexthop, thread->desc);
+
+	switch(table){
+	case RT_TABLE_UNSPEC:
+	case RT_TABLE_DEFAULT:
+	case RT_TABLE_MAIN:
+	case RT_TABLE_LOCAL:
+		break;
+	default:
+		netlink_route_vrf(thread, nlh->nlmsg_type, replace,
+			table, &route);
+		goto out;
+		break;
+	}
+
+	/* own addresses, a dump gives them again as they are now */
+	if(route.type == FIB_TYPE_LOCAL && route.prefix_len
+	== (route.family == AF_INET ? 32 : 128)){
+		if(nlh->nlmsg_type == RTM_NEWROUTE)
+			local_add(thread->fib->locals, route.family,
+				route.prefix, thread->desc);
+		else
+			local_delete(thread->fib->locals, route.family,
+				route.prefix, thread->desc);
+	}
+
+	/* the generation being resynchronized takes changes as they come */
+	fib = route.family == AF_INET ?
+		thread->fib->resync_inet : thread->fib->resync_inet6;
+	if(fib)
+		netlink_resync_apply(thread, nlh->nlmsg_type, replace, &route);
+
+	if(dump)
+		goto out;
+
+	fib = route.family == AF_INET ?
+		thread->fib->fib_inet : thread->fib->fib_inet6;
+
+	/* a best-path change of a route in the FIB needs no bulk load */
+	if(nlh->nlmsg_type == RTM_NEWROUTE && bulk){
+		if(!replace || fib_route_replace(fib, route.family,
+		route.type, route.prefix, route.prefix_len, route.nexthop,
+		route.group, route.adj, route.port_index, route.id,
+		thread->desc) < 0)
+			netlink_bulk_add(thread, &route);
+		goto out;
+	}
+
+	/* routes held back go first, a delete may refer to them */
+	if(thread->fib->bulk.num)
+		netlink_bulk_flush(thread);
+
+	fib = route.family == AF_INET ?
+		thread->fib->fib_inet : thread->fib->fib_inet6;
+	netlink_route_apply(thread, fib, nlh->nlmsg_type, replace, &route);
+
+out:
+	if(route.group)
+		nexthop_group_put(route.group);
+	if(route.adj)
+		adj_put(route.adj);
+	for(i = 0; i < num_nexthops; i++){
+		if(nexthops[i].adj)
+			adj_put(nexthops[i].adj);
+	}
+	return;
+}
+
+/*
+ * Reads the paths of RTA_MULTIPATH into nexthops, returns their number.
+ * Paths over a link the kernel reports down hold no bucket.
+ */
+static int netlink_multipath(struct ixmapfwd_thread *thread,
+	struct rtattr *route_attr, struct nexthop *nexthops)
+{
+	struct rtnexthop *rtnh;
+	struct rtattr *rtnh_attr;
+	struct nexthop *nexthop;
+	int rtnh_len, rtnh_attr_len, num, i;
+
+	rtnh = (struct rtnexthop *)RTA_DATA(route_attr);
+	rtnh_len = RTA_PAYLOAD(route_attr);
+	num = 0;
+
+	while(RTNH_OK(rtnh, rtnh_len) && num < NEXTHOP_MAX){
+		nexthop = &nexthops[num++];
+		memset(nexthop, 0, sizeof(struct nexthop));
+
+		nexthop->ifindex = rtnh->rtnh_ifindex;
+		nexthop->weight = rtnh->rtnh_hops + 1;
+		nexthop->port_index = -1;
+		if(rtnh->rtnh_flags & (RTNH_F_DEAD | RTNH_F_LINKDOWN))
+			nexthop->flags |= NEXTHOP_F_DEAD | NEXTHOP_F_LINKDOWN;
+
+		for(i = 0; i < thread->num_ports; i++){
+			if(thread->tun_plane->ports[i].ifindex
+			== nexthop->ifindex){
+				nexthop->port_index = i;
+				break;
+			}
+		}
+
+		rtnh_attr = RTNH_DATA(rtnh);
+		rtnh_attr_len = rtnh->rtnh_len - RTNH_LENGTH(0);
+
+		while(RTA_OK(rtnh_attr, rtnh_attr_len)){
+			if(rtnh_attr->rta_type == RTA_GATEWAY){
+				memcpy(nexthop->addr, RTA_DATA(rtnh_attr),
+					RTA_PAYLOAD(rtnh_attr));
+				nexthop->flags |= NEXTHOP_F_GATEWAY;
+			}
+
+			rtnh_attr = RTA_NEXT(rtnh_attr, rtnh_attr_len);
+		}
+
+		rtnh_len -= RTNH_ALIGN(rtnh->rtnh_len);
+		rtnh = RTNH_NEXT(rtnh);
+	}
+
+	return num;
+}
+
+/* A replace finding no route of its prefix adds, as NLM_F_CREATE does */
+static void netlink_route_apply(struct ixmapfwd_thread *thread,
+	struct fib *fib, int type, int replace, struct fib_route *route)
+{
+	int ret;
+
+	switch(type){
 	case RTM_NEWROUTE:
-		fib_route_update(fib, family, type,
-			prefix, prefix_len, nexthop, port_index, ifindex,
+		if(replace){
+			ret = fib_route_replace(fib, route->family,
+				route->type, route->prefix, route->prefix_len,
+				route->nexthop, route->group, route->adj,
+				route->port_index, route->id, thread->desc);
+			if(!ret)
+				break;
+		}
+
+		fib_route_update(fib, route->family, route->type,
+			route->prefix, route->prefix_len, route->nexthop,
+			route->group, route->adj, route->port_index, route->id,
 			thread->desc);
 		break;
 	case RTM_DELROUTE:
-		fib_route_delete(fib, family,
-			prefix, prefix_len, ifindex);
+		fib_route_delete(fib, route->family,
+			route->prefix, route->prefix_len, route->id);
 		break;
 	default:
 		break;
 	}
 
+	return;
+}
+
+/*
+ * Any other table goes to its VRF, route by route: VRF tables are
+ * neither loaded in bulk nor part of a snapshot, and a dump fills
+ * them as they are.
+ */
+static void netlink_route_vrf(struct ixmapfwd_thread *thread, int type,
+	int replace, uint32_t table, struct fib_route *route)
+{
+	struct vrf_table *vrfs;
+	struct vrf *vrf;
+	struct fib *fib;
+
+	vrfs = thread->fib->vrfs;
+
+	vrf = vrf_get(vrfs, table);
+	if(!vrf)
+		goto err_vrf_get;
+
+	fib = route->family == AF_INET ? vrf->fib_inet : vrf->fib_inet6;
+	if(!fib){
+		if(type == RTM_DELROUTE)
+			goto out;
+
+		fib = vrf_fib(vrfs, vrf, route->family, thread->desc);
+		if(!fib)
+			goto err_vrf_fib;
+	}
+
+	netlink_route_apply(thread, fib, type, replace, route);
 out:
 	return;
+
+err_vrf_fib:
+err_vrf_get:
+	ixmapfwd_log(LOG_ERR, "no VRF for routing table %u", table);
+	return;
+}
+
+static int netlink_bulk_hold(struct ixmapfwd_bulk *bulk,
+	struct fib_route *route)
+{
+	struct fib_route *routes;
+	unsigned int size;
+
+	if(bulk->num == bulk->size){
+		size = bulk->size ? bulk->size * 2 : NETLINK_BULK_INIT;
+		routes = realloc(bulk->routes, sizeof(struct fib_route) * size);
+		if(!routes)
+			goto err_routes_alloc;
+
+		bulk->routes = routes;
+		bulk->size = size;
+	}
+
+	/* the group must outlive a later route of the same prefix */
+	if(route->group)
+		nexthop_group_get(route->group);
+	if(route->adj)
+		adj_hold(route->adj);
+
+	bulk->routes[bulk->num++] = *route;
+	return 0;
+
+err_routes_alloc:
+	return -1;
+}
+
+static void netlink_bulk_add(struct ixmapfwd_thread *thread,
+	struct fib_route *route)
+{
+	struct ixmapfwd_fib *fib;
+	int ret;
+
+	fib = thread->fib;
+
+	ret = netlink_bulk_hold(&fib->bulk, route);
+	if(ret < 0)
+		goto err_bulk_hold;
+
+	fib->bulk_stamp = netlink_now();
+
+	if(fib->bulk.num >= NETLINK_BULK_MAX)
+		netlink_bulk_flush(thread);
+
+	return;
+
+err_bulk_hold:
+	netlink_bulk_flush(thread);
+	fib_route_update(route->family == AF_INET ?
+		fib->fib_inet : fib->fib_inet6, route->family, route->type,
+		route->prefix, route->prefix_len, route->nexthop,
+		route->group, route->adj, route->port_index, route->id,
+		thread->desc);
+	return;
+}
+
+void netlink_bulk_poll(struct ixmapfwd_thread *thread)
+{
+	if(!thread->fib->bulk.num)
+		return;
+
+	if(netlink_now() - thread->fib->bulk_stamp >= NETLINK_BULK_QUIET)
+		netlink_bulk_flush(thread);
+
+	return;
+}
+
+void netlink_bulk_flush(struct ixmapfwd_thread *thread)
+{
+	struct ixmapfwd_fib *fib;
+	unsigned long start;
+	unsigned int dropped;
+
+	fib = thread->fib;
+	start = netlink_now();
+
+	dropped = netlink_bulk_swap(thread, &fib->fib_inet, AF_INET,
+		&fib->bulk);
+	dropped += netlink_bulk_swap(thread, &fib->fib_inet6, AF_INET6,
+		&fib->bulk);
+
+	ixmapfwd_log(LOG_INFO, "thread %d bulk loaded %u routes in %lu ms",
+		thread->index, fib->bulk.num, netlink_now() - start);
+	if(dropped)
+		ixmapfwd_log(LOG_ERR, "thread %d could not install %u routes",
+			thread->index, dropped);
+
+	netlink_bulk_clear(&fib->bulk);
+	netlink_flow_invalidate(thread);
+	return;
+}
+
+static void netlink_bulk_clear(struct ixmapfwd_bulk *bulk)
+{
+	unsigned int i;
+
+	for(i = 0; i < bulk->num; i++){
+		if(bulk->routes[i].group)
+			nexthop_group_put(bulk->routes[i].group);
+		if(bulk->routes[i].adj)
+			adj_put(bulk->routes[i].adj);
+	}
+
+	bulk->num = 0;
+	return;
+}
+
+/*
+ * Also fills a resync generation, which no reader holds yet.
+ * Returns the number of routes that could not be installed.
+ */
+static unsigned int netlink_bulk_swap(struct ixmapfwd_thread *thread,
+	struct fib **fib_ptr, int family, struct ixmapfwd_bulk *bulk)
+{
+	struct fib *fib_old, *fib_new;
+	struct fib_route *route;
+	unsigned int i, num, dropped;
+	int ret;
+
+	fib_old = *fib_ptr;
+
+	for(i = 0, num = 0; i < bulk->num; i++){
+		if(bulk->routes[i].family == family)
+			num++;
+	}
+
+	if(!num)
+		return 0;
+
+	/* fibagg keeps the engine minimal route by route */
+	if(fib_old->agg)
+		goto apply_routes;
+
+	fib_new = fib_build(fib_old, family, bulk->routes, bulk->num,
+		&dropped, thread->desc);
+	if(!fib_new)
+		goto err_fib_build;
+
+	/* the generation is complete before readers can reach it */
+	smp_wmb();
+	ACCESS_ONCE(*fib_ptr) = fib_new;
+	fib_retire(fib_old);
+
+	return dropped;
+
+err_fib_build:
+	ixmapfwd_log(LOG_ERR, "failed to build fib generation, "
+		"installing %u routes one by one", num);
+apply_routes:
+	for(i = 0, dropped = 0; i < bulk->num; i++){
+		route = &bulk->routes[i];
+		if(route->family != family)
+			continue;
+
+		ret = fib_route_update(fib_old, route->family, route->type,
+			route->prefix, route->prefix_len, route->nexthop,
+			route->group, route->adj, route->port_index, route->id,
+			thread->desc);
+		if(ret < 0)
+			dropped++;
+	}
+	return dropped;
 }
 
-static void netlink_neigh(struct ixmapfwd_thread *thread, struct nlmsghdr *nlh)
+unsigned long netlink_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void netlink_neigh(struct ixmapfwd_thread *thread, struct nlmsghdr *nlh,
+	int dump)
 {
 	struct ndmsg *neigh_entry;
 	struct rtattr *route_attr;
-	struct neigh_table *neigh;
+	struct neigh_table *neigh, **resync;
 	int route_attr_len;
 	int ifindex;
 	int family;
 	uint8_t dst_addr[16] = {};
 	uint8_t dst_mac[ETH_ALEN] = {};
-	int i, port_index = -1;
+	int i, type, lladdr, port_index = -1;
 
 	neigh_entry = (struct ndmsg *)NLMSG_DATA(nlh);
 	family		= neigh_entry->ndm_family;
 	ifindex		= neigh_entry->ndm_ifindex;
 	port_index 	= -1;
+	lladdr		= 0;
 
 	for(i = 0; i < thread->num_ports; i++){
 		if(thread->tun_plane->ports[i].ifindex == ifindex){
@@ -169,6 +726,7 @@ static void netlink_neigh(struct ixmapfwd_thread *thread, struct nlmsghdr *nlh)
 		case NDA_LLADDR:
 			memcpy(dst_mac, RTA_DATA(route_attr),
 				RTA_PAYLOAD(route_attr));
+			lladdr = 1;
 			break;
 		default:
 			break;
@@ -177,22 +735,72 @@ static void netlink_neigh(struct ixmapfwd_thread *thread, struct nlmsghdr *nlh)
 		route_attr = RTA_NEXT(route_attr, route_attr_len);
 	}
 
+	/*
+	 * Only FAILED and a real RTM_DELNEIGH remove the neighbor. The
+	 * other states without an address, INCOMPLETE first, are the kernel
+	 * still resolving it: its packets stay held until it answers.
+	 */
+	type = nlh->nlmsg_type;
+	if(type == RTM_NEWNEIGH && !lladdr){
+		if(!(neigh_entry->ndm_state & NUD_FAILED))
+			goto out;
+
+		type = RTM_DELNEIGH;
+	}
+
 	switch(family){
 	case AF_INET:
-		neigh = thread->neigh_inet[port_index];
+		neigh = thread->fib->neigh_inet[port_index];
+		resync = thread->resync_neigh_inet;
 		break;
 	case AF_INET6:
-		neigh = thread->neigh_inet6[port_index];
+		neigh = thread->fib->neigh_inet6[port_index];
+		resync = thread->resync_neigh_inet6;
 		break;
 	default:
 		goto out;
 		break;
 	}
 
-	switch(nlh->nlmsg_type){
+	/* the routes through the neighbor follow it, dumped or not */
+	adj_update(thread->fib->adjs, family, port_index, dst_addr,
+		type == RTM_NEWNEIGH ? dst_mac : NULL);
+
+	/*
+	 * as do multipath members through it: a FAILED one gives up
+	 * its buckets until it answers, others keep theirs meanwhile
+	 */
+	if(type == RTM_NEWNEIGH || neigh_entry->ndm_state & NUD_FAILED)
+		nexthop_table_mark(thread->fib->nexthops, family, ifindex,
+			dst_addr, NEXTHOP_F_FAILED, type != RTM_NEWNEIGH);
+
+	/*
+	 * and so do the packets held for it, see forward_pending(),
+	 * those of the other threads once thread_pending_poll() finds it
+	 */
+	forward_pending_flush(thread, family, port_index, dst_addr,
+		type == RTM_NEWNEIGH ? dst_mac : NULL);
+
+	if(resync)
+		netlink_neigh_apply(resync[port_index], type,
+			family, dst_addr, dst_mac, thread->desc);
+
+	if(dump)
+		goto out;
+
+	netlink_neigh_apply(neigh, type,
+		family, dst_addr, dst_mac, thread->desc);
+
+out:
+	return;
+}
+
+static void netlink_neigh_apply(struct neigh_table *neigh, int type,
+	int family, void *dst_addr, void *dst_mac, struct ixmap_desc *desc)
+{
+	switch(type){
 	case RTM_NEWNEIGH:
-		neigh_add(neigh, family, dst_addr, dst_mac,
-			thread->desc);
+		neigh_add(neigh, family, dst_addr, dst_mac, desc);
 		break;
 	case RTM_DELNEIGH:
 		neigh_delete(neigh, family, dst_addr);
@@ -201,6 +809,624 @@ static void netlink_neigh(struct ixmapfwd_thread *thread, struct nlmsghdr *nlh)
 		break;
 	}
 
-out:
+	return;
+}
+
+/*
+ * Links only reach the writer: a VRF device binds its table to
+ * its ifindex, and a port follows the master it is enslaved to.
+ */
+static void netlink_link(struct ixmapfwd_thread *thread, struct nlmsghdr *nlh)
+{
+	struct ifinfomsg *link_entry;
+	struct rtattr *link_attr;
+	struct vrf_table *vrfs;
+	uint32_t table;
+	int link_attr_len, master, down, i;
+
+	link_entry = (struct ifinfomsg *)NLMSG_DATA(nlh);
+	vrfs = thread->fib->vrfs;
+	master = 0;
+	table = 0;
+
+	link_attr = IFLA_RTA(link_entry);
+	link_attr_len = IFLA_PAYLOAD(nlh);
+
+	while(RTA_OK(link_attr, link_attr_len)){
+		switch(link_attr->rta_type){
+		case IFLA_MASTER:
+			master = *(int *)RTA_DATA(link_attr);
+			break;
+		case IFLA_LINKINFO:
+			table = netlink_link_vrf(link_attr);
+			break;
+		default:
+			break;
+		}
+
+		link_attr = RTA_NEXT(link_attr, link_attr_len);
+	}
+
+	if(nlh->nlmsg_type == RTM_DELLINK){
+		vrf_unbind(vrfs, link_entry->ifi_index);
+		master = 0;
+	}else if(table){
+		vrf_bind(vrfs, table, link_entry->ifi_index);
+	}
+
+	/* multipath members out of a link going down lose their buckets */
+	down = nlh->nlmsg_type == RTM_DELLINK
+		|| (link_entry->ifi_flags & (IFF_UP | IFF_RUNNING))
+		!= (IFF_UP | IFF_RUNNING);
+	nexthop_table_mark(thread->fib->nexthops, AF_UNSPEC,
+		link_entry->ifi_index, NULL, NEXTHOP_F_LINKDOWN, down);
+
+	for(i = 0; i < thread->num_ports; i++){
+		if(thread->tun_plane->ports[i].ifindex == link_entry->ifi_index
+		&& vrfs->port_master[i] != master){
+			vrf_port_master(vrfs, i, master);
+			ixmapfwd_log(LOG_INFO, "port %d bound to master %d",
+				i, master);
+		}
+	}
+
+	return;
+}
+
+/* Returns the table of a VRF device from its IFLA_LINKINFO, 0 if other */
+static uint32_t netlink_link_vrf(struct rtattr *link_attr)
+{
+	struct rtattr *info_attr, *data_attr;
+	uint32_t table;
+	int info_attr_len, data_attr_len, vrf;
+
+	info_attr = RTA_DATA(link_attr);
+	info_attr_len = RTA_PAYLOAD(link_attr);
+	table = 0;
+	vrf = 0;
+
+	while(RTA_OK(info_attr, info_attr_len)){
+		switch(info_attr->rta_type){
+		case IFLA_INFO_KIND:
+			vrf = !strncmp(RTA_DATA(info_attr), "vrf",
+				RTA_PAYLOAD(info_attr));
+			break;
+		case IFLA_INFO_DATA:
+			data_attr = RTA_DATA(info_attr);
+			data_attr_len = RTA_PAYLOAD(info_attr);
+
+			while(RTA_OK(data_attr, data_attr_len)){
+				if(data_attr->rta_type == IFLA_VRF_TABLE)
+					table = *(uint32_t *)RTA_DATA(data_attr);
+
+				data_attr = RTA_NEXT(data_attr, data_attr_len);
+			}
+			break;
+		default:
+			break;
+		}
+
+		info_attr = RTA_NEXT(info_attr, info_attr_len);
+	}
+
+	return vrf ? table : 0;
+}
+
+/*
+ * The writer of a node asks for the links, to bind ports to their VRF.
+ * After a warm start the tables come from a snapshot, which may be
+ * stale. The kernel is asked for its routes, then its neighbors,
+ * and the replies fill fresh tables that replace the loaded ones
+ * once a dump is complete. Changes arriving meanwhile go to both.
+ */
+int netlink_resync(struct ixmapfwd_thread *thread)
+{
+	struct sockaddr_nl addr;
+	socklen_t addr_len;
+	int ret;
+
+	addr_len = sizeof(struct sockaddr_nl);
+	ret = getsockname(thread->netlink_fd,
+		(struct sockaddr *)&addr, &addr_len);
+	if(ret < 0)
+		goto err_getsockname;
+
+	thread->netlink_pid = addr.nl_pid;
+
+	/* one dump at a time on a socket, neighbors follow routes */
+	ret = netlink_dump_request(thread, RTM_GETLINK);
+	if(ret < 0)
+		goto err_resync;
+
+	return 0;
+
+err_resync:
+err_getsockname:
+	return -1;
+}
+
+/*
+ * The kernel drops notifications once the socket buffer is full, as
+ * when a burst outlasts NETLINK_RCVBUF_SIZE while a generation is
+ * built. What they carried is only found again in a dump, so the
+ * routes are resynchronized as after a warm start, right away or once
+ * the dump running is over.
+ */
+void netlink_overrun(struct ixmapfwd_thread *thread)
+{
+	int ret;
+
+	if(!thread->netlink_lost)
+		ixmapfwd_log(LOG_ERR, "thread %d lost netlink messages, "
+			"resynchronizing routes", thread->index);
+
+	thread->netlink_lost = 1;
+	if(thread->resync_seq)
+		return;
+
+	ret = netlink_resync(thread);
+	if(ret < 0)
+		goto err_resync;
+
+	return;
+
+err_resync:
+	ixmapfwd_log(LOG_ERR, "thread %d failed to resynchronize "
+		"with the kernel", thread->index);
+	return;
+}
+
+static int netlink_dump_request(struct ixmapfwd_thread *thread, int type)
+{
+	struct {
+		struct nlmsghdr	nlh;
+		struct rtgenmsg	gen;
+	} req;
+	struct sockaddr_nl addr;
+	int ret;
+
+	memset(&addr, 0, sizeof(struct sockaddr_nl));
+	addr.nl_family = AF_NETLINK;
+
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len	= NLMSG_LENGTH(sizeof(struct rtgenmsg));
+	req.nlh.nlmsg_type	= type;
+	req.nlh.nlmsg_flags	= NLM_F_REQUEST | NLM_F_DUMP;
+	req.nlh.nlmsg_seq	= type == RTM_GETLINK ? NETLINK_SEQ_LINK :
+		type == RTM_GETROUTE ? NETLINK_SEQ_ROUTE : NETLINK_SEQ_NEIGH;
+	req.nlh.nlmsg_pid	= thread->netlink_pid;
+	req.gen.rtgen_family	= AF_UNSPEC;
+
+	ret = sendto(thread->netlink_fd, &req, req.nlh.nlmsg_len, 0,
+		(struct sockaddr *)&addr, sizeof(struct sockaddr_nl));
+	if(ret < 0)
+		goto err_sendto;
+
+	thread->resync_seq = req.nlh.nlmsg_seq;
+	return 0;
+
+err_sendto:
+	return -1;
+}
+
+static int netlink_resync_route(struct ixmapfwd_thread *thread)
+{
+	struct ixmapfwd_fib *fib;
+	int ret;
+
+	fib = thread->fib;
+	thread->netlink_lost = 0;
+
+	/* not shared with readers yet, no qsbr needed */
+	fib->resync_inet = fib_alloc(thread->desc,
+		fib->fib_inet->engine, NULL);
+	if(!fib->resync_inet)
+		goto err_fib_alloc;
+
+	fib->resync_inet6 = fib_alloc(thread->desc,
+		fib->fib_inet6->engine, NULL);
+	if(!fib->resync_inet6)
+		goto err_fib_alloc;
+
+	fib_stats_set(fib->resync_inet, fib->stats);
+	fib_stats_set(fib->resync_inet6, fib->stats);
+
+	if(fib->fib_inet->agg){
+		if(fib_aggregate(fib->resync_inet, AF_INET, thread->desc) < 0
+		|| fib_aggregate(fib->resync_inet6, AF_INET6,
+			thread->desc) < 0)
+			goto err_fib_alloc;
+	}
+
+	ret = netlink_dump_request(thread, RTM_GETROUTE);
+	if(ret < 0)
+		goto err_dump_request;
+
+	return 0;
+
+err_dump_request:
+err_fib_alloc:
+	netlink_resync_release(thread);
+	return -1;
+}
+
+static int netlink_resync_neigh(struct ixmapfwd_thread *thread)
+{
+	struct neigh_table **resync_inet, **resync_inet6;
+	int i, ret;
+
+	resync_inet = ixmap_mem_alloc(thread->desc,
+		sizeof(struct neigh_table *) * thread->num_ports);
+	if(!resync_inet)
+		goto err_table_inet;
+
+	resync_inet6 = ixmap_mem_alloc(thread->desc,
+		sizeof(struct neigh_table *) * thread->num_ports);
+	if(!resync_inet6)
+		goto err_table_inet6;
+
+	memset(resync_inet, 0, sizeof(struct neigh_table *) * thread->num_ports);
+	memset(resync_inet6, 0, sizeof(struct neigh_table *) * thread->num_ports);
+	thread->resync_neigh_inet = resync_inet;
+	thread->resync_neigh_inet6 = resync_inet6;
+
+	for(i = 0; i < thread->num_ports; i++){
+		resync_inet[i] = neigh_alloc(thread->desc, AF_INET,
+			thread->fib->qsbr);
+		if(!resync_inet[i])
+			goto err_neigh_alloc;
+
+		resync_inet6[i] = neigh_alloc(thread->desc, AF_INET6,
+			thread->fib->qsbr);
+		if(!resync_inet6[i])
+			goto err_neigh_alloc;
+	}
+
+	ret = netlink_dump_request(thread, RTM_GETNEIGH);
+	if(ret < 0)
+		goto err_dump_request;
+
+	return 0;
+
+err_dump_request:
+err_neigh_alloc:
+	netlink_resync_release(thread);
+	return -1;
+err_table_inet6:
+	ixmap_mem_free(resync_inet);
+err_table_inet:
+	return -1;
+}
+
+/*
+ * The dump, and the routes added while it runs, are held back and
+ * built into the fresh generation at once by fib_build(). A replace or
+ * a delete is applied route by route, after what was held before it.
+ * A generation missing routes is never published: the resync is given
+ * up and the tables in use are kept.
+ */
+static void netlink_resync_apply(struct ixmapfwd_thread *thread, int type,
+	int replace, struct fib_route *route)
+{
+	struct ixmapfwd_fib *fib;
+	int ret;
+
+	fib = thread->fib;
+
+	if(type == RTM_NEWROUTE && !replace){
+		ret = netlink_bulk_hold(&fib->resync_bulk, route);
+		if(!ret)
+			return;
+	}
+
+	if(netlink_resync_flush(thread)){
+		netlink_resync_abort(thread);
+		return;
+	}
+
+	netlink_route_apply(thread, route->family == AF_INET ?
+		fib->resync_inet : fib->resync_inet6, type, replace, route);
+	return;
+}
+
+static unsigned int netlink_resync_flush(struct ixmapfwd_thread *thread)
+{
+	struct ixmapfwd_fib *fib;
+	unsigned int dropped;
+
+	fib = thread->fib;
+
+	dropped = netlink_bulk_swap(thread, &fib->resync_inet, AF_INET,
+		&fib->resync_bulk);
+	dropped += netlink_bulk_swap(thread, &fib->resync_inet6, AF_INET6,
+		&fib->resync_bulk);
+	netlink_bulk_clear(&fib->resync_bulk);
+
+	if(dropped)
+		ixmapfwd_log(LOG_ERR, "thread %d could not install %u "
+			"resynchronized routes", thread->index, dropped);
+	return dropped;
+}
+
+static void netlink_resync_done(struct ixmapfwd_thread *thread)
+{
+	struct ixmapfwd_fib *fib;
+	struct fib *fib_old;
+	struct neigh_table *neigh_old;
+	unsigned long start;
+	unsigned int num;
+	int i;
+
+	fib = thread->fib;
+
+	switch(thread->resync_seq){
+	case NETLINK_SEQ_LINK:
+		thread->resync_seq = 0;
+
+		if((thread->snapshot || thread->netlink_lost)
+		&& netlink_resync_route(thread) < 0)
+			goto err_resync_route;
+		break;
+	case NETLINK_SEQ_ROUTE:
+		start = netlink_now();
+		num = fib->resync_bulk.num;
+		if(netlink_resync_flush(thread))
+			goto err_resync_build;
+
+		/* routes held back are in the fresh generation already */
+		netlink_bulk_clear(&fib->bulk);
+
+		fib_qsbr_set(fib->resync_inet, fib->qsbr);
+		fib_qsbr_set(fib->resync_inet6, fib->qsbr);
+		smp_wmb();
+
+		fib_old = fib->fib_inet;
+		ACCESS_ONCE(fib->fib_inet) = fib->resync_inet;
+		fib_retire(fib_old);
+
+		fib_old = fib->fib_inet6;
+		ACCESS_ONCE(fib->fib_inet6) = fib->resync_inet6;
+		fib_retire(fib_old);
+
+		fib->resync_inet = NULL;
+		fib->resync_inet6 = NULL;
+		thread->resync_seq = 0;
+
+		ixmapfwd_log(LOG_INFO, "thread %d resynchronized routes, "
+			"built %u in %lu ms", thread->index, num,
+			netlink_now() - start);
+
+		if(netlink_resync_neigh(thread) < 0)
+			goto err_resync_neigh;
+		break;
+	case NETLINK_SEQ_NEIGH:
+		/* readers of the node may be in the old tables still */
+		smp_wmb();
+		for(i = 0; i < thread->num_ports; i++){
+			neigh_old = fib->neigh_inet[i];
+			ACCESS_ONCE(fib->neigh_inet[i]) =
+				thread->resync_neigh_inet[i];
+			thread->resync_neigh_inet[i] = NULL;
+			neigh_retire(neigh_old);
+
+			neigh_old = fib->neigh_inet6[i];
+			ACCESS_ONCE(fib->neigh_inet6[i]) =
+				thread->resync_neigh_inet6[i];
+			thread->resync_neigh_inet6[i] = NULL;
+			neigh_retire(neigh_old);
+		}
+
+		/* neighbors gone while nobody told us */
+		adj_resolve(fib->adjs);
+
+		netlink_resync_release(thread);
+
+		ixmapfwd_log(LOG_INFO, "thread %d resynchronized neighbors",
+			thread->index);
+		break;
+	default:
+		break;
+	}
+
+	return;
+
+err_resync_neigh:
+	ixmapfwd_log(LOG_ERR, "thread %d failed to resynchronize neighbors",
+		thread->index);
+	return;
+
+err_resync_build:
+	netlink_resync_abort(thread);
+	return;
+
+err_resync_route:
+	ixmapfwd_log(LOG_ERR, "thread %d failed to resynchronize routes",
+		thread->index);
+	return;
+}
+
+/* the loaded tables stay in use, updated by events as before */
+static void netlink_resync_abort(struct ixmapfwd_thread *thread)
+{
+	uint32_t seq;
+
+	seq = thread->resync_seq;
+	ixmapfwd_log(LOG_ERR, "thread %d failed to resynchronize %s",
+		thread->index, seq == NETLINK_SEQ_LINK ? "links" :
+		seq == NETLINK_SEQ_ROUTE ? "routes" : "neighbors");
+
+	netlink_resync_release(thread);
+
+	/* ports stay on the main table until their links change */
+	if(seq == NETLINK_SEQ_LINK
+	&& (thread->snapshot || thread->netlink_lost))
+		netlink_resync_route(thread);
+	return;
+}
+
+void netlink_resync_release(struct ixmapfwd_thread *thread)
+{
+	struct ixmapfwd_fib *fib;
+	int i;
+
+	fib = thread->fib;
+	thread->resync_seq = 0;
+
+	/* the fresh generation belongs to the writer of the node */
+	if(thread->fib_writer && fib->resync_inet){
+		fib_release(fib->resync_inet);
+		fib->resync_inet = NULL;
+	}
+
+	if(thread->fib_writer && fib->resync_inet6){
+		fib_release(fib->resync_inet6);
+		fib->resync_inet6 = NULL;
+	}
+
+	if(thread->fib_writer)
+		netlink_bulk_clear(&fib->resync_bulk);
+
+	if(thread->resync_neigh_inet){
+		for(i = 0; i < thread->num_ports; i++){
+			if(thread->resync_neigh_inet[i])
+				neigh_release(thread->resync_neigh_inet[i]);
+			if(thread->resync_neigh_inet6[i])
+				neigh_release(thread->resync_neigh_inet6[i]);
+		}
+
+		ixmap_mem_free(thread->resync_neigh_inet6);
+		ixmap_mem_free(thread->resync_neigh_inet);
+		thread->resync_neigh_inet = NULL;
+		thread->resync_neigh_inet6 = NULL;
+	}
+
+	return;
+}
+
+/*
+ * The kernel does not see what is forwarded here, and would let busy
+ * neighbors age to STALE and collect them. Those used since the last
+ * call are sent to it with NTF_USE, as if its own traffic went to
+ * them: it refreshes their use and, once STALE, probes them again.
+ * The writer of a node sends those of its neighbors and gateways.
+ *
+ * The mark is one byte shared by every core of the node, not one per
+ * core: it is stored only while clear, and only this clears it, so
+ * the line of a used entry is taken away from the readers at most once
+ * per core and NETLINK_CONFIRM_INTERVAL, against millions of loads in
+ * between. Per-core marks would spare so few misses, for a walk of
+ * each core's marks here.
+ */
+void netlink_confirm(struct ixmapfwd_thread *thread)
+{
+	struct netlink_confirm confirm;
+	int i;
+
+	confirm.thread	= thread;
+	confirm.len	= 0;
+	confirm.num	= 0;
+
+	for(i = 0; i < thread->num_ports; i++){
+		confirm.ifindex = thread->tun_plane->ports[i].ifindex;
+
+		confirm.family = AF_INET;
+		neigh_walk(thread->fib->neigh_inet[i],
+			netlink_confirm_neigh, &confirm);
+
+		confirm.family = AF_INET6;
+		neigh_walk(thread->fib->neigh_inet6[i],
+			netlink_confirm_neigh, &confirm);
+	}
+
+	adj_walk(thread->fib->adjs, netlink_confirm_adj, &confirm);
+
+	netlink_confirm_send(&confirm);
+	thread->neigh_confirmed += confirm.num;
+	return;
+}
+
+static void netlink_confirm_neigh(struct neigh_entry *neigh_entry, void *arg)
+{
+	struct netlink_confirm *confirm = arg;
+
+	if(!ACCESS_ONCE(neigh_entry->used))
+		return;
+
+	ACCESS_ONCE(neigh_entry->used) = 0;
+	netlink_confirm_add(confirm, confirm->family, confirm->ifindex,
+		neigh_entry->dst_addr);
+	return;
+}
+
+/* readers may mark it again meanwhile, it is then sent next time */
+static void netlink_confirm_adj(struct adj *adj, void *arg)
+{
+	struct netlink_confirm *confirm = arg;
+
+	if(!ACCESS_ONCE(adj->used))
+		return;
+
+	ACCESS_ONCE(adj->used) = 0;
+	netlink_confirm_add(confirm, adj->family,
+		confirm->thread->tun_plane->ports[adj->port_index].ifindex,
+		adj->key);
+	return;
+}
+
+/* An error reply to one of them is ignored, see netlink_process() */
+static void netlink_confirm_add(struct netlink_confirm *confirm, int family,
+	int ifindex, void *addr)
+{
+	struct nlmsghdr *nlh;
+	struct ndmsg *ndm;
+	struct rtattr *attr;
+	unsigned int addr_len, space;
+
+	addr_len = family == AF_INET ? 4 : 16;
+	space = NLMSG_SPACE(sizeof(struct ndmsg) + RTA_SPACE(addr_len));
+
+	if(confirm->len + space > NETLINK_CONFIRM_SIZE)
+		netlink_confirm_send(confirm);
+
+	nlh = (struct nlmsghdr *)&confirm->buf[confirm->len];
+	memset(nlh, 0, space);
+	nlh->nlmsg_len		= NLMSG_LENGTH(sizeof(struct ndmsg)
+					+ RTA_LENGTH(addr_len));
+	nlh->nlmsg_type		= RTM_NEWNEIGH;
+	nlh->nlmsg_flags	= NLM_F_REQUEST | NLM_F_REPLACE;
+	nlh->nlmsg_seq		= NETLINK_SEQ_CONFIRM;
+	nlh->nlmsg_pid		= confirm->thread->netlink_pid;
+
+	ndm = (struct ndmsg *)NLMSG_DATA(nlh);
+	ndm->ndm_family		= family;
+	ndm->ndm_ifindex	= ifindex;
+	ndm->ndm_state		= NUD_REACHABLE;
+	ndm->ndm_flags		= NTF_USE;
+
+	attr = (struct rtattr *)((uint8_t *)ndm
+		+ NLMSG_ALIGN(sizeof(struct ndmsg)));
+	attr->rta_type		= NDA_DST;
+	attr->rta_len		= RTA_LENGTH(addr_len);
+	memcpy(RTA_DATA(attr), addr, addr_len);
+
+	confirm->len += space;
+	confirm->num++;
+	return;
+}
+
+/* a batch lost is sent again by the next round, if still in use */
+static void netlink_confirm_send(struct netlink_confirm *confirm)
+{
+	struct sockaddr_nl addr;
+
+	if(!confirm->len)
+		return;
+
+	memset(&addr, 0, sizeof(struct sockaddr_nl));
+	addr.nl_family = AF_NETLINK;
+
+	sendto(confirm->thread->netlink_fd, confirm->buf, confirm->len, 0,
+		(struct sockaddr *)&addr, sizeof(struct sockaddr_nl));
+	confirm->len = 0;
 	return;
 }
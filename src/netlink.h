@@ -3,7 +3,45 @@
 
 #include "main.h"
 
+/*
+ * This many route additions within NETLINK_BULK_QUIET ms start a bulk
+ * load. Routes are then held back and installed as a new FIB generation
+ * once no route message came for NETLINK_BULK_QUIET ms.
+ */
+#define NETLINK_BULK_MIN	64
+#define NETLINK_BULK_QUIET	100
+#define NETLINK_BULK_MAX	(1 << 20)
+#define NETLINK_BULK_INIT	1024
+
+/*
+ * Routes keep coming while a bulk load is built, see netlink_overrun().
+ * SO_RCVBUFFORCE needs CAP_NET_ADMIN, without it net.core.rmem_max
+ * caps the buffer.
+ */
+#define NETLINK_RCVBUF_SIZE	(256 << 20)
+
+/* a dump reply may take up to 32KB, see netlink_dump() */
+#define NETLINK_READ_SIZE	32768
+#define NETLINK_SEQ_ROUTE	1
+#define NETLINK_SEQ_NEIGH	2
+#define NETLINK_SEQ_LINK	3
+#define NETLINK_SEQ_CONFIRM	4
+
+/*
+ * Neighbors forwarded to are confirmed to the kernel this often, well
+ * within the 15 to 45s it keeps one REACHABLE by default.
+ */
+#define NETLINK_CONFIRM_INTERVAL	10000 /* ms */
+#define NETLINK_CONFIRM_SIZE		16384 /* bytes per sendto() */
+
 void netlink_process(struct ixmapfwd_thread *thread,
 	uint8_t *read_buf, int read_size);
+void netlink_bulk_poll(struct ixmapfwd_thread *thread);
+void netlink_bulk_flush(struct ixmapfwd_thread *thread);
+int netlink_resync(struct ixmapfwd_thread *thread);
+void netlink_overrun(struct ixmapfwd_thread *thread);
+void netlink_resync_release(struct ixmapfwd_thread *thread);
+void netlink_confirm(struct ixmapfwd_thread *thread);
+unsigned long netlink_now();
 
 #endif /* _IXMAPFWD_NETLINK_H */
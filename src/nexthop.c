@@ -0,0 +1,600 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <ixmap.h>
+
+#include "main.h"
+#include "nexthop.h"
+
+static void nexthop_group_balance(struct nexthop_group *group,
+	uint8_t *buckets);
+static int nexthop_equal(struct nexthop *nexthop_a,
+	struct nexthop *nexthop_b);
+static void nexthop_key_set(uint32_t *key, uint32_t rt_table, int family,
+	void *prefix, unsigned int prefix_len);
+static unsigned int nexthop_key_generate(void *key, unsigned int bit_len);
+static int nexthop_key_compare(void *key_tgt, void *key_ent);
+static void nexthop_route_delete(struct hash_entry *entry);
+static struct nexthop_use *nexthop_route_link(struct nexthop_table *table,
+	struct nexthop_route *route, struct nexthop_group *group,
+	struct ixmap_desc *desc);
+static void nexthop_route_unlink(struct nexthop_route *route);
+static void nexthop_via_key_set(uint32_t *key, int family, int ifindex,
+	void *addr);
+static struct nexthop_via *nexthop_via_get(struct nexthop_table *table,
+	int family, struct nexthop *nexthop, struct ixmap_desc *desc);
+static void nexthop_via_put(struct nexthop_via *via);
+static void nexthop_via_mark(struct nexthop_via *via, unsigned int flag,
+	int set);
+static unsigned int nexthop_link_key_generate(void *key,
+	unsigned int bit_len);
+static int nexthop_link_key_compare(void *key_tgt, void *key_ent);
+static void nexthop_entry_delete(struct hash_entry *entry);
+
+/*
+ * Returns the group with one reference, for the caller.
+ * It holds its own references to the adjacencies of members.
+ * Members also in prev keep the buckets they had there.
+ */
+struct nexthop_group *nexthop_group_alloc(struct nexthop *nexthops,
+	unsigned int num_nexthops, struct nexthop_group *prev,
+	struct ixmap_desc *desc)
+{
+	struct nexthop_group *group;
+	uint8_t buckets[NEXTHOP_BUCKETS];
+	uint8_t index_map[NEXTHOP_MAX];
+	unsigned int i, j;
+
+	if(!num_nexthops || num_nexthops > NEXTHOP_MAX)
+		goto err_invalid_num;
+
+	group = ixmap_mem_alloc(desc, sizeof(struct nexthop_group)
+		+ sizeof(struct nexthop) * num_nexthops);
+	if(!group)
+		goto err_group_alloc;
+
+	group->refcount = 1;
+	group->num_nexthops = num_nexthops;
+	memcpy(group->nexthops, nexthops,
+		sizeof(struct nexthop) * num_nexthops);
+
+	for(i = 0; i < num_nexthops; i++){
+		if(nexthops[i].adj)
+			adj_hold(nexthops[i].adj);
+	}
+
+	memset(buckets, NEXTHOP_NONE, sizeof(buckets));
+
+	if(prev){
+		for(i = 0; i < prev->num_nexthops; i++){
+			index_map[i] = NEXTHOP_NONE;
+			for(j = 0; j < num_nexthops; j++){
+				if(nexthop_equal(&prev->nexthops[i],
+				&nexthops[j])){
+					index_map[i] = j;
+					break;
+				}
+			}
+		}
+
+		for(i = 0; i < NEXTHOP_BUCKETS; i++){
+			if(prev->buckets[i] != NEXTHOP_NONE)
+				buckets[i] = index_map[prev->buckets[i]];
+		}
+	}
+
+	memset(group->buckets, NEXTHOP_NONE, sizeof(group->buckets));
+	nexthop_group_balance(group, buckets);
+	return group;
+
+err_group_alloc:
+err_invalid_num:
+	return NULL;
+}
+
+void nexthop_group_get(struct nexthop_group *group)
+{
+	group->refcount++;
+	return;
+}
+
+void nexthop_group_put(struct nexthop_group *group)
+{
+	unsigned int i;
+
+	group->refcount--;
+	if(group->refcount)
+		return;
+
+	for(i = 0; i < group->num_nexthops; i++){
+		if(group->nexthops[i].adj)
+			adj_put(group->nexthops[i].adj);
+	}
+
+	ixmap_mem_free(group);
+	return;
+}
+
+/*
+ * Changes in place, readers may be selecting from the group:
+ * each bucket moves from one live member to another at once.
+ */
+int nexthop_group_set_dead(struct nexthop_group *group,
+	unsigned int index, int dead)
+{
+	uint8_t buckets[NEXTHOP_BUCKETS];
+
+	if(index >= group->num_nexthops)
+		goto err_invalid_index;
+
+	if(dead)
+		group->nexthops[index].flags |= NEXTHOP_F_DEAD;
+	else
+		group->nexthops[index].flags &= ~NEXTHOP_F_DEAD;
+
+	memcpy(buckets, group->buckets, sizeof(buckets));
+	nexthop_group_balance(group, buckets);
+	return 0;
+
+err_invalid_index:
+	return -1;
+}
+
+/*
+ * Each live member is owed buckets in proportion to its weight.
+ * A bucket keeps the member buckets[] gives it while that member
+ * is owed more, the others go to the members still short.
+ */
+static void nexthop_group_balance(struct nexthop_group *group,
+	uint8_t *buckets)
+{
+	struct nexthop *nexthop;
+	unsigned int quota[NEXTHOP_MAX], count[NEXTHOP_MAX];
+	unsigned int weight, assigned, i, j;
+	uint8_t index;
+
+	weight = 0;
+	for(i = 0; i < group->num_nexthops; i++){
+		nexthop = &group->nexthops[i];
+		if(!(nexthop->flags & NEXTHOP_F_DEAD))
+			weight += nexthop->weight;
+	}
+
+	if(!weight){
+		for(i = 0; i < NEXTHOP_BUCKETS; i++){
+			ACCESS_ONCE(group->buckets[i]) = NEXTHOP_NONE;
+		}
+		return;
+	}
+
+	assigned = 0;
+	for(i = 0; i < group->num_nexthops; i++){
+		nexthop = &group->nexthops[i];
+		quota[i] = nexthop->flags & NEXTHOP_F_DEAD ? 0 :
+			NEXTHOP_BUCKETS * nexthop->weight / weight;
+		count[i] = 0;
+		assigned += quota[i];
+	}
+
+	/* rounding leftovers, one more each for the first live members */
+	for(i = 0; assigned < NEXTHOP_BUCKETS; i++){
+		if(group->nexthops[i].flags & NEXTHOP_F_DEAD)
+			continue;
+
+		quota[i]++;
+		assigned++;
+	}
+
+	for(i = 0; i < NEXTHOP_BUCKETS; i++){
+		index = buckets[i];
+		if(index == NEXTHOP_NONE || count[index] >= quota[index]){
+			buckets[i] = NEXTHOP_NONE;
+			continue;
+		}
+
+		count[index]++;
+	}
+
+	for(i = 0, j = 0; i < NEXTHOP_BUCKETS; i++){
+		if(buckets[i] == NEXTHOP_NONE){
+			while(count[j] >= quota[j])
+				j++;
+
+			buckets[i] = j;
+			count[j]++;
+		}
+
+		ACCESS_ONCE(group->buckets[i]) = buckets[i];
+	}
+
+	return;
+}
+
+/* same way out, weight and state aside */
+static int nexthop_equal(struct nexthop *nexthop_a,
+	struct nexthop *nexthop_b)
+{
+	return nexthop_a->ifindex == nexthop_b->ifindex
+		&& (nexthop_a->flags & NEXTHOP_F_GATEWAY)
+		== (nexthop_b->flags & NEXTHOP_F_GATEWAY)
+		&& !memcmp(nexthop_a->addr, nexthop_b->addr, 16);
+}
+
+struct nexthop_table *nexthop_table_alloc(struct ixmap_desc *desc)
+{
+	struct nexthop_table *table;
+
+	table = ixmap_mem_alloc(desc, sizeof(struct nexthop_table));
+	if(!table)
+		goto err_table_alloc;
+
+	hash_init(&table->table);
+	table->table.hash_entry_delete	= nexthop_route_delete;
+	table->table.hash_key_generate	= nexthop_key_generate;
+	table->table.hash_key_compare	= nexthop_key_compare;
+
+	/* emptied by the routes leaving, see nexthop_via_put() */
+	hash_init(&table->vias);
+	table->vias.hash_entry_delete	= nexthop_entry_delete;
+	table->vias.hash_key_generate	= nexthop_key_generate;
+	table->vias.hash_key_compare	= nexthop_key_compare;
+
+	hash_init(&table->links);
+	table->links.hash_entry_delete	= nexthop_entry_delete;
+	table->links.hash_key_generate	= nexthop_link_key_generate;
+	table->links.hash_key_compare	= nexthop_link_key_compare;
+
+	return table;
+
+err_table_alloc:
+	return NULL;
+}
+
+void nexthop_table_release(struct nexthop_table *table)
+{
+	/* the routes leaving take their ways out and links with them */
+	hash_delete_all(&table->table);
+	ixmap_mem_free(table);
+	return;
+}
+
+static void nexthop_key_set(uint32_t *key, uint32_t rt_table, int family,
+	void *prefix, unsigned int prefix_len)
+{
+	memset(key, 0, sizeof(uint32_t) * NEXTHOP_KEY_WORDS);
+	memcpy(key, prefix, family == AF_INET ? 4 : 16);
+	key[NEXTHOP_KEY_WORDS - 2] = (family << 8) | prefix_len;
+	key[NEXTHOP_KEY_WORDS - 1] = rt_table;
+	return;
+}
+
+static unsigned int nexthop_key_generate(void *key, unsigned int bit_len)
+{
+	uint64_t hash = 0;
+	int i;
+
+	for(i = 0; i < NEXTHOP_KEY_WORDS; i++){
+		hash = (hash ^ ((uint32_t *)key)[i]) * GOLDEN_RATIO_64;
+	}
+
+	return hash >> (64 - bit_len);
+}
+
+static int nexthop_key_compare(void *key_tgt, void *key_ent)
+{
+	return memcmp(key_tgt, key_ent,
+		sizeof(uint32_t) * NEXTHOP_KEY_WORDS) ? 1 : 0;
+}
+
+static void nexthop_route_delete(struct hash_entry *entry)
+{
+	struct nexthop_route *route;
+
+	route = hash_entry(entry, struct nexthop_route, hash);
+	nexthop_route_unlink(route);
+	nexthop_group_put(route->group);
+	ixmap_mem_free(route);
+	return;
+}
+
+static unsigned int nexthop_link_key_generate(void *key,
+	unsigned int bit_len)
+{
+	uint64_t hash = *(uint32_t *)key * GOLDEN_RATIO_64;
+
+	return hash >> (64 - bit_len);
+}
+
+static int nexthop_link_key_compare(void *key_tgt, void *key_ent)
+{
+	return *(uint32_t *)key_tgt != *(uint32_t *)key_ent;
+}
+
+static void nexthop_entry_delete(struct hash_entry *entry)
+{
+	return;
+}
+
+struct nexthop_group *nexthop_table_lookup(struct nexthop_table *table,
+	uint32_t rt_table, int family, void *prefix, unsigned int prefix_len)
+{
+	struct hash_entry *hash_entry;
+	uint32_t key[NEXTHOP_KEY_WORDS];
+
+	nexthop_key_set(key, rt_table, family, prefix, prefix_len);
+
+	hash_entry = hash_lookup(&table->table, key);
+	if(!hash_entry)
+		return NULL;
+
+	return hash_entry(hash_entry, struct nexthop_route, hash)->group;
+}
+
+/* The table takes a reference to group, and drops the one it replaces */
+int nexthop_table_update(struct nexthop_table *table,
+	uint32_t rt_table, int family, void *prefix, unsigned int prefix_len,
+	struct nexthop_group *group, struct ixmap_desc *desc)
+{
+	struct nexthop_route *route;
+	struct nexthop_use *uses;
+	struct hash_entry *hash_entry;
+	uint32_t key[NEXTHOP_KEY_WORDS];
+	int ret;
+
+	nexthop_key_set(key, rt_table, family, prefix, prefix_len);
+	nexthop_group_get(group);
+
+	hash_entry = hash_lookup(&table->table, key);
+	if(hash_entry){
+		route = hash_entry(hash_entry, struct nexthop_route, hash);
+
+		/* the members of the old group stay listed on failure */
+		uses = nexthop_route_link(table, route, group, desc);
+		if(!uses)
+			goto err_route_link;
+
+		nexthop_route_unlink(route);
+		nexthop_group_put(route->group);
+		route->group = group;
+		route->uses = uses;
+		return 0;
+	}
+
+	route = ixmap_mem_alloc(desc, sizeof(struct nexthop_route));
+	if(!route)
+		goto err_route_alloc;
+
+	memcpy(route->key, key, sizeof(key));
+	route->group = group;
+
+	route->uses = nexthop_route_link(table, route, group, desc);
+	if(!route->uses)
+		goto err_route_link_new;
+
+	ret = hash_add(&table->table, route->key, &route->hash);
+	if(ret < 0)
+		goto err_hash_add;
+
+	return 0;
+
+err_hash_add:
+	nexthop_route_unlink(route);
+err_route_link_new:
+	ixmap_mem_free(route);
+err_route_alloc:
+err_route_link:
+	nexthop_group_put(group);
+	return -1;
+}
+
+int nexthop_table_delete(struct nexthop_table *table,
+	uint32_t rt_table, int family, void *prefix, unsigned int prefix_len)
+{
+	uint32_t key[NEXTHOP_KEY_WORDS];
+
+	nexthop_key_set(key, rt_table, family, prefix, prefix_len);
+	return hash_delete(&table->table, key);
+}
+
+/* Lists each member of group on its way out, for route to take group */
+static struct nexthop_use *nexthop_route_link(struct nexthop_table *table,
+	struct nexthop_route *route, struct nexthop_group *group,
+	struct ixmap_desc *desc)
+{
+	struct nexthop_use *uses;
+	struct nexthop_via *via;
+	unsigned int i, num_linked;
+	int family;
+
+	uses = ixmap_mem_alloc(desc,
+		sizeof(struct nexthop_use) * group->num_nexthops);
+	if(!uses)
+		goto err_uses_alloc;
+
+	family = route->key[NEXTHOP_KEY_WORDS - 2] >> 8;
+
+	for(i = 0, num_linked = 0; i < group->num_nexthops;
+	i++, num_linked++){
+		via = nexthop_via_get(table, family, &group->nexthops[i], desc);
+		if(!via)
+			goto err_via_get;
+
+		uses[i].route	= route;
+		uses[i].index	= i;
+		uses[i].via	= via;
+		hlist_add_head(&uses[i].list, &via->uses);
+	}
+
+	return uses;
+
+err_via_get:
+	for(i = 0; i < num_linked; i++){
+		hlist_del(&uses[i].list);
+		nexthop_via_put(uses[i].via);
+	}
+	ixmap_mem_free(uses);
+err_uses_alloc:
+	return NULL;
+}
+
+static void nexthop_route_unlink(struct nexthop_route *route)
+{
+	unsigned int i;
+
+	for(i = 0; i < route->group->num_nexthops; i++){
+		hlist_del(&route->uses[i].list);
+		nexthop_via_put(route->uses[i].via);
+	}
+
+	ixmap_mem_free(route->uses);
+	route->uses = NULL;
+	return;
+}
+
+static void nexthop_via_key_set(uint32_t *key, int family, int ifindex,
+	void *addr)
+{
+	memset(key, 0, sizeof(uint32_t) * NEXTHOP_KEY_WORDS);
+	if(addr)
+		memcpy(key, addr, family == AF_INET ? 4 : 16);
+	key[NEXTHOP_KEY_WORDS - 2] = (family << 8) | !!addr;
+	key[NEXTHOP_KEY_WORDS - 1] = ifindex;
+	return;
+}
+
+static struct nexthop_via *nexthop_via_get(struct nexthop_table *table,
+	int family, struct nexthop *nexthop, struct ixmap_desc *desc)
+{
+	struct nexthop_via *via;
+	struct nexthop_link *link;
+	struct hash_entry *hash_entry;
+	uint32_t key[NEXTHOP_KEY_WORDS];
+	uint32_t ifindex;
+	int link_allocated = 0;
+
+	nexthop_via_key_set(key, family, nexthop->ifindex,
+		nexthop->flags & NEXTHOP_F_GATEWAY ? nexthop->addr : NULL);
+
+	hash_entry = hash_lookup(&table->vias, key);
+	if(hash_entry)
+		return hash_entry(hash_entry, struct nexthop_via, hash);
+
+	ifindex = nexthop->ifindex;
+	hash_entry = hash_lookup(&table->links, &ifindex);
+	if(hash_entry){
+		link = hash_entry(hash_entry, struct nexthop_link, hash);
+	}else{
+		link = ixmap_mem_alloc(desc, sizeof(struct nexthop_link));
+		if(!link)
+			goto err_link_alloc;
+
+		link->ifindex = ifindex;
+		INIT_HLIST_HEAD(&link->vias);
+		hash_add(&table->links, &link->ifindex, &link->hash);
+		link_allocated = 1;
+	}
+
+	via = ixmap_mem_alloc(desc, sizeof(struct nexthop_via));
+	if(!via)
+		goto err_via_alloc;
+
+	memcpy(via->key, key, sizeof(key));
+	via->link = link;
+	INIT_HLIST_HEAD(&via->uses);
+	hlist_add_head(&via->list, &link->vias);
+	hash_add(&table->vias, via->key, &via->hash);
+
+	return via;
+
+err_via_alloc:
+	if(link_allocated){
+		hlist_del(&link->hash.list);
+		ixmap_mem_free(link);
+	}
+err_link_alloc:
+	return NULL;
+}
+
+/* A way out no member takes any more leaves its link, as may the link */
+static void nexthop_via_put(struct nexthop_via *via)
+{
+	struct nexthop_link *link;
+
+	if(!hlist_empty(&via->uses))
+		return;
+
+	link = via->link;
+	hlist_del(&via->hash.list);
+	hlist_del(&via->list);
+	ixmap_mem_free(via);
+
+	if(!hlist_empty(&link->vias))
+		return;
+
+	hlist_del(&link->hash.list);
+	ixmap_mem_free(link);
+	return;
+}
+
+/*
+ * Sets or clears flag, NEXTHOP_F_LINKDOWN or NEXTHOP_F_FAILED, on the
+ * members out of ifindex, only those through the gateway addr of family
+ * unless it is NULL. Their buckets move as soon as one is down for
+ * either, without waiting for the kernel to send the route again.
+ * Only the members listed on the matching ways out are visited.
+ */
+void nexthop_table_mark(struct nexthop_table *table, int family,
+	int ifindex, void *addr, unsigned int flag, int set)
+{
+	struct nexthop_via *via;
+	struct nexthop_link *link;
+	struct hash_entry *hash_entry;
+	uint32_t key[NEXTHOP_KEY_WORDS];
+	uint32_t link_key;
+
+	if(addr){
+		nexthop_via_key_set(key, family, ifindex, addr);
+		hash_entry = hash_lookup(&table->vias, key);
+		if(hash_entry)
+			nexthop_via_mark(hash_entry(hash_entry,
+				struct nexthop_via, hash), flag, set);
+		return;
+	}
+
+	link_key = ifindex;
+	hash_entry = hash_lookup(&table->links, &link_key);
+	if(!hash_entry)
+		return;
+
+	link = hash_entry(hash_entry, struct nexthop_link, hash);
+	hlist_for_each_entry(via, &link->vias, list){
+		nexthop_via_mark(via, flag, set);
+	}
+
+	return;
+}
+
+static void nexthop_via_mark(struct nexthop_via *via, unsigned int flag,
+	int set)
+{
+	struct nexthop_use *use;
+	struct nexthop_group *group;
+	struct nexthop *nexthop;
+
+	hlist_for_each_entry(use, &via->uses, list){
+		group = use->route->group;
+		nexthop = &group->nexthops[use->index];
+
+		if(!(nexthop->flags & flag) == !set)
+			continue;
+
+		nexthop->flags ^= flag;
+		nexthop_group_set_dead(group, use->index, nexthop->flags
+			& (NEXTHOP_F_LINKDOWN | NEXTHOP_F_FAILED));
+	}
+
+	return;
+}
@@ -0,0 +1,118 @@
+#ifndef _IXMAPFWD_NEXTHOP_H
+#define _IXMAPFWD_NEXTHOP_H
+
+#include <stdint.h>
+#include "hash.h"
+#include "adj.h"
+
+/*
+ * ECMP next-hop groups, from the RTA_MULTIPATH of a route.
+ * A flow hash picks one of NEXTHOP_BUCKETS buckets, each holding a
+ * member. Members get buckets in proportion to their weight, and a
+ * membership change only moves the buckets it has to (resilient
+ * hashing), so flows on the surviving members keep their path.
+ */
+#define NEXTHOP_MAX		64
+#define NEXTHOP_BUCKET_BITS	9
+#define NEXTHOP_BUCKETS		(1 << NEXTHOP_BUCKET_BITS)
+#define NEXTHOP_NONE		0xff /* bucket of a group with no live member */
+#define NEXTHOP_KEY_WORDS	6
+
+#define NEXTHOP_F_GATEWAY	0x1 /* addr is set, otherwise on link */
+#define NEXTHOP_F_DEAD		0x2 /* holds no bucket */
+#define NEXTHOP_F_LINKDOWN	0x4 /* its link is down */
+#define NEXTHOP_F_FAILED	0x8 /* its gateway does not answer */
+
+struct nexthop {
+	uint8_t			addr[16];
+	int			port_index; /* -1 means not ixmap interface */
+	int			ifindex;
+	unsigned int		weight;
+	unsigned int		flags;
+	struct adj		*adj; /* of a gateway over an ixmap port */
+};
+
+struct nexthop_group {
+	unsigned int		refcount;
+	unsigned int		num_nexthops;
+	uint8_t			buckets[NEXTHOP_BUCKETS];
+	struct nexthop		nexthops[0];
+};
+
+/* the last group of each multipath route, to derive the next one from */
+struct nexthop_route {
+	struct hash_entry	hash;
+	uint32_t		key[NEXTHOP_KEY_WORDS]; /* prefix, family, len, rt */
+	struct nexthop_group	*group;
+	struct nexthop_use	*uses; /* one per member of group */
+};
+
+/* a member of the group of a route, on the list of its way out */
+struct nexthop_use {
+	struct hlist_node	list;
+	struct nexthop_route	*route;
+	unsigned int		index;
+	struct nexthop_via	*via;
+};
+
+/*
+ * One way out, through a gateway or on link, and the members taking it:
+ * a neighbor or link change only walks the members it concerns.
+ */
+struct nexthop_via {
+	struct hash_entry	hash;
+	uint32_t		key[NEXTHOP_KEY_WORDS]; /* addr, family, ifindex */
+	struct hlist_node	list; /* on its link */
+	struct nexthop_link	*link;
+	struct hlist_head	uses;
+};
+
+/* the ways out of one interface */
+struct nexthop_link {
+	struct hash_entry	hash;
+	uint32_t		ifindex;
+	struct hlist_head	vias;
+};
+
+struct nexthop_table {
+	struct hash_table	table;
+	struct hash_table	vias;
+	struct hash_table	links;
+};
+
+struct nexthop_group *nexthop_group_alloc(struct nexthop *nexthops,
+	unsigned int num_nexthops, struct nexthop_group *prev,
+	struct ixmap_desc *desc);
+void nexthop_group_get(struct nexthop_group *group);
+void nexthop_group_put(struct nexthop_group *group);
+int nexthop_group_set_dead(struct nexthop_group *group,
+	unsigned int index, int dead);
+struct nexthop_table *nexthop_table_alloc(struct ixmap_desc *desc);
+void nexthop_table_release(struct nexthop_table *table);
+struct nexthop_group *nexthop_table_lookup(struct nexthop_table *table,
+	uint32_t rt_table, int family, void *prefix, unsigned int prefix_len);
+int nexthop_table_update(struct nexthop_table *table,
+	uint32_t rt_table, int family, void *prefix, unsigned int prefix_len,
+	struct nexthop_group *group, struct ixmap_desc *desc);
+int nexthop_table_delete(struct nexthop_table *table,
+	uint32_t rt_table, int family, void *prefix, unsigned int prefix_len);
+void nexthop_table_mark(struct nexthop_table *table, int family,
+	int ifindex, void *addr, unsigned int flag, int set);
+
+/*
+ * RSS fills the redirection table from the low bits of the hash,
+ * they hardly vary among the packets of one queue: use the high ones.
+ */
+static inline struct nexthop *nexthop_select(struct nexthop_group *group,
+	uint32_t hash)
+{
+	unsigned int index;
+
+	index = group->buckets[hash >> (32 - NEXTHOP_BUCKET_BITS)];
+	if(unlikely(index == NEXTHOP_NONE))
+		return NULL;
+
+	return &group->nexthops[index];
+}
+
+#endif /* _IXMAPFWD_NEXTHOP_H */
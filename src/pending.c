@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <ixmap.h>
+
+#include "main.h"
+#include "pending.h"
+
+struct pending_table *pending_alloc(struct ixmap_desc *desc)
+{
+	struct pending_table *pending;
+
+	pending = ixmap_mem_alloc(desc, sizeof(struct pending_table));
+	if(!pending)
+		goto err_pending_alloc;
+
+	memset(pending, 0, sizeof(struct pending_table));
+	return pending;
+
+err_pending_alloc:
+	return NULL;
+}
+
+/* Slots still held go back to buf */
+void pending_release(struct pending_table *pending, struct ixmap_buf *buf)
+{
+	while(pending->num_hops){
+		pending_drop(pending, &pending->hops[0], buf);
+	}
+
+	ixmap_mem_free(pending);
+	return;
+}
+
+struct pending_hop *pending_lookup(struct pending_table *pending,
+	int family, int port_index, void *addr)
+{
+	struct pending_hop *hop;
+	unsigned int i;
+
+	for(i = 0; i < pending->num_hops; i++){
+		hop = &pending->hops[i];
+		if(hop->family != family || hop->port_index != port_index)
+			continue;
+
+		if(!memcmp(hop->addr, addr, family == AF_INET ? 4 : 16))
+			return hop;
+	}
+
+	return NULL;
+}
+
+struct pending_hop *pending_add(struct pending_table *pending,
+	int family, int port_index, void *addr, unsigned long now)
+{
+	struct pending_hop *hop;
+
+	if(pending->num_hops == PENDING_HOPS)
+		goto err_table_full;
+
+	hop = &pending->hops[pending->num_hops++];
+	memset(hop->addr, 0, sizeof(hop->addr));
+	memcpy(hop->addr, addr, family == AF_INET ? 4 : 16);
+	hop->family = family;
+	hop->port_index = port_index;
+	hop->stamp = now;
+	hop->num = 0;
+	return hop;
+
+err_table_full:
+	return NULL;
+}
+
+/* The last next hop takes the place of the removed one */
+void pending_remove(struct pending_table *pending, struct pending_hop *hop)
+{
+	struct pending_hop *last;
+
+	last = &pending->hops[--pending->num_hops];
+	if(hop != last)
+		memcpy(hop, last, sizeof(struct pending_hop));
+
+	return;
+}
+
+void pending_drop(struct pending_table *pending, struct pending_hop *hop,
+	struct ixmap_buf *buf)
+{
+	unsigned int i;
+
+	for(i = 0; i < hop->num; i++){
+		ixmap_slot_release(buf, hop->packets[i].slot_index);
+	}
+
+	pending_remove(pending, hop);
+	return;
+}
+
+void pending_expire(struct pending_table *pending, struct ixmap_buf *buf,
+	unsigned long now)
+{
+	struct pending_hop *hop;
+	unsigned int i;
+
+	/* a removal moves the last next hop to i, seen on the next turn */
+	for(i = 0; i < pending->num_hops;){
+		hop = &pending->hops[i];
+		if(now - hop->stamp < PENDING_TIMEOUT){
+			i++;
+			continue;
+		}
+
+		pending->drop_timeout += hop->num;
+		pending_drop(pending, hop, buf);
+	}
+
+	return;
+}
@@ -0,0 +1,53 @@
+#ifndef _IXMAPFWD_PENDING_H
+#define _IXMAPFWD_PENDING_H
+
+#include <stdint.h>
+#include <ixmap.h>
+
+/*
+ * Packets of one thread waiting for the neighbor of their next hop.
+ * The first packet to a next hop goes to the kernel, which resolves
+ * it. Those after it keep their slot here, without a copy, until
+ * netlink_neigh() or thread_pending_poll() brings the neighbor or
+ * PENDING_TIMEOUT runs out.
+ * Slots held are bounded by PENDING_HOPS * PENDING_DEPTH.
+ */
+#define PENDING_HOPS		16 /* next hops waiting at once */
+#define PENDING_DEPTH		16 /* packets held per next hop */
+#define PENDING_TIMEOUT		1000 /* ms, a kernel ARP/ND retransmit */
+#define PENDING_POLL_INTERVAL	10 /* ms between looks at the neighbors */
+
+struct pending_hop {
+	uint32_t		addr[4];
+	int			family;
+	int			port_index; /* egress */
+	unsigned long		stamp; /* first packet punted, in ms */
+	unsigned int		num;
+	int			ports_in[PENDING_DEPTH]; /* for expired TTLs */
+	struct ixmap_packet	packets[PENDING_DEPTH];
+};
+
+struct pending_table {
+	struct pending_hop	hops[PENDING_HOPS]; /* num_hops first ones */
+	unsigned int		num_hops;
+	unsigned long		punted; /* resolutions asked to the kernel */
+	unsigned long		held;
+	unsigned long		flushed;
+	unsigned long		drop_full; /* next hop at PENDING_DEPTH */
+	unsigned long		drop_timeout;
+	unsigned long		drop_failed; /* kernel gave up resolving */
+};
+
+struct pending_table *pending_alloc(struct ixmap_desc *desc);
+void pending_release(struct pending_table *pending, struct ixmap_buf *buf);
+struct pending_hop *pending_lookup(struct pending_table *pending,
+	int family, int port_index, void *addr);
+struct pending_hop *pending_add(struct pending_table *pending,
+	int family, int port_index, void *addr, unsigned long now);
+void pending_remove(struct pending_table *pending, struct pending_hop *hop);
+void pending_drop(struct pending_table *pending, struct pending_hop *hop,
+	struct ixmap_buf *buf);
+void pending_expire(struct pending_table *pending, struct ixmap_buf *buf,
+	unsigned long now);
+
+#endif /* _IXMAPFWD_PENDING_H */
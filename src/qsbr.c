@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sched.h>
+#include <ixmap.h>
+
+#include "main.h"
+#include "qsbr.h"
+
+static void qsbr_mem_free(void *ptr, unsigned long data);
+static unsigned long qsbr_seq_min(struct qsbr *qsbr);
+
+struct qsbr *qsbr_alloc(struct ixmap_desc *desc, unsigned int num_readers)
+{
+	struct qsbr *qsbr;
+	int i;
+
+	qsbr = ixmap_mem_alloc(desc, sizeof(struct qsbr));
+	if(!qsbr)
+		goto err_qsbr_alloc;
+
+	qsbr->readers = ixmap_mem_alloc(desc,
+		sizeof(struct qsbr_reader) * num_readers);
+	if(!qsbr->readers)
+		goto err_readers_alloc;
+
+	qsbr->defer = ixmap_mem_alloc(desc,
+		sizeof(struct qsbr_defer) * QSBR_DEFER_MAX);
+	if(!qsbr->defer)
+		goto err_defer_alloc;
+
+	for(i = 0; i < num_readers; i++){
+		qsbr->readers[i].seq = QSBR_OFFLINE;
+	}
+
+	qsbr->seq		= 1;
+	qsbr->num_readers	= num_readers;
+	qsbr->defer_head	= 0;
+	qsbr->defer_num		= 0;
+
+	return qsbr;
+
+err_defer_alloc:
+	ixmap_mem_free(qsbr->readers);
+err_readers_alloc:
+	ixmap_mem_free(qsbr);
+err_qsbr_alloc:
+	return NULL;
+}
+
+/* All readers must have stopped */
+void qsbr_release(struct qsbr *qsbr)
+{
+	qsbr_synchronize(qsbr);
+
+	ixmap_mem_free(qsbr->defer);
+	ixmap_mem_free(qsbr->readers);
+	ixmap_mem_free(qsbr);
+	return;
+}
+
+static void qsbr_mem_free(void *ptr, unsigned long data)
+{
+	ixmap_mem_free(ptr);
+	return;
+}
+
+/*
+ * Without a qsbr the table is private to its thread,
+ * so the callback runs at once.
+ */
+void qsbr_call(struct qsbr *qsbr, void (*func)(void *, unsigned long),
+	void *ptr, unsigned long data)
+{
+	struct qsbr_defer *defer;
+
+	if(!qsbr){
+		func(ptr, data);
+		return;
+	}
+
+	while(qsbr->defer_num == QSBR_DEFER_MAX){
+		qsbr_poll(qsbr);
+		if(qsbr->defer_num == QSBR_DEFER_MAX)
+			sched_yield();
+	}
+
+	defer = &qsbr->defer[(qsbr->defer_head + qsbr->defer_num)
+		% QSBR_DEFER_MAX];
+	defer->func	= func;
+	defer->ptr	= ptr;
+	defer->data	= data;
+
+	/* the object is unpublished before the counter moves */
+	barrier();
+	defer->seq	= ++qsbr->seq;
+	qsbr->defer_num++;
+
+	return;
+}
+
+void qsbr_free(struct qsbr *qsbr, void *ptr)
+{
+	qsbr_call(qsbr, qsbr_mem_free, ptr, 0);
+	return;
+}
+
+/* Oldest counter still observed by an online reader other than the writer */
+static unsigned long qsbr_seq_min(struct qsbr *qsbr)
+{
+	unsigned long seq, seq_min;
+	int i;
+
+	/* order the counter update against loading the readers' views */
+	smp_mb();
+
+	seq_min = qsbr->seq;
+	for(i = 1; i < qsbr->num_readers; i++){
+		seq = qsbr->readers[i].seq;
+		if(seq != QSBR_OFFLINE && seq < seq_min)
+			seq_min = seq;
+	}
+
+	return seq_min;
+}
+
+void qsbr_poll(struct qsbr *qsbr)
+{
+	struct qsbr_defer *defer;
+	unsigned long seq_min;
+
+	if(!qsbr->defer_num)
+		return;
+
+	seq_min = qsbr_seq_min(qsbr);
+
+	while(qsbr->defer_num){
+		defer = &qsbr->defer[qsbr->defer_head];
+		if(defer->seq > seq_min)
+			break;
+
+		defer->func(defer->ptr, defer->data);
+		qsbr->defer_head = (qsbr->defer_head + 1) % QSBR_DEFER_MAX;
+		qsbr->defer_num--;
+	}
+
+	return;
+}
+
+void qsbr_synchronize(struct qsbr *qsbr)
+{
+	while(qsbr->defer_num){
+		qsbr_poll(qsbr);
+		if(qsbr->defer_num)
+			sched_yield();
+	}
+
+	return;
+}
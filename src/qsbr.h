@@ -0,0 +1,75 @@
+#ifndef _IXMAPFWD_QSBR_H
+#define _IXMAPFWD_QSBR_H
+
+#include <ixmap.h>
+#include "main.h"
+
+/*
+ * Quiescent state based reclamation:
+ * A single writer retires memory still reachable by lookups with
+ * qsbr_call(), and the callback runs once every reader has passed
+ * a quiescent state. Readers only store their view of the counter,
+ * so the lookup path takes neither locks nor atomics.
+ */
+#define QSBR_DEFER_MAX		((1 << 16) - 2)
+#define QSBR_OFFLINE		0
+#define QSBR_POLL_INTERVAL	10 /* ms, while releases are pending */
+
+struct qsbr_reader {
+	volatile unsigned long	seq;
+} __attribute__((aligned(64)));
+
+struct qsbr_defer {
+	void			(*func)(
+				void *,
+				unsigned long
+				);
+	void			*ptr;
+	unsigned long		data;
+	unsigned long		seq;
+};
+
+struct qsbr {
+	volatile unsigned long	seq;
+	struct qsbr_reader	*readers; /* readers[0] is the writer */
+	unsigned int		num_readers;
+	struct qsbr_defer	*defer;
+	unsigned int		defer_head;
+	unsigned int		defer_num;
+};
+
+struct qsbr *qsbr_alloc(struct ixmap_desc *desc, unsigned int num_readers);
+void qsbr_release(struct qsbr *qsbr);
+void qsbr_call(struct qsbr *qsbr, void (*func)(void *, unsigned long),
+	void *ptr, unsigned long data);
+void qsbr_free(struct qsbr *qsbr, void *ptr);
+void qsbr_poll(struct qsbr *qsbr);
+void qsbr_synchronize(struct qsbr *qsbr);
+
+/* Reader side: nothing retired before this call is referenced after it */
+static inline void qsbr_quiescent(struct qsbr *qsbr,
+	struct qsbr_reader *reader)
+{
+	barrier();
+	reader->seq = qsbr->seq;
+	return;
+}
+
+/* Reader side: stop being waited for, e.g. while blocked in epoll_wait() */
+static inline void qsbr_offline(struct qsbr_reader *reader)
+{
+	barrier();
+	reader->seq = QSBR_OFFLINE;
+	return;
+}
+
+static inline void qsbr_online(struct qsbr *qsbr,
+	struct qsbr_reader *reader)
+{
+	reader->seq = qsbr->seq;
+	/* publish the counter before the first lookup loads anything */
+	smp_mb();
+	return;
+}
+
+#endif /* _IXMAPFWD_QSBR_H */
@@ -0,0 +1,505 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <ixmap.h>
+
+#include "main.h"
+#include "snapshot.h"
+
+struct snapshot_walk {
+	struct snapshot_route	*route;
+	struct snapshot_neigh	*neigh;
+	struct snapshot_nexthop	*nexthops;
+	unsigned int		num_nexthops;
+	int			family;
+	int			port_index;
+};
+
+static unsigned int snapshot_fib_count(struct fib *fib);
+static void snapshot_route_collect(void *ptr, void *arg);
+static void snapshot_nexthop_count(void *ptr, void *arg);
+static struct nexthop_group *snapshot_group_load(struct snapshot *snapshot,
+	struct snapshot_route *record, struct adj_table *adjs,
+	unsigned int *ifindex, unsigned int num_ports,
+	struct ixmap_desc *desc);
+static void snapshot_neigh_count(struct neigh_entry *neigh_entry,
+	void *arg);
+static void snapshot_neigh_collect(struct neigh_entry *neigh_entry,
+	void *arg);
+static void snapshot_reverse(struct snapshot_route *routes,
+	unsigned int num);
+static int snapshot_write(char *path, void *buf, size_t size);
+
+static unsigned int snapshot_fib_count(struct fib *fib)
+{
+	return fib->agg ? fib->agg->num_routes : fib->num_routes;
+}
+
+static void snapshot_route_collect(void *ptr, void *arg)
+{
+	struct snapshot_walk *walk = arg;
+	struct fib_entry *entry = ptr;
+	struct snapshot_route *route;
+	struct snapshot_nexthop *record;
+	struct nexthop *nexthop;
+	unsigned int i;
+
+	route = walk->route++;
+	memset(route, 0, sizeof(struct snapshot_route));
+
+	route->family		= walk->family;
+	route->type		= entry->type;
+	route->prefix_len	= entry->prefix_len;
+	route->port_index	= entry->port_index;
+	route->id		= entry->id;
+	memcpy(route->prefix, entry->prefix,
+		walk->family == AF_INET ? 4 : 16);
+	memcpy(route->nexthop, entry->nexthop,
+		walk->family == AF_INET ? 4 : 16);
+
+	if(!entry->group)
+		return;
+
+	route->num_nexthops = entry->group->num_nexthops;
+	route->nexthop_index = walk->num_nexthops;
+
+	for(i = 0; i < entry->group->num_nexthops; i++){
+		nexthop = &entry->group->nexthops[i];
+		record = &walk->nexthops[walk->num_nexthops++];
+
+		record->flags		= nexthop->flags;
+		record->weight		= nexthop->weight;
+		record->port_index	= nexthop->port_index;
+		record->ifindex		= nexthop->ifindex;
+		memcpy(record->addr, nexthop->addr, 16);
+	}
+	return;
+}
+
+static void snapshot_nexthop_count(void *ptr, void *arg)
+{
+	struct fib_entry *entry = ptr;
+
+	if(entry->group)
+		(*(unsigned int *)arg) += entry->group->num_nexthops;
+	return;
+}
+
+static void snapshot_neigh_count(struct neigh_entry *neigh_entry,
+	void *arg)
+{
+	(*(unsigned int *)arg)++;
+	return;
+}
+
+static void snapshot_neigh_collect(struct neigh_entry *neigh_entry,
+	void *arg)
+{
+	struct snapshot_walk *walk = arg;
+	struct snapshot_neigh *neigh;
+
+	neigh = walk->neigh++;
+	memset(neigh, 0, sizeof(struct snapshot_neigh));
+
+	neigh->family		= walk->family;
+	neigh->port_index	= walk->port_index;
+	memcpy(neigh->dst_addr, neigh_entry->dst_addr,
+		walk->family == AF_INET ? 4 : 16);
+	memcpy(neigh->dst_mac, neigh_entry->dst_mac, ETH_ALEN);
+	return;
+}
+
+static void snapshot_reverse(struct snapshot_route *routes,
+	unsigned int num)
+{
+	struct snapshot_route route;
+	unsigned int i;
+
+	for(i = 0; i < num / 2; i++){
+		route = routes[i];
+		routes[i] = routes[num - 1 - i];
+		routes[num - 1 - i] = route;
+	}
+
+	return;
+}
+
+/*
+ * Called by the thread owning the tables, so nothing changes under it.
+ * The file is replaced at once, a crash leaves the previous snapshot.
+ */
+int snapshot_save(char *path, struct fib *fib_inet, struct fib *fib_inet6,
+	struct neigh_table **neigh_inet, struct neigh_table **neigh_inet6,
+	unsigned int num_ports)
+{
+	struct snapshot_header *header;
+	struct snapshot_walk walk;
+	unsigned int num_inet, num_inet6, num_neighs, num_nexthops, i;
+	size_t size;
+	void *buf;
+	int ret;
+
+	num_inet = snapshot_fib_count(fib_inet);
+	num_inet6 = snapshot_fib_count(fib_inet6);
+
+	num_nexthops = 0;
+	fib_route_walk(fib_inet, snapshot_nexthop_count, &num_nexthops);
+	fib_route_walk(fib_inet6, snapshot_nexthop_count, &num_nexthops);
+
+	num_neighs = 0;
+	for(i = 0; i < num_ports; i++){
+		neigh_walk(neigh_inet[i], snapshot_neigh_count, &num_neighs);
+		neigh_walk(neigh_inet6[i], snapshot_neigh_count, &num_neighs);
+	}
+
+	size = sizeof(struct snapshot_header)
+		+ sizeof(struct snapshot_route) * (num_inet + num_inet6)
+		+ sizeof(struct snapshot_neigh) * num_neighs
+		+ sizeof(struct snapshot_nexthop) * num_nexthops;
+
+	buf = malloc(size);
+	if(!buf)
+		goto err_buf_alloc;
+
+	header = buf;
+	memset(header, 0, sizeof(struct snapshot_header));
+	header->magic		= SNAPSHOT_MAGIC;
+	header->version		= SNAPSHOT_VERSION;
+	header->header_size	= sizeof(struct snapshot_header);
+	header->size		= size;
+	header->stamp		= time(NULL);
+	header->num_routes	= num_inet + num_inet6;
+	header->num_neighs	= num_neighs;
+	header->routes_offset	= sizeof(struct snapshot_header);
+	header->neighs_offset	= header->routes_offset
+		+ sizeof(struct snapshot_route) * header->num_routes;
+	header->num_nexthops	= num_nexthops;
+	header->nexthops_offset	= header->neighs_offset
+		+ sizeof(struct snapshot_neigh) * header->num_neighs;
+
+	walk.route = buf + header->routes_offset;
+	walk.nexthops = buf + header->nexthops_offset;
+	walk.num_nexthops = 0;
+	walk.family = AF_INET;
+	fib_route_walk(fib_inet, snapshot_route_collect, &walk);
+	walk.family = AF_INET6;
+	fib_route_walk(fib_inet6, snapshot_route_collect, &walk);
+
+	/* oldest first, so that the newest route of a prefix still wins */
+	snapshot_reverse(buf + header->routes_offset, num_inet);
+	snapshot_reverse(buf + header->routes_offset
+		+ sizeof(struct snapshot_route) * num_inet, num_inet6);
+
+	walk.neigh = buf + header->neighs_offset;
+	for(i = 0; i < num_ports; i++){
+		walk.port_index = i;
+
+		walk.family = AF_INET;
+		neigh_walk(neigh_inet[i], snapshot_neigh_collect, &walk);
+		walk.family = AF_INET6;
+		neigh_walk(neigh_inet6[i], snapshot_neigh_collect, &walk);
+	}
+
+	ret = snapshot_write(path, buf, size);
+	if(ret < 0)
+		goto err_write;
+
+	free(buf);
+	return 0;
+
+err_write:
+	free(buf);
+err_buf_alloc:
+	return -1;
+}
+
+static int snapshot_write(char *path, void *buf, size_t size)
+{
+	char path_tmp[PATH_MAX];
+	ssize_t written;
+	size_t offset;
+	int fd, ret;
+
+	ret = snprintf(path_tmp, sizeof(path_tmp), "%s.tmp", path);
+	if(ret < 0 || ret >= sizeof(path_tmp))
+		goto err_path;
+
+	fd = open(path_tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if(fd < 0)
+		goto err_open;
+
+	for(offset = 0; offset < size; offset += written){
+		written = write(fd, buf + offset, size - offset);
+		if(written < 0)
+			goto err_write;
+	}
+
+	ret = fsync(fd);
+	if(ret < 0)
+		goto err_write;
+
+	close(fd);
+
+	ret = rename(path_tmp, path);
+	if(ret < 0)
+		goto err_rename;
+
+	return 0;
+
+err_write:
+	close(fd);
+err_rename:
+	unlink(path_tmp);
+err_open:
+err_path:
+	return -1;
+}
+
+struct snapshot *snapshot_open(char *path)
+{
+	struct snapshot *snapshot;
+	struct snapshot_header *header;
+	struct stat st;
+	int fd, ret;
+
+	snapshot = malloc(sizeof(struct snapshot));
+	if(!snapshot)
+		goto err_snapshot_alloc;
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0)
+		goto err_open;
+
+	ret = fstat(fd, &st);
+	if(ret < 0 || st.st_size < sizeof(struct snapshot_header))
+		goto err_stat;
+
+	snapshot->size = st.st_size;
+	snapshot->addr = mmap(NULL, snapshot->size, PROT_READ,
+		MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	if(snapshot->addr == MAP_FAILED)
+		goto err_mmap;
+
+	header = snapshot->addr;
+	if(header->magic != SNAPSHOT_MAGIC
+	|| header->version != SNAPSHOT_VERSION
+	|| header->header_size != sizeof(struct snapshot_header)
+	|| header->size != snapshot->size)
+		goto err_invalid;
+
+	if(header->routes_offset + sizeof(struct snapshot_route)
+		* (uint64_t)header->num_routes > snapshot->size
+	|| header->neighs_offset + sizeof(struct snapshot_neigh)
+		* (uint64_t)header->num_neighs > snapshot->size
+	|| header->nexthops_offset + sizeof(struct snapshot_nexthop)
+		* (uint64_t)header->num_nexthops > snapshot->size)
+		goto err_invalid;
+
+	snapshot->header = header;
+	snapshot->routes = snapshot->addr + header->routes_offset;
+	snapshot->neighs = snapshot->addr + header->neighs_offset;
+	snapshot->nexthops = snapshot->addr + header->nexthops_offset;
+
+	close(fd);
+	return snapshot;
+
+err_invalid:
+	munmap(snapshot->addr, snapshot->size);
+err_mmap:
+err_stat:
+	close(fd);
+err_open:
+	free(snapshot);
+err_snapshot_alloc:
+	return NULL;
+}
+
+void snapshot_close(struct snapshot *snapshot)
+{
+	munmap(snapshot->addr, snapshot->size);
+	free(snapshot);
+	return;
+}
+
+/*
+ * Replaces *fib_ptr, not shared with readers yet, by a generation
+ * holding the routes of family. Routes out of an ixmap port take
+ * the ifindex its tap has now, as netlink will refer to them by it.
+ * Returns the number of routes installed.
+ */
+int snapshot_load_fib(struct snapshot *snapshot, struct fib **fib_ptr,
+	struct adj_table *adjs, int family, unsigned int *ifindex,
+	unsigned int num_ports, struct ixmap_desc *desc)
+{
+	struct snapshot_route *record;
+	struct fib_route *routes, *route;
+	struct fib *fib_new;
+	unsigned int num, dropped, i;
+	int ret;
+
+	routes = malloc(sizeof(struct fib_route)
+		* (snapshot->header->num_routes + 1));
+	if(!routes)
+		goto err_routes_alloc;
+
+	for(i = 0, num = 0; i < snapshot->header->num_routes; i++){
+		record = &snapshot->routes[i];
+		if(record->family != family
+		|| record->port_index >= (int)num_ports)
+			continue;
+
+		/* a damaged file must not reach the engines */
+		if(record->prefix_len > (family == AF_INET ? 32 : 128)
+		|| record->type > FIB_TYPE_PROHIBIT)
+			continue;
+
+		route = &routes[num++];
+		route->family		= record->family;
+		route->type		= record->type;
+		route->prefix_len	= record->prefix_len;
+		route->port_index	= record->port_index;
+		route->id		= record->port_index < 0 ?
+			record->id : ifindex[record->port_index];
+		route->group		= NULL;
+		route->adj		= NULL;
+		memcpy(route->prefix, record->prefix, 16);
+		memcpy(route->nexthop, record->nexthop, 16);
+
+		if(record->num_nexthops){
+			route->group = snapshot_group_load(snapshot, record,
+				adjs, ifindex, num_ports, desc);
+			if(!route->group)
+				num--;
+		}else if(route->type == FIB_TYPE_FORWARD){
+			route->adj = adj_get(adjs, family,
+				route->port_index, route->nexthop, desc);
+		}
+	}
+
+	fib_new = fib_build(*fib_ptr, family, routes, num, &dropped, desc);
+	if(fib_new){
+		fib_release(*fib_ptr);
+		*fib_ptr = fib_new;
+	}else{
+		/* aggregated, or short of memory for two generations */
+		for(i = 0, dropped = 0; i < num; i++){
+			route = &routes[i];
+			ret = fib_route_update(*fib_ptr, route->family,
+				route->type, route->prefix, route->prefix_len,
+				route->nexthop, route->group, route->adj,
+				route->port_index, route->id, desc);
+			if(ret < 0)
+				dropped++;
+		}
+	}
+
+	/* installed entries hold their own references */
+	for(i = 0; i < num; i++){
+		if(routes[i].group)
+			nexthop_group_put(routes[i].group);
+		if(routes[i].adj)
+			adj_put(routes[i].adj);
+	}
+
+	free(routes);
+	return num - dropped;
+
+err_routes_alloc:
+	return -1;
+}
+
+/* Paths keep no bucket history, the group is balanced afresh */
+static struct nexthop_group *snapshot_group_load(struct snapshot *snapshot,
+	struct snapshot_route *record, struct adj_table *adjs,
+	unsigned int *ifindex, unsigned int num_ports,
+	struct ixmap_desc *desc)
+{
+	struct snapshot_nexthop *records;
+	struct nexthop nexthops[NEXTHOP_MAX];
+	struct nexthop *nexthop;
+	struct nexthop_group *group;
+	unsigned int i;
+
+	if(record->num_nexthops > NEXTHOP_MAX
+	|| (uint64_t)record->nexthop_index + record->num_nexthops
+	> snapshot->header->num_nexthops)
+		goto err_invalid;
+
+	records = &snapshot->nexthops[record->nexthop_index];
+
+	for(i = 0; i < record->num_nexthops; i++){
+		nexthop = &nexthops[i];
+
+		nexthop->flags		= records[i].flags;
+		nexthop->weight		= records[i].weight;
+		nexthop->port_index	= records[i].port_index;
+		nexthop->ifindex	= records[i].ifindex;
+		memcpy(nexthop->addr, records[i].addr, 16);
+
+		if(nexthop->port_index >= (int)num_ports)
+			nexthop->port_index = -1;
+		if(nexthop->port_index >= 0)
+			nexthop->ifindex = ifindex[nexthop->port_index];
+
+		nexthop->adj = NULL;
+		if(nexthop->flags & NEXTHOP_F_GATEWAY)
+			nexthop->adj = adj_get(adjs, record->family,
+				nexthop->port_index, nexthop->addr, desc);
+	}
+
+	group = nexthop_group_alloc(nexthops, record->num_nexthops,
+		NULL, desc);
+
+	for(i = 0; i < record->num_nexthops; i++){
+		if(nexthops[i].adj)
+			adj_put(nexthops[i].adj);
+	}
+
+	return group;
+
+err_invalid:
+	return NULL;
+}
+
+int snapshot_load_neigh(struct snapshot *snapshot,
+	struct neigh_table **neigh_inet, struct neigh_table **neigh_inet6,
+	unsigned int num_ports, struct ixmap_desc *desc)
+{
+	struct snapshot_neigh *record;
+	struct neigh_table *neigh;
+	unsigned int i, num;
+	int ret;
+
+	for(i = 0, num = 0; i < snapshot->header->num_neighs; i++){
+		record = &snapshot->neighs[i];
+		if(record->port_index < 0
+		|| record->port_index >= (int)num_ports)
+			continue;
+
+		switch(record->family){
+		case AF_INET:
+			neigh = neigh_inet[record->port_index];
+			break;
+		case AF_INET6:
+			neigh = neigh_inet6[record->port_index];
+			break;
+		default:
+			continue;
+		}
+
+		ret = neigh_add(neigh, record->family, record->dst_addr,
+			record->dst_mac, desc);
+		if(!ret)
+			num++;
+	}
+
+	return num;
+}
@@ -0,0 +1,86 @@
+#ifndef _IXMAPFWD_SNAPSHOT_H
+#define _IXMAPFWD_SNAPSHOT_H
+
+#include <stdint.h>
+#include <linux/if_ether.h>
+#include "fib.h"
+#include "neigh.h"
+
+#define SNAPSHOT_MAGIC		0x50414e5350414d58ULL /* "XMAPSNAP" */
+#define SNAPSHOT_VERSION	2
+
+/*
+ * FIB and neighbors written on shutdown or checkpoint. On the next
+ * start the file is mapped read only and its records are rebuilt into
+ * tables, the routes through fib_build(). There is no pointer in it,
+ * records are found by their offset from the start of the file. Addresses are in network
+ * order, the rest in host order: it is for a restart on the same host.
+ * Routes of one family are stored oldest first.
+ */
+struct snapshot_header {
+	uint64_t		magic;
+	uint32_t		version;
+	uint32_t		header_size;
+	uint64_t		size; /* whole file */
+	uint64_t		stamp; /* seconds since the Epoch */
+	uint32_t		num_routes;
+	uint32_t		num_neighs;
+	uint64_t		routes_offset;
+	uint64_t		neighs_offset;
+	uint32_t		num_nexthops;
+	uint32_t		reserved;
+	uint64_t		nexthops_offset;
+};
+
+struct snapshot_route {
+	uint8_t			family;
+	uint8_t			type;
+	uint8_t			prefix_len;
+	uint8_t			num_nexthops; /* 0 unless multipath */
+	int32_t			port_index;
+	int32_t			id; /* ifindex when written */
+	uint32_t		nexthop_index; /* first of its paths */
+	uint8_t			prefix[16];
+	uint8_t			nexthop[16];
+};
+
+/* a path of a multipath route */
+struct snapshot_nexthop {
+	uint32_t		flags;
+	uint32_t		weight;
+	int32_t			port_index;
+	int32_t			ifindex; /* when written */
+	uint8_t			addr[16];
+};
+
+struct snapshot_neigh {
+	uint8_t			family;
+	uint8_t			reserved[3];
+	int32_t			port_index;
+	uint8_t			dst_addr[16];
+	uint8_t			dst_mac[ETH_ALEN];
+	uint8_t			reserved2[2];
+};
+
+struct snapshot {
+	void			*addr;
+	size_t			size;
+	struct snapshot_header	*header;
+	struct snapshot_route	*routes;
+	struct snapshot_neigh	*neighs;
+	struct snapshot_nexthop	*nexthops;
+};
+
+int snapshot_save(char *path, struct fib *fib_inet, struct fib *fib_inet6,
+	struct neigh_table **neigh_inet, struct neigh_table **neigh_inet6,
+	unsigned int num_ports);
+struct snapshot *snapshot_open(char *path);
+void snapshot_close(struct snapshot *snapshot);
+int snapshot_load_fib(struct snapshot *snapshot, struct fib **fib_ptr,
+	struct adj_table *adjs, int family, unsigned int *ifindex,
+	unsigned int num_ports, struct ixmap_desc *desc);
+int snapshot_load_neigh(struct snapshot *snapshot,
+	struct neigh_table **neigh_inet, struct neigh_table **neigh_inet6,
+	unsigned int num_ports, struct ixmap_desc *desc);
+
+#endif /* _IXMAPFWD_SNAPSHOT_H */
@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <ixmap.h>
+
+#include "main.h"
+#include "stats.h"
+
+static void stats_sum(struct stats_table *table, unsigned int id,
+	struct stats_counter *sum);
+
+struct stats_table *stats_table_alloc(struct ixmap_desc *desc,
+	unsigned int num_routes, unsigned int num_threads)
+{
+	struct stats_table *table;
+	unsigned int i, threads_assigned = 0;
+
+	table = ixmap_mem_alloc(desc, sizeof(struct stats_table));
+	if(!table)
+		goto err_table_alloc;
+
+	table->num_threads	= num_threads;
+	table->num_ids		= num_routes + 1;
+
+	table->free_ids = ixmap_mem_alloc(desc,
+		sizeof(unsigned int) * num_routes);
+	if(!table->free_ids)
+		goto err_free_ids_alloc;
+
+	table->base = ixmap_mem_alloc(desc,
+		sizeof(struct stats_counter) * table->num_ids);
+	if(!table->base)
+		goto err_base_alloc;
+
+	memset(table->base, 0, sizeof(struct stats_counter) * table->num_ids);
+
+	table->counters = ixmap_mem_alloc(desc,
+		sizeof(struct stats_counter *) * num_threads);
+	if(!table->counters)
+		goto err_counters_alloc;
+
+	/* one array per thread, never a cache line written by two */
+	for(i = 0; i < num_threads; i++, threads_assigned++){
+		table->counters[i] = ixmap_mem_alloc(desc,
+			sizeof(struct stats_counter) * table->num_ids);
+		if(!table->counters[i])
+			goto err_counter_alloc;
+
+		memset(table->counters[i], 0,
+			sizeof(struct stats_counter) * table->num_ids);
+	}
+
+	/* lowest ids first */
+	for(i = 0; i < num_routes; i++){
+		table->free_ids[i] = num_routes - i;
+	}
+	table->num_free = num_routes;
+
+	return table;
+
+err_counter_alloc:
+	for(i = 0; i < threads_assigned; i++){
+		ixmap_mem_free(table->counters[i]);
+	}
+	ixmap_mem_free(table->counters);
+err_counters_alloc:
+	ixmap_mem_free(table->base);
+err_base_alloc:
+	ixmap_mem_free(table->free_ids);
+err_free_ids_alloc:
+	ixmap_mem_free(table);
+err_table_alloc:
+	return NULL;
+}
+
+/* All threads must have stopped and the FIBs be released */
+void stats_table_release(struct stats_table *table)
+{
+	unsigned int i;
+
+	for(i = 0; i < table->num_threads; i++){
+		ixmap_mem_free(table->counters[i]);
+	}
+	ixmap_mem_free(table->counters);
+	ixmap_mem_free(table->base);
+	ixmap_mem_free(table->free_ids);
+	ixmap_mem_free(table);
+	return;
+}
+
+/*
+ * STATS_ID_NONE once every id is taken, the route then goes uncounted.
+ * The counters of the threads are left alone, the id is reported from
+ * their sums now on. A thread may still add to an id it cached before.
+ */
+unsigned int stats_id_get(struct stats_table *table)
+{
+	unsigned int id;
+
+	if(!table->num_free)
+		return STATS_ID_NONE;
+
+	id = table->free_ids[--table->num_free];
+	stats_sum(table, id, &table->base[id]);
+
+	return id;
+}
+
+/* Once no reader can find the entry, i.e. after its grace period */
+void stats_id_put(struct stats_table *table, unsigned int id)
+{
+	if(id == STATS_ID_NONE)
+		return;
+
+	table->free_ids[table->num_free++] = id;
+	return;
+}
+
+/* What the route holding id counted, by the writer like stats_id_get() */
+void stats_read(struct stats_table *table, unsigned int id,
+	struct stats_counter *sum)
+{
+	stats_sum(table, id, sum);
+	sum->packets	-= table->base[id].packets;
+	sum->bytes	-= table->base[id].bytes;
+	return;
+}
+
+/* Counters move on while they are summed, good enough for a report */
+static void stats_sum(struct stats_table *table, unsigned int id,
+	struct stats_counter *sum)
+{
+	unsigned int i;
+
+	sum->packets	= 0;
+	sum->bytes	= 0;
+
+	for(i = 0; i < table->num_threads; i++){
+		sum->packets	+= ACCESS_ONCE(table->counters[i][id].packets);
+		sum->bytes	+= ACCESS_ONCE(table->counters[i][id].bytes);
+	}
+
+	return;
+}
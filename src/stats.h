@@ -0,0 +1,46 @@
+#ifndef _IXMAPFWD_STATS_H
+#define _IXMAPFWD_STATS_H
+
+#include <stdint.h>
+
+/*
+ * Packet and byte counters of the routes of a node, see -r.
+ * The writer gives each FIB entry a compact id, every thread counts
+ * into its own array by that id with plain increments, and a reader
+ * of the stats sums the arrays. Id 0 takes what has no id of its own,
+ * so the fast path never tests it. The arrays are only ever written by
+ * their thread: an id taken again starts from the sums it had then.
+ */
+#define STATS_ID_NONE		0
+
+struct stats_counter {
+	uint64_t		packets;
+	uint64_t		bytes;
+};
+
+struct stats_table {
+	struct stats_counter	**counters; /* per thread, num_ids each */
+	struct stats_counter	*base; /* sums as each id was taken */
+	unsigned int		num_threads;
+	unsigned int		num_ids; /* STATS_ID_NONE included */
+	unsigned int		*free_ids;
+	unsigned int		num_free;
+};
+
+struct stats_table *stats_table_alloc(struct ixmap_desc *desc,
+	unsigned int num_routes, unsigned int num_threads);
+void stats_table_release(struct stats_table *table);
+unsigned int stats_id_get(struct stats_table *table);
+void stats_id_put(struct stats_table *table, unsigned int id);
+void stats_read(struct stats_table *table, unsigned int id,
+	struct stats_counter *sum);
+
+static inline void stats_count(struct stats_counter *counters,
+	unsigned int id, unsigned int bytes)
+{
+	counters[id].packets++;
+	counters[id].bytes += bytes;
+	return;
+}
+
+#endif /* _IXMAPFWD_STATS_H */
@@ -17,6 +17,7 @@
 #include <stddef.h>
 #include <syslog.h>
 #include <numa.h>
+#include <arpa/inet.h>
 #include <ixmap.h>
 
 #include "main.h"
@@ -25,6 +26,23 @@
 #include "epoll.h"
 #include "netlink.h"
 
+struct thread_stats_route {
+	struct fib_entry	*entry;
+	struct stats_counter	sum;
+	int			family;
+	uint32_t		table; /* 0 for the main FIB */
+};
+
+/* the busiest routes by bytes, in descending order */
+struct thread_stats_walk {
+	struct stats_table	*stats;
+	int			family;
+	uint32_t		table;
+	struct thread_stats_route top[THREAD_STATS_TOP];
+	unsigned int		num_top;
+	unsigned int		num_routes; /* with traffic, top or not */
+};
+
 static int thread_wait(struct ixmapfwd_thread *thread,
 	int fd_ep, uint8_t *read_buf, int read_size);
 static int thread_fd_prepare(struct list_head *ep_desc_head,
@@ -32,6 +50,21 @@ static int thread_fd_prepare(struct list_head *ep_desc_head,
 static void thread_fd_destroy(struct list_head *ep_desc_head,
 	int fd_ep);
 static void thread_print_result(struct ixmapfwd_thread *thread);
+static void thread_print_fib(struct ixmapfwd_thread *thread);
+static void thread_print_flow(struct ixmapfwd_thread *thread);
+static void thread_print_neigh(struct ixmapfwd_thread *thread);
+static void thread_print_pending(struct ixmapfwd_thread *thread);
+static void thread_print_nd(struct ixmapfwd_thread *thread);
+static void thread_print_stats(struct ixmapfwd_thread *thread);
+static void thread_stats_fib(struct thread_stats_walk *walk,
+	struct fib *fib, int family, uint32_t table);
+static void thread_stats_collect(void *ptr, void *arg);
+static void thread_snapshot_poll(struct ixmapfwd_thread *thread);
+static void thread_reject_poll(struct ixmapfwd_thread *thread);
+static void thread_nd_poll(struct ixmapfwd_thread *thread);
+static void thread_pending_poll(struct ixmapfwd_thread *thread);
+static void thread_confirm_poll(struct ixmapfwd_thread *thread);
+static void thread_snapshot_save(struct ixmapfwd_thread *thread);
 
 void *thread_process_interrupt(void *data)
 {
@@ -39,53 +72,37 @@ void *thread_process_interrupt(void *data)
 	struct list_head	ep_desc_head;
 	uint8_t			*read_buf;
 	int			read_size, fd_ep, i, ret;
-	int			ports_assigned = 0;
 
 	ixmapfwd_log(LOG_INFO, "thread %d started", thread->index);
 	read_size = getpagesize();
 	INIT_LIST_HEAD(&ep_desc_head);
 
-	/* Prepare fib */
-	thread->fib_inet = fib_alloc(thread->desc);
-	if(!thread->fib_inet)
-		goto err_fib_inet_alloc;
-
-	thread->fib_inet6 = fib_alloc(thread->desc);
-	if(!thread->fib_inet6)
-		goto err_fib_inet6_alloc;
-
-	/* Prepare Neighbor table */
-	thread->neigh_inet = ixmap_mem_alloc(thread->desc,
-		sizeof(struct neigh *) * thread->num_ports);
-	if(!thread->neigh_inet)
-		goto err_neigh_table_inet;
-	
-	thread->neigh_inet6 = ixmap_mem_alloc(thread->desc,
-		sizeof(struct neigh *) * thread->num_ports);
-	if(!thread->neigh_inet6)
-		goto err_neigh_table_inet6;
-
-	for(i = 0; i < thread->num_ports; i++, ports_assigned++){
-		thread->neigh_inet[i] = neigh_alloc(thread->desc, AF_INET);
-		if(!thread->neigh_inet[i])
-			goto err_neigh_inet_alloc;
-
-		thread->neigh_inet6[i] = neigh_alloc(thread->desc, AF_INET6);
-		if(!thread->neigh_inet6[i])
-			goto err_neigh_inet6_alloc;
-
-		/* calclulate maximum buf_size we should prepare */
+	/* calclulate maximum buf_size we should prepare */
+	for(i = 0; i < thread->num_ports; i++){
 		if(thread->tun_plane->ports[i].mtu_frame > read_size)
 			read_size = thread->tun_plane->ports[i].mtu_frame;
+	}
 
-		continue;
-
-err_neigh_inet6_alloc:
-		neigh_release(thread->neigh_inet[i]);
-err_neigh_inet_alloc:
-		goto err_assign_ports;
+	if(thread->flow_entries){
+		thread->flow = flow_cache_alloc(thread->desc,
+			thread->flow_entries, thread->flow_tuple,
+			&thread->fib->flow_gen);
+		if(!thread->flow)
+			goto err_flow_alloc;
 	}
 
+	thread->pending = pending_alloc(thread->desc);
+	if(!thread->pending)
+		goto err_pending_alloc;
+
+	thread->nd = nd_alloc(thread->desc, thread->num_ports);
+	if(!thread->nd)
+		goto err_nd_alloc;
+
+	/* room for the dump replies of netlink_resync() */
+	if(thread->fib_writer)
+		read_size = max(read_size, NETLINK_READ_SIZE);
+
 	/* Prepare read buffer */
 	read_buf = numa_alloc_onnode(read_size,
 		numa_node_of_cpu(thread->index));
@@ -99,33 +116,50 @@ err_neigh_inet_alloc:
 		goto err_ixgbe_epoll_prepare;
 	}
 
+	/* tables loaded from the snapshot may be stale, VRFs are not in it */
+	if(thread->fib_writer){
+		ret = netlink_resync(thread);
+		if(ret < 0)
+			ixmapfwd_log(LOG_ERR, "thread %d failed to "
+				"resynchronize with the kernel", thread->index);
+	}
+	thread->snapshot_stamp = netlink_now();
+	thread->confirm_stamp = thread->snapshot_stamp;
+
 	/* Prepare initial RX buffer */
 	for(i = 0; i < thread->num_ports; i++){
 		ixmap_rx_assign(thread->plane, i, thread->buf);
 	}
 
 	ret = thread_wait(thread, fd_ep, read_buf, read_size);
+	qsbr_offline(thread->qsbr_reader);
 	if(ret < 0)
 		goto err_wait;
 
 err_wait:
+	if(!thread->index && thread->snapshot_path)
+		thread_snapshot_save(thread);
+	netlink_resync_release(thread);
+	if(thread->fib_writer)
+		thread_print_fib(thread);
+	if(thread->fib_writer && thread->fib->stats)
+		thread_print_stats(thread);
+	if(thread->flow)
+		thread_print_flow(thread);
+	thread_print_neigh(thread);
+	thread_print_pending(thread);
+	thread_print_nd(thread);
 	thread_fd_destroy(&ep_desc_head, fd_ep);
 err_ixgbe_epoll_prepare:
 	numa_free(read_buf, read_size);
 err_alloc_read_buf:
-err_assign_ports:
-	for(i = 0; i < ports_assigned; i++){
-		neigh_release(thread->neigh_inet6[i]);
-		neigh_release(thread->neigh_inet[i]);
-	}
-	ixmap_mem_free(thread->neigh_inet6);
-err_neigh_table_inet6:
-	ixmap_mem_free(thread->neigh_inet);
-err_neigh_table_inet:
-	fib_release(thread->fib_inet6);
-err_fib_inet6_alloc:
-	fib_release(thread->fib_inet);
-err_fib_inet_alloc:
+	nd_release(thread->nd);
+err_nd_alloc:
+	pending_release(thread->pending, thread->buf);
+err_pending_alloc:
+	if(thread->flow)
+		flow_cache_release(thread->flow);
+err_flow_alloc:
 	thread_print_result(thread);
 	pthread_kill(thread->ptid, SIGINT);
 	return NULL;
@@ -137,11 +171,33 @@ static int thread_wait(struct ixmapfwd_thread *thread,
         struct epoll_desc *ep_desc;
         struct epoll_event events[EPOLL_MAXEVENTS];
 	struct ixmap_packet packet[IXMAP_RX_BUDGET];
-        int i, ret, num_fd;
+        int i, ret, num_fd, timeout;
         unsigned int port_index;
+	struct signalfd_siginfo *siginfo;
+	int offset;
 
 	while(1){
-		num_fd = epoll_wait(fd_ep, events, EPOLL_MAXEVENTS, -1);
+		/*
+		 * The writer wakes up to run releases readers are done with,
+		 * and to install routes held back once their burst is over.
+		 */
+		timeout = -1;
+		if(!thread->index && thread->snapshot_path
+		&& thread->snapshot_interval)
+			timeout = max((long)(thread->snapshot_interval * 1000
+				- (netlink_now() - thread->snapshot_stamp)), 0L);
+		if(thread->fib_writer && thread->fib->bulk.num)
+			timeout = NETLINK_BULK_QUIET;
+		if(thread->fib_writer && thread->qsbr->defer_num)
+			timeout = QSBR_POLL_INTERVAL;
+		if(thread->pending->num_hops
+		&& (timeout < 0 || timeout > PENDING_POLL_INTERVAL))
+			timeout = PENDING_POLL_INTERVAL;
+
+		/* FIB is not referenced while blocked */
+		qsbr_offline(thread->qsbr_reader);
+		num_fd = epoll_wait(fd_ep, events, EPOLL_MAXEVENTS, timeout);
+		qsbr_online(thread->qsbr, thread->qsbr_reader);
 		if(num_fd < 0){
 			goto err_read;
 		}
@@ -200,6 +256,10 @@ static int thread_wait(struct ixmapfwd_thread *thread,
 				break;
 			case EPOLL_NETLINK:
 				ret = read(ep_desc->fd, read_buf, read_size);
+				if(ret < 0 && errno == ENOBUFS){
+					netlink_overrun(thread);
+					break;
+				}
 				if(ret < 0)
 					goto err_read;
 
@@ -210,12 +270,33 @@ static int thread_wait(struct ixmapfwd_thread *thread,
 				if(ret < 0)
 					goto err_read;
 
-				goto out;
+				/* SIGUSR2 only asks for the route counters */
+				for(offset = 0; offset < ret;
+				offset += sizeof(struct signalfd_siginfo)){
+					siginfo = (struct signalfd_siginfo *)
+						&read_buf[offset];
+					if(siginfo->ssi_signo != SIGUSR2)
+						goto out;
+				}
+
+				if(thread->fib->stats)
+					thread_print_stats(thread);
 				break;
 			default:
 				break;
 			}
 		}
+
+		if(thread->fib_writer){
+			netlink_bulk_poll(thread);
+			qsbr_poll(thread->qsbr);
+		}
+
+		thread_snapshot_poll(thread);
+		thread_reject_poll(thread);
+		thread_nd_poll(thread);
+		thread_pending_poll(thread);
+		thread_confirm_poll(thread);
 	}
 
 out:
@@ -287,6 +368,8 @@ static int thread_fd_prepare(struct list_head *ep_desc_head,
 	/* signalfd preparing */
 	sigemptyset(&sigset);
 	sigaddset(&sigset, SIGUSR1);
+	if(thread->fib_writer)
+		sigaddset(&sigset, SIGUSR2);
 	ep_desc = epoll_desc_alloc_signalfd(&sigset, thread->index);
 	if(!ep_desc)
 		goto err_epoll_desc_signalfd;
@@ -299,10 +382,15 @@ static int thread_fd_prepare(struct list_head *ep_desc_head,
 		goto err_epoll_add_signalfd;
 	}
 
+	/* routes and neighbors are shared on the node, see its writer */
+	if(!thread->fib_writer)
+		return fd_ep;
+
 	/* netlink preparing */
 	memset(&addr, 0, sizeof(struct sockaddr_nl));
 	addr.nl_family = AF_NETLINK;
-	addr.nl_groups = RTMGRP_NEIGH | RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE;
+	addr.nl_groups = RTMGRP_NEIGH | RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE
+		| RTMGRP_LINK;
 
 	ep_desc = epoll_desc_alloc_netlink(&addr, thread->index);
 	if(!ep_desc)
@@ -316,6 +404,8 @@ static int thread_fd_prepare(struct list_head *ep_desc_head,
 		goto err_epoll_add_netlink;
 	}
 
+	thread->netlink_fd = ep_desc->fd;
+
 	return fd_ep;
 
 err_epoll_add_netlink:
@@ -372,5 +462,409 @@ static void thread_print_result(struct ixmapfwd_thread *thread)
 		ixmapfwd_log(LOG_INFO, "  Tx packetes transmitted = %lu",
 			ixmap_count_tx_clean_total(thread->plane, i));
 	}
+
+	ixmapfwd_log(LOG_INFO, "thread %d route drops:", thread->index);
+	ixmapfwd_log(LOG_INFO, "  blackhole = %lu", thread->drop_blackhole);
+	ixmapfwd_log(LOG_INFO, "  unreachable = %lu, prohibit = %lu "
+		"(%lu answered by the kernel)", thread->drop_unreachable,
+		thread->drop_prohibit, thread->reject_answered);
+	return;
+}
+
+static void thread_print_flow(struct ixmapfwd_thread *thread)
+{
+	struct flow_cache *cache = thread->flow;
+	unsigned long total;
+
+	total = cache->hits + cache->misses;
+
+	ixmapfwd_log(LOG_INFO, "thread %d flow cache statictis:",
+		thread->index);
+	ixmapfwd_log(LOG_INFO, "  entries = %u, key = %s",
+		(cache->mask + 1) * FLOW_WAYS,
+		cache->tuple ? "5-tuple" : "destination");
+	ixmapfwd_log(LOG_INFO, "  hits = %lu, misses = %lu (%.1f%% hit)",
+		cache->hits, cache->misses,
+		total ? 100.0 * cache->hits / total : 0);
+	return;
+}
+
+/*
+ * All ports of a family together. The writer logs the shared tables,
+ * every thread its own lookups in them.
+ */
+static void thread_print_neigh(struct ixmapfwd_thread *thread)
+{
+	struct neigh_table **tables, *neigh;
+	struct neigh_stats *stats;
+	unsigned long kicks;
+	unsigned int entries, buckets, grows;
+	int i, j;
+
+	for(i = 0; i < 2; i++){
+		tables = i ? thread->fib->neigh_inet6 : thread->fib->neigh_inet;
+		stats = i ? &thread->neigh_stats_inet6 :
+			&thread->neigh_stats_inet;
+
+		ixmapfwd_log(LOG_INFO, "thread %d neigh_inet%s statictis:",
+			thread->index, i ? "6" : "");
+		ixmapfwd_log(LOG_INFO, "  lookups = %lu, probes = %.2f "
+			"per lookup", stats->lookups, stats->lookups ?
+			(double)stats->probes / stats->lookups : 0);
+		ixmapfwd_log(LOG_INFO, "  signature collisions = %lu",
+			stats->collisions);
+
+		if(!thread->fib_writer)
+			continue;
+
+		kicks = 0;
+		entries = buckets = grows = 0;
+
+		for(j = 0; j < thread->num_ports; j++){
+			neigh = tables[j];
+			kicks		+= neigh->kicks;
+			entries		+= neigh->num_entries;
+			buckets		+= neigh->layout->mask + 1;
+			grows		+= neigh->grows;
+		}
+
+		ixmapfwd_log(LOG_INFO, "  shared entries = %u, buckets = %u, "
+			"grows = %u, kicks = %lu", entries, buckets, grows,
+			kicks);
+	}
+
+	if(thread->fib_writer)
+		ixmapfwd_log(LOG_INFO, "thread %d neighbors confirmed to "
+			"the kernel = %lu", thread->index,
+			thread->neigh_confirmed);
+	return;
+}
+
+static void thread_print_pending(struct ixmapfwd_thread *thread)
+{
+	struct pending_table *pending = thread->pending;
+
+	ixmapfwd_log(LOG_INFO, "thread %d neighbor resolution:",
+		thread->index);
+	ixmapfwd_log(LOG_INFO, "  punted = %lu, held = %lu, flushed = %lu",
+		pending->punted, pending->held, pending->flushed);
+	ixmapfwd_log(LOG_INFO, "  dropped full = %lu, timeout = %lu, "
+		"failed = %lu", pending->drop_full, pending->drop_timeout,
+		pending->drop_failed);
+	return;
+}
+
+/* Ports that saw no ARP nor ND are left out */
+static void thread_print_nd(struct ixmapfwd_thread *thread)
+{
+	struct nd_port *port;
+	int i;
+
+	for(i = 0; i < thread->num_ports; i++){
+		port = &thread->nd->ports[i];
+		if(!port->arp_answered && !port->ns_answered
+		&& !port->punted && !port->limited)
+			continue;
+
+		ixmapfwd_log(LOG_INFO, "thread %d port %d neighbor "
+			"requests:", thread->index, i);
+		ixmapfwd_log(LOG_INFO, "  arp answered = %lu, "
+			"ns answered = %lu", port->arp_answered,
+			port->ns_answered);
+		ixmapfwd_log(LOG_INFO, "  punted = %lu, rate limited = %lu",
+			port->punted, port->limited);
+	}
+
+	return;
+}
+
+static void thread_print_fib(struct ixmapfwd_thread *thread)
+{
+	struct lpm6_stats stats;
+	struct fib *fib_array[2];
+	struct fibagg *agg;
+	int i;
+
+	fib_array[0] = thread->fib->fib_inet;
+	fib_array[1] = thread->fib->fib_inet6;
+
+	for(i = 0; i < 2; i++){
+		agg = fib_array[i]->agg;
+		if(!agg)
+			continue;
+
+		ixmapfwd_log(LOG_INFO, "thread %d shared fib_inet%s aggregation:",
+			thread->index, agg->family == AF_INET6 ? "6" : "");
+		ixmapfwd_log(LOG_INFO, "  rib routes = %u, rib prefixes = %u",
+			agg->num_routes, agg->num_prefixes);
+		ixmapfwd_log(LOG_INFO, "  fib prefixes = %u, ratio = %.1f%%",
+			fib_array[i]->num_routes, agg->num_prefixes ?
+			100.0 * fib_array[i]->num_routes / agg->num_prefixes : 0);
+	}
+
+	if(thread->fib->fib_inet6->engine != FIB_ENGINE_LPM6)
+		return;
+
+	lpm6_stats(thread->fib->fib_inet6->table.lpm6, &stats);
+
+	ixmapfwd_log(LOG_INFO, "thread %d shared fib_inet6 statictis:",
+		thread->index);
+	ixmapfwd_log(LOG_INFO, "  prefixes = %u, markers = %u, slots = %u",
+		stats.prefixes, stats.markers, stats.slots);
+	ixmapfwd_log(LOG_INFO, "  prefix lengths = %u", stats.lengths);
+
+	/* lookup cost by the length of the best matching prefix */
+	for(i = 0; i <= LPM6_LEN_MAX; i++){
+		if(!stats.count[i])
+			continue;
+
+		ixmapfwd_log(LOG_INFO, "  /%d: prefixes = %u, probes = %u",
+			i, stats.count[i], stats.probes[i]);
+	}
+	return;
+}
+
+/* Counters of every thread of the node, so only the writer prints */
+static void thread_print_stats(struct ixmapfwd_thread *thread)
+{
+	struct thread_stats_walk walk;
+	struct thread_stats_route *route;
+	struct vrf_table *vrfs;
+	struct vrf *vrf;
+	struct stats_counter sum;
+	char prefix_a[INET6_ADDRSTRLEN];
+	unsigned int i;
+
+	memset(&walk, 0, sizeof(struct thread_stats_walk));
+	walk.stats = thread->fib->stats;
+
+	thread_stats_fib(&walk, thread->fib->fib_inet, AF_INET, 0);
+	thread_stats_fib(&walk, thread->fib->fib_inet6, AF_INET6, 0);
+
+	vrfs = thread->fib->vrfs;
+	for(i = 0; i < vrfs->num_vrfs; i++){
+		vrf = &vrfs->vrfs[i];
+		if(!vrf->table)
+			continue;
+
+		if(vrf->fib_inet)
+			thread_stats_fib(&walk, vrf->fib_inet,
+				AF_INET, vrf->table);
+		if(vrf->fib_inet6)
+			thread_stats_fib(&walk, vrf->fib_inet6,
+				AF_INET6, vrf->table);
+	}
+
+	ixmapfwd_log(LOG_INFO, "thread %d route counters:", thread->index);
+	ixmapfwd_log(LOG_INFO, "  routes with traffic = %u, ids free = %u",
+		walk.num_routes, walk.stats->num_free);
+
+	for(i = 0; i < walk.num_top; i++){
+		route = &walk.top[i];
+
+		inet_ntop(route->family, route->entry->prefix,
+			prefix_a, sizeof(prefix_a));
+		if(route->table)
+			ixmapfwd_log(LOG_INFO, "  %s/%u table %u: "
+				"packets = %lu, bytes = %lu",
+				prefix_a, route->entry->prefix_len, route->table,
+				route->sum.packets, route->sum.bytes);
+		else
+			ixmapfwd_log(LOG_INFO, "  %s/%u: "
+				"packets = %lu, bytes = %lu",
+				prefix_a, route->entry->prefix_len,
+				route->sum.packets, route->sum.bytes);
+	}
+
+	/* routes that found no free id, see -r */
+	stats_read(walk.stats, STATS_ID_NONE, &sum);
+	if(sum.packets)
+		ixmapfwd_log(LOG_INFO, "  uncounted routes: "
+			"packets = %lu, bytes = %lu", sum.packets, sum.bytes);
+	return;
+}
+
+static void thread_stats_fib(struct thread_stats_walk *walk,
+	struct fib *fib, int family, uint32_t table)
+{
+	walk->family	= family;
+	walk->table	= table;
+	fib_entry_walk(fib, thread_stats_collect, walk);
+	return;
+}
+
+static void thread_stats_collect(void *ptr, void *arg)
+{
+	struct fib_entry *entry = ptr;
+	struct thread_stats_walk *walk = arg;
+	struct thread_stats_route route;
+	unsigned int i;
+
+	if(entry->stats_id == STATS_ID_NONE)
+		return;
+
+	stats_read(walk->stats, entry->stats_id, &route.sum);
+	if(!route.sum.packets)
+		return;
+
+	walk->num_routes++;
+
+	if(walk->num_top == THREAD_STATS_TOP
+	&& route.sum.bytes <= walk->top[THREAD_STATS_TOP - 1].sum.bytes)
+		return;
+
+	route.entry	= entry;
+	route.family	= walk->family;
+	route.table	= walk->table;
+
+	/* the last one falls off when full */
+	i = walk->num_top < THREAD_STATS_TOP ?
+		walk->num_top++ : THREAD_STATS_TOP - 1;
+	for(; i > 0 && walk->top[i - 1].sum.bytes < route.sum.bytes; i--){
+		walk->top[i] = walk->top[i - 1];
+	}
+	walk->top[i] = route;
+	return;
+}
+
+static void thread_snapshot_poll(struct ixmapfwd_thread *thread)
+{
+
+	if(thread->index || !thread->snapshot_path
+	|| !thread->snapshot_interval)
+		return;
+
+	if(netlink_now() - thread->snapshot_stamp
+	< thread->snapshot_interval * 1000UL)
+		return;
+
+	thread_snapshot_save(thread);
+	return;
+}
+
+/* The clock is read only once some rejected packet took a token */
+static void thread_reject_poll(struct ixmapfwd_thread *thread)
+{
+	unsigned long now;
+
+	if(thread->reject_tokens == FORWARD_REJECT_RATE)
+		return;
+
+	now = netlink_now();
+	if(now - thread->reject_stamp < 1000)
+		return;
+
+	thread->reject_tokens = FORWARD_REJECT_RATE;
+	thread->reject_stamp = now;
+	return;
+}
+
+/* Likewise once some request was answered */
+static void thread_nd_poll(struct ixmapfwd_thread *thread)
+{
+	unsigned long now;
+
+	if(!thread->nd->taken)
+		return;
+
+	now = netlink_now();
+	if(now - thread->nd->stamp < 1000)
+		return;
+
+	nd_refill(thread->nd, now);
+	return;
+}
+
+/*
+ * Only the writer hears from the kernel, the other threads find the
+ * neighbors of their held packets in the tables of the node. Packets
+ * held longer than PENDING_TIMEOUT give up on their neighbor.
+ */
+static void thread_pending_poll(struct ixmapfwd_thread *thread)
+{
+	struct pending_table *pending = thread->pending;
+	struct pending_hop *hop;
+	struct neigh_table **tables, *neigh;
+	struct neigh_entry *neigh_entry;
+	struct neigh_stats *stats;
+	uint8_t mac[ETH_ALEN];
+	unsigned int i;
+
+	if(!pending->num_hops)
+		return;
+
+	/* a flush moves the last next hop to i, already seen */
+	for(i = pending->num_hops; i-- > 0;){
+		hop = &pending->hops[i];
+		if(hop->family == AF_INET){
+			tables = thread->fib->neigh_inet;
+			stats = &thread->neigh_stats_inet;
+		}else{
+			tables = thread->fib->neigh_inet6;
+			stats = &thread->neigh_stats_inet6;
+		}
+
+		neigh = ACCESS_ONCE(tables[hop->port_index]);
+		neigh_entry = neigh_lookup(neigh, stats, hop->addr);
+		if(!neigh_entry
+		|| neigh_load(neigh, neigh_entry, hop->addr, mac) < 0)
+			continue;
+
+		forward_pending_flush(thread, hop->family, hop->port_index,
+			hop->addr, mac);
+	}
+
+	pending_expire(pending, thread->buf, netlink_now());
+	return;
+}
+
+/*
+ * Not woken up for it: without traffic there is nothing to confirm.
+ * Flows of every thread are invalidated so that their packets mark
+ * their neighbor again.
+ */
+static void thread_confirm_poll(struct ixmapfwd_thread *thread)
+{
+	unsigned long now;
+
+	now = netlink_now();
+	if(now - thread->confirm_stamp < NETLINK_CONFIRM_INTERVAL)
+		return;
+
+	if(thread->fib_writer)
+		netlink_confirm(thread);
+
+	if(thread->flow)
+		flow_cache_invalidate(thread->flow);
+
+	thread->confirm_stamp = now;
+	return;
+}
+
+/*
+ * Thread 0 writes the snapshot: it is the writer of its node, so
+ * neither its FIB nor its neighbors change while they are walked.
+ */
+static void thread_snapshot_save(struct ixmapfwd_thread *thread)
+{
+	unsigned long start;
+	int ret;
+
+	start = netlink_now();
+	ret = snapshot_save(thread->snapshot_path,
+		thread->fib->fib_inet, thread->fib->fib_inet6,
+		thread->fib->neigh_inet, thread->fib->neigh_inet6,
+		thread->num_ports);
+	if(ret < 0){
+		ixmapfwd_log(LOG_ERR, "failed to save snapshot to %s",
+			thread->snapshot_path);
+		goto err_save;
+	}
+
+	ixmapfwd_log(LOG_INFO, "thread %d saved snapshot in %lu ms",
+		thread->index, netlink_now() - start);
+
+err_save:
+	thread->snapshot_stamp = netlink_now();
 	return;
 }
@@ -7,20 +7,92 @@
 #include "iftap.h"
 #include "neigh.h"
 #include "fib.h"
+#include "qsbr.h"
+#include "snapshot.h"
+#include "vrf.h"
+#include "flow.h"
+#include "local.h"
+#include "stats.h"
+#include "pending.h"
+#include "nd.h"
+
+#define THREAD_STATS_TOP	16 /* routes logged, see thread_print_stats() */
+
+/* routes held back for fib_build(), in arrival order */
+struct ixmapfwd_bulk {
+	struct fib_route	*routes;
+	unsigned int		num;
+	unsigned int		size;
+};
+
+/*
+ * FIB shared by the threads of a NUMA node, updated by one of them.
+ * Readers load fib_inet and fib_inet6 once per burst, a bulk load
+ * replaces them with a new generation, see fib_build().
+ * Ports bound to a VRF read the FIB of its table instead.
+ */
+struct ixmapfwd_fib {
+	struct fib		*fib_inet;
+	struct fib		*fib_inet6;
+	struct qsbr		*qsbr;
+	int			writer; /* thread index, -1 if no thread */
+	unsigned int		num_threads;
+	unsigned int		threads_assigned;
+	struct ixmapfwd_bulk	bulk;
+	unsigned long		bulk_stamp; /* last route held, or window start */
+	unsigned int		bulk_count; /* route additions in the window */
+	struct fib		*resync_inet; /* filled by a route dump */
+	struct fib		*resync_inet6;
+	struct ixmapfwd_bulk	resync_bulk; /* for resync_inet and inet6 */
+	struct nexthop_table	*nexthops; /* multipath routes, writer only */
+	struct vrf_table	*vrfs;
+	struct adj_table	*adjs; /* gateways of all FIBs, writer only */
+	struct neigh_table	**neigh_inet; /* per port, see neigh.h */
+	struct neigh_table	**neigh_inet6;
+	unsigned int		flow_gen; /* bumped by the writer, see flow.h */
+	struct local_table	*locals; /* addresses of the main FIB */
+	struct stats_table	*stats; /* route counters, or NULL */
+};
 
 struct ixmapfwd_thread {
 	struct ixmap_plane	*plane;
 	struct ixmap_buf	*buf;
 	struct ixmap_desc	*desc;
-	struct neigh_table	**neigh_inet;
-	struct neigh_table	**neigh_inet6;
-	struct fib		*fib_inet;
-	struct fib		*fib_inet6;
+	struct ixmapfwd_fib	*fib;
+	struct qsbr		*qsbr;
+	struct qsbr_reader	*qsbr_reader;
+	int			fib_writer;
 	struct tun_plane	*tun_plane;
 	int			index;
 	pthread_t		tid;
 	pthread_t		ptid;
 	unsigned int		num_ports;
+	int			netlink_fd;
+	uint32_t		netlink_pid;
+	uint32_t		resync_seq; /* dump running, 0 if none */
+	struct neigh_table	**resync_neigh_inet;
+	struct neigh_table	**resync_neigh_inet6;
+	struct snapshot		*snapshot; /* loaded at start, or NULL */
+	int			netlink_lost; /* routes dumped again, if set */
+	char			*snapshot_path;
+	unsigned int		snapshot_interval; /* seconds, 0 if none */
+	unsigned long		snapshot_stamp; /* last checkpoint, in ms */
+	struct flow_cache	*flow; /* NULL if disabled */
+	unsigned int		flow_entries;
+	unsigned int		flow_tuple;
+	unsigned long		drop_blackhole;
+	unsigned long		drop_unreachable; /* including answered */
+	unsigned long		drop_prohibit;
+	unsigned long		reject_answered;
+	unsigned int		reject_tokens;
+	unsigned long		reject_stamp; /* last refill, in ms */
+	struct pending_table	*pending; /* packets waiting for a neighbor */
+	struct nd_table		*nd; /* ARP/ND answered per port */
+	unsigned long		confirm_stamp; /* last netlink_confirm(), ms */
+	unsigned long		neigh_confirmed;
+	struct neigh_stats	neigh_stats_inet; /* lookups of this thread */
+	struct neigh_stats	neigh_stats_inet6;
+	struct stats_counter	*stats; /* this thread's, or NULL */
 };
 
 void *thread_process_interrupt(void *data);
@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <ixmap.h>
+
+#include "main.h"
+#include "vrf.h"
+
+static void vrf_port_update(struct vrf_table *vrfs);
+
+struct vrf_table *vrf_table_alloc(unsigned int num_ports,
+	struct qsbr *qsbr, struct stats_table *stats, unsigned int aggregate,
+	struct ixmap_desc *desc)
+{
+	struct vrf_table *vrfs;
+
+	vrfs = ixmap_mem_alloc(desc, sizeof(struct vrf_table));
+	if(!vrfs)
+		goto err_vrfs_alloc;
+
+	memset(vrfs, 0, sizeof(struct vrf_table));
+	vrfs->qsbr = qsbr;
+	vrfs->stats = stats;
+	vrfs->aggregate = aggregate;
+	vrfs->num_ports = num_ports;
+
+	vrfs->port_vrf = ixmap_mem_alloc(desc,
+		sizeof(struct vrf *) * num_ports);
+	if(!vrfs->port_vrf)
+		goto err_port_vrf_alloc;
+
+	vrfs->port_master = ixmap_mem_alloc(desc,
+		sizeof(int) * num_ports);
+	if(!vrfs->port_master)
+		goto err_port_master_alloc;
+
+	memset(vrfs->port_vrf, 0, sizeof(struct vrf *) * num_ports);
+	memset(vrfs->port_master, 0, sizeof(int) * num_ports);
+	return vrfs;
+
+err_port_master_alloc:
+	ixmap_mem_free(vrfs->port_vrf);
+err_port_vrf_alloc:
+	ixmap_mem_free(vrfs);
+err_vrfs_alloc:
+	return NULL;
+}
+
+/* All threads must have stopped */
+void vrf_table_release(struct vrf_table *vrfs)
+{
+	struct vrf *vrf;
+	int i;
+
+	for(i = 0; i < vrfs->num_vrfs; i++){
+		vrf = &vrfs->vrfs[i];
+
+		if(vrf->fib_inet)
+			fib_release(vrf->fib_inet);
+		if(vrf->fib_inet6)
+			fib_release(vrf->fib_inet6);
+	}
+
+	if(vrfs->pool)
+		lpm6_pool_release(vrfs->pool);
+
+	ixmap_mem_free(vrfs->port_master);
+	ixmap_mem_free(vrfs->port_vrf);
+	ixmap_mem_free(vrfs);
+	return;
+}
+
+/* Returns the VRF of table, taking a free one if none has it yet */
+struct vrf *vrf_get(struct vrf_table *vrfs, uint32_t table)
+{
+	struct vrf *vrf;
+	int i;
+
+	for(i = 0; i < vrfs->num_vrfs; i++){
+		if(vrfs->vrfs[i].table == table)
+			return &vrfs->vrfs[i];
+	}
+
+	if(vrfs->num_vrfs == VRF_MAX)
+		goto err_vrf_full;
+
+	vrf = &vrfs->vrfs[vrfs->num_vrfs++];
+	vrf->table = table;
+	vrf->ifindex = 0;
+	vrf->fib_inet = NULL;
+	vrf->fib_inet6 = NULL;
+	return vrf;
+
+err_vrf_full:
+	return NULL;
+}
+
+/* Readers may find the fib as soon as it is set, it starts empty */
+struct fib *vrf_fib(struct vrf_table *vrfs, struct vrf *vrf,
+	int family, struct ixmap_desc *desc)
+{
+	struct fib *fib, **fib_ptr;
+	int ret;
+
+	switch(family){
+	case AF_INET:
+		fib_ptr = &vrf->fib_inet;
+		break;
+	case AF_INET6:
+		fib_ptr = &vrf->fib_inet6;
+		break;
+	default:
+		goto err_invalid_family;
+		break;
+	}
+
+	if(*fib_ptr)
+		return *fib_ptr;
+
+	if(!vrfs->pool){
+		vrfs->pool = lpm6_pool_alloc(desc);
+		if(!vrfs->pool)
+			goto err_pool_alloc;
+	}
+
+	fib = fib_alloc_pool(desc, family == AF_INET ?
+		FIB_ENGINE_DIR24 : FIB_ENGINE_LPM6,
+		vrfs->qsbr, vrfs->pool);
+	if(!fib)
+		goto err_fib_alloc;
+
+	fib_stats_set(fib, vrfs->stats);
+
+	if(vrfs->aggregate){
+		ret = fib_aggregate(fib, family, desc);
+		if(ret < 0)
+			goto err_fib_aggregate;
+	}
+
+	smp_wmb();
+	ACCESS_ONCE(*fib_ptr) = fib;
+	return fib;
+
+err_fib_aggregate:
+	fib_release(fib);
+err_fib_alloc:
+err_pool_alloc:
+err_invalid_family:
+	return NULL;
+}
+
+/* An l3mdev device of table appeared */
+void vrf_bind(struct vrf_table *vrfs, uint32_t table, int ifindex)
+{
+	struct vrf *vrf;
+
+	vrf = vrf_get(vrfs, table);
+	if(!vrf)
+		return;
+
+	vrf->ifindex = ifindex;
+	vrf_port_update(vrfs);
+	return;
+}
+
+/* The device is gone, its ports fall back on the main FIB */
+void vrf_unbind(struct vrf_table *vrfs, int ifindex)
+{
+	int i;
+
+	for(i = 0; i < vrfs->num_vrfs; i++){
+		if(vrfs->vrfs[i].ifindex == ifindex)
+			vrfs->vrfs[i].ifindex = 0;
+	}
+
+	vrf_port_update(vrfs);
+	return;
+}
+
+void vrf_port_master(struct vrf_table *vrfs, unsigned int port_index,
+	int master)
+{
+	vrfs->port_master[port_index] = master;
+	vrf_port_update(vrfs);
+	return;
+}
+
+static void vrf_port_update(struct vrf_table *vrfs)
+{
+	struct vrf *vrf;
+	int i, j;
+
+	for(i = 0; i < vrfs->num_ports; i++){
+		vrf = NULL;
+
+		for(j = 0; j < vrfs->num_vrfs; j++){
+			if(vrfs->port_master[i]
+			&& vrfs->vrfs[j].ifindex == vrfs->port_master[i]){
+				vrf = &vrfs->vrfs[j];
+				break;
+			}
+		}
+
+		ACCESS_ONCE(vrfs->port_vrf[i]) = vrf;
+	}
+
+	return;
+}
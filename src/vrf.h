@@ -0,0 +1,51 @@
+#ifndef _IXMAPFWD_VRF_H
+#define _IXMAPFWD_VRF_H
+
+#include <stdint.h>
+#include "fib.h"
+#include "lpm6.h"
+#include "qsbr.h"
+
+/*
+ * Routing tables other than main, local and default, one FIB each.
+ * A port enslaved to a VRF device (l3mdev) of the kernel looks up
+ * the table of that device, the other ports the main FIB.
+ * Tables hold DIR24 engines for IPv4 and LPM6 for IPv6, all drawing
+ * from one pool of nexthop slots. DIR24 maps its tables sparse then,
+ * so an extra table costs only the pages its routes write.
+ * Slots are never freed before exit, readers may keep a vrf pointer.
+ */
+#define VRF_MAX			64
+
+struct vrf {
+	uint32_t		table; /* kernel routing table, 0 if unused */
+	int			ifindex; /* l3mdev device, 0 if none */
+	struct fib		*fib_inet; /* NULL until a route comes */
+	struct fib		*fib_inet6;
+};
+
+struct vrf_table {
+	struct vrf		vrfs[VRF_MAX];
+	unsigned int		num_vrfs;
+	struct lpm6_pool	*pool; /* allocated with the first fib */
+	struct qsbr		*qsbr;
+	struct stats_table	*stats; /* or NULL, see fib_stats_set() */
+	unsigned int		aggregate;
+	unsigned int		num_ports;
+	struct vrf		**port_vrf; /* NULL means the main FIB */
+	int			*port_master; /* ifindex, 0 if none */
+};
+
+struct vrf_table *vrf_table_alloc(unsigned int num_ports,
+	struct qsbr *qsbr, struct stats_table *stats, unsigned int aggregate,
+	struct ixmap_desc *desc);
+void vrf_table_release(struct vrf_table *vrfs);
+struct vrf *vrf_get(struct vrf_table *vrfs, uint32_t table);
+struct fib *vrf_fib(struct vrf_table *vrfs, struct vrf *vrf,
+	int family, struct ixmap_desc *desc);
+void vrf_bind(struct vrf_table *vrfs, uint32_t table, int ifindex);
+void vrf_unbind(struct vrf_table *vrfs, int ifindex);
+void vrf_port_master(struct vrf_table *vrfs, unsigned int port_index,
+	int master);
+
+#endif /* _IXMAPFWD_VRF_H */